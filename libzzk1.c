@@ -0,0 +1,8051 @@
+/*
+ * libzzk1 — ZZK1 / ZZK2 归档读写库的实现。接口与用法见 zzk1.h。
+ *
+ * 文件结构:
+ *   [文件头: Magic(4B) + TotalSize(4B) + Reserved(4B)]
+ *   [数据块: Type(4B) + Length(4B) + Value(Length B) + CRC32(4B)] ...
+ *
+ *   Magic Number: 0x5A5A4B31 ("ZZK1")
+ *
+ *   ZZK2 变体: TotalSize 与 Length 扩展为 8 字节，其余字段不变，CRC32 仍覆盖 Type + Length + Value:
+ *   [文件头: Magic(4B) + TotalSize(8B) + Reserved(4B)]
+ *   [数据块: Type(4B) + Length(8B) + Value(Length B) + CRC32(4B)] ...
+ *   Magic Number: 0x5A5A4B32 ("ZZK2")。读取方按 Magic 自动识别两种格式。
+ *
+ *   数据类型:
+ *     0x00000001 - UTF-8 文本
+ *     0x00000002 - 二进制文件（前一个块为其元数据）
+ *     0x00000003 - 尾部索引（可选，见"索引块"一节）
+ *     0x00000004 - 流分片: Flags(4B) + Data；连续的分片组成一个流，
+ *                  Flags 位 0 标记最后一片（前一个块为流的元数据）
+ *     0x00000005 - 内容引用: 指向内容相同的二进制块（前一个块为元数据，见"内容去重"一节）
+ *     0x00000006 - 压缩块: 以内置 LZ 编码存储的文本或二进制内容（见"LZ 压缩"一节）
+ *     0x00000007 - 分块校验表: 前一个二进制块按段的 CRC32（见"分块校验表"一节）
+ *     0x00000008 - 词项索引（可选，位于尾部索引之前，见"词项索引"一节）
+ *     0x00000009 - 检查点: 之前的块数与块序列的滚动摘要（可选，见"检查点"一节）
+ *     0xFFFFFFFF - 填充/对齐
+ *
+ * 实现约定:
+ *   - 公开函数返回 ZZK_OK 或负的 ZZK_ERR_*，从不 exit()
+ *   - 失败原因经日志回调输出，文本与命令行工具一直以来的提示相同
+ *   - 内部的 u32 / u64 即 zzk_u32 / zzk_u64，静态函数沿用命令行工具时期的命名
+ */
+
+/*
+ * 可选平台扩展（默认关闭，保持纯 C89 构建）:
+ *   -DZZK1_POSIX    使用 POSIX 文件接口（mmap 零拷贝读取等）
+ *   -DZZK1_THREADS  使用 POSIX 线程并行执行（需要 -pthread，隐含 ZZK1_POSIX）
+ *   -DZZK1_LINUX    使用 Linux 内核侧拷贝 copy_file_range/sendfile 与 inotify（隐含 ZZK1_POSIX）
+ *   -DZZK1_STATS    编入运行统计（各阶段耗时与读写量，见"运行统计"一节）
+ */
+#if (defined(ZZK1_THREADS) || defined(ZZK1_LINUX)) && !defined(ZZK1_POSIX)
+#define ZZK1_POSIX
+#endif
+#ifdef ZZK1_POSIX
+#define _POSIX_C_SOURCE 200112L
+#define _FILE_OFFSET_BITS 64
+#endif
+#ifdef ZZK1_LINUX
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zzk1.h"
+
+#ifdef ZZK1_POSIX
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#else
+#include <time.h>
+#endif
+#ifdef ZZK1_THREADS
+#include <pthread.h>
+#endif
+#ifdef ZZK1_LINUX
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#endif
+
+#define MAGIC_NUMBER 0x5A5A4B31  /* "ZZK1" */
+#define MAGIC_ZZK2   0x5A5A4B32  /* "ZZK2" */
+#define RESERVED     0x00000000
+
+#define TYPE_TEXT     ZZK_TYPE_TEXT
+#define TYPE_BINARY   ZZK_TYPE_BINARY
+#define TYPE_INDEX    ZZK_TYPE_INDEX
+#define TYPE_STREAM   ZZK_TYPE_STREAM
+#define TYPE_REF      ZZK_TYPE_REF
+#define TYPE_LZ       ZZK_TYPE_LZ
+#define TYPE_SUMS     ZZK_TYPE_SUMS
+#define TYPE_TERMS    ZZK_TYPE_TERMS
+#define TYPE_CHECKPOINT ZZK_TYPE_CHECKPOINT
+#define TYPE_PADDING  ZZK_TYPE_PADDING
+
+typedef zzk_u32 u32;
+typedef zzk_u64 u64;
+#define U64_MAX ((u64)-1)
+
+/*
+ * 归档格式描述。ZZK1 与 ZZK2 的块结构相同，只有长度类字段的宽度不同；
+ * 读取方按 Magic 选择，之后所有偏移计算都经由这里的字段完成。
+ */
+struct zzk_format {
+    const char *name;
+    u32 magic;
+    unsigned size_width;      /* TotalSize / Length / 索引中 Offset 的字节数 */
+    unsigned header_size;     /* Magic + TotalSize + Reserved */
+    unsigned chunk_header;    /* Type + Length */
+    unsigned chunk_overhead;  /* Type + Length + CRC32 */
+    u64 max_size;             /* TotalSize 能表示的上限 */
+};
+
+static const struct zzk_format FORMAT_ZZK1 = { "ZZK1", MAGIC_NUMBER, 4, 12, 8, 12, 0xFFFFFFFFUL };
+static const struct zzk_format FORMAT_ZZK2 = { "ZZK2", MAGIC_ZZK2, 8, 16, 12, 16, U64_MAX };
+
+static int write_u32_be(FILE *fp, u32 val);
+static int read_u32_be(FILE *fp, u32 *val);
+
+/* ========== 日志与状态码 ========== */
+
+static zzk_log_fn log_fn = NULL;
+static void *log_ctx = NULL;
+
+void zzk_set_log(zzk_log_fn fn, void *ctx) {
+    log_fn = fn;
+    log_ctx = ctx;
+}
+
+static void log_msg(int level, const char *fmt, ...) {
+    va_list ap;
+    if (!log_fn) return;
+    va_start(ap, fmt);
+    log_fn(log_ctx, level, fmt, ap);
+    va_end(ap);
+}
+
+/* 以 perror 的格式报告系统调用失败，返回 ZZK_ERR_IO（保留 errno） */
+static int io_error(const char *what) {
+    int saved = errno;
+    log_msg(ZZK_LOG_ERROR, "%s: %s\n", what, strerror(saved));
+    errno = saved;
+    return ZZK_ERR_IO;
+}
+
+static int nomem(void) {
+    log_msg(ZZK_LOG_ERROR, "Error: Memory allocation failed.\n");
+    return ZZK_ERR_NOMEM;
+}
+
+const char *zzk_strerror(int status) {
+    switch (status) {
+    case ZZK_OK:              return "success";
+    case ZZK_ERR_IO:          return "I/O error";
+    case ZZK_ERR_NOMEM:       return "out of memory";
+    case ZZK_ERR_ARG:         return "invalid argument";
+    case ZZK_ERR_FORMAT:      return "not a ZZK1/ZZK2 archive";
+    case ZZK_ERR_CORRUPT:     return "archive structure is damaged";
+    case ZZK_ERR_CRC:         return "CRC32 mismatch";
+    case ZZK_ERR_OVERFLOW:    return "size exceeds format limit";
+    case ZZK_ERR_NOT_FOUND:   return "chunk not found";
+    case ZZK_ERR_EXISTS:      return "file already exists";
+    case ZZK_ERR_UNSUPPORTED: return "not supported by this build";
+    case ZZK_ERR_INPUT:       return "unexpected end of input";
+    default:                  return "unknown error";
+    }
+}
+
+/* ========== 运行统计 ========== */
+
+/*
+ * -DZZK1_STATS 时编入插桩：各阶段的墙钟与 CPU 时间、读写字节数、块头数与定位次数，
+ * 由 zzk_stats_enable 指定的结构累计（未启用时每个插桩点只多一次判断）。
+ * 未定义 ZZK1_STATS 时插桩宏展开为原语句本身，不留下任何代码。
+ * 时间只记在叶子操作上（块头读取、内容读取、CRC、写出、同步），阶段之间不重叠；
+ * 映射模式没有显式读取，缺页时间计入随后使用数据的阶段（通常是 CRC）。
+ */
+#ifdef ZZK1_STATS
+static struct zzk_stats *stats_sink = NULL;
+#ifdef ZZK1_THREADS
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+struct stats_timer {
+    double wall;
+    double cpu;
+};
+
+static double now_ms(void);
+
+/* 当前线程的 CPU 时间（毫秒）；没有线程时钟时退回进程 CPU 时间 */
+static double stats_cpu_ms(void) {
+#if defined(ZZK1_POSIX) && defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+    return (double)clock() * 1000.0 / CLOCKS_PER_SEC;
+}
+
+static void stats_start(struct stats_timer *t) {
+    t->wall = 0;
+    t->cpu = 0;
+    if (!stats_sink) return;
+    t->wall = now_ms();
+    t->cpu = stats_cpu_ms();
+}
+
+static void stats_stop(const struct stats_timer *t, int phase) {
+    double wall, cpu;
+
+    if (!stats_sink) return;
+    wall = now_ms() - t->wall;
+    cpu = stats_cpu_ms() - t->cpu;
+#ifdef ZZK1_THREADS
+    pthread_mutex_lock(&stats_lock);
+#endif
+    stats_sink->phases[phase].wall_ms += wall;
+    stats_sink->phases[phase].cpu_ms += cpu;
+    stats_sink->phases[phase].calls++;
+#ifdef ZZK1_THREADS
+    pthread_mutex_unlock(&stats_lock);
+#endif
+}
+
+#define STATS_BYTES_READ    0
+#define STATS_BYTES_WRITTEN 1
+#define STATS_CHUNKS        2
+#define STATS_SEEKS         3
+
+static void stats_count(int counter, u64 n) {
+    if (!stats_sink) return;
+#ifdef ZZK1_THREADS
+    pthread_mutex_lock(&stats_lock);
+#endif
+    if (counter == STATS_BYTES_READ) stats_sink->bytes_read += n;
+    else if (counter == STATS_BYTES_WRITTEN) stats_sink->bytes_written += n;
+    else if (counter == STATS_CHUNKS) stats_sink->chunks += (long)n;
+    else stats_sink->seeks += (long)n;
+#ifdef ZZK1_THREADS
+    pthread_mutex_unlock(&stats_lock);
+#endif
+}
+
+/* 计时一条语句（语句内不能含 break / continue / return） */
+#define STATS_TIME(phase, stmt) \
+    do { struct stats_timer stats_t_; stats_start(&stats_t_); stmt; stats_stop(&stats_t_, phase); } while (0)
+#define STATS_COUNT(counter, n) stats_count(counter, (u64)(n))
+#else
+#define STATS_TIME(phase, stmt) do { stmt; } while (0)
+#define STATS_COUNT(counter, n) ((void)0)
+#endif
+
+int zzk_stats_enable(struct zzk_stats *s) {
+#ifdef ZZK1_STATS
+    if (s) memset(s, 0, sizeof(*s));
+    stats_sink = s;
+    return ZZK_OK;
+#else
+    (void)s;
+    return ZZK_ERR_UNSUPPORTED;
+#endif
+}
+
+const char *zzk_phase_name(int phase) {
+    static const char *names[ZZK_PHASE_COUNT] = { "open", "scan", "read", "crc", "write", "sync" };
+    return (phase >= 0 && phase < ZZK_PHASE_COUNT) ? names[phase] : "unknown";
+}
+
+/* ========== 工具函数 ========== */
+
+static int write_all(FILE *fp, const void *buf, size_t len, const char *what) {
+    size_t written;
+
+    if (len == 0) return ZZK_OK;
+    STATS_TIME(ZZK_PHASE_WRITE, written = fwrite(buf, 1, len, fp));
+    STATS_COUNT(STATS_BYTES_WRITTEN, written);
+    if (written != len) return io_error(what);
+    return ZZK_OK;
+}
+
+static int write_u32(FILE *fp, u32 val, const char *what) {
+    if (write_u32_be(fp, val) != 0) return io_error(what);
+    STATS_COUNT(STATS_BYTES_WRITTEN, 4);
+    return ZZK_OK;
+}
+
+/* 安全字符串拼接，防止缓冲区溢出。成功返回 0，截断返回 -1 */
+static int append_str(char *dst, size_t dst_cap, size_t *used, const char *src) {
+    size_t src_len, avail;
+
+    if (dst_cap == 0 || *used >= dst_cap) {
+        if (dst_cap > 0) dst[dst_cap - 1] = '\0';
+        return -1;
+    }
+
+    src_len = strlen(src);
+    avail = (dst_cap - 1) - *used;
+    if (src_len > avail) {
+        memcpy(dst + *used, src, avail);
+        *used += avail;
+        dst[*used] = '\0';
+        return -1;
+    }
+
+    memcpy(dst + *used, src, src_len);
+    *used += src_len;
+    dst[*used] = '\0';
+    return 0;
+}
+
+/* 以十进制格式化 u64（C89 的 printf 没有 64 位整数格式） */
+static const char *u64_str(u64 val, char buf[24]) {
+    char *p = buf + 23;
+    *p = '\0';
+    do {
+        *--p = (char)('0' + (int)(val % 10));
+        val /= 10;
+    } while (val != 0);
+    return p;
+}
+
+const char *zzk_u64_str(zzk_u64 val, char buf[24]) {
+    return u64_str(val, buf);
+}
+
+static int get_file_size(FILE *fp, u64 *size, const char *what) {
+#ifdef ZZK1_POSIX
+    off_t pos;
+    if (fseeko(fp, 0, SEEK_END) != 0) return io_error(what);
+    pos = ftello(fp);
+#else
+    long pos;
+    if (fseek(fp, 0, SEEK_END) != 0) return io_error(what);
+    pos = ftell(fp);
+#endif
+    if (pos < 0) return io_error(what);
+    *size = (u64)pos;
+    return ZZK_OK;
+}
+
+/*
+ * 定位到绝对偏移。POSIX 构建用 64 位 fseeko 一次到位；
+ * 纯 C89 构建从文件头分步前进，避免 fseek 的 long 参数在 32 位平台上溢出。
+ */
+static int seek_to(FILE *fp, u64 offset) {
+#ifdef ZZK1_POSIX
+    STATS_COUNT(STATS_SEEKS, 1);
+    if ((off_t)offset < 0 || (u64)(off_t)offset != offset ||
+        fseeko(fp, (off_t)offset, SEEK_SET) != 0) return io_error("Error seeking file");
+#else
+    const long MAX_STEP = 0x70000000;
+    STATS_COUNT(STATS_SEEKS, 1);
+    if (fseek(fp, 0, SEEK_SET) != 0) return io_error("Error seeking file");
+    while (offset > 0) {
+        long step = (offset > (u64)MAX_STEP) ? MAX_STEP : (long)offset;
+        if (fseek(fp, step, SEEK_CUR) != 0) return io_error("Error seeking file");
+        offset -= (u64)step;
+    }
+#endif
+    return ZZK_OK;
+}
+
+/* ========== 序列化 ========== */
+
+/* 将 u32 转换为大端字节序 */
+static void u32_to_be(u32 val, unsigned char buf[4]) {
+    buf[0] = (unsigned char)((val >> 24) & 0xFF);
+    buf[1] = (unsigned char)((val >> 16) & 0xFF);
+    buf[2] = (unsigned char)((val >> 8)  & 0xFF);
+    buf[3] = (unsigned char)(val & 0xFF);
+}
+
+/* 从大端字节序解析 u32 */
+static u32 be_to_u32(const unsigned char buf[4]) {
+    return ((u32)buf[0] << 24) | ((u32)buf[1] << 16) | ((u32)buf[2] << 8) | (u32)buf[3];
+}
+
+/* 以大端序写入 width（4 或 8）字节宽的长度字段 */
+static void uint_to_be(u64 val, unsigned char *buf, unsigned width) {
+    while (width > 0) {
+        buf[--width] = (unsigned char)(val & 0xFF);
+        val >>= 8;
+    }
+}
+
+/* 解析 width 字节宽的大端长度字段；u64 放不下时返回 U64_MAX */
+static u64 be_to_uint(const unsigned char *buf, unsigned width) {
+    u64 val = 0;
+    unsigned i;
+    for (i = 0; i < width; i++) {
+        if (val > (U64_MAX >> 8)) return U64_MAX;
+        val = (val << 8) | buf[i];
+    }
+    return val;
+}
+
+/* 编码块头 Type + Length，返回字节数（ZZK1 为 8，ZZK2 为 12） */
+static unsigned encode_chunk_header(const struct zzk_format *fmt, u32 type, u64 length, unsigned char *buf) {
+    u32_to_be(type, buf);
+    uint_to_be(length, buf + 4, fmt->size_width);
+    return fmt->chunk_header;
+}
+
+/* 以大端序写入 32 位整数 */
+static int write_u32_be(FILE *fp, u32 val) {
+    unsigned char buf[4];
+    u32_to_be(val, buf);
+    return (fwrite(buf, 1, 4, fp) != 4) ? -1 : 0;
+}
+
+/* 以大端序读取 32 位整数 */
+static int read_u32_be(FILE *fp, u32 *val) {
+    unsigned char buf[4];
+    if (fread(buf, 1, 4, fp) != 4) return -1;
+    *val = ((u32)buf[0] << 24) |
+           ((u32)buf[1] << 16) |
+           ((u32)buf[2] << 8)  |
+           ((u32)buf[3]);
+    return 0;
+}
+
+/* ========== CRC32 校验 ========== */
+
+/*
+ * 多内核 CRC32 引擎（多项式 0xEDB88320，与格式规范一致）:
+ *   bytewise - 逐字节查表，参考实现，所有平台可用
+ *   slice8   - slicing-by-8，每轮处理 8 字节，按字节组装，与字节序无关
+ *   pclmul   - x86-64 无进位乘法折叠，每轮处理 64 字节（运行时 CPUID 检测）
+ * crc32_init() 在启动时选择最快的可用内核；环境变量 ZZK1_CRC 可强制指定。
+ */
+
+#if !defined(ZZK1_NO_SIMD) && defined(__x86_64__) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define ZZK1_HAVE_PCLMUL 1
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <smmintrin.h>
+#endif
+
+typedef u32 (*crc32_kernel_fn)(u32 crc, const unsigned char *buf, size_t len);
+
+static u32 crc32_table[8][256];
+static int crc32_table_ready = 0;
+static crc32_kernel_fn crc32_kernel;
+static const char *crc32_kernel_name = "bytewise";
+static u32 x2n_table[32];  /* x^(2^k) mod p，见 crc32_combine */
+
+static u32 multmodp(u32 a, u32 b);
+
+/* 参考实现：逐字节查表。新内核必须与其结果逐位一致 */
+static u32 crc32_update_bytewise(u32 crc, const unsigned char *buf, size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        crc = crc32_table[0][(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+/* slicing-by-8：8 张表并行查找，一次消化 8 字节 */
+static u32 crc32_update_slice8(u32 crc, const unsigned char *buf, size_t len) {
+    while (len >= 8) {
+        u32 lo = crc ^ ((u32)buf[0] | ((u32)buf[1] << 8) |
+                        ((u32)buf[2] << 16) | ((u32)buf[3] << 24));
+        crc = crc32_table[7][lo & 0xFF] ^
+              crc32_table[6][(lo >> 8) & 0xFF] ^
+              crc32_table[5][(lo >> 16) & 0xFF] ^
+              crc32_table[4][(lo >> 24) & 0xFF] ^
+              crc32_table[3][buf[4]] ^
+              crc32_table[2][buf[5]] ^
+              crc32_table[1][buf[6]] ^
+              crc32_table[0][buf[7]];
+        buf += 8;
+        len -= 8;
+    }
+    return crc32_update_bytewise(crc, buf, len);
+}
+
+#ifdef ZZK1_HAVE_PCLMUL
+/*
+ * 无进位乘法折叠（Intel "Fast CRC Computation Using PCLMULQDQ" 白皮书），
+ * 常数对应反射多项式 0xEDB88320。4 路 128 位并行折叠，最后 Barrett 归约。
+ * 不足 64 字节或非 16 字节对齐的尾部交给 slice8。
+ */
+__attribute__((target("pclmul,sse4.1")))
+static u32 crc32_update_pclmul(u32 crc, const unsigned char *buf, size_t len) {
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+    size_t tail;
+
+    if (len < 64) return crc32_update_slice8(crc, buf, len);
+    tail = len & 15;
+    len -= tail;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)(crc & 0xFFFFFFFFUL)));
+    x0 = _mm_set_epi32(0x00000001, (int)0xC6E41596UL, 0x00000001, 0x54442BD4);  /* k1, k2 */
+    buf += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        len -= 64;
+    }
+
+    /* 4 路折叠为 1 路 */
+    x0 = _mm_set_epi32(0x00000000, (int)0xCCAA009EUL, 0x00000001, 0x751997D0);  /* k3, k4 */
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 位折叠到 64 位 */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_set_epi32(0, 0, 0x00000001, 0x63CD6124);                           /* k5 */
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett 归约到 32 位 */
+    x0 = _mm_set_epi32(0x00000001, (int)0xF7011641UL, 0x00000001, (int)0xDB710641UL);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    crc = (u32)(unsigned int)_mm_extract_epi32(x1, 1);
+
+    return crc32_update_slice8(crc, buf, tail);
+}
+
+static int cpu_has_pclmul(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+    return (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+#endif
+
+static void crc32_init(void) {
+    u32 i, j, c;
+    const char *force;
+
+    if (crc32_table_ready) return;
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++) {
+            c = (c & 1) ? ((c >> 1) ^ 0xEDB88320UL) : (c >> 1);
+        }
+        crc32_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            c = crc32_table[j - 1][i];
+            crc32_table[j][i] = (c >> 8) ^ crc32_table[0][c & 0xFF];
+        }
+    }
+
+    /* x2n_table[k] = x^(2^k) mod p，供 crc32_combine 使用 */
+    c = (u32)1 << 30;  /* x^1 */
+    x2n_table[0] = c;
+    for (i = 1; i < 32; i++) x2n_table[i] = c = multmodp(c, c);
+
+    crc32_kernel = crc32_update_slice8;
+    crc32_kernel_name = "slice8";
+#ifdef ZZK1_HAVE_PCLMUL
+    if (cpu_has_pclmul()) {
+        crc32_kernel = crc32_update_pclmul;
+        crc32_kernel_name = "pclmul";
+    }
+#endif
+
+    force = getenv("ZZK1_CRC");
+    if (force) {
+        if (strcmp(force, "bytewise") == 0) {
+            crc32_kernel = crc32_update_bytewise;
+            crc32_kernel_name = "bytewise";
+        } else if (strcmp(force, "slice8") == 0) {
+            crc32_kernel = crc32_update_slice8;
+            crc32_kernel_name = "slice8";
+        } else if (strcmp(force, "pclmul") != 0 || strcmp(crc32_kernel_name, "pclmul") != 0) {
+            log_msg(ZZK_LOG_WARNING, "Warning: ZZK1_CRC=%s not available, using %s.\n", force, crc32_kernel_name);
+        }
+    }
+    crc32_table_ready = 1;
+}
+
+/* 增量更新 CRC32。用法: crc=0xFFFFFFFFUL; crc=crc32_update(crc,d,n); crc^=0xFFFFFFFFUL; */
+static u32 crc32_update(u32 crc, const unsigned char *buf, size_t len) {
+    if (!crc32_table_ready) crc32_init();
+    return crc32_kernel(crc, buf, len);
+}
+
+/*
+ * CRC32 合并（zlib 1.2.12 起的 x2nmodp 算法）:
+ * 已知 crc1 = CRC(A)、crc2 = CRC(B)，len2 = |B|，求 CRC(A||B)。
+ * 输入输出均为最终值（已异或 0xFFFFFFFF），用于分段并行计算后拼接。
+ * crc1 后补 len2 个零字节等于在 GF(2) 上乘以 x^(8*len2) mod p，
+ * 后者由 x2n_table[k] = x^(2^k) mod p 按 len2 的二进制位连乘得到，耗时 O(log len2)。
+ */
+/* a * b mod p（反射位序，最高位为 x^0） */
+static u32 multmodp(u32 a, u32 b) {
+    u32 m = (u32)1 << 31, p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ 0xEDB88320UL : b >> 1;
+    }
+    return p;
+}
+
+/* x^(n * 2^k) mod p */
+static u32 x2nmodp(u64 n, unsigned k) {
+    u32 p = (u32)1 << 31;  /* x^0 */
+
+    while (n) {
+        if (n & 1) p = multmodp(x2n_table[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+static u32 crc32_combine(u32 crc1, u32 crc2, u64 len2) {
+    if (len2 == 0) return crc1;
+    if (!crc32_table_ready) crc32_init();
+    return multmodp(x2nmodp(len2, 3), crc1) ^ crc2;
+}
+
+/* ========== 并行执行 ========== */
+
+/*
+ * 极简任务池：nthreads 个工作者从共享计数器领取任务编号 [0, njobs)。
+ * fn(ctx, worker, job) 中的 worker 为工作者编号 [0, nthreads)，
+ * 便于各工作者持有独立的文件句柄和缓冲区。
+ * 未定义 ZZK1_THREADS 时退化为当前线程顺序执行。
+ * run_jobs 返回实际参与的工作者数（不超过 njobs，线程创建失败时更少，至少为 1）。
+ */
+typedef void (*job_fn)(void *ctx, int worker, long job);
+
+static int default_thread_count(void) {
+#ifdef ZZK1_THREADS
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) return 1;
+    if (n > 64) return 64;
+    return (int)n;
+#else
+    return 1;
+#endif
+}
+
+#ifdef ZZK1_THREADS
+struct job_pool {
+    pthread_mutex_t lock;
+    long next_job;
+    long njobs;
+    job_fn fn;
+    void *ctx;
+};
+
+struct job_worker {
+    struct job_pool *pool;
+    int id;
+};
+
+static void *job_worker_main(void *arg) {
+    struct job_worker *w = (struct job_worker *)arg;
+    struct job_pool *pool = w->pool;
+    long job;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        job = pool->next_job++;
+        pthread_mutex_unlock(&pool->lock);
+        if (job >= pool->njobs) break;
+        pool->fn(pool->ctx, w->id, job);
+    }
+    return NULL;
+}
+#endif
+
+static int run_jobs(int nthreads, long njobs, job_fn fn, void *ctx) {
+#ifdef ZZK1_THREADS
+    struct job_pool pool;
+    pthread_t *threads = NULL;
+    struct job_worker *workers = NULL;
+    int i, started = 0;
+
+    if (nthreads > njobs) nthreads = (int)njobs;
+    if (nthreads > 1) {
+        threads = (pthread_t *)malloc(sizeof(pthread_t) * (size_t)nthreads);
+        workers = (struct job_worker *)malloc(sizeof(struct job_worker) * (size_t)nthreads);
+    }
+    if (nthreads > 1 && threads && workers) {
+        pthread_mutex_init(&pool.lock, NULL);
+        pool.next_job = 0;
+        pool.njobs = njobs;
+        pool.fn = fn;
+        pool.ctx = ctx;
+
+        for (i = 0; i < nthreads; i++) {
+            workers[i].pool = &pool;
+            workers[i].id = i;
+            if (pthread_create(&threads[i], NULL, job_worker_main, &workers[i]) != 0) break;
+            started++;
+        }
+        if (started == 0) {
+            /* 无法创建线程时由当前线程完成全部任务 */
+            workers[0].pool = &pool;
+            workers[0].id = 0;
+            job_worker_main(&workers[0]);
+        }
+        for (i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+        pthread_mutex_destroy(&pool.lock);
+        free(workers);
+        free(threads);
+        return started > 0 ? started : 1;
+    }
+    /* 只有一个工作者或内存不足时由当前线程顺序执行 */
+    free(workers);
+    free(threads);
+#endif
+    {
+        long job;
+        (void)nthreads;
+        for (job = 0; job < njobs; job++) fn(ctx, 0, job);
+    }
+    return 1;
+}
+
+/* ========== 基础设施接口 ========== */
+
+void zzk_init(void) {
+    crc32_init();
+}
+
+const char *zzk_crc32_kernel(void) {
+    crc32_init();
+    return crc32_kernel_name;
+}
+
+zzk_u32 zzk_crc32_update(zzk_u32 crc, const void *buf, size_t len) {
+    return crc32_update(crc, (const unsigned char *)buf, len);
+}
+
+zzk_u32 zzk_crc32_combine(zzk_u32 crc1, zzk_u32 crc2, zzk_u64 len2) {
+    return crc32_combine(crc1, crc2, len2);
+}
+
+int zzk_default_threads(void) {
+    return default_thread_count();
+}
+
+/*
+ * 用参考实现逐一核对各 CRC32 内核。
+ * 覆盖 0..1100 字节的所有长度、16 种起始对齐、随机初始值，以及已知答案向量。
+ */
+int zzk_crc32_selftest(FILE *report) {
+    struct { const char *name; crc32_kernel_fn fn; } kernels[3];
+    int nkernels = 0, k, failures = 0;
+    unsigned char *buf;
+    size_t buf_len = 1 << 20, i, len, align;
+    unsigned long seed = 12345;
+
+    crc32_init();
+    kernels[nkernels].name = "bytewise"; kernels[nkernels].fn = crc32_update_bytewise; nkernels++;
+    kernels[nkernels].name = "slice8";   kernels[nkernels].fn = crc32_update_slice8;   nkernels++;
+#ifdef ZZK1_HAVE_PCLMUL
+    if (cpu_has_pclmul()) {
+        kernels[nkernels].name = "pclmul"; kernels[nkernels].fn = crc32_update_pclmul; nkernels++;
+    }
+#endif
+
+    buf = (unsigned char *)malloc(buf_len);
+    if (!buf) return nomem();
+    for (i = 0; i < buf_len; i++) {
+        seed = (seed * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+        buf[i] = (unsigned char)(seed >> 16);
+    }
+
+    fprintf(report, "CRC32 kernel in use: %s\n", crc32_kernel_name);
+    for (k = 0; k < nkernels; k++) {
+        int bad = 0;
+        u32 crc = kernels[k].fn(0xFFFFFFFFUL, (const unsigned char *)"123456789", 9) ^ 0xFFFFFFFFUL;
+        if (crc != 0xCBF43926UL) bad++;
+
+        for (align = 0; align < 16 && !bad; align++) {
+            for (len = 0; len <= 1100 && !bad; len++) {
+                u32 init = (u32)((len * 2654435761UL) & 0xFFFFFFFFUL);
+                if (kernels[k].fn(init, buf + align, len) !=
+                    crc32_update_bytewise(init, buf + align, len)) bad++;
+            }
+        }
+        if (!bad && kernels[k].fn(0xFFFFFFFFUL, buf + 3, buf_len - 3) !=
+                    crc32_update_bytewise(0xFFFFFFFFUL, buf + 3, buf_len - 3)) bad++;
+
+        fprintf(report, "  %-8s %s\n", kernels[k].name, bad ? "FAIL" : "OK");
+        failures += bad;
+    }
+
+    free(buf);
+    return failures ? ZZK_ERR_CRC : ZZK_OK;
+}
+
+const char *zzk_type_name(zzk_u32 type) {
+    if (type == TYPE_TEXT) return "TEXT";
+    if (type == TYPE_BINARY) return "BINARY";
+    if (type == TYPE_INDEX) return "INDEX";
+    if (type == TYPE_STREAM) return "STREAM";
+    if (type == TYPE_REF) return "REF";
+    if (type == TYPE_LZ) return "LZ";
+    if (type == TYPE_SUMS) return "SUMS";
+    if (type == TYPE_TERMS) return "TERMS";
+    if (type == TYPE_CHECKPOINT) return "CHECKPOINT";
+    if (type == TYPE_PADDING) return "PADDING";
+    return "UNKNOWN";
+}
+
+/*
+ * 写入完整数据块: Type(4) + Length(4 或 8) + Value(Length) + CRC32(4)
+ * CRC32 覆盖 Type + Length + Value。crc_out 非 NULL 时返回块的 CRC32
+ */
+static int write_chunk(FILE *fp, const struct zzk_format *fmt, u32 type, const void *value, size_t length,
+                       u32 *crc_out) {
+    unsigned char hdr[12];
+    unsigned hdr_len = encode_chunk_header(fmt, type, (u64)length, hdr);
+    u32 crc = 0xFFFFFFFFUL;
+
+    crc = crc32_update(crc, hdr, hdr_len);
+    crc = crc32_update(crc, (const unsigned char *)value, length);
+    crc ^= 0xFFFFFFFFUL;
+
+    if (write_all(fp, hdr, hdr_len, "Error writing chunk header") != 0 ||
+        write_all(fp, value, length, "Error writing chunk value") != 0 ||
+        write_u32(fp, crc, "Error writing chunk CRC32") != 0) return ZZK_ERR_IO;
+    if (crc_out) *crc_out = crc;
+    return ZZK_OK;
+}
+
+/* ========== 持久化策略 ========== */
+
+/*
+ * 追加的持久化模式（struct zzk_options 的 sync_mode）:
+ *   none   只 fflush，交给操作系统择机写回（默认，与旧版行为一致）
+ *   data   每次提交: fdatasync 数据 → 写 TotalSize → fdatasync 文件头
+ *   group  组提交：每累计 N 条记录或距上次提交超过 T 毫秒提交一次，分摊 fdatasync 的代价；
+ *          每次只写一条记录的调用方等同 data
+ * 顺序保证：TotalSize 只会覆盖已经落盘的数据，崩溃后读取方不会看到未同步的块。
+ * data / group 需要 POSIX 构建。
+ */
+static const struct zzk_options default_options = { ZZK_SYNC_NONE, 0, 0, NULL, 0, 0, 0, 0, 0, 0 };
+
+void zzk_options_init(struct zzk_options *opt) {
+    *opt = default_options;
+}
+
+/* 毫秒时间戳。POSIX 使用单调时钟；纯 C89 只能退回 clock()（进程 CPU 时间，仅供参考） */
+static double now_ms(void) {
+#ifdef ZZK1_POSIX
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+    return (double)clock() * 1000.0 / CLOCKS_PER_SEC;
+}
+
+double zzk_clock_ms(void) {
+    return now_ms();
+}
+
+/*
+ * 解析持久化模式: none | data | group[:N][,Tms]，例如 group:64,10ms。
+ * 只写 group 时取 64 条 / 10 毫秒。语法错误返回 ZZK_ERR_ARG，
+ * 非 POSIX 构建选择 data / group 返回 ZZK_ERR_UNSUPPORTED；失败时 opt 不变。
+ */
+int zzk_parse_sync_mode(struct zzk_options *opt, const char *arg) {
+    struct zzk_options parsed = *opt;
+    const char *p;
+    char *endptr;
+    long value;
+
+    if (strcmp(arg, "none") == 0) {
+        parsed.sync_mode = ZZK_SYNC_NONE;
+    } else if (strcmp(arg, "data") == 0) {
+        parsed.sync_mode = ZZK_SYNC_DATA;
+    } else if (strncmp(arg, "group", 5) == 0 && (arg[5] == '\0' || arg[5] == ':')) {
+        parsed.sync_mode = ZZK_SYNC_GROUP;
+        parsed.group_records = 64;
+        parsed.group_ms = 10;
+        if (arg[5] == ':') {
+            parsed.group_records = 0;
+            parsed.group_ms = 0;
+            for (p = arg + 6; ; p = endptr + 1) {
+                value = strtol(p, &endptr, 10);
+                if (endptr == p || value < 1) return ZZK_ERR_ARG;
+                if (strncmp(endptr, "ms", 2) == 0) {
+                    parsed.group_ms = value;
+                    endptr += 2;
+                } else {
+                    parsed.group_records = value;
+                }
+                if (*endptr == '\0') break;
+                if (*endptr != ',') return ZZK_ERR_ARG;
+            }
+        }
+    } else {
+        return ZZK_ERR_ARG;
+    }
+#ifndef ZZK1_POSIX
+    if (parsed.sync_mode != ZZK_SYNC_NONE) return ZZK_ERR_UNSUPPORTED;
+#endif
+    *opt = parsed;
+    return ZZK_OK;
+}
+
+/* 解析流水线写入的 N[:SIZE]（SIZE 可带 K / M 后缀）；空串取默认的缓冲区数与大小 */
+int zzk_parse_pipeline(struct zzk_options *opt, const char *arg) {
+    long buffers = (long)ZZK_PIPELINE_BUFFERS;
+    unsigned long size = (unsigned long)ZZK_PIPELINE_BUFFER_SIZE;
+    char *endptr;
+
+    if (*arg != '\0') {
+        buffers = strtol(arg, &endptr, 10);
+        if (endptr == arg || buffers < ZZK_PIPELINE_MIN_BUFFERS || buffers > ZZK_PIPELINE_MAX_BUFFERS) {
+            return ZZK_ERR_ARG;
+        }
+        if (*endptr == ':') {
+            arg = endptr + 1;
+            size = strtoul(arg, &endptr, 10);
+            if (endptr == arg) return ZZK_ERR_ARG;
+            if (*endptr == 'K' || *endptr == 'k') {
+                size = (size > ZZK_PIPELINE_MAX_SIZE / 1024) ? 0 : size * 1024;
+                endptr++;
+            } else if (*endptr == 'M' || *endptr == 'm') {
+                size = (size > ZZK_PIPELINE_MAX_SIZE / (1024 * 1024)) ? 0 : size * 1024 * 1024;
+                endptr++;
+            }
+            if (size < ZZK_PIPELINE_MIN_SIZE || size > ZZK_PIPELINE_MAX_SIZE) return ZZK_ERR_ARG;
+        }
+        if (*endptr != '\0') return ZZK_ERR_ARG;
+    }
+#ifndef ZZK1_THREADS
+    (void)opt;
+    return ZZK_ERR_UNSUPPORTED;
+#else
+    opt->pipeline_buffers = (int)buffers;
+    opt->pipeline_size = (zzk_u32)size;
+    return ZZK_OK;
+#endif
+}
+
+/* 刷新 stdio 缓冲；持久化模式下再让数据到达存储介质 */
+static int sync_data(FILE *fp, const struct zzk_options *opt, const char *what) {
+    int failed;
+
+    STATS_TIME(ZZK_PHASE_SYNC, failed = fflush(fp) != 0);
+    if (failed) return io_error(what);
+#ifdef ZZK1_POSIX
+    if (opt->sync_mode != ZZK_SYNC_NONE) {
+        STATS_TIME(ZZK_PHASE_SYNC, failed = fdatasync(fileno(fp)) != 0);
+        if (failed) return io_error(what);
+        if (opt->stats) opt->stats->syncs++;
+    }
+#else
+    (void)opt;
+#endif
+    return ZZK_OK;
+}
+
+/* 新建或改名后同步所在目录，使目录项本身持久（仅持久化模式，失败时忽略） */
+static void sync_parent_dir(const char *path, const struct zzk_options *opt) {
+#ifdef ZZK1_POSIX
+    char dir[4096];
+    const char *slash = strrchr(path, '/');
+    size_t len = slash ? (size_t)(slash - path) : 0;
+    int fd;
+
+    if (opt->sync_mode == ZZK_SYNC_NONE || len >= sizeof(dir)) return;
+    if (slash && len == 0) len = 1;  /* 根目录下的文件 */
+    memcpy(dir, slash ? path : ".", slash ? len : 1);
+    dir[slash ? len : 1] = '\0';
+    fd = open(dir, O_RDONLY);
+    if (fd < 0) return;
+    if (fsync(fd) == 0 && opt->stats) opt->stats->syncs++;
+    close(fd);
+#else
+    (void)path;
+    (void)opt;
+#endif
+}
+
+/* ========== 文件头操作 ========== */
+
+/* 按 Magic 识别格式，未知 Magic 返回 NULL */
+static const struct zzk_format *format_from_magic(u32 magic) {
+    if (magic == FORMAT_ZZK1.magic) return &FORMAT_ZZK1;
+    if (magic == FORMAT_ZZK2.magic) return &FORMAT_ZZK2;
+    return NULL;
+}
+
+static int format_id(const struct zzk_format *fmt) {
+    return fmt == &FORMAT_ZZK1 ? ZZK_FORMAT_ZZK1 : ZZK_FORMAT_ZZK2;
+}
+
+/* 超出格式上限时的统一报错。ZZK1 归档提示可先 upgrade 到 ZZK2 */
+static int report_size_overflow(const struct zzk_format *fmt) {
+    if (fmt == &FORMAT_ZZK1) {
+        log_msg(ZZK_LOG_ERROR, "Error: file size overflow (exceeds 4GB limit). "
+                               "Use 'upgrade' to convert the archive to ZZK2.\n");
+    } else {
+        log_msg(ZZK_LOG_ERROR, "Error: file size overflow.\n");
+    }
+    return ZZK_ERR_OVERFLOW;
+}
+
+/* 写入文件头（Magic + TotalSize + Reserved），fp 须位于文件开头 */
+static int write_header(FILE *fp, const struct zzk_format *fmt, u64 total_size) {
+    unsigned char buf[8];
+    if (write_u32(fp, fmt->magic, "Error writing magic") != 0) return ZZK_ERR_IO;
+    uint_to_be(total_size, buf, fmt->size_width);
+    if (write_all(fp, buf, fmt->size_width, "Error writing total size") != 0) return ZZK_ERR_IO;
+    return write_u32(fp, RESERVED, "Error writing reserved");
+}
+
+/* 就地改写文件头中的 TotalSize 字段（不刷新） */
+static int write_total_size(FILE *fp, const struct zzk_format *fmt, u64 total_size) {
+    unsigned char buf[8];
+    STATS_COUNT(STATS_SEEKS, 1);
+    if (fseek(fp, 4, SEEK_SET) != 0) return io_error("Error seeking to header size field");
+    uint_to_be(total_size, buf, fmt->size_width);
+    return write_all(fp, buf, fmt->size_width, "Error writing updated total size");
+}
+
+/*
+ * 读取并验证文件头（Magic + TotalSize + Reserved），按 Magic 识别格式。
+ * 返回 0 成功；-1 Magic 无法识别；-2 文件头被截断。
+ */
+static int read_header(FILE *fp, const struct zzk_format **fmt, u64 *total_size, u32 *reserved) {
+    unsigned char buf[8];
+    u32 magic;
+
+    if (read_u32_be(fp, &magic) != 0 || (*fmt = format_from_magic(magic)) == NULL) return -1;
+    if (fread(buf, 1, (*fmt)->size_width, fp) != (*fmt)->size_width) return -2;
+    *total_size = be_to_uint(buf, (*fmt)->size_width);
+    if (read_u32_be(fp, reserved) != 0) return -2;
+    return 0;
+}
+
+/*
+ * 追加方之间的互斥：POSIX 构建对整个文件加 fcntl 写锁（阻塞等待，关闭文件时释放），
+ * 使并发的追加（包括 serve 守护进程持有的写入句柄）依次进行。
+ * 锁是建议性的，文件系统不支持时忽略；只读方不受影响。
+ */
+static void lock_for_append(FILE *fp) {
+#ifdef ZZK1_POSIX
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 0;
+    while (fcntl(fileno(fp), F_SETLKW, &fl) != 0 && errno == EINTR) {
+    }
+#else
+    (void)fp;
+#endif
+}
+
+/*
+ * 打开现有归档用于追加。验证文件头，定位到写入位置。
+ * 处理三种情况：正常 / 尾部有垃圾数据 / 文件被截断。
+ */
+static int validate_and_open(const char *filename, FILE **fp_out, const struct zzk_format **fmt_out,
+                             u64 *current_size_out) {
+    const struct zzk_format *fmt;
+    u32 reserved;
+    u64 header_total_size, actual_size;
+    char a[24], b[24];
+    int rc;
+    FILE *fp = fopen(filename, "rb+");
+
+    if (!fp) return io_error("Error opening file");
+    lock_for_append(fp);
+
+    rc = read_header(fp, &fmt, &header_total_size, &reserved);
+    if (rc != 0) {
+        log_msg(ZZK_LOG_ERROR, rc == -1 ? "Invalid magic number.\n" : "Error reading size.\n");
+        fclose(fp);
+        return ZZK_ERR_FORMAT;
+    }
+    if (reserved != RESERVED) {
+        log_msg(ZZK_LOG_WARNING, "Warning: reserved field is non-zero (%lu).\n", (unsigned long)reserved);
+    }
+    if (header_total_size < fmt->header_size) {
+        log_msg(ZZK_LOG_ERROR, "Error: invalid total size in header (%s < %u).\n",
+                u64_str(header_total_size, a), fmt->header_size);
+        fclose(fp);
+        return ZZK_ERR_FORMAT;
+    }
+
+    /* 用实际文件大小做追加基准，避免头部 Total Size 与实际不一致 */
+    if (get_file_size(fp, &actual_size, "Error seeking/ftell file") != 0) {
+        fclose(fp);
+        return ZZK_ERR_IO;
+    }
+    if (header_total_size != actual_size) {
+        log_msg(ZZK_LOG_WARNING, "Warning: header Total Size (%s) != actual file size (%s).\n",
+                u64_str(header_total_size, a), u64_str(actual_size, b));
+
+        if (actual_size < header_total_size) {
+            log_msg(ZZK_LOG_ERROR, "Error: file truncated. Corrupted.\n");
+            fclose(fp);
+            return ZZK_ERR_CORRUPT;
+        }
+        /* 尾部有垃圾数据，回退到 header 声明的末尾覆盖写入 */
+        log_msg(ZZK_LOG_WARNING, "Fixing: overwriting trailing garbage data.\n");
+        actual_size = header_total_size;
+    }
+
+    if (seek_to(fp, actual_size) != 0) {
+        fclose(fp);
+        return ZZK_ERR_IO;
+    }
+    *fp_out = fp;
+    *fmt_out = fmt;
+    *current_size_out = actual_size;
+    return ZZK_OK;
+}
+
+/*
+ * 更新文件头中的 Total Size 字段，之后回到新的末尾继续写入。
+ * 先让数据落盘再写文件头（按持久化策略），并计入提交延迟统计。
+ */
+static int update_total_size(FILE *fp, const struct zzk_format *fmt, const struct zzk_options *opt,
+                             u64 added_size, u64 old_size) {
+    u64 new_size;
+    double start, elapsed;
+
+    if (old_size > fmt->max_size - added_size) return report_size_overflow(fmt);
+    new_size = old_size + added_size;
+    start = now_ms();
+    if (sync_data(fp, opt, "Error flushing data before header update") != 0 ||
+        write_total_size(fp, fmt, new_size) != 0 ||
+        sync_data(fp, opt, "Error flushing header update") != 0 ||
+        seek_to(fp, new_size) != 0) return ZZK_ERR_IO;
+
+    if (opt->stats) {
+        elapsed = now_ms() - start;
+        opt->stats->commits++;
+        opt->stats->total_ms += elapsed;
+        if (elapsed > opt->stats->max_ms) opt->stats->max_ms = elapsed;
+    }
+    return ZZK_OK;
+}
+
+/* ========== 归档读取器 ========== */
+
+/*
+ * 只读路径的统一入口。
+ * 启用 ZZK1_POSIX 时优先 mmap 文件头声明的有效区：块头直接从映射解析，
+ * CRC 在映射上原地计算，提取的数据直接从映射写出。
+ * 无法映射时（纯 C89 构建、地址空间不足、非普通文件、设置了 ZZK1_NO_MMAP）
+ * 回退到 stdio，并记住当前偏移以省去多余的 fseek。
+ */
+#define READER_SEQUENTIAL 1
+#define READER_WILLNEED   2
+#define READER_DONE       3  /* 已处理完的范围：把其中的整页移出本进程的驻留集 */
+#define READER_BUFFER_SIZE (64 * 1024)
+
+struct zzk_reader {
+    FILE *fp;
+    int owns_fp;
+    char *path;                /* 打开的路径（stdio 模式的并行校验按路径各自打开）；附着时为 NULL */
+    const struct zzk_format *fmt;
+    u64 total_size;            /* 文件头声明的 TotalSize */
+    const unsigned char *map;  /* 映射基址；NULL 表示 stdio 模式 */
+    size_t map_len;            /* 映射长度（不超过实际文件大小） */
+    u64 pos;                   /* stdio 模式下 fp 的当前偏移 */
+    int pos_known;
+#ifdef ZZK1_LINUX
+    int notify_fd;             /* zzk_reader_wait 的 inotify 句柄，首次等待时建立；-1 表示没有 */
+#endif
+};
+
+#ifdef ZZK1_POSIX
+static void reader_try_map(struct zzk_reader *r) {
+    struct stat st;
+    size_t len;
+    void *p;
+
+    if (getenv("ZZK1_NO_MMAP")) return;
+    if ((u64)(size_t)r->total_size != r->total_size) return;  /* 地址空间放不下 */
+    if (fstat(fileno(r->fp), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) return;
+
+    len = (size_t)r->total_size;
+    if ((u64)st.st_size < (u64)len) len = (size_t)st.st_size;
+    p = mmap(NULL, len, PROT_READ, MAP_SHARED, fileno(r->fp), 0);
+    if (p == MAP_FAILED) return;
+
+    r->map = (const unsigned char *)p;
+    r->map_len = len;
+}
+#endif
+
+/* 打开归档并读取文件头 */
+static int reader_open(struct zzk_reader *r, const char *filename) {
+    u32 reserved;
+    int rc;
+
+    r->fp = fopen(filename, "rb");
+    if (!r->fp) return io_error("Error opening file");
+    r->owns_fp = 1;
+    r->map = NULL;
+    r->map_len = 0;
+#ifdef ZZK1_LINUX
+    r->notify_fd = -1;
+#endif
+
+    rc = read_header(r->fp, &r->fmt, &r->total_size, &reserved);
+    if (rc != 0) {
+        log_msg(ZZK_LOG_ERROR, rc == -1 ? "Invalid magic number.\n" : "Error reading header (truncated header).\n");
+        fclose(r->fp);
+        return ZZK_ERR_FORMAT;
+    }
+    if (r->total_size < r->fmt->header_size) {
+        log_msg(ZZK_LOG_ERROR, "Error: invalid total size in header.\n");
+        fclose(r->fp);
+        return ZZK_ERR_FORMAT;
+    }
+    r->pos = r->fmt->header_size;
+    r->pos_known = 1;
+
+#ifdef ZZK1_POSIX
+    reader_try_map(r);
+#endif
+    return ZZK_OK;
+}
+
+/* 以 stdio 模式包装一个已打开的句柄（追加路径使用），关闭时不关闭 fp */
+static void reader_attach(struct zzk_reader *r, FILE *fp, const struct zzk_format *fmt, u64 total_size) {
+    r->fp = fp;
+    r->owns_fp = 0;
+    r->path = NULL;
+    r->fmt = fmt;
+    r->total_size = total_size;
+    r->map = NULL;
+    r->map_len = 0;
+    r->pos = 0;
+    r->pos_known = 0;
+#ifdef ZZK1_LINUX
+    r->notify_fd = -1;
+#endif
+}
+
+static void reader_close(struct zzk_reader *r) {
+#ifdef ZZK1_POSIX
+    if (r->map) munmap((void *)r->map, r->map_len);
+#endif
+#ifdef ZZK1_LINUX
+    if (r->notify_fd >= 0) close(r->notify_fd);
+    r->notify_fd = -1;
+#endif
+    r->map = NULL;
+    if (r->owns_fp) fclose(r->fp);
+    r->fp = NULL;
+}
+
+/* 访问模式提示：扫描用 SEQUENTIAL，即将整段读取的块用 WILLNEED */
+static void reader_advise(struct zzk_reader *r, u64 offset, u64 len, int advice) {
+#ifdef ZZK1_POSIX
+    size_t page, start, end;
+
+    if (!r->map || offset >= (u64)r->map_len) return;
+    page = (size_t)sysconf(_SC_PAGESIZE);
+    if (page == 0 || page == (size_t)-1) page = 4096;
+    start = (size_t)offset & ~(page - 1);
+    end = (len > r->map_len - offset) ? r->map_len : (size_t)offset + len;
+    if (advice == READER_DONE) {
+        /* 只读映射丢弃后再访问会从页缓存重新建立；只处理完全落在范围内的页 */
+        start = ((size_t)offset + page - 1) & ~(page - 1);
+        end &= ~(page - 1);
+        if (end <= start) return;
+#ifdef ZZK1_LINUX
+        madvise((void *)(r->map + start), end - start, MADV_DONTNEED);
+#else
+        posix_madvise((void *)(r->map + start), end - start, POSIX_MADV_DONTNEED);  /* glibc 忽略此提示 */
+#endif
+        return;
+    }
+    posix_madvise((void *)(r->map + start), end - start,
+                  advice == READER_SEQUENTIAL ? POSIX_MADV_SEQUENTIAL : POSIX_MADV_WILLNEED);
+#else
+    (void)r;
+    (void)offset;
+    (void)len;
+    (void)advice;
+#endif
+}
+
+/*
+ * 取得 [offset, offset+len) 的字节。映射模式返回映射内指针（零拷贝），
+ * stdio 模式读入 buf 后返回 buf。越过 TotalSize 或文件末尾时返回 NULL。
+ */
+static const unsigned char *reader_get(struct zzk_reader *r, u64 offset, size_t len, unsigned char *buf) {
+    if (offset > r->total_size || (u64)len > r->total_size - offset) return NULL;
+    if (r->map) {
+        if (offset > (u64)r->map_len || len > r->map_len - (size_t)offset) return NULL;
+        STATS_COUNT(STATS_BYTES_READ, len);
+        return r->map + (size_t)offset;
+    }
+
+    if (!r->pos_known || r->pos != offset) {
+        r->pos_known = 0;
+        if (seek_to(r->fp, offset) != 0) return NULL;
+    }
+    if (len > 0 && fread(buf, 1, len, r->fp) != len) {
+        r->pos_known = 0;
+        return NULL;
+    }
+    STATS_COUNT(STATS_BYTES_READ, len);
+    r->pos = offset + (u64)len;
+    r->pos_known = 1;
+    return buf;
+}
+
+/*
+ * 读取 offset 处的块头并做边界检查。
+ * 返回 0 成功；-1 块头不完整；-2 Length 超出 TotalSize 剩余空间。
+ */
+static int reader_chunk_header(struct zzk_reader *r, u64 offset, u32 *type, u64 *length) {
+    const struct zzk_format *fmt = r->fmt;
+    unsigned char buf[12];
+    const unsigned char *p;
+
+    if (offset > r->total_size || r->total_size - offset < fmt->chunk_header) return -1;
+    STATS_TIME(ZZK_PHASE_SCAN, p = reader_get(r, offset, fmt->chunk_header, buf));
+    STATS_COUNT(STATS_CHUNKS, 1);
+    if (!p) return -1;
+    *type = be_to_u32(p);
+    *length = be_to_uint(p + 4, fmt->size_width);
+    if (r->total_size - offset < fmt->chunk_overhead ||
+        *length > r->total_size - offset - fmt->chunk_overhead) return -2;
+    return 0;
+}
+
+/* 读取块末尾存储的 CRC32。成功返回 0 */
+static int reader_chunk_crc(struct zzk_reader *r, u64 offset, u64 length, u32 *crc) {
+    unsigned char buf[4];
+    const unsigned char *p = reader_get(r, offset + r->fmt->chunk_header + length, 4, buf);
+    if (!p) return -1;
+    *crc = be_to_u32(p);
+    return 0;
+}
+
+#ifdef ZZK1_LINUX
+/* 内核侧拷贝的窗口：先拷贝一个窗口，再在映射上对同一窗口计算 CRC（此时已在页缓存中） */
+#define KERNEL_COPY_WINDOW (8UL * 1024 * 1024)
+/* 更短的数据经 stdio 缓冲写出：内核拷贝每次要 fflush + 拷贝 + 重新定位，小块上反而更慢 */
+#define KERNEL_COPY_MIN    (64 * 1024)
+
+/*
+ * 把 in_fd 的 [in_off, in_off+len) 拷贝到 out_fd 的当前位置（并推进该位置），
+ * 数据不经过用户态。优先 copy_file_range，跨文件系统或目标不是普通文件时退到 sendfile。
+ * 成功返回 0；尚未拷贝任何数据就发现不支持时返回 -1（调用方改走可移植路径）；
+ * 中途出错返回 -2。
+ */
+static int kernel_copy(int in_fd, u64 in_off, int out_fd, u64 len, int *use_sendfile) {
+    off_t off = (off_t)in_off;
+    u64 done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        size_t want = (len - done > 0x40000000UL) ? 0x40000000UL : (size_t)(len - done);
+        if (!*use_sendfile) {
+            n = copy_file_range(in_fd, &off, out_fd, NULL, want, 0);
+            if (n < 0 && done == 0 &&
+                (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)) {
+                *use_sendfile = 1;
+                continue;
+            }
+        } else {
+            n = sendfile(out_fd, in_fd, &off, want);
+            if (n < 0 && done == 0 && (errno == EINVAL || errno == ENOSYS)) return -1;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return done == 0 && n == 0 ? -1 : -2;
+        done += (u64)n;
+    }
+    return 0;
+}
+
+/*
+ * reader_crc_copy 的内核侧实现：数据由内核直接从归档拷到 out，
+ * CRC 在映射上按窗口计算（crc 为 NULL 时不校验，也不要求映射）。
+ */
+static int reader_kernel_copy(struct zzk_reader *r, u64 offset, u64 len, u32 *crc, FILE *out) {
+    int use_sendfile = 0, rc;
+    u64 done = 0, step;
+
+    if (fflush(out) != 0) return -2;
+    while (done < len) {
+        step = (len - done > KERNEL_COPY_WINDOW) ? (u64)KERNEL_COPY_WINDOW : len - done;
+        STATS_TIME(ZZK_PHASE_WRITE, rc = kernel_copy(fileno(r->fp), offset + done, fileno(out), step, &use_sendfile));
+        if (rc == -1 && done == 0) return -1;
+        if (rc != 0) return -2;
+        /* 内核侧拷贝同样读取了归档（校验时还经映射读取一次，只计一次） */
+        STATS_COUNT(STATS_BYTES_READ, step);
+        STATS_COUNT(STATS_BYTES_WRITTEN, step);
+        if (crc) STATS_TIME(ZZK_PHASE_CRC, *crc = crc32_update(*crc, r->map + (size_t)(offset + done), (size_t)step));
+        done += step;
+    }
+    /* 让 stdio 与文件描述符的位置重新同步（管道等不可定位的输出无需同步） */
+    if (fseek(out, 0, SEEK_CUR) != 0 && errno != ESPIPE) return -2;
+    return 0;
+}
+#endif
+
+/*
+ * 对 [offset, offset+len) 继续累积 CRC（crc 为中间状态，NULL 表示不计算）。
+ * out 非 NULL 时同时把数据写出：ZZK1_LINUX 下不短于 KERNEL_COPY_MIN 的数据由内核直接拷贝，
+ * 否则映射模式直接从映射写出，stdio 模式经缓冲区中转。
+ * 成功返回 0；读取失败（含缓冲区分配失败）返回 -1；写出失败返回 -2。
+ */
+static int reader_crc_copy(struct zzk_reader *r, u64 offset, u64 len, u32 *crc, FILE *out) {
+    unsigned char *buffer = NULL;
+    const unsigned char *p;
+    u64 remaining = len;
+    size_t step;
+    int rc = 0;
+
+    if (offset > r->total_size || len > r->total_size - offset) return -1;
+#ifdef ZZK1_LINUX
+    if (out && len >= KERNEL_COPY_MIN && (r->map || !crc) &&
+        (!r->map || (offset <= (u64)r->map_len && len <= (u64)r->map_len - offset))) {
+        rc = reader_kernel_copy(r, offset, len, crc, out);
+        if (rc != -1) return rc;
+        rc = 0;
+    }
+#endif
+
+    if (!r->map) {
+        buffer = (unsigned char *)malloc(READER_BUFFER_SIZE);
+        if (!buffer) {
+            nomem();
+            return -1;
+        }
+    }
+    while (remaining > 0) {
+        /* 映射模式按 1MB 切片，让 CRC 与写出在缓存热的数据上交替进行 */
+        step = r->map ? (1024 * 1024) : READER_BUFFER_SIZE;
+        if ((u64)step > remaining) step = (size_t)remaining;
+        STATS_TIME(ZZK_PHASE_READ, p = reader_get(r, offset, step, buffer));
+        if (!p) {
+            rc = -1;
+            break;
+        }
+        if (crc) STATS_TIME(ZZK_PHASE_CRC, *crc = crc32_update(*crc, p, step));
+        if (out) {
+            size_t written;
+            STATS_TIME(ZZK_PHASE_WRITE, written = fwrite(p, 1, step, out));
+            STATS_COUNT(STATS_BYTES_WRITTEN, written);
+            if (written != step) {
+                rc = -2;
+                break;
+            }
+        }
+        offset += (u64)step;
+        remaining -= (u64)step;
+    }
+    free(buffer);
+    return rc;
+}
+
+/* ========== 索引块 ========== */
+
+/*
+ * 尾部索引块（TYPE_INDEX），可选，始终是归档的最后一个块:
+ *   Value = Count(4) + Count × [Index(4) + Type(4) + Offset(4) + Length(4) + CRC32(4)]
+ *           + IndexOffset(4) + "ZIDX"(4)
+ *   Offset 为块起始（Type 字段）的文件偏移；IndexOffset 为索引块自身的起始偏移。
+ *   ZZK2 中 Offset、Length、IndexOffset 随长度字段扩展为 8 字节。
+ * 读取方从 TotalSize 倒推：末尾 CRC32 之前是 "ZIDX" 与 IndexOffset，据此 O(1) 定位。
+ * 追加时若存在索引，先把 TotalSize 收缩到 IndexOffset（崩溃后仍是合法归档），
+ * 再写入新块与新索引，最后一次性更新 TotalSize。旧版读取器按未知类型跳过。
+ */
+#define INDEX_MAGIC          0x5A494458  /* "ZIDX" */
+#define INDEX_ENTRY_SIZE(f)  (12 + 2 * (f)->size_width)  /* ZZK1: 20, ZZK2: 28 */
+#define INDEX_FIXED_SIZE(f)  (8 + (f)->size_width)       /* Count + IndexOffset + Magic */
+#define INDEX_ENTRY_MAX      28
+
+struct chunk_entry {
+    u32 type;
+    u64 offset;  /* 块起始偏移（Type 字段） */
+    u64 length;
+    u32 crc;
+};
+
+struct chunk_table {
+    struct chunk_entry *items;
+    long count;
+    long cap;
+};
+
+static int chunk_table_push(struct chunk_table *t, u32 type, u64 offset, u64 length, u32 crc) {
+    if (t->count == t->cap) {
+        long cap = t->cap ? t->cap * 2 : 64;
+        struct chunk_entry *items = (struct chunk_entry *)realloc(t->items, sizeof(*t->items) * (size_t)cap);
+        if (!items) return nomem();
+        t->items = items;
+        t->cap = cap;
+    }
+    t->items[t->count].type = type;
+    t->items[t->count].offset = offset;
+    t->items[t->count].length = length;
+    t->items[t->count].crc = crc;
+    t->count++;
+    return ZZK_OK;
+}
+
+/*
+ * 从 pos 开始顺序遍历块头（跳过 Value，只读存储的 CRC32），直到 end。
+ * 完整遍历返回 ZZK_OK，遇到结构损坏返回 ZZK_ERR_CORRUPT（t 保留损坏点之前的块）。
+ */
+static int scan_chunk_range(struct zzk_reader *r, u64 pos, u64 end, struct chunk_table *t) {
+    const struct zzk_format *fmt = r->fmt;
+    u64 length;
+    u32 type, crc;
+
+    while (pos <= end && end - pos >= fmt->chunk_header) {
+        if (reader_chunk_header(r, pos, &type, &length) != 0) return ZZK_ERR_CORRUPT;
+        if (end - pos < fmt->chunk_overhead || length > end - pos - fmt->chunk_overhead) return ZZK_ERR_CORRUPT;
+        if (reader_chunk_crc(r, pos, length, &crc) != 0) return ZZK_ERR_CORRUPT;
+        if (chunk_table_push(t, type, pos, length, crc) != 0) return ZZK_ERR_NOMEM;
+        pos += fmt->chunk_overhead + length;
+    }
+    return ZZK_OK;
+}
+
+static int scan_chunk_headers(struct zzk_reader *r, u64 end, struct chunk_table *t) {
+    return scan_chunk_range(r, r->fmt->header_size, end, t);
+}
+
+/*
+ * 检查尾部索引是否存在。存在时返回 1，并给出索引块偏移与条目数。
+ * 只读取尾标与块头，不读取条目本身。
+ */
+static int locate_index(struct zzk_reader *r, u64 *index_offset, u32 *count) {
+    const struct zzk_format *fmt = r->fmt;
+    unsigned w = fmt->size_width;
+    unsigned char buf[16];
+    const unsigned char *p;
+    u64 total_size = r->total_size, offset, length;
+    u32 n;
+
+    if (total_size < fmt->header_size + fmt->chunk_overhead + INDEX_FIXED_SIZE(fmt)) return 0;
+    p = reader_get(r, total_size - (w + 8), w + 8, buf);
+    if (!p || be_to_u32(p + w) != INDEX_MAGIC) return 0;
+
+    offset = be_to_uint(p, w);
+    if (offset < fmt->header_size ||
+        offset > total_size - fmt->chunk_overhead - INDEX_FIXED_SIZE(fmt)) return 0;
+    length = total_size - offset - fmt->chunk_overhead;
+
+    p = reader_get(r, offset, fmt->chunk_header + 4, buf);
+    if (!p || be_to_u32(p) != TYPE_INDEX || be_to_uint(p + 4, w) != length) return 0;
+    n = be_to_u32(p + fmt->chunk_header);
+    if ((u64)n > (length - INDEX_FIXED_SIZE(fmt)) / INDEX_ENTRY_SIZE(fmt) ||
+        (u64)n * INDEX_ENTRY_SIZE(fmt) + INDEX_FIXED_SIZE(fmt) != length) return 0;
+
+    *index_offset = offset;
+    *count = n;
+    return 1;
+}
+
+/*
+ * 读取并校验完整的尾部索引到 t。
+ * 成功返回 1，索引不存在或损坏返回 0，内存不足返回 ZZK_ERR_NOMEM。
+ */
+static int load_index(struct zzk_reader *r, struct chunk_table *t, u64 *index_offset) {
+    const struct zzk_format *fmt = r->fmt;
+    unsigned w = fmt->size_width, entry_size = INDEX_ENTRY_SIZE(fmt);
+    u64 offset, entries;
+    u32 count, i, crc, stored_crc;
+    unsigned char buf[INDEX_ENTRY_MAX];
+    const unsigned char *p;
+
+    if (!locate_index(r, &offset, &count)) return 0;
+
+    p = reader_get(r, offset, fmt->chunk_header + 4, buf);
+    if (!p) return 0;
+    crc = crc32_update(0xFFFFFFFFUL, p, fmt->chunk_header + 4);
+
+    entries = offset + fmt->chunk_header + 4;
+    t->count = 0;
+    for (i = 0; i < count; i++) {
+        p = reader_get(r, entries + (u64)i * entry_size, entry_size, buf);
+        if (!p) return 0;
+        crc = crc32_update(crc, p, entry_size);
+        if (be_to_u32(p) != i + 1) return 0;
+        if (chunk_table_push(t, be_to_u32(p + 4), be_to_uint(p + 8, w),
+                             be_to_uint(p + 8 + w, w), be_to_u32(p + 8 + 2 * w)) != 0) return ZZK_ERR_NOMEM;
+    }
+    p = reader_get(r, entries + (u64)count * entry_size, w + 4, buf);
+    if (!p) return 0;
+    crc = crc32_update(crc, p, w + 4) ^ 0xFFFFFFFFUL;
+    if (reader_chunk_crc(r, offset, (u64)count * entry_size + INDEX_FIXED_SIZE(fmt), &stored_crc) != 0 ||
+        stored_crc != crc) return 0;
+
+    *index_offset = offset;
+    return 1;
+}
+
+/* 在当前位置写入索引块（覆盖 t 中全部条目），written 返回写入的字节数 */
+static int write_index_chunk(FILE *fp, const struct zzk_format *fmt, const struct chunk_table *t,
+                             u64 index_offset, u64 *written) {
+    unsigned w = fmt->size_width, entry_size = INDEX_ENTRY_SIZE(fmt);
+    unsigned char hdr[16], entry[INDEX_ENTRY_MAX];
+    u64 length = (u64)t->count * entry_size + INDEX_FIXED_SIZE(fmt);
+    unsigned hdr_len;
+    u32 crc;
+    long i;
+
+    hdr_len = encode_chunk_header(fmt, TYPE_INDEX, length, hdr);
+    u32_to_be((u32)t->count, hdr + hdr_len);
+    crc = crc32_update(0xFFFFFFFFUL, hdr, hdr_len + 4);
+    if (write_all(fp, hdr, hdr_len + 4, "Error writing index chunk header") != 0) return ZZK_ERR_IO;
+
+    for (i = 0; i < t->count; i++) {
+        u32_to_be((u32)(i + 1), entry);
+        u32_to_be(t->items[i].type, entry + 4);
+        uint_to_be(t->items[i].offset, entry + 8, w);
+        uint_to_be(t->items[i].length, entry + 8 + w, w);
+        u32_to_be(t->items[i].crc, entry + 8 + 2 * w);
+        crc = crc32_update(crc, entry, entry_size);
+        if (write_all(fp, entry, entry_size, "Error writing index chunk") != 0) return ZZK_ERR_IO;
+    }
+
+    uint_to_be(index_offset, hdr, w);
+    u32_to_be(INDEX_MAGIC, hdr + w);
+    crc = crc32_update(crc, hdr, w + 4);
+    if (write_all(fp, hdr, w + 4, "Error writing index chunk") != 0 ||
+        write_u32(fp, crc ^ 0xFFFFFFFFUL, "Error writing index chunk CRC32") != 0) return ZZK_ERR_IO;
+
+    *written = fmt->chunk_overhead + length;
+    return ZZK_OK;
+}
+
+/* ========== LZ 压缩 ========== */
+
+/*
+ * 压缩块（TYPE_LZ）: Value = OrigType(4) + OrigLength(8) + BlockSize(4)
+ *                          + N × [BlockLen(4) + BlockData] + ContentCRC(4)
+ *   原内容（TEXT 或 BINARY 的 Value）按 BlockSize 切成 N = ceil(OrigLength / BlockSize) 个独立块，
+ *   各块分别压缩，可以并行编解码。BlockLen 最高位为 1 表示该块原样存储（压缩无收益），
+ *   其余 31 位为 BlockData 的字节数。ContentCRC 是解压后完整内容的 CRC32；
+ *   块末尾的 CRC32 照常覆盖 Type + Length + Value（压缩后的字节），verify 无需解压。
+ *   字段与格式无关，upgrade 原样复制；旧版读取器按未知类型跳过。
+ *
+ * 块编码（LZ77，序列的排列同 LZ4 的块格式，偏移为大端序）:
+ *   序列 = Token(1) + [长度扩展] + 字面量 + Offset(2) + [长度扩展]
+ *   Token 高 4 位为字面量长度 L，低 4 位为匹配长度 M - 4。
+ *   L 或 M - 4 为 15 时，其后追加字节直到遇到不为 255 的字节，逐个累加到长度上。
+ *   解码：复制 L 个字面量；若已到块末尾则结束（最后一个序列只有字面量），
+ *   否则读 Offset（1..65535），从已输出内容的末尾回退 Offset 字节处逐字节复制 M 个字节
+ *   （允许与正在输出的部分重叠）。解码结果必须恰好是该块的原始长度。
+ */
+#define LZ_BLOCK_SIZE  (256 * 1024)
+#define LZ_MAX_BLOCK   (16UL * 1024 * 1024)
+#define LZ_RAW         0x80000000UL
+#define LZ_PREFIX_SIZE 16          /* OrigType + OrigLength + BlockSize */
+#define LZ_MIN_MATCH   4
+#define LZ_HASH_BITS   14
+#define LZ_MIN_INPUT   64          /* 更短的记录不压缩 */
+
+static u32 lz_read32(const unsigned char *p) {
+    return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | (u32)p[3];
+}
+
+static unsigned lz_hash(u32 v) {
+    return (unsigned)(((v * 2654435761UL) & 0xFFFFFFFFUL) >> (32 - LZ_HASH_BITS));
+}
+
+/* 写出长度扩展字节 */
+static size_t lz_put_length(unsigned char *out, size_t op, size_t len) {
+    while (len >= 255) {
+        out[op++] = 255;
+        len -= 255;
+    }
+    out[op++] = (unsigned char)len;
+    return op;
+}
+
+/* 追加一个序列；mlen 为 0 表示只有字面量的结尾序列。放不下 cap 时返回 0 */
+static size_t lz_emit(unsigned char *out, size_t cap, size_t op, const unsigned char *lit, size_t nlit,
+                      size_t offset, size_t mlen) {
+    size_t need = 1 + nlit + (nlit >= 15 ? (nlit - 15) / 255 + 1 : 0);
+
+    if (mlen > 0) need += 2 + (mlen - LZ_MIN_MATCH >= 15 ? (mlen - LZ_MIN_MATCH - 15) / 255 + 1 : 0);
+    if (need > cap - op) return 0;
+
+    out[op++] = (unsigned char)(((nlit >= 15 ? 15 : nlit) << 4) |
+                                (mlen == 0 ? 0 : (mlen - LZ_MIN_MATCH >= 15 ? 15 : mlen - LZ_MIN_MATCH)));
+    if (nlit >= 15) op = lz_put_length(out, op, nlit - 15);
+    memcpy(out + op, lit, nlit);
+    op += nlit;
+    if (mlen > 0) {
+        out[op++] = (unsigned char)(offset >> 8);
+        out[op++] = (unsigned char)(offset & 0xFF);
+        if (mlen - LZ_MIN_MATCH >= 15) op = lz_put_length(out, op, mlen - LZ_MIN_MATCH - 15);
+    }
+    return op;
+}
+
+/*
+ * 贪心的单遍 LZ77 编码：以 4 字节前缀的哈希表查找最近一次出现的位置。
+ * table 为 2^LZ_HASH_BITS 个条目的工作区。返回编码长度，超过 cap 时返回 0（调用方原样存储）。
+ */
+static size_t lz_compress(const unsigned char *in, size_t n, unsigned char *out, size_t cap, u32 *table) {
+    size_t ip = 0, anchor = 0, op = 0, ref, len;
+    unsigned h;
+
+    memset(table, 0, sizeof(u32) << LZ_HASH_BITS);
+    while (n >= LZ_MIN_MATCH && ip <= n - LZ_MIN_MATCH) {
+        h = lz_hash(lz_read32(in + ip));
+        ref = (size_t)table[h];
+        table[h] = (u32)(ip + 1);  /* 0 表示空 */
+        if (ref == 0 || ip - (ref - 1) > 65535 || lz_read32(in + ref - 1) != lz_read32(in + ip)) {
+            ip++;
+            continue;
+        }
+        ref--;
+        len = LZ_MIN_MATCH;
+        while (ip + len < n && in[ref + len] == in[ip + len]) len++;
+        op = lz_emit(out, cap, op, in + anchor, ip - anchor, ip - ref, len);
+        if (op == 0) return 0;
+        ip += len;
+        anchor = ip;
+    }
+    op = lz_emit(out, cap, op, in + anchor, n - anchor, 0, 0);
+    return op;
+}
+
+/* 读取长度扩展字节，越界返回 -1 */
+static int lz_get_length(const unsigned char *in, size_t n, size_t *ip, size_t *len) {
+    unsigned b;
+    do {
+        if (*ip >= n) return -1;
+        b = in[(*ip)++];
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/* 解码一个块到 out，结果必须恰好 out_len 字节。成功返回 0，数据不合法返回 -1 */
+static int lz_decompress(const unsigned char *in, size_t n, unsigned char *out, size_t out_len) {
+    size_t ip = 0, op = 0, len, offset;
+    unsigned token;
+
+    while (ip < n) {
+        token = in[ip++];
+        len = token >> 4;
+        if (len == 15 && lz_get_length(in, n, &ip, &len) != 0) return -1;
+        if (len > n - ip || len > out_len - op) return -1;
+        memcpy(out + op, in + ip, len);
+        ip += len;
+        op += len;
+        if (ip == n) break;
+
+        if (n - ip < 2) return -1;
+        offset = ((size_t)in[ip] << 8) | in[ip + 1];
+        ip += 2;
+        len = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15 && lz_get_length(in, n, &ip, &len) != 0) return -1;
+        if (offset == 0 || offset > op || len > out_len - op) return -1;
+        for (; len > 0; len--, op++) out[op] = out[op - offset];
+    }
+    return op == out_len ? 0 : -1;
+}
+
+/*
+ * 并行编解码的一批块。编码时 raw 为原始块、packed 为 BlockLen + BlockData；
+ * 解码时反之。两个方向都在任务里算好各自的 CRC32，主线程按顺序合并。
+ */
+struct lz_job {
+    const unsigned char *raw;
+    unsigned char *raw_buf;       /* 解码输出 */
+    size_t raw_len;
+    const unsigned char *packed;  /* 解码输入（BlockData，不含 BlockLen） */
+    unsigned char *packed_buf;    /* 编码输出（含 BlockLen） */
+    size_t packed_len;
+    int stored_raw;
+    int failed;
+    u32 raw_crc;
+    u32 packed_crc;               /* 覆盖 BlockLen + BlockData */
+};
+
+struct lz_ctx {
+    struct lz_job *jobs;
+    u32 **tables;                 /* 每个工作者一张哈希表（只用于编码） */
+    int verify;
+};
+
+static void lz_compress_job(void *ctx, int worker, long job) {
+    struct lz_ctx *x = (struct lz_ctx *)ctx;
+    struct lz_job *j = &x->jobs[job];
+    size_t n = lz_compress(j->raw, j->raw_len, j->packed_buf + 4, j->raw_len - 1, x->tables[worker]);
+
+    if (n == 0) {
+        memcpy(j->packed_buf + 4, j->raw, j->raw_len);
+        u32_to_be((u32)j->raw_len | LZ_RAW, j->packed_buf);
+        n = j->raw_len;
+    } else {
+        u32_to_be((u32)n, j->packed_buf);
+    }
+    j->packed_len = n + 4;
+    j->raw_crc = crc32_update(0xFFFFFFFFUL, j->raw, j->raw_len) ^ 0xFFFFFFFFUL;
+    j->packed_crc = crc32_update(0xFFFFFFFFUL, j->packed_buf, j->packed_len) ^ 0xFFFFFFFFUL;
+}
+
+static void lz_decompress_job(void *ctx, int worker, long job) {
+    struct lz_ctx *x = (struct lz_ctx *)ctx;
+    struct lz_job *j = &x->jobs[job];
+    unsigned char prefix[4];
+
+    (void)worker;
+    if (j->stored_raw) {
+        j->raw = j->packed;
+    } else {
+        j->failed = lz_decompress(j->packed, j->packed_len, j->raw_buf, j->raw_len) != 0;
+        j->raw = j->raw_buf;
+    }
+    if (j->failed) return;
+    j->raw_crc = crc32_update(0xFFFFFFFFUL, j->raw, j->raw_len) ^ 0xFFFFFFFFUL;
+    if (x->verify) {
+        u32_to_be((u32)j->packed_len | (j->stored_raw ? LZ_RAW : 0), prefix);
+        j->packed_crc = crc32_update(crc32_update(0xFFFFFFFFUL, prefix, 4), j->packed, j->packed_len) ^ 0xFFFFFFFFUL;
+    }
+}
+
+/* 一批并行的块数：每个工作者 4 块，缓冲区合计不超过约 32MB */
+static int lz_window(int nthreads, u64 block_size) {
+    u64 limit = (32UL * 1024 * 1024) / block_size;
+    int window = nthreads * 4;
+    if ((u64)window > limit) window = limit > 0 ? (int)limit : 1;
+    return window;
+}
+
+/* 释放编解码批次的缓冲区 */
+static void lz_free(struct lz_ctx *ctx, int nthreads, unsigned char *raw, unsigned char *packed) {
+    int i;
+    if (ctx->tables) {
+        for (i = 0; i < nthreads; i++) free(ctx->tables[i]);
+    }
+    free(ctx->tables);
+    free(ctx->jobs);
+    free(raw);
+    free(packed);
+}
+
+/*
+ * 在内存中解码整个压缩块的 Value（含前缀与 ContentCRC）到 out，out 至少 OrigLength 字节。
+ * 成功返回 0，结构或编码损坏返回 -1，解压内容与 ContentCRC 不一致返回 -2。
+ */
+static int lz_decode_value(const unsigned char *value, u64 value_len, unsigned char *out) {
+    u64 orig_len, block_size, pos = LZ_PREFIX_SIZE, done = 0, end;
+    u32 block_len, crc = 0xFFFFFFFFUL;
+    size_t raw_len, packed_len;
+
+    if (value_len < LZ_PREFIX_SIZE + 4) return -1;
+    orig_len = be_to_uint(value + 4, 8);
+    block_size = be_to_u32(value + 12);
+    end = value_len - 4;
+    if (block_size == 0 || block_size > LZ_MAX_BLOCK) return -1;
+    while (done < orig_len) {
+        raw_len = orig_len - done > block_size ? (size_t)block_size : (size_t)(orig_len - done);
+        if (end - pos < 4) return -1;
+        block_len = be_to_u32(value + (size_t)pos);
+        packed_len = (size_t)(block_len & ~LZ_RAW);
+        pos += 4;
+        if ((u64)packed_len > end - pos) return -1;
+        if (block_len & LZ_RAW) {
+            if (packed_len != raw_len) return -1;
+            memcpy(out + (size_t)done, value + (size_t)pos, raw_len);
+        } else if (lz_decompress(value + (size_t)pos, packed_len, out + (size_t)done, raw_len) != 0) {
+            return -1;
+        }
+        crc = crc32_update(crc, out + (size_t)done, raw_len);
+        pos += (u64)packed_len;
+        done += (u64)raw_len;
+    }
+    if (pos != end) return -1;
+    return (crc ^ 0xFFFFFFFFUL) == be_to_u32(value + (size_t)end) ? 0 : -2;
+}
+
+/* ========== 内容去重 ========== */
+
+/*
+ * 内容引用块（TYPE_REF）: Value = Chunk(4) + Length(8) + CRC32(4)
+ *   Chunk 为内容相同的 BINARY 块的 1-based 编号（总在引用之前），
+ *   Length 与 CRC32 为该内容（只含 Value）的长度与 CRC32，提取时据此确认目标。
+ *   字段与格式无关，upgrade 原样复制；旧版读取器按未知类型跳过。
+ *
+ * 去重表以 BINARY 块存储的 CRC32 与长度为键，打开时取自尾部索引或一遍块头扫描，不读取内容。
+ * 键相同只说明可能重复：写引用前逐字节比较，CRC32 碰撞不会产生错误的引用。
+ */
+#define REF_SIZE 16
+
+struct dedup_entry {
+    u32 crc;          /* 块存储的 CRC32（覆盖 Type + Length + Value） */
+    u64 length;
+    u64 offset;
+    long chunk;
+    long next;        /* 同一桶中更早加入的条目，-1 结束 */
+};
+
+struct dedup_table {
+    struct dedup_entry *items;
+    long count;
+    long cap;
+    long *buckets;    /* 桶数与 cap 相同（2 的幂） */
+};
+
+static unsigned long dedup_bucket(const struct dedup_table *t, u32 crc, u64 length) {
+    return (unsigned long)((crc ^ (u32)(length * 2654435761UL)) & (u32)(t->cap - 1));
+}
+
+static void dedup_link(struct dedup_table *t, long i) {
+    unsigned long b = dedup_bucket(t, t->items[i].crc, t->items[i].length);
+    t->items[i].next = t->buckets[b];
+    t->buckets[b] = i;
+}
+
+/* 扩容时按加入顺序重新链接，各桶仍是新条目在前 */
+static int dedup_add(struct dedup_table *t, u32 crc, u64 length, u64 offset, long chunk) {
+    struct dedup_entry *e;
+    long i;
+
+    if (t->count == t->cap) {
+        long cap = t->cap ? t->cap * 2 : 256;
+        struct dedup_entry *items = (struct dedup_entry *)realloc(t->items, sizeof(*items) * (size_t)cap);
+        long *buckets;
+        if (!items) return nomem();
+        t->items = items;
+        buckets = (long *)malloc(sizeof(long) * (size_t)cap);
+        if (!buckets) return nomem();
+        free(t->buckets);
+        t->buckets = buckets;
+        t->cap = cap;
+        for (i = 0; i < cap; i++) buckets[i] = -1;
+        for (i = 0; i < t->count; i++) dedup_link(t, i);
+    }
+    e = &t->items[t->count];
+    e->crc = crc;
+    e->length = length;
+    e->offset = offset;
+    e->chunk = chunk;
+    dedup_link(t, t->count++);
+    return ZZK_OK;
+}
+
+/* 撤回记录后丢弃编号大于 chunks 的条目。条目按编号递增加入，被丢弃的总在各自桶的链首 */
+static void dedup_truncate(struct dedup_table *t, long chunks) {
+    struct dedup_entry *e;
+
+    while (t->count > 0 && t->items[t->count - 1].chunk > chunks) {
+        e = &t->items[--t->count];
+        t->buckets[dedup_bucket(t, e->crc, e->length)] = e->next;
+    }
+}
+
+/* 由块表收录全部 BINARY 块 */
+static int dedup_build(struct dedup_table *t, const struct chunk_table *chunks) {
+    long i;
+    int rc;
+
+    for (i = 0; i < chunks->count; i++) {
+        const struct chunk_entry *c = &chunks->items[i];
+        if (c->type != TYPE_BINARY) continue;
+        if ((rc = dedup_add(t, c->crc, c->length, c->offset, i + 1)) != ZZK_OK) return rc;
+    }
+    return ZZK_OK;
+}
+
+/* ========== 分块校验表 ========== */
+
+/*
+ * 分块校验表（TYPE_SUMS），紧跟在它覆盖的 BINARY 块之后，与之属于同一条记录:
+ *   Value = BlockSize(4) + Length(8) + ValueCRC(4) + N × CRC32(4)
+ *   被覆盖块的 Value 按 BlockSize 切成 N = ceil(Length / BlockSize) 段，依次记录每段的 CRC32；
+ *   Length 与 ValueCRC 为被覆盖块 Value 的长度与 CRC32，读取方据此确认校验表与前一个块对应。
+ *   按字节范围提取时只需读取并校验范围所在的段，不必读完整个块。
+ *   字段与格式无关，upgrade 原样复制；旧版读取器按未知类型跳过。
+ */
+#define SUMS_PREFIX_SIZE 16
+#define SUMS_MIN_BLOCK   1024
+#define SUMS_MAX_BLOCK   (16UL * 1024 * 1024)
+
+/* 写入时随数据累积各段的 CRC32，条目直接以大端序写在将要写出的 Value 中 */
+struct block_sums {
+    unsigned char *value;
+    size_t value_len;
+    u32 block_size;
+    u64 count;        /* 已完成的段数 */
+    u32 fill;         /* 当前段已累积的字节数 */
+    u32 crc;          /* 当前段的 CRC 中间状态 */
+};
+
+static int sums_init(struct block_sums *s, u32 block_size, u64 length) {
+    u64 blocks = (length + block_size - 1) / block_size, size = SUMS_PREFIX_SIZE + 4 * blocks;
+
+    s->value = NULL;
+    if ((u64)(size_t)size != size || !(s->value = (unsigned char *)malloc((size_t)size))) return nomem();
+    s->value_len = (size_t)size;
+    s->block_size = block_size;
+    s->count = 0;
+    s->fill = 0;
+    s->crc = 0xFFFFFFFFUL;
+    u32_to_be(block_size, s->value);
+    uint_to_be(length, s->value + 4, 8);
+    return ZZK_OK;
+}
+
+static void sums_close_block(struct block_sums *s) {
+    u32_to_be(s->crc ^ 0xFFFFFFFFUL, s->value + SUMS_PREFIX_SIZE + 4 * (size_t)s->count++);
+    s->fill = 0;
+    s->crc = 0xFFFFFFFFUL;
+}
+
+static void sums_update(struct block_sums *s, const unsigned char *p, size_t len) {
+    size_t step;
+
+    while (len > 0) {
+        step = s->block_size - s->fill;
+        if (step > len) step = len;
+        s->crc = crc32_update(s->crc, p, step);
+        s->fill += (u32)step;
+        if (s->fill == s->block_size) sums_close_block(s);
+        p += step;
+        len -= step;
+    }
+}
+
+/* 收尾：补上最后不满一段的 CRC32，写入 ValueCRC */
+static void sums_finish(struct block_sums *s, u32 value_crc) {
+    if (s->fill > 0) sums_close_block(s);
+    u32_to_be(value_crc, s->value + 12);
+}
+
+/* 读取方找到的校验表 */
+struct sums_ref {
+    u64 entries;      /* 第一个条目的文件偏移 */
+    u32 block_size;
+    u64 count;
+};
+
+/*
+ * 查找紧跟在 c 之后、与之对应的分块校验表，找到返回 1，没有返回 0。
+ * 校验表存在但与 c 不对应或自身 CRC32 不一致时给出警告并返回 0，由调用方改为整块校验。
+ * 校验表本身只占被覆盖内容的 BlockSize 分之 4，整体校验的代价可以忽略。
+ */
+static int find_block_sums(struct zzk_reader *r, const struct zzk_chunk *c, struct sums_ref *s) {
+    const struct zzk_format *fmt = r->fmt;
+    unsigned char buf[SUMS_PREFIX_SIZE];
+    const unsigned char *p;
+    u64 offset = c->offset + fmt->chunk_overhead + c->length, length, size;
+    u32 type, value_crc, crc, stored_crc;
+
+    if (reader_chunk_header(r, offset, &type, &length) != 0 || type != TYPE_SUMS) return 0;
+    p = length >= SUMS_PREFIX_SIZE ? reader_get(r, offset + fmt->chunk_header, SUMS_PREFIX_SIZE, buf) : NULL;
+    if (p) {
+        s->block_size = be_to_u32(p);
+        s->entries = offset + fmt->chunk_header + SUMS_PREFIX_SIZE;
+        value_crc = be_to_u32(p + 12);
+        size = be_to_uint(p + 4, 8);
+        if (s->block_size >= SUMS_MIN_BLOCK && s->block_size <= SUMS_MAX_BLOCK && size == c->length) {
+            s->count = (size + s->block_size - 1) / s->block_size;
+            crc = zzk_reader_header_crc(r, c) ^ 0xFFFFFFFFUL;
+            if (length == SUMS_PREFIX_SIZE + 4 * s->count &&
+                reader_chunk_crc(r, c->offset, c->length, &stored_crc) == 0 &&
+                stored_crc == crc32_combine(crc, value_crc, size)) {
+                crc = crc32_update(0xFFFFFFFFUL, buf, encode_chunk_header(fmt, TYPE_SUMS, length, buf));
+                reader_advise(r, offset, fmt->chunk_overhead + length, READER_WILLNEED);
+                if (reader_crc_copy(r, offset + fmt->chunk_header, length, &crc, NULL) == 0 &&
+                    reader_chunk_crc(r, offset, length, &stored_crc) == 0 &&
+                    stored_crc == (crc ^ 0xFFFFFFFFUL)) return 1;
+            }
+        }
+    }
+    log_msg(ZZK_LOG_WARNING, "Warning: block checksum table after chunk #%ld is damaged or stale; "
+            "verifying the whole chunk.\n", c->index);
+    return 0;
+}
+
+/* ========== 词项索引 ========== */
+
+/*
+ * 词项索引块（TYPE_TERMS），可选，位于归档末尾（有尾部索引时紧邻其前）:
+ *   Value = Covered(4) + Count(4) + Count × RecordOffset(4) + Records + ValueLength(4) + "ZTRM"(4)
+ *   Record = TermLen(1) + Term + N(4) + N × 块编号的差值（LEB128 变长整数，首项相对 0）
+ *   Covered 为索引覆盖的块数（其前的全部块）；RecordOffset 为记录在 Value 中的位置，按词项的字节序排列，
+ *   查找时在目录上二分，只读取目录与命中的记录。尾标记录 Value 自身的长度而不是偏移，
+ *   与格式无关，upgrade 原样复制后仍可定位。
+ * 词项取自 TEXT 块（及原类型为 TEXT 的压缩块）:
+ *   - 单词：ASCII 字母、数字、下划线与非 ASCII 字节组成的连续串，ASCII 字母折叠为小写，
+ *     少于 2 字节的不收录，超过 64 字节的截断
+ *   - 字段：块开头 1KB 内 "Filename: " / "Description: " 行的整个值（折叠为小写），
+ *     收录为 "filename:<值>" / "description:<值>"；文件名另收录去掉目录后的部分
+ * 与尾部索引相同，写入句柄打开时摘下词项索引，关闭时只读取本次新写入的文本块，补充词项后重写。
+ */
+#define TERMS_MAGIC      0x5A54524D  /* "ZTRM" */
+#define TERMS_FIXED_SIZE 16          /* Covered + Count + ValueLength + Magic */
+#define TERM_MAX         255
+#define TERM_WORD_MIN    2
+#define TERM_WORD_MAX    64
+#define TERM_FIELD_SCAN  1024        /* 元数据块的上限（见 build_file_metadata） */
+#define TERMS_LZ_MAX     0x10000000UL
+#define TERMS_READ_SIZE  65536
+
+static unsigned char fold_ascii(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? (unsigned char)(c + ('a' - 'A')) : c;
+}
+
+static int term_byte(unsigned char c) {
+    return c >= 0x80 || c == '_' || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+/* 词项回调：返回 0 继续，1 提前结束，负值为错误码 */
+typedef int (*term_fn)(void *ctx, const unsigned char *term, size_t len);
+
+/* 分段输入的单词切分，单词可以跨越输入段 */
+struct tokenizer {
+    term_fn fn;
+    void *ctx;
+    unsigned char word[TERM_WORD_MAX];
+    size_t len;
+    int rc;
+};
+
+static void tokenizer_init(struct tokenizer *t, term_fn fn, void *ctx) {
+    t->fn = fn;
+    t->ctx = ctx;
+    t->len = 0;
+    t->rc = 0;
+}
+
+static void tokenizer_flush(struct tokenizer *t) {
+    if (t->len >= TERM_WORD_MIN && t->rc == 0) t->rc = t->fn(t->ctx, t->word, t->len);
+    t->len = 0;
+}
+
+static void tokenizer_feed(struct tokenizer *t, const unsigned char *p, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n && t->rc == 0; i++) {
+        if (!term_byte(p[i])) {
+            if (t->len > 0) tokenizer_flush(t);
+        } else if (t->len < TERM_WORD_MAX) {
+            t->word[t->len++] = fold_ascii(p[i]);
+        }
+    }
+}
+
+static int field_term(term_fn fn, void *ctx, const char *name, const unsigned char *value, size_t n) {
+    unsigned char key[TERM_MAX];
+    size_t len = strlen(name), i;
+
+    memcpy(key, name, len);
+    for (i = 0; i < n && len < TERM_MAX; i++) key[len++] = fold_ascii(value[i]);
+    return fn(ctx, key, len);
+}
+
+/* 在文本开头查找 Filename: / Description: 行，产生字段词项 */
+static int text_field_terms(const unsigned char *text, size_t n, term_fn fn, void *ctx) {
+    size_t pos = 0, end, base;
+    int rc = 0;
+
+    if (n > TERM_FIELD_SCAN) n = TERM_FIELD_SCAN;
+    while (rc == 0 && pos < n) {
+        for (end = pos; end < n && text[end] != '\n'; end++) {
+        }
+        if (end - pos > 10 && memcmp(text + pos, "Filename: ", 10) == 0) {
+            rc = field_term(fn, ctx, "filename:", text + pos + 10, end - pos - 10);
+            for (base = end; base > pos + 10 && text[base - 1] != '/' && text[base - 1] != '\\'; base--) {
+            }
+            if (rc == 0 && base > pos + 10 && base < end) rc = field_term(fn, ctx, "filename:", text + base, end - base);
+        } else if (end - pos > 13 && memcmp(text + pos, "Description: ", 13) == 0) {
+            rc = field_term(fn, ctx, "description:", text + pos + 13, end - pos - 13);
+        }
+        pos = end + 1;
+    }
+    return rc;
+}
+
+static int text_terms(const unsigned char *text, size_t n, term_fn fn, void *ctx) {
+    struct tokenizer t;
+    int rc = text_field_terms(text, n, fn, ctx);
+
+    if (rc != 0) return rc;
+    tokenizer_init(&t, fn, ctx);
+    tokenizer_feed(&t, text, n);
+    tokenizer_flush(&t);
+    return t.rc;
+}
+
+/* 压缩块整体解压后切分；原类型不是 TEXT 的不产生词项 */
+static int lz_chunk_terms(struct zzk_reader *r, const struct chunk_entry *e, term_fn fn, void *ctx) {
+    unsigned char prefix[LZ_PREFIX_SIZE], *stored = NULL, *text;
+    const unsigned char *p;
+    u64 orig_len;
+    int rc;
+
+    if (e->length < LZ_PREFIX_SIZE + 4) return ZZK_ERR_CORRUPT;
+    p = reader_get(r, e->offset + r->fmt->chunk_header, LZ_PREFIX_SIZE, prefix);
+    if (!p) return ZZK_ERR_IO;
+    if (be_to_u32(p) != TYPE_TEXT) return 0;
+    orig_len = be_to_uint(p + 4, 8);
+    if (orig_len > TERMS_LZ_MAX || (u64)(size_t)e->length != e->length) return ZZK_ERR_OVERFLOW;
+
+    text = (unsigned char *)malloc(orig_len > 0 ? (size_t)orig_len : 1);
+    if (text && !r->map) stored = (unsigned char *)malloc((size_t)e->length);
+    if (!text || (!r->map && !stored)) {
+        free(text);
+        return nomem();
+    }
+    p = reader_get(r, e->offset + r->fmt->chunk_header, (size_t)e->length, stored);
+    if (!p) rc = ZZK_ERR_IO;
+    else if (lz_decode_value(p, e->length, text) != 0) rc = ZZK_ERR_CORRUPT;
+    else rc = text_terms(text, (size_t)orig_len, fn, ctx);
+    free(stored);
+    free(text);
+    return rc;
+}
+
+/*
+ * 对块 e 的文本产生全部词项（同一词项可能多次出现），非文本块不产生词项。
+ * TEXT 块分段读取，内存占用与块大小无关。读取失败返回 ZZK_ERR_IO，
+ * 压缩块损坏返回 ZZK_ERR_CORRUPT，解压后过大返回 ZZK_ERR_OVERFLOW。
+ */
+static int chunk_terms(struct zzk_reader *r, const struct chunk_entry *e, term_fn fn, void *ctx) {
+    struct tokenizer t;
+    unsigned char buf[TERMS_READ_SIZE];
+    const unsigned char *p;
+    u64 value = e->offset + r->fmt->chunk_header, done = 0;
+    size_t n;
+    int rc = 0;
+
+    if (e->type == TYPE_LZ) return lz_chunk_terms(r, e, fn, ctx);
+    if (e->type != TYPE_TEXT) return 0;
+    tokenizer_init(&t, fn, ctx);
+    while (rc == 0 && t.rc == 0 && done < e->length) {
+        n = e->length - done > sizeof(buf) ? sizeof(buf) : (size_t)(e->length - done);
+        p = reader_get(r, value + done, n, buf);
+        if (!p) return ZZK_ERR_IO;
+        if (done == 0) rc = text_field_terms(p, n, fn, ctx);
+        tokenizer_feed(&t, p, n);
+        done += (u64)n;
+    }
+    if (rc == 0) tokenizer_flush(&t);
+    return rc != 0 ? rc : t.rc;
+}
+
+/* chunk_terms 的结果：无法切分的压缩块提示后跳过，其余错误原样返回 */
+static int chunk_terms_status(long chunk, int rc) {
+    if (rc == ZZK_ERR_CORRUPT) {
+        log_msg(ZZK_LOG_WARNING, "Warning: compressed chunk #%ld is damaged. Skipping its terms.\n", chunk);
+    } else if (rc == ZZK_ERR_OVERFLOW) {
+        log_msg(ZZK_LOG_WARNING, "Warning: compressed text chunk #%ld too large. Skipping its terms.\n", chunk);
+    } else if (rc == ZZK_ERR_IO) {
+        log_msg(ZZK_LOG_ERROR, "Error reading chunk data.\n");
+        return rc;
+    } else if (rc < 0) {
+        return rc;
+    }
+    return ZZK_OK;
+}
+
+/* 写入句柄维护的词项表：词项 → 升序的块编号 */
+struct term_entry {
+    size_t text;       /* 词项在 pool 中的位置 */
+    unsigned len;
+    u32 hash;
+    long next;         /* 同一哈希桶的下一项，-1 结束 */
+    u32 *chunks;
+    u32 count;
+    u32 cap;
+};
+
+struct term_table {
+    struct term_entry *items;
+    long count;
+    long cap;
+    long *buckets;
+    unsigned long nbuckets;   /* 2 的幂 */
+    unsigned char *pool;
+    size_t pool_len;
+    size_t pool_cap;
+    u32 covered;              /* 已收录的块数 */
+    u32 current;              /* term_table_add 记入的块编号 */
+};
+
+static u32 term_hash(const unsigned char *p, size_t len) {
+    u32 h = 2166136261UL;
+    size_t i;
+
+    for (i = 0; i < len; i++) h = ((h ^ p[i]) * 16777619UL) & 0xFFFFFFFFUL;
+    return h;
+}
+
+static void term_table_free(struct term_table *t) {
+    long i;
+
+    for (i = 0; i < t->count; i++) free(t->items[i].chunks);
+    free(t->items);
+    free(t->buckets);
+    free(t->pool);
+    memset(t, 0, sizeof(*t));
+}
+
+static int term_table_rehash(struct term_table *t, unsigned long nbuckets) {
+    long *buckets = (long *)malloc(sizeof(long) * nbuckets);
+    unsigned long b;
+    long i;
+
+    if (!buckets) return nomem();
+    for (b = 0; b < nbuckets; b++) buckets[b] = -1;
+    for (i = 0; i < t->count; i++) {
+        b = t->items[i].hash & (nbuckets - 1);
+        t->items[i].next = buckets[b];
+        buckets[b] = i;
+    }
+    free(t->buckets);
+    t->buckets = buckets;
+    t->nbuckets = nbuckets;
+    return ZZK_OK;
+}
+
+/* 查找词项，不存在时插入（没有块编号）。返回条目下标，内存不足返回 -1 */
+static long term_table_insert(struct term_table *t, const unsigned char *term, size_t len) {
+    u32 h = term_hash(term, len);
+    struct term_entry *e;
+    long i;
+
+    if (t->nbuckets > 0) {
+        for (i = t->buckets[h & (t->nbuckets - 1)]; i >= 0; i = t->items[i].next) {
+            e = &t->items[i];
+            if (e->hash == h && e->len == len && memcmp(t->pool + e->text, term, len) == 0) return i;
+        }
+    }
+    if (t->count == t->cap) {
+        long cap = t->cap ? t->cap * 2 : 256;
+        e = (struct term_entry *)realloc(t->items, sizeof(*e) * (size_t)cap);
+        if (!e) {
+            nomem();
+            return -1;
+        }
+        t->items = e;
+        t->cap = cap;
+    }
+    if (t->pool_cap - t->pool_len < len) {
+        size_t cap = t->pool_cap ? t->pool_cap : 4096;
+        unsigned char *pool;
+        while (cap - t->pool_len < len) cap *= 2;
+        pool = (unsigned char *)realloc(t->pool, cap);
+        if (!pool) {
+            nomem();
+            return -1;
+        }
+        t->pool = pool;
+        t->pool_cap = cap;
+    }
+    if ((unsigned long)t->count >= t->nbuckets &&
+        term_table_rehash(t, t->nbuckets ? t->nbuckets * 2 : 256) != ZZK_OK) return -1;
+
+    i = t->count++;
+    e = &t->items[i];
+    memcpy(t->pool + t->pool_len, term, len);
+    e->text = t->pool_len;
+    e->len = (unsigned)len;
+    e->hash = h;
+    e->chunks = NULL;
+    e->count = 0;
+    e->cap = 0;
+    e->next = t->buckets[h & (t->nbuckets - 1)];
+    t->buckets[h & (t->nbuckets - 1)] = i;
+    t->pool_len += len;
+    return i;
+}
+
+/* term_fn：把词项记入 t->current 号块 */
+static int term_table_add(void *ctx, const unsigned char *term, size_t len) {
+    struct term_table *t = (struct term_table *)ctx;
+    struct term_entry *e;
+    long i = term_table_insert(t, term, len);
+    u32 *chunks;
+
+    if (i < 0) return ZZK_ERR_NOMEM;
+    e = &t->items[i];
+    if (e->count > 0 && e->chunks[e->count - 1] == t->current) return 0;
+    if (e->count == e->cap) {
+        u32 cap = e->cap ? e->cap * 2 : 4;
+        chunks = (u32 *)realloc(e->chunks, sizeof(u32) * (size_t)cap);
+        if (!chunks) return nomem();
+        e->chunks = chunks;
+        e->cap = cap;
+    }
+    e->chunks[e->count++] = t->current;
+    return 0;
+}
+
+static unsigned varint_put(u32 v, unsigned char *out) {
+    unsigned n = 0;
+
+    while (v >= 0x80) {
+        out[n++] = (unsigned char)((v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (unsigned char)v;
+    return n;
+}
+
+static int varint_get(const unsigned char *p, size_t n, size_t *pos, u32 *v) {
+    u32 result = 0;
+    unsigned shift;
+
+    for (shift = 0; *pos < n && shift < 32; shift += 7) {
+        unsigned char c = p[(*pos)++];
+        result |= (u32)(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            *v = result & 0xFFFFFFFFUL;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* 一条已编码的记录 */
+struct term_record {
+    const unsigned char *term;
+    size_t len;
+    u32 count;
+    const unsigned char *postings;
+    size_t postings_len;
+};
+
+static int term_record_parse(const unsigned char *rec, size_t n, struct term_record *out) {
+    if (n < 1 || rec[0] == 0 || n - 1 < (size_t)rec[0] + 4) return -1;
+    out->term = rec + 1;
+    out->len = rec[0];
+    out->count = be_to_u32(rec + 1 + out->len);
+    out->postings = rec + 5 + out->len;
+    out->postings_len = n - 5 - out->len;
+    if ((u64)out->count > (u64)out->postings_len) return -1;  /* 每个差值至少 1 字节 */
+    return 0;
+}
+
+/* 解码记录的块编号到 out（至少 count 项）；必须严格递增且不超过 covered */
+static int term_record_chunks(const struct term_record *rec, u32 covered, u32 *out) {
+    size_t pos = 0;
+    u32 i, prev = 0, delta;
+
+    for (i = 0; i < rec->count; i++) {
+        if (varint_get(rec->postings, rec->postings_len, &pos, &delta) != 0 ||
+            delta == 0 || delta > covered - prev) return -1;
+        prev += delta;
+        out[i] = prev;
+    }
+    return pos == rec->postings_len ? 0 : -1;
+}
+
+/*
+ * 检查 end 之前的最后一个块是否为词项索引。是则返回 1，并给出块偏移、Value 长度与词项数。
+ * 只读取尾标与块头。
+ */
+static int locate_terms(struct zzk_reader *r, u64 end, u64 *offset, u64 *length, u32 *count) {
+    const struct zzk_format *fmt = r->fmt;
+    unsigned char buf[20];
+    const unsigned char *p;
+    u64 len, off;
+    u32 n;
+
+    if (end < fmt->header_size + fmt->chunk_overhead + TERMS_FIXED_SIZE) return 0;
+    p = reader_get(r, end - 12, 8, buf);
+    if (!p || be_to_u32(p + 4) != TERMS_MAGIC) return 0;
+    len = be_to_u32(p);
+    if (len < TERMS_FIXED_SIZE || len > end - fmt->header_size - fmt->chunk_overhead) return 0;
+
+    off = end - fmt->chunk_overhead - len;
+    p = reader_get(r, off, fmt->chunk_header + 8, buf);
+    if (!p || be_to_u32(p) != TYPE_TERMS || be_to_uint(p + 4, fmt->size_width) != len) return 0;
+    n = be_to_u32(p + fmt->chunk_header + 4);
+    if ((u64)n > (len - TERMS_FIXED_SIZE) / 4) return 0;
+
+    *offset = off;
+    *length = len;
+    *count = n;
+    return 1;
+}
+
+/*
+ * 读取并校验 end 之前的词项索引到 t。成功返回 1 并给出块偏移；不存在返回 0；
+ * 存在但已损坏时提示并返回 0（此后不再维护）；内存不足返回 ZZK_ERR_NOMEM。
+ */
+static int load_terms(struct zzk_reader *r, u64 end, struct term_table *t, u64 *terms_offset) {
+    struct term_record rec;
+    struct term_entry *e;
+    unsigned char hdr[12], *buf = NULL;
+    const unsigned char *v;
+    unsigned hdr_len;
+    u64 offset, length, rec_off, rec_end;
+    u32 count, i, covered = 0, crc, stored_crc;
+    long k;
+    int rc = 1;
+
+    if (!locate_terms(r, end, &offset, &length, &count)) return 0;
+    if ((u64)(size_t)length != length || (!r->map && !(buf = (unsigned char *)malloc((size_t)length)))) {
+        return nomem();
+    }
+    v = reader_get(r, offset + r->fmt->chunk_header, (size_t)length, buf);
+    hdr_len = encode_chunk_header(r->fmt, TYPE_TERMS, length, hdr);
+    if (!v || reader_chunk_crc(r, offset, length, &stored_crc) != 0) {
+        rc = 0;
+    } else {
+        crc = crc32_update(crc32_update(0xFFFFFFFFUL, hdr, hdr_len), v, (size_t)length) ^ 0xFFFFFFFFUL;
+        if (crc != stored_crc) rc = 0;
+        covered = be_to_u32(v);
+    }
+    for (i = 0; rc == 1 && i < count; i++) {
+        rec_off = be_to_u32(v + 8 + 4 * (size_t)i);
+        rec_end = i + 1 < count ? be_to_u32(v + 12 + 4 * (size_t)i) : length - 8;
+        if (rec_off < 8 + 4 * (u64)count || rec_end < rec_off || rec_end > length - 8 ||
+            term_record_parse(v + (size_t)rec_off, (size_t)(rec_end - rec_off), &rec) != 0) {
+            rc = 0;
+            break;
+        }
+        k = term_table_insert(t, rec.term, rec.len);
+        if (k < 0) {
+            rc = ZZK_ERR_NOMEM;
+            break;
+        }
+        e = &t->items[k];
+        if (e->count != 0 || rec.count == 0) {
+            rc = 0;
+        } else if (!(e->chunks = (u32 *)malloc(sizeof(u32) * (size_t)rec.count))) {
+            rc = nomem();
+        } else {
+            e->cap = rec.count;
+            if (term_record_chunks(&rec, covered, e->chunks) != 0) rc = 0;
+            else e->count = rec.count;
+        }
+    }
+    free(buf);
+    if (rc != 1) {
+        if (rc == 0) {
+            log_msg(ZZK_LOG_WARNING, "Warning: term index is damaged and will no longer be updated. "
+                    "Rebuild it with 'index --terms'.\n");
+        }
+        term_table_free(t);
+        return rc;
+    }
+    t->covered = covered;
+    *terms_offset = offset;
+    return 1;
+}
+
+struct term_order {
+    const unsigned char *text;
+    unsigned len;
+    long item;
+};
+
+static int term_order_cmp(const void *a, const void *b) {
+    const struct term_order *x = (const struct term_order *)a, *y = (const struct term_order *)b;
+    int c = memcmp(x->text, y->text, x->len < y->len ? x->len : y->len);
+
+    if (c != 0) return c;
+    return x->len < y->len ? -1 : (x->len > y->len ? 1 : 0);
+}
+
+/* 编码一条记录到 out，返回字节数（out 为 NULL 时只计算长度） */
+static size_t term_record_encode(const struct term_table *t, const struct term_entry *e, unsigned char *out) {
+    unsigned char tmp[5];
+    size_t n = 5 + e->len;
+    u32 i, prev = 0;
+
+    if (out) {
+        out[0] = (unsigned char)e->len;
+        memcpy(out + 1, t->pool + e->text, e->len);
+        u32_to_be(e->count, out + 1 + e->len);
+    }
+    for (i = 0; i < e->count; i++) {
+        n += varint_put(e->chunks[i] - prev, out ? out + n : tmp);
+        prev = e->chunks[i];
+    }
+    return n;
+}
+
+static int terms_put(FILE *fp, const void *p, size_t n, u32 *crc) {
+    *crc = crc32_update(*crc, (const unsigned char *)p, n);
+    return write_all(fp, p, n, "Error writing term index");
+}
+
+/*
+ * 在当前位置写入词项索引块，written / crc_out 返回写入的字节数与块的 CRC32。
+ * Value 超过 4GB（偏移字段的上限）时不写入，返回 ZZK_ERR_OVERFLOW。
+ */
+static int write_terms_chunk(FILE *fp, const struct zzk_format *fmt, const struct term_table *t,
+                             u64 *written, u32 *crc_out) {
+    struct term_order *order;
+    unsigned char hdr[20], *rec = NULL;
+    size_t size, max_rec = 0;
+    u64 length = 8 + 4 * (u64)t->count + 8, rec_off;
+    unsigned hdr_len;
+    u32 crc = 0xFFFFFFFFUL;
+    long k;
+    int rc;
+
+    order = (struct term_order *)malloc(sizeof(*order) * (size_t)(t->count ? t->count : 1));
+    if (!order) return nomem();
+    for (k = 0; k < t->count; k++) {
+        order[k].text = t->pool + t->items[k].text;
+        order[k].len = t->items[k].len;
+        order[k].item = k;
+        size = term_record_encode(t, &t->items[k], NULL);
+        if (size > max_rec) max_rec = size;
+        length += (u64)size;
+    }
+    if (length > 0xFFFFFFFFUL || length > fmt->max_size) {
+        free(order);
+        log_msg(ZZK_LOG_WARNING, "Warning: term index exceeds 4GB.\n");
+        return ZZK_ERR_OVERFLOW;
+    }
+    if (!(rec = (unsigned char *)malloc(max_rec > 4 ? max_rec : 4))) {
+        free(order);
+        return nomem();
+    }
+    qsort(order, (size_t)t->count, sizeof(*order), term_order_cmp);
+
+    hdr_len = encode_chunk_header(fmt, TYPE_TERMS, length, hdr);
+    u32_to_be(t->covered, hdr + hdr_len);
+    u32_to_be((u32)t->count, hdr + hdr_len + 4);
+    rc = terms_put(fp, hdr, hdr_len + 8, &crc);
+    rec_off = 8 + 4 * (u64)t->count;
+    for (k = 0; rc == ZZK_OK && k < t->count; k++) {
+        u32_to_be((u32)rec_off, rec);
+        rc = terms_put(fp, rec, 4, &crc);
+        rec_off += (u64)term_record_encode(t, &t->items[order[k].item], NULL);
+    }
+    for (k = 0; rc == ZZK_OK && k < t->count; k++) {
+        size = term_record_encode(t, &t->items[order[k].item], rec);
+        rc = terms_put(fp, rec, size, &crc);
+    }
+    free(rec);
+    free(order);
+    if (rc != ZZK_OK) return rc;
+
+    u32_to_be((u32)length, hdr);
+    u32_to_be(TERMS_MAGIC, hdr + 4);
+    if (terms_put(fp, hdr, 8, &crc) != 0 ||
+        write_u32(fp, crc ^ 0xFFFFFFFFUL, "Error writing term index CRC32") != 0) return ZZK_ERR_IO;
+    *written = fmt->chunk_overhead + length;
+    *crc_out = crc ^ 0xFFFFFFFFUL;
+    return ZZK_OK;
+}
+
+/* ========== 检查点 ========== */
+
+/*
+ * 检查点块（TYPE_CHECKPOINT），可选，opt.checkpoint 非零时每写入约这么多字节在记录之间插入一个:
+ *   Value = "ZCKP"(4) + Offset(8) + Chunks(8) + Digest(4)
+ *   Offset 为检查点块自身的起始偏移，Chunks 为它之前的块数，
+ *   Digest 为之前全部块存储的 CRC32（按块顺序、大端）串接后的 CRC32，即块序列的滚动摘要。
+ * 块大小固定（ZZK1 36 字节，ZZK2 40 字节）且 Offset 必须等于所在位置，
+ * 因此从任意字节向回搜索都能可靠地认出检查点，不依赖块边界是否完好。
+ * recover 从有效区末尾向回找到最后一个完好的检查点，只校验它之后的块，
+ * 耗时取决于受损的尾部而不是归档大小；旧版读取器按未知类型跳过。
+ */
+#define CKPT_MAGIC        0x5A434B50  /* "ZCKP" */
+#define CKPT_VALUE_SIZE   24
+#define CKPT_SIZE(f)      ((f)->chunk_overhead + CKPT_VALUE_SIZE)
+#define CKPT_SEARCH_BLOCK (64 * 1024)
+
+/* 滚动摘要的状态：digest 为未取反的 CRC32 中间值，since 为上一个检查点之后写入的字节数 */
+struct ckpt_state {
+    u32 digest;
+    u64 chunks;
+    u64 since;
+};
+
+static void ckpt_reset(struct ckpt_state *s) {
+    s->digest = 0xFFFFFFFFUL;
+    s->chunks = 0;
+    s->since = 0;
+}
+
+/* 把一个块登记进滚动摘要 */
+static void ckpt_fold(struct ckpt_state *s, u32 crc, u64 size) {
+    unsigned char buf[4];
+    u32_to_be(crc, buf);
+    s->digest = crc32_update(s->digest, buf, 4);
+    s->chunks++;
+    s->since += size;
+}
+
+static void ckpt_encode(const struct ckpt_state *s, u64 offset, unsigned char *value) {
+    u32_to_be(CKPT_MAGIC, value);
+    uint_to_be(offset, value + 4, 8);
+    uint_to_be(s->chunks, value + 12, 8);
+    u32_to_be(s->digest ^ 0xFFFFFFFFUL, value + 20);
+}
+
+/*
+ * 检查 p 处（位于 offset、至少 CKPT_SIZE 字节）是否为完好的检查点块，
+ * 是则返回 1 并恢复检查点之后的摘要状态（已计入检查点块本身）。
+ */
+static int ckpt_parse(const struct zzk_format *fmt, const unsigned char *p, u64 offset, struct ckpt_state *s) {
+    const unsigned char *value = p + fmt->chunk_header;
+    u32 crc;
+
+    if (be_to_u32(p) != TYPE_CHECKPOINT || be_to_uint(p + 4, fmt->size_width) != CKPT_VALUE_SIZE ||
+        be_to_u32(value) != CKPT_MAGIC || be_to_uint(value + 4, 8) != offset) return 0;
+    crc = crc32_update(0xFFFFFFFFUL, p, fmt->chunk_header + CKPT_VALUE_SIZE) ^ 0xFFFFFFFFUL;
+    if (be_to_u32(value + CKPT_VALUE_SIZE) != crc) return 0;
+    s->digest = be_to_u32(value + 20) ^ 0xFFFFFFFFUL;
+    s->chunks = be_to_uint(value + 12, 8);
+    s->since = 0;
+    ckpt_fold(s, crc, 0);
+    return 1;
+}
+
+/*
+ * 在 [lo, end) 内从后向前查找最后一个完好的检查点块，按 64KB 分段读取（相邻段重叠一个检查点的长度）。
+ * 找到返回 1，并给出其偏移与之后的摘要状态；没有返回 0；读取失败返回 ZZK_ERR_IO。
+ * searched 累计读过的字节数。
+ */
+static int ckpt_search(struct zzk_reader *r, u64 lo, u64 end, u64 *offset, struct ckpt_state *s, u64 *searched) {
+    const struct zzk_format *fmt = r->fmt;
+    unsigned size = CKPT_SIZE(fmt);
+    unsigned char *buffer = NULL;
+    const unsigned char *p;
+    u64 hi, start;
+    size_t len, i;
+    int rc = 0;
+
+    if (end < lo || end - lo < size) return 0;
+    if (!r->map) {
+        buffer = (unsigned char *)malloc(CKPT_SEARCH_BLOCK + size);
+        if (!buffer) return nomem();
+    }
+    /* 候选起点 c 满足 lo <= c <= end - size；每段覆盖 [start, hi] 内的候选 */
+    hi = end - size;
+    for (;;) {
+        start = (hi - lo > CKPT_SEARCH_BLOCK) ? hi - CKPT_SEARCH_BLOCK : lo;
+        len = (size_t)(hi - start) + size;
+        p = reader_get(r, start, len, buffer);
+        if (!p) {
+            rc = io_error("Error reading archive");
+            break;
+        }
+        *searched += (u64)len;
+        for (i = (size_t)(hi - start) + 1; i-- > 0;) {
+            /* 先用类型字段的首字节过滤，绝大多数位置只比较一次 */
+            if (p[i] == 0 && p[i + 3] == (unsigned char)TYPE_CHECKPOINT &&
+                ckpt_parse(fmt, p + i, start + i, s)) {
+                *offset = start + i;
+                rc = 1;
+                break;
+            }
+        }
+        if (rc != 0 || start == lo) break;
+        hi = start - 1;
+    }
+    free(buffer);
+    return rc;
+}
+
+/* ========== 写入句柄 ========== */
+
+#define STREAM_FINAL         ZZK_STREAM_FINAL
+#define STREAM_DEFAULT_PIECE ZZK_STREAM_DEFAULT_PIECE
+#define STREAM_MAX_PIECE     ZZK_STREAM_MAX_PIECE
+
+/*
+ * 写入句柄的生命周期: open → 追加 × N → close。
+ * 若归档带有尾部索引，open 时将其摘下，close 时连同新块条目一并重写；
+ * 词项索引同样在 open 时摘下，close 时补充新写入的文本块后重写（位于尾部索引之前）。
+ * 每条记录写完由持久化策略决定是否中途提交（writer_record_done）；
+ * 中途提交只推进 TotalSize，不写索引（索引仍在最终提交时重写）。
+ * 记录写到一半失败时回退到记录起点（不早于已提交位置），句柄可继续使用；
+ * 连回退都失败时句柄被标记为 failed，只能 abort。
+ */
+struct zzk_writer {
+    FILE *fp;
+    const struct zzk_format *fmt;
+    struct zzk_options opt;
+    u64 start_size;           /* 打开时的有效末尾（已摘除旧索引） */
+    u64 tail_size;            /* 打开时文件头的 TotalSize（摘除旧索引之前），放弃时据此恢复 */
+    u64 committed_size;       /* 文件头当前声明的 TotalSize */
+    u64 pos;                  /* 下一个块的写入位置 */
+    int has_index;
+    struct chunk_table index;
+    long committed_entries;   /* 已提交部分的索引条目数 */
+    long chunks;              /* 有效区内的块数（含未提交记录）；-1 表示尚未统计 */
+    long committed_chunks;
+    long pending;             /* 上次提交后写入的记录数 */
+    double last_commit_ms;
+    int failed;
+    struct dedup_table dedup; /* opt.dedup 时收录有效区内的 BINARY 块 */
+    struct zzk_dedup_stats dedup_stats;
+    int has_terms;
+    struct term_table terms;
+    u64 terms_from;           /* 尚未收录进词项表的块从这里开始 */
+    struct ckpt_state ckpt;   /* opt.checkpoint 时写入位置处的滚动摘要 */
+    struct ckpt_state committed_ckpt;
+    unsigned char *ring;      /* opt.pipeline_buffers 时流水线写入的缓冲区，首次使用时分配，之后重复使用 */
+};
+
+/* 记录起点，失败时 writer_rollback 回到这里 */
+struct writer_mark {
+    u64 pos;
+    long entries;
+    long chunks;
+    struct ckpt_state ckpt;
+};
+
+/* 建立去重表：优先取自已加载的索引，否则扫描一遍块头（顺带得到块数） */
+static int writer_init_dedup(struct zzk_writer *w, struct zzk_reader *reader) {
+    struct chunk_table table = { NULL, 0, 0 };
+    int rc;
+
+    if (w->has_index) return dedup_build(&w->dedup, &w->index);
+    rc = scan_chunk_headers(reader, w->pos, &table);
+    if (rc == ZZK_ERR_CORRUPT) {
+        log_msg(ZZK_LOG_ERROR, "Error: archive structure is damaged after chunk #%ld.\n", table.count);
+    }
+    if (rc == ZZK_OK) rc = dedup_build(&w->dedup, &table);
+    if (rc == ZZK_OK) {
+        w->chunks = table.count;
+        w->committed_chunks = table.count;
+    }
+    free(table.items);
+    if (seek_to(w->fp, w->pos) != 0 && rc == ZZK_OK) rc = ZZK_ERR_IO;
+    return rc;
+}
+
+/*
+ * opt.checkpoint 时求出写入位置处的摘要状态：有索引时直接取自索引条目，
+ * 否则向回搜索最后一个检查点，只扫描它之后的块头；归档还没有检查点时扫描全部块头（仅此一次）。
+ */
+static int writer_init_checkpoint(struct zzk_writer *w, struct zzk_reader *reader) {
+    const struct zzk_format *fmt = w->fmt;
+    struct chunk_table table = { NULL, 0, 0 };
+    const struct chunk_table *t = &table;
+    unsigned char buf[40];
+    const unsigned char *p;
+    u64 from = fmt->header_size, offset, searched = 0;
+    long i, first = 0;
+    int rc = ZZK_OK;
+
+    if (w->has_index) {
+        t = &w->index;
+        for (i = t->count; i-- > 0;) {
+            if (t->items[i].type != TYPE_CHECKPOINT) continue;
+            p = reader_get(reader, t->items[i].offset, CKPT_SIZE(fmt), buf);
+            if (p && ckpt_parse(fmt, p, t->items[i].offset, &w->ckpt)) first = i + 1;
+            else ckpt_reset(&w->ckpt);
+            break;
+        }
+    } else {
+        rc = ckpt_search(reader, fmt->header_size, w->pos, &offset, &w->ckpt, &searched);
+        if (rc == 1) from = offset + CKPT_SIZE(fmt);
+        if (rc >= 0) rc = scan_chunk_range(reader, from, w->pos, &table);
+        if (rc == ZZK_ERR_CORRUPT) {
+            log_msg(ZZK_LOG_ERROR, "Error: archive structure is damaged after chunk #%ld.\n",
+                    (long)w->ckpt.chunks + table.count);
+        }
+    }
+    for (i = first; rc == ZZK_OK && i < t->count; i++) {
+        ckpt_fold(&w->ckpt, t->items[i].crc, fmt->chunk_overhead + t->items[i].length);
+    }
+    if (rc == ZZK_OK && w->chunks < 0) {
+        w->chunks = (long)w->ckpt.chunks;
+        w->committed_chunks = w->chunks;
+    }
+    w->committed_ckpt = w->ckpt;
+    free(table.items);
+    if (seek_to(w->fp, w->pos) != 0 && rc == ZZK_OK) rc = ZZK_ERR_IO;
+    return rc;
+}
+
+/*
+ * 摘下 end 之前的词项索引并载入词项表，end 随之前移。
+ * 词项表覆盖的块数与尾部索引不符时（中间有不维护词项索引的追加）从头重新收录。
+ */
+static int writer_load_terms(struct zzk_writer *w, struct zzk_reader *reader, u64 *end) {
+    u64 offset = 0;
+    int rc = load_terms(reader, *end, &w->terms, &offset);
+
+    if (rc != 1) return rc;
+    w->has_terms = 1;
+    w->terms_from = offset;
+    *end = offset;
+    if (w->has_index) {
+        if (w->index.count > 0 && w->index.items[w->index.count - 1].offset == offset) w->index.count--;
+        if ((u64)w->index.count != (u64)w->terms.covered) {
+            term_table_free(&w->terms);
+            w->terms_from = w->fmt->header_size;
+        }
+    }
+    return ZZK_OK;
+}
+
+int zzk_writer_open(zzk_writer **out, const char *path, const struct zzk_options *opt) {
+    struct zzk_reader reader;
+    struct zzk_writer *w;
+    u64 current_size = 0, index_offset;
+    int rc;
+
+    zzk_init();
+    *out = NULL;
+    if (opt && opt->block_crc != 0 && (opt->block_crc < SUMS_MIN_BLOCK || opt->block_crc > SUMS_MAX_BLOCK)) {
+        log_msg(ZZK_LOG_ERROR, "Error: block checksum size must be between %lu and %lu bytes.\n",
+                (unsigned long)SUMS_MIN_BLOCK, (unsigned long)SUMS_MAX_BLOCK);
+        return ZZK_ERR_ARG;
+    }
+    if (opt && opt->pipeline_buffers != 0 &&
+        (opt->pipeline_buffers < ZZK_PIPELINE_MIN_BUFFERS || opt->pipeline_buffers > ZZK_PIPELINE_MAX_BUFFERS ||
+         opt->pipeline_size < ZZK_PIPELINE_MIN_SIZE || opt->pipeline_size > ZZK_PIPELINE_MAX_SIZE)) {
+        log_msg(ZZK_LOG_ERROR, "Error: pipeline needs %d..%d buffers of %lu..%lu bytes.\n",
+                ZZK_PIPELINE_MIN_BUFFERS, ZZK_PIPELINE_MAX_BUFFERS, ZZK_PIPELINE_MIN_SIZE, ZZK_PIPELINE_MAX_SIZE);
+        return ZZK_ERR_ARG;
+    }
+    w = (struct zzk_writer *)malloc(sizeof(*w));
+    if (!w) return nomem();
+    w->opt = opt ? *opt : default_options;
+    w->has_index = 0;
+    w->index.items = NULL;
+    w->index.count = 0;
+    w->index.cap = 0;
+    w->failed = 0;
+    w->ring = NULL;
+    memset(&w->dedup, 0, sizeof(w->dedup));
+    memset(&w->dedup_stats, 0, sizeof(w->dedup_stats));
+    w->has_terms = 0;
+    memset(&w->terms, 0, sizeof(w->terms));
+    w->terms_from = 0;
+    ckpt_reset(&w->ckpt);
+    w->committed_ckpt = w->ckpt;
+
+    STATS_TIME(ZZK_PHASE_OPEN, rc = validate_and_open(path, &w->fp, &w->fmt, &current_size));
+    if (rc != ZZK_OK) {
+        free(w);
+        return rc;
+    }
+
+    reader_attach(&reader, w->fp, w->fmt, current_size);
+    rc = load_index(&reader, &w->index, &index_offset);
+    if (rc == 1) {
+        w->has_index = 1;
+        current_size = index_offset;
+    }
+    if (rc >= 0) rc = writer_load_terms(w, &reader, &current_size);
+    if (rc >= 0 && (w->has_index || w->has_terms)) {
+        /* 先收缩 TotalSize，使旧索引在崩溃时也不会与新数据重叠 */
+        if (write_total_size(w->fp, w->fmt, current_size) != 0 ||
+            sync_data(w->fp, &w->opt, "Error flushing header update") != 0) rc = ZZK_ERR_IO;
+    }
+    if (rc >= 0 && seek_to(w->fp, current_size) != 0) rc = ZZK_ERR_IO;
+    if (rc < 0) {
+        fclose(w->fp);
+        free(w->index.items);
+        term_table_free(&w->terms);
+        free(w);
+        return rc;
+    }
+
+    w->tail_size = reader.total_size;
+    w->start_size = current_size;
+    w->committed_size = current_size;
+    w->pos = current_size;
+    w->committed_entries = w->index.count;
+    /* 索引覆盖其之前的全部块 */
+    w->chunks = w->has_index ? w->index.count : (w->has_terms ? (long)w->terms.covered : -1);
+    w->committed_chunks = w->chunks;
+    w->pending = 0;
+    w->last_commit_ms = now_ms();
+    if ((w->opt.dedup && (rc = writer_init_dedup(w, &reader)) != ZZK_OK) ||
+        (w->opt.checkpoint && (rc = writer_init_checkpoint(w, &reader)) != ZZK_OK)) {
+        zzk_writer_abort(w);
+        return rc;
+    }
+    *out = w;
+    return ZZK_OK;
+}
+
+int zzk_writer_format(const zzk_writer *w) {
+    return format_id(w->fmt);
+}
+
+zzk_u64 zzk_writer_size(const zzk_writer *w) {
+    return w->pos;
+}
+
+zzk_u64 zzk_writer_committed_size(const zzk_writer *w) {
+    return w->committed_size;
+}
+
+static int writer_usable(const struct zzk_writer *w) {
+    if (!w->failed) return ZZK_OK;
+    log_msg(ZZK_LOG_ERROR, "Error: archive writer is unusable after an earlier failure.\n");
+    return ZZK_ERR_IO;
+}
+
+static void writer_mark(const struct zzk_writer *w, struct writer_mark *m) {
+    m->pos = w->pos;
+    m->entries = w->index.count;
+    m->chunks = w->chunks;
+    m->ckpt = w->ckpt;
+}
+
+/* 撤回记录起点之后写入的块；已经提交的部分保留 */
+static void writer_rollback(struct zzk_writer *w, const struct writer_mark *m) {
+    if (m->pos < w->committed_size) {
+        w->pos = w->committed_size;
+        w->index.count = w->committed_entries;
+        w->chunks = w->committed_chunks;
+        w->ckpt = w->committed_ckpt;
+        w->pending = 0;
+    } else {
+        w->pos = m->pos;
+        w->index.count = m->entries;
+        w->chunks = m->chunks;
+        w->ckpt = m->ckpt;
+    }
+    if (w->opt.dedup) dedup_truncate(&w->dedup, w->chunks);
+    clearerr(w->fp);
+    if (seek_to(w->fp, w->pos) != 0) w->failed = 1;
+}
+
+/* 登记刚写入的块（用于更新索引并推进写入位置） */
+static int writer_chunk_written(struct zzk_writer *w, u32 type, u64 length, u32 crc) {
+    if (w->has_index && chunk_table_push(&w->index, type, w->pos, length, crc) != 0) return ZZK_ERR_NOMEM;
+    if (w->opt.dedup && type == TYPE_BINARY && dedup_add(&w->dedup, crc, length, w->pos, w->chunks + 1) != 0) {
+        return ZZK_ERR_NOMEM;
+    }
+    if (w->opt.checkpoint) ckpt_fold(&w->ckpt, crc, w->fmt->chunk_overhead + length);
+    w->pos += w->fmt->chunk_overhead + length;
+    if (w->chunks >= 0) w->chunks++;
+    return ZZK_OK;
+}
+
+/* 中途提交：让已写入的记录对读取方可见（并按策略落盘） */
+static int writer_flush_group(struct zzk_writer *w) {
+    if (w->pos != w->committed_size) {
+        if (update_total_size(w->fp, w->fmt, &w->opt, w->pos - w->committed_size, w->committed_size) != 0) {
+            /* 文件头是否已更新无从得知，不再继续写入 */
+            w->failed = 1;
+            return ZZK_ERR_IO;
+        }
+        w->committed_size = w->pos;
+        w->committed_entries = w->index.count;
+        w->committed_chunks = w->chunks;
+        w->committed_ckpt = w->ckpt;
+    }
+    w->pending = 0;
+    w->last_commit_ms = now_ms();
+    return ZZK_OK;
+}
+
+/* 一条记录写完。data 模式逐条提交；group 模式攒够 N 条或超过 T 毫秒时提交 */
+static int writer_record_done(struct zzk_writer *w) {
+    const struct zzk_options *opt = &w->opt;
+
+    if (opt->stats) opt->stats->records++;
+    w->pending++;
+    if (opt->sync_mode == ZZK_SYNC_DATA) return writer_flush_group(w);
+    if (opt->sync_mode == ZZK_SYNC_GROUP &&
+        ((opt->group_records > 0 && w->pending >= opt->group_records) ||
+         (opt->group_ms > 0 && now_ms() - w->last_commit_ms >= opt->group_ms))) {
+        return writer_flush_group(w);
+    }
+    return ZZK_OK;
+}
+
+/*
+ * 等待下一条记录前调用：group 模式下若有未提交的记录，最多等待到时限，
+ * 输入在时限内没有到达就先提交，避免记录在空闲的管道上无限期滞留。
+ * 调用方须已将 in 设为无缓冲（见 zzk_writer_prepare_input），否则 poll 看不到 stdio 缓冲区。
+ */
+int zzk_writer_wait_input(zzk_writer *w, FILE *in) {
+#ifdef ZZK1_POSIX
+    struct pollfd pfd;
+    double left;
+
+    if (w->failed || w->opt.sync_mode != ZZK_SYNC_GROUP || w->opt.group_ms <= 0 || w->pending == 0) {
+        return ZZK_OK;
+    }
+    left = w->opt.group_ms - (now_ms() - w->last_commit_ms);
+    pfd.fd = fileno(in);
+    pfd.events = POLLIN;
+    if (left <= 0 || poll(&pfd, 1, (int)left + 1) == 0) return writer_flush_group(w);
+#else
+    (void)w;
+    (void)in;
+#endif
+    return ZZK_OK;
+}
+
+void zzk_writer_prepare_input(zzk_writer *w, FILE *in) {
+    if (w->opt.sync_mode == ZZK_SYNC_GROUP && w->opt.group_ms > 0) setvbuf(in, NULL, _IONBF, 0);
+}
+
+/* 确认追加一个 length 字节的块后不超过格式上限（ZZK1 为 4GB） */
+static int writer_reserve(struct zzk_writer *w, u64 length) {
+    u64 max = w->fmt->max_size, overhead = w->fmt->chunk_overhead;
+    if (length > max - overhead || w->pos > max - overhead - length) return report_size_overflow(w->fmt);
+    return ZZK_OK;
+}
+
+static int writer_memory_chunk(struct zzk_writer *w, u32 type, const void *data, size_t len) {
+    u32 crc;
+    int rc = writer_reserve(w, (u64)len);
+    if (rc == ZZK_OK) rc = write_chunk(w->fp, w->fmt, type, data, len, &crc);
+    if (rc == ZZK_OK) rc = writer_chunk_written(w, type, (u64)len, crc);
+    return rc;
+}
+
+/*
+ * 距上一个检查点已写入 opt.checkpoint 字节时，在下一条记录开始之前（以及最终提交时）插入检查点块，
+ * 因此检查点不会夹在元数据与其二进制块、或同一个流的分片之间，记录的块编号也不受影响。
+ */
+static int writer_checkpoint(struct zzk_writer *w) {
+    struct writer_mark m;
+    unsigned char value[CKPT_VALUE_SIZE];
+    int rc;
+
+    if (w->opt.checkpoint == 0 || w->ckpt.since < w->opt.checkpoint) return ZZK_OK;
+    ckpt_encode(&w->ckpt, w->pos, value);
+    writer_mark(w, &m);
+    rc = writer_memory_chunk(w, TYPE_CHECKPOINT, value, sizeof(value));
+    if (rc != ZZK_OK) {
+        writer_rollback(w, &m);
+        return rc;
+    }
+    w->ckpt.since = 0;
+    return ZZK_OK;
+}
+
+#ifdef ZZK1_LINUX
+/*
+ * append_file 的内核侧拷贝：源文件映射后按窗口 copy_file_range 到归档，
+ * 同一窗口随即在映射上计算 CRC（及分块校验表）。返回 0 成功，-1 不支持（未写入任何数据），其余为错误码。
+ */
+static int writer_kernel_copy(struct zzk_writer *w, FILE *in, u64 length, u32 *crc, struct block_sums *sums) {
+    struct stat st;
+    void *map;
+    int use_sendfile = 0, rc = 0;
+    u64 done = 0, step;
+
+    if (length == 0 || (u64)(size_t)length != length || fstat(fileno(in), &st) != 0 ||
+        !S_ISREG(st.st_mode) || (u64)st.st_size < length) return -1;
+    map = mmap(NULL, (size_t)length, PROT_READ, MAP_SHARED, fileno(in), 0);
+    if (map == MAP_FAILED) return -1;
+    posix_madvise(map, (size_t)length, POSIX_MADV_SEQUENTIAL);
+
+    if (fflush(w->fp) != 0) rc = io_error("Error writing chunk header");
+    while (rc == 0 && done < length) {
+        step = (length - done > KERNEL_COPY_WINDOW) ? (u64)KERNEL_COPY_WINDOW : length - done;
+        STATS_TIME(ZZK_PHASE_WRITE, rc = kernel_copy(fileno(in), done, fileno(w->fp), step, &use_sendfile));
+        if (rc == -1 && done == 0) break;
+        if (rc != 0) {
+            rc = io_error("Error copying file into archive");
+            break;
+        }
+        STATS_COUNT(STATS_BYTES_READ, step);
+        STATS_COUNT(STATS_BYTES_WRITTEN, step);
+        STATS_TIME(ZZK_PHASE_CRC, {
+            *crc = crc32_update(*crc, (const unsigned char *)map + (size_t)done, (size_t)step);
+            if (sums) sums_update(sums, (const unsigned char *)map + (size_t)done, (size_t)step);
+        });
+        done += step;
+    }
+    munmap(map, (size_t)length);
+    if (rc != 0) return rc;
+    if (fseek(w->fp, 0, SEEK_CUR) != 0) return io_error("Error seeking archive");
+    return 0;
+}
+#endif
+
+#ifdef ZZK1_THREADS
+/*
+ * 流水线写入：读取线程把输入读进环形的大缓冲区，CRC 线程按顺序累积 CRC32（与分块校验表），
+ * 写出阶段在调用线程中把同一缓冲区写到归档。CRC 与写出互不依赖，同时处理同一个缓冲区；
+ * 两者都用完后缓冲区才交还读取线程。三个阶段重叠进行，吞吐接近源与目标中较慢的一方，
+ * 而不是三者耗时之和。缓冲区个数与大小由 opt.pipeline_buffers / pipeline_size 决定。
+ */
+struct pipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned char *ring;
+    size_t slot_size;
+    long nslots;
+    FILE *in;
+    u64 length;
+    long produced;        /* 已读满的缓冲区数（单调递增，第 k 个位于 k % nslots） */
+    long checked;         /* CRC 阶段处理完的缓冲区数 */
+    long written;         /* 写出阶段处理完的缓冲区数 */
+    int reader_done;
+    int abort;            /* 写出失败时通知其他阶段退出 */
+    int read_status;      /* 0、ZZK_ERR_IO 或 ZZK_ERR_INPUT */
+    int read_errno;
+    u64 missing;          /* ZZK_ERR_INPUT 时缺少的字节数 */
+    u32 crc;
+    struct block_sums *sums;
+};
+
+static size_t pipeline_slot_len(const struct pipeline *p, long k) {
+    u64 start = (u64)k * p->slot_size;
+    return (p->length - start > p->slot_size) ? p->slot_size : (size_t)(p->length - start);
+}
+
+static void *pipeline_reader(void *arg) {
+    struct pipeline *p = (struct pipeline *)arg;
+    long k, nblocks = (long)((p->length + p->slot_size - 1) / p->slot_size);
+    size_t want, got;
+    unsigned char *buf;
+    int stop;
+
+    for (k = 0; k < nblocks; k++) {
+        /* 等第 k - nslots 个缓冲区被 CRC 与写出两个阶段都用完 */
+        pthread_mutex_lock(&p->lock);
+        while (!p->abort && k - (p->checked < p->written ? p->checked : p->written) >= p->nslots) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        stop = p->abort;
+        pthread_mutex_unlock(&p->lock);
+        if (stop) break;
+
+        want = pipeline_slot_len(p, k);
+        buf = p->ring + (size_t)(k % p->nslots) * p->slot_size;
+        STATS_TIME(ZZK_PHASE_READ, got = fread(buf, 1, want, p->in));
+        STATS_COUNT(STATS_BYTES_READ, got);
+        pthread_mutex_lock(&p->lock);
+        if (got == want) {
+            p->produced = k + 1;
+        } else {
+            p->read_status = ferror(p->in) ? ZZK_ERR_IO : ZZK_ERR_INPUT;
+            p->read_errno = errno;
+            p->missing = p->length - (u64)k * p->slot_size - (u64)got;
+        }
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        if (got != want) break;
+    }
+    pthread_mutex_lock(&p->lock);
+    p->reader_done = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* 等到第 k 个缓冲区读满；读取已结束或被中止而等不到时返回 NULL */
+static unsigned char *pipeline_wait(struct pipeline *p, long k) {
+    int ready;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->abort && p->produced <= k && !p->reader_done) pthread_cond_wait(&p->cond, &p->lock);
+    ready = !p->abort && p->produced > k;
+    pthread_mutex_unlock(&p->lock);
+    return ready ? p->ring + (size_t)(k % p->nslots) * p->slot_size : NULL;
+}
+
+static void pipeline_release(struct pipeline *p, long *counter, long k) {
+    pthread_mutex_lock(&p->lock);
+    *counter = k + 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void *pipeline_checker(void *arg) {
+    struct pipeline *p = (struct pipeline *)arg;
+    unsigned char *buf;
+    size_t len;
+    long k;
+
+    for (k = 0; (buf = pipeline_wait(p, k)) != NULL; k++) {
+        len = pipeline_slot_len(p, k);
+        STATS_TIME(ZZK_PHASE_CRC, {
+            p->crc = crc32_update(p->crc, buf, len);
+            if (p->sums) sums_update(p->sums, buf, len);
+        });
+        pipeline_release(p, &p->checked, k);
+    }
+    return NULL;
+}
+
+/*
+ * 以流水线写出 length 字节的块内容，*crc 为 Type + Length 之后的中间状态。
+ * 成功返回 0；无法启动（内存不足或无法创建线程，尚未读取输入）返回 -1，由调用方改走顺序路径；
+ * 其余失败返回 ZZK_ERR_*。
+ */
+static int writer_pipeline(struct zzk_writer *w, FILE *in, u64 length, u32 *crc, struct block_sums *sums,
+                           const char *what) {
+    struct pipeline p;
+    pthread_t reader, checker;
+    unsigned char *buf;
+    char num[24];
+    long k;
+    int rc = 0;
+
+    p.nslots = w->opt.pipeline_buffers;
+    p.slot_size = (size_t)w->opt.pipeline_size;
+    if (!w->ring) w->ring = (unsigned char *)malloc(p.slot_size * (size_t)p.nslots);
+    if (!w->ring) return -1;
+    p.ring = w->ring;
+    p.in = in;
+    p.length = length;
+    p.produced = p.checked = p.written = 0;
+    p.reader_done = p.abort = 0;
+    p.read_status = 0;
+    p.read_errno = 0;
+    p.missing = 0;
+    p.crc = *crc;
+    p.sums = sums;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    if (pthread_create(&checker, NULL, pipeline_checker, &p) != 0) {
+        rc = -1;
+    } else if (pthread_create(&reader, NULL, pipeline_reader, &p) != 0) {
+        pthread_mutex_lock(&p.lock);
+        p.reader_done = 1;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+        pthread_join(checker, NULL);
+        rc = -1;
+    }
+    if (rc != 0) {
+        pthread_cond_destroy(&p.cond);
+        pthread_mutex_destroy(&p.lock);
+        return rc;
+    }
+
+    for (k = 0; (buf = pipeline_wait(&p, k)) != NULL; k++) {
+        if (write_all(w->fp, buf, pipeline_slot_len(&p, k), "Error writing chunk value") != 0) {
+            rc = ZZK_ERR_IO;
+            pthread_mutex_lock(&p.lock);
+            p.abort = 1;
+            pthread_cond_broadcast(&p.cond);
+            pthread_mutex_unlock(&p.lock);
+            break;
+        }
+        pipeline_release(&p, &p.written, k);
+    }
+    pthread_join(reader, NULL);
+    pthread_join(checker, NULL);
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+
+    if (rc == 0 && p.read_status == ZZK_ERR_IO) {
+        errno = p.read_errno;
+        return io_error(what);
+    }
+    if (rc == 0 && p.read_status == ZZK_ERR_INPUT) {
+        log_msg(ZZK_LOG_ERROR, "%s: unexpected end of input (%s bytes missing).\n", what, u64_str(p.missing, num));
+        return ZZK_ERR_INPUT;
+    }
+    *crc = p.crc;
+    return rc;
+}
+#endif
+
+/*
+ * 从 in 流式读取恰好 length 字节作为一个块写入（流式写入 + 流式 CRC）。
+ * in 为刚打开、位于开头的普通文件时传 from_file=1，允许走内核侧拷贝。
+ * sums 非 NULL 时同时累积分块校验表（由调用方在块后写出）。
+ */
+static int writer_stream_chunk(struct zzk_writer *w, u32 type, FILE *in, u64 length,
+                               int from_file, const char *what, struct block_sums *sums) {
+    unsigned char hdr[12];
+    unsigned char buffer[65536];
+    unsigned hdr_len;
+    u64 remaining = length;
+    u32 crc = 0xFFFFFFFFUL;
+    size_t to_read;
+    char num[24];
+    int rc;
+
+    if ((rc = writer_reserve(w, length)) != ZZK_OK) return rc;
+
+    hdr_len = encode_chunk_header(w->fmt, type, length, hdr);
+    crc = crc32_update(crc, hdr, hdr_len);
+    if (write_all(w->fp, hdr, hdr_len, "Error writing chunk header") != 0) return ZZK_ERR_IO;
+
+#ifdef ZZK1_THREADS
+    /* 只有一个缓冲区装不下的内容才值得启动流水线 */
+    if (w->opt.pipeline_buffers > 0 && remaining > (u64)w->opt.pipeline_size) {
+        rc = writer_pipeline(w, in, length, &crc, sums, what);
+        if (rc == 0) remaining = 0;
+        else if (rc != -1) return rc;
+    }
+#endif
+#ifdef ZZK1_LINUX
+    if (from_file && remaining > 0) {
+        rc = writer_kernel_copy(w, in, length, &crc, sums);
+        if (rc == 0) remaining = 0;
+        else if (rc != -1) return rc;
+    }
+#else
+    (void)from_file;
+#endif
+    while (remaining > 0) {
+        size_t got;
+        to_read = (remaining > sizeof(buffer)) ? sizeof(buffer) : (size_t)remaining;
+        STATS_TIME(ZZK_PHASE_READ, got = fread(buffer, 1, to_read, in));
+        STATS_COUNT(STATS_BYTES_READ, got);
+        if (got != to_read) {
+            if (ferror(in)) return io_error(what);
+            log_msg(ZZK_LOG_ERROR, "%s: unexpected end of input (%s bytes missing).\n",
+                    what, u64_str(remaining, num));
+            return ZZK_ERR_INPUT;
+        }
+        if (write_all(w->fp, buffer, to_read, "Error writing chunk value") != 0) return ZZK_ERR_IO;
+        STATS_TIME(ZZK_PHASE_CRC, {
+            crc = crc32_update(crc, buffer, to_read);
+            if (sums) sums_update(sums, buffer, to_read);
+        });
+        remaining -= (u64)to_read;
+    }
+
+    crc ^= 0xFFFFFFFFUL;
+    if (write_u32(w->fp, crc, "Error writing chunk CRC32") != 0) return ZZK_ERR_IO;
+    if (sums) {
+        /* 块 CRC 与 Type + Length 的 CRC 之差即 Value 的 CRC32，无需再算一遍 */
+        sums_finish(sums, crc ^ crc32_combine(crc32_update(0xFFFFFFFFUL, hdr, hdr_len) ^ 0xFFFFFFFFUL, 0, length));
+    }
+    return writer_chunk_written(w, type, length, crc);
+}
+
+/*
+ * 写入压缩块（格式见"LZ 压缩"）。原内容来自内存 data，data 为 NULL 时从 in 读取 length 字节；
+ * 每批 lz_window 个块在任务池上并行压缩后按顺序写出。Value 长度事先未知：
+ * 先写占位块头，写完后回填 Length，块 CRC 由各段 CRC 经 crc32_combine 合并得到。
+ */
+static int writer_lz_chunk(struct zzk_writer *w, u32 type, const unsigned char *data, FILE *in, u64 length,
+                           const char *what) {
+    const struct zzk_format *fmt = w->fmt;
+    struct lz_ctx ctx;
+    struct lz_job *j;
+    unsigned char hdr[12], prefix[LZ_PREFIX_SIZE], trailer[4];
+    unsigned char *raw = NULL, *packed = NULL;
+    u64 nblocks = (length + LZ_BLOCK_SIZE - 1) / LZ_BLOCK_SIZE, done = 0, value_len;
+    u32 value_crc, content_crc = 0, crc;
+    size_t n;
+    unsigned hdr_len;
+    int nthreads = default_thread_count(), window, count, i, rc;
+    char num[24];
+
+    /* 最坏情况下每块原样存储，多出 BlockLen */
+    if ((rc = writer_reserve(w, LZ_PREFIX_SIZE + length + 4 * nblocks + 4)) != ZZK_OK) return rc;
+
+    window = lz_window(nthreads, LZ_BLOCK_SIZE);
+    ctx.verify = 1;
+    ctx.jobs = (struct lz_job *)calloc((size_t)window, sizeof(struct lz_job));
+    ctx.tables = (u32 **)calloc((size_t)nthreads, sizeof(u32 *));
+    packed = (unsigned char *)malloc((size_t)window * (LZ_BLOCK_SIZE + 4));
+    if (!data) raw = (unsigned char *)malloc((size_t)window * LZ_BLOCK_SIZE);
+    rc = (ctx.jobs && ctx.tables && packed && (data || raw)) ? ZZK_OK : ZZK_ERR_NOMEM;
+    for (i = 0; rc == ZZK_OK && i < nthreads; i++) {
+        ctx.tables[i] = (u32 *)malloc(sizeof(u32) << LZ_HASH_BITS);
+        if (!ctx.tables[i]) rc = ZZK_ERR_NOMEM;
+    }
+    if (rc != ZZK_OK) {
+        lz_free(&ctx, nthreads, raw, packed);
+        return nomem();
+    }
+
+    hdr_len = encode_chunk_header(fmt, TYPE_LZ, 0, hdr);
+    u32_to_be(type, prefix);
+    uint_to_be(length, prefix + 4, 8);
+    u32_to_be(LZ_BLOCK_SIZE, prefix + 12);
+    if (write_all(w->fp, hdr, hdr_len, "Error writing chunk header") != 0 ||
+        write_all(w->fp, prefix, sizeof(prefix), "Error writing chunk value") != 0) rc = ZZK_ERR_IO;
+    value_crc = crc32_update(0xFFFFFFFFUL, prefix, sizeof(prefix)) ^ 0xFFFFFFFFUL;
+    value_len = sizeof(prefix);
+
+    while (rc == ZZK_OK && done < length) {
+        for (count = 0; count < window && done < length; count++) {
+            j = &ctx.jobs[count];
+            n = length - done > LZ_BLOCK_SIZE ? LZ_BLOCK_SIZE : (size_t)(length - done);
+            if (data) {
+                j->raw = data + done;
+            } else {
+                j->raw = raw + (size_t)count * LZ_BLOCK_SIZE;
+                if (fread(raw + (size_t)count * LZ_BLOCK_SIZE, 1, n, in) != n) {
+                    if (ferror(in)) {
+                        rc = io_error(what);
+                    } else {
+                        log_msg(ZZK_LOG_ERROR, "%s: unexpected end of input (%s bytes missing).\n",
+                                what, u64_str(length - done, num));
+                        rc = ZZK_ERR_INPUT;
+                    }
+                    break;
+                }
+            }
+            j->raw_len = n;
+            j->packed_buf = packed + (size_t)count * (LZ_BLOCK_SIZE + 4);
+            done += (u64)n;
+        }
+        if (rc != ZZK_OK) break;
+
+        run_jobs(nthreads, count, lz_compress_job, &ctx);
+        for (i = 0; i < count; i++) {
+            j = &ctx.jobs[i];
+            if (write_all(w->fp, j->packed_buf, j->packed_len, "Error writing chunk value") != 0) {
+                rc = ZZK_ERR_IO;
+                break;
+            }
+            value_crc = crc32_combine(value_crc, j->packed_crc, j->packed_len);
+            content_crc = crc32_combine(content_crc, j->raw_crc, j->raw_len);
+            value_len += j->packed_len;
+        }
+    }
+    lz_free(&ctx, nthreads, raw, packed);
+    if (rc != ZZK_OK) return rc;
+
+    u32_to_be(content_crc, trailer);
+    if (write_all(w->fp, trailer, 4, "Error writing chunk value") != 0) return ZZK_ERR_IO;
+    value_crc = crc32_combine(value_crc, crc32_update(0xFFFFFFFFUL, trailer, 4) ^ 0xFFFFFFFFUL, 4);
+    value_len += 4;
+
+    /* 回填 Length，再回到块末尾写 CRC32 */
+    hdr_len = encode_chunk_header(fmt, TYPE_LZ, value_len, hdr);
+    crc = crc32_combine(crc32_update(0xFFFFFFFFUL, hdr, hdr_len) ^ 0xFFFFFFFFUL, value_crc, value_len);
+    if (seek_to(w->fp, w->pos) != 0 ||
+        write_all(w->fp, hdr, hdr_len, "Error writing chunk header") != 0 ||
+        seek_to(w->fp, w->pos + hdr_len + value_len) != 0 ||
+        write_u32(w->fp, crc, "Error writing chunk CRC32") != 0) return ZZK_ERR_IO;
+    return writer_chunk_written(w, TYPE_LZ, value_len, crc);
+}
+
+/* 调用方提供的块只能是普通数据类型；INDEX、STREAM、REF、LZ、SUMS、TERMS 与 CHECKPOINT 的布局由库维护 */
+static int writer_check_type(u32 type) {
+    if (type != TYPE_INDEX && type != TYPE_STREAM && type != TYPE_REF && type != TYPE_LZ &&
+        type != TYPE_SUMS && type != TYPE_TERMS && type != TYPE_CHECKPOINT) return ZZK_OK;
+    log_msg(ZZK_LOG_ERROR, "Error: chunk type %s cannot be appended directly.\n", zzk_type_name(type));
+    return ZZK_ERR_ARG;
+}
+
+/* opt.compress 时 TEXT / BINARY 内容写成压缩块；过短的内容不值得压缩 */
+static int writer_compresses(const struct zzk_writer *w, u32 type, u64 length) {
+    return w->opt.compress && (type == TYPE_TEXT || type == TYPE_BINARY) && length >= LZ_MIN_INPUT;
+}
+
+/* 单条记录的收尾：成功时交给持久化策略，失败时撤回 */
+static int writer_finish_record(struct zzk_writer *w, const struct writer_mark *m, int rc) {
+    if (rc != ZZK_OK) {
+        writer_rollback(w, m);
+        return rc;
+    }
+    return writer_record_done(w);
+}
+
+int zzk_writer_append(zzk_writer *w, zzk_u32 type, const void *data, size_t len) {
+    struct writer_mark m;
+    int rc;
+
+    if ((rc = writer_usable(w)) != ZZK_OK || (rc = writer_check_type(type)) != ZZK_OK ||
+        (rc = writer_checkpoint(w)) != ZZK_OK) return rc;
+    writer_mark(w, &m);
+    if (writer_compresses(w, type, (u64)len)) {
+        rc = writer_lz_chunk(w, type, (const unsigned char *)data, NULL, (u64)len, NULL);
+    } else {
+        rc = writer_memory_chunk(w, type, data, len);
+    }
+    return writer_finish_record(w, &m, rc);
+}
+
+int zzk_writer_append_from(zzk_writer *w, zzk_u32 type, FILE *in, zzk_u64 length) {
+    struct writer_mark m;
+    int rc;
+
+    if ((rc = writer_usable(w)) != ZZK_OK || (rc = writer_check_type(type)) != ZZK_OK ||
+        (rc = writer_checkpoint(w)) != ZZK_OK) return rc;
+    writer_mark(w, &m);
+    return writer_finish_record(w, &m, writer_stream_chunk(w, type, in, length, 0, "Error reading input", NULL));
+}
+
+/* append-dir 写入元数据的附加字段：修改时间（has_mtime 为 0 时未知）与内容的 CRC32 */
+struct file_stamp {
+    int has_mtime;
+    long mtime;
+    u32 hash;
+};
+
+/* 构建文件元数据文本，返回其长度。stamp 非 NULL 时追加 Modified / Hash 两行 */
+static size_t build_file_metadata(char *metadata, size_t cap, const char *target_file,
+                                  const char *description, u64 target_size, const struct file_stamp *stamp) {
+    size_t used = 0;
+    int truncated = 0;
+    char size_buf[24];
+
+    metadata[0] = '\0';
+
+    if (append_str(metadata, cap, &used, "Filename: ") != 0) truncated = 1;
+    if (append_str(metadata, cap, &used, target_file) != 0) truncated = 1;
+    if (append_str(metadata, cap, &used, "\nDescription: ") != 0) truncated = 1;
+    if (append_str(metadata, cap, &used, description) != 0) truncated = 1;
+    if (append_str(metadata, cap, &used, "\nSize: ") != 0) truncated = 1;
+    if (append_str(metadata, cap, &used, u64_str(target_size, size_buf)) != 0) truncated = 1;
+    if (append_str(metadata, cap, &used, " bytes") != 0) truncated = 1;
+    if (stamp && stamp->has_mtime) {
+        sprintf(size_buf, "%ld", stamp->mtime);
+        if (append_str(metadata, cap, &used, "\nModified: ") != 0) truncated = 1;
+        if (append_str(metadata, cap, &used, size_buf) != 0) truncated = 1;
+    }
+    if (stamp) {
+        sprintf(size_buf, "crc32:%08lx", (unsigned long)stamp->hash);
+        if (append_str(metadata, cap, &used, "\nHash: ") != 0) truncated = 1;
+        if (append_str(metadata, cap, &used, size_buf) != 0) truncated = 1;
+    }
+
+    if (truncated) {
+        log_msg(ZZK_LOG_WARNING, "Warning: metadata truncated to %lu bytes.\n", (unsigned long)(cap - 1));
+    }
+    return used;
+}
+
+/* 计算文件内容（只含 Value）的 CRC32，结束后回到文件开头 */
+static int file_value_crc(FILE *fp, u64 length, u32 *crc_out) {
+    unsigned char buffer[65536];
+    u32 crc = 0xFFFFFFFFUL;
+    size_t n;
+
+    while (length > 0) {
+        n = length > sizeof(buffer) ? sizeof(buffer) : (size_t)length;
+        if (fread(buffer, 1, n, fp) != n) return io_error("Error reading target file");
+        crc = crc32_update(crc, buffer, n);
+        length -= (u64)n;
+    }
+    if (fseek(fp, 0, SEEK_SET) != 0) return io_error("Error seeking target file to start");
+    *crc_out = crc ^ 0xFFFFFFFFUL;
+    return ZZK_OK;
+}
+
+/*
+ * 逐字节比较 fp 与归档中 e 所指块的内容，相同返回 1，不同返回 0。
+ * 在写入句柄上读取：先刷新写缓冲，结束后回到写入位置与文件开头。
+ */
+static int writer_same_content(struct zzk_writer *w, const struct dedup_entry *e, FILE *fp) {
+    struct zzk_reader reader;
+    unsigned char mine[32768], theirs[32768];
+    const unsigned char *p;
+    u64 offset = e->offset + w->fmt->chunk_header, remaining = e->length;
+    size_t n;
+    int same = 1;
+
+    if (fflush(w->fp) != 0) return io_error("Error flushing archive");
+    reader_attach(&reader, w->fp, w->fmt, w->pos);
+    while (same == 1 && remaining > 0) {
+        n = remaining > sizeof(mine) ? sizeof(mine) : (size_t)remaining;
+        p = reader_get(&reader, offset, n, theirs);
+        if (!p) same = io_error("Error reading archive");
+        else if (fread(mine, 1, n, fp) != n) same = io_error("Error reading target file");
+        else if (memcmp(mine, p, n) != 0) same = 0;
+        offset += (u64)n;
+        remaining -= (u64)n;
+    }
+    if (seek_to(w->fp, w->pos) != 0) {
+        w->failed = 1;
+        return ZZK_ERR_IO;
+    }
+    if (fseek(fp, 0, SEEK_SET) != 0) return io_error("Error seeking target file to start");
+    return same;
+}
+
+/* 引用块不比内容小时不去重 */
+#define DEDUP_WORTHWHILE(w, length) ((w)->opt.dedup && (w)->dedup.count > 0 && (length) > REF_SIZE)
+
+/*
+ * 在去重表中查找与 fp（位于文件开头）内容相同的 BINARY 块，value_crc 为文件内容的 CRC32。
+ * 找到时复制其条目到 found 并返回 1，否则返回 0。
+ */
+static int writer_find_duplicate(struct zzk_writer *w, FILE *fp, u64 length, u32 value_crc,
+                                 struct dedup_entry *found) {
+    unsigned char hdr[12];
+    unsigned hdr_len;
+    u32 crc;
+    long i;
+    int rc;
+
+    /* 按本归档的块头编码换算成块存储的 CRC32，与表中的键比较 */
+    hdr_len = encode_chunk_header(w->fmt, TYPE_BINARY, length, hdr);
+    crc = crc32_combine(crc32_update(0xFFFFFFFFUL, hdr, hdr_len) ^ 0xFFFFFFFFUL, value_crc, length);
+    for (i = w->dedup.buckets[dedup_bucket(&w->dedup, crc, length)]; i >= 0; i = w->dedup.items[i].next) {
+        const struct dedup_entry *e = &w->dedup.items[i];
+        if (e->crc != crc || e->length != length) continue;
+        rc = writer_same_content(w, e, fp);
+        if (rc < 0) return rc;
+        if (rc == 1) {
+            *found = *e;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int writer_ref_chunk(struct zzk_writer *w, const struct dedup_entry *e, u32 value_crc) {
+    unsigned char value[REF_SIZE];
+
+    u32_to_be((u32)e->chunk, value);
+    uint_to_be(e->length, value + 4, 8);
+    u32_to_be(value_crc, value + 12);
+    return writer_memory_chunk(w, TYPE_REF, value, sizeof(value));
+}
+
+/*
+ * 写入文件内容的二进制块；opt.block_crc 时随后写入它的分块校验表，
+ * 各段的 CRC32 与块的 CRC32 在同一遍读取中计算。
+ */
+static int writer_binary_chunk(struct zzk_writer *w, FILE *fp, u64 length) {
+    struct block_sums sums;
+    int rc;
+
+    if (!w->opt.block_crc) {
+        return writer_stream_chunk(w, TYPE_BINARY, fp, length, 1, "Error reading target file", NULL);
+    }
+    if ((rc = sums_init(&sums, w->opt.block_crc, length)) != ZZK_OK) return rc;
+    rc = writer_stream_chunk(w, TYPE_BINARY, fp, length, 1, "Error reading target file", &sums);
+    if (rc == ZZK_OK) rc = writer_memory_chunk(w, TYPE_SUMS, sums.value, sums.value_len);
+    free(sums.value);
+    return rc;
+}
+
+/*
+ * 写入内容已在内存中、CRC32 已知的块（append-dir 的工作者读入的小文件），
+ * 块 CRC 由 Type + Length 的 CRC 与 value_crc 合并得到，不再遍历内容。
+ */
+static int writer_known_chunk(struct zzk_writer *w, u32 type, const unsigned char *data, u64 length,
+                              u32 value_crc) {
+    unsigned char hdr[12];
+    unsigned hdr_len = encode_chunk_header(w->fmt, type, length, hdr);
+    u32 crc;
+    int rc;
+
+    if ((rc = writer_reserve(w, length)) != ZZK_OK) return rc;
+    crc = crc32_combine(crc32_update(0xFFFFFFFFUL, hdr, hdr_len) ^ 0xFFFFFFFFUL, value_crc, length);
+    if (write_all(w->fp, hdr, hdr_len, "Error writing chunk header") != 0 ||
+        write_all(w->fp, data, (size_t)length, "Error writing chunk value") != 0 ||
+        write_u32(w->fp, crc, "Error writing chunk CRC32") != 0) return ZZK_ERR_IO;
+    return writer_chunk_written(w, type, length, crc);
+}
+
+/*
+ * 一个文件记录的内容来源。fp 位于文件开头；data 非 NULL 时内容已全部读入，
+ * has_crc 时 value_crc 为内容的 CRC32，sums 为已算好的分块校验表（可为 NULL）。
+ */
+struct file_source {
+    FILE *fp;
+    u64 size;
+    const unsigned char *data;
+    int has_crc;
+    u32 value_crc;
+    struct block_sums *sums;
+    const struct file_stamp *stamp;
+};
+
+/*
+ * 写入一个文件记录：元数据块（文本）+ 二进制块（+ 可选的分块校验表）。
+ * 开启去重时按内容的 CRC32 查表，内容已在归档中则以引用块代替二进制块。
+ */
+static int writer_file_record(struct zzk_writer *w, const char *path, const char *description,
+                              struct file_source *src) {
+    struct writer_mark m;
+    struct dedup_entry dup;
+    u64 payload, meta_len, max = w->fmt->max_size, overhead = w->fmt->chunk_overhead;
+    char metadata[1024];
+    int rc = ZZK_OK, found = 0;
+
+    memset(&dup, 0, sizeof(dup));
+    if (DEDUP_WORTHWHILE(w, src->size)) {
+        if (!src->has_crc) rc = file_value_crc(src->fp, src->size, &src->value_crc);
+        src->has_crc = (rc == ZZK_OK);
+        if (rc == ZZK_OK) found = writer_find_duplicate(w, src->fp, src->size, src->value_crc, &dup);
+        if (found < 0) return found;
+    }
+    if (rc != ZZK_OK) return rc;
+
+    meta_len = build_file_metadata(metadata, sizeof(metadata), path, description, src->size, src->stamp);
+    payload = found ? REF_SIZE : src->size;
+
+    /* 溢出检查（写入前执行） */
+    if (meta_len > max - overhead ||
+        payload > max - overhead ||
+        (overhead + meta_len) > max - (overhead + payload) ||
+        w->pos > max - ((overhead + meta_len) + (overhead + payload))) {
+        return report_size_overflow(w->fmt);
+    }
+
+    writer_mark(w, &m);
+    rc = writer_memory_chunk(w, TYPE_TEXT, metadata, (size_t)meta_len);
+    if (rc == ZZK_OK) {
+        if (found) {
+            rc = writer_ref_chunk(w, &dup, src->value_crc);
+        } else if (writer_compresses(w, TYPE_BINARY, src->size)) {
+            rc = writer_lz_chunk(w, TYPE_BINARY, src->data, src->fp, src->size, "Error reading target file");
+        } else if (src->data && src->has_crc) {
+            rc = writer_known_chunk(w, TYPE_BINARY, src->data, src->size, src->value_crc);
+            if (rc == ZZK_OK && src->sums) {
+                rc = writer_memory_chunk(w, TYPE_SUMS, src->sums->value, src->sums->value_len);
+            }
+        } else {
+            rc = writer_binary_chunk(w, src->fp, src->size);
+        }
+    }
+    rc = writer_finish_record(w, &m, rc);
+    if (rc == ZZK_OK && found) {
+        w->dedup_stats.refs++;
+        w->dedup_stats.saved += src->size;
+        w->dedup_stats.last_target = dup.chunk;
+    }
+    return rc;
+}
+
+/* 追加一个文件，作为一条记录 */
+int zzk_writer_append_file(zzk_writer *w, const char *path, const char *description) {
+    struct file_source src;
+    int rc;
+
+    if ((rc = writer_usable(w)) != ZZK_OK || (rc = writer_checkpoint(w)) != ZZK_OK) return rc;
+    memset(&src, 0, sizeof(src));
+    src.fp = fopen(path, "rb");
+    if (!src.fp) return io_error("Error opening target file");
+
+    rc = get_file_size(src.fp, &src.size, "Error seeking/ftell target file");
+    if (rc == ZZK_OK && fseek(src.fp, 0, SEEK_SET) != 0) rc = io_error("Error seeking target file to start");
+    if (rc == ZZK_OK) rc = writer_file_record(w, path, description, &src);
+    fclose(src.fp);
+    return rc;
+}
+
+/*
+ * 把长度未知的输入（管道、FIFO）写成一组 STREAM 分片，每片至多 piece_size 字节。
+ * 内存占用固定为一个分片缓冲区；数据部分的 CRC 随读随算，
+ * 写块时再与 Type+Length+Flags 的 CRC 合并。每片是一条记录，由持久化策略决定何时提交。
+ */
+static int writer_stream_pieces(struct zzk_writer *w, FILE *in, u32 piece_size, u64 *total) {
+    unsigned char *buffer;
+    unsigned char hdr[16];
+    unsigned hdr_len;
+    size_t filled, got;
+    u32 data_crc, crc, flags;
+    int c, rc = ZZK_OK;
+
+    buffer = (unsigned char *)malloc((size_t)piece_size);
+    if (!buffer) return nomem();
+
+    *total = 0;
+    do {
+        if ((rc = zzk_writer_wait_input(w, in)) != ZZK_OK) break;
+        filled = 0;
+        data_crc = 0xFFFFFFFFUL;
+        while (filled < piece_size && (got = fread(buffer + filled, 1, piece_size - filled, in)) > 0) {
+            data_crc = crc32_update(data_crc, buffer + filled, got);
+            filled += got;
+        }
+        if (ferror(in)) {
+            rc = io_error("Error reading stream input");
+            break;
+        }
+
+        /* 预读一个字节判断是否为最后一片 */
+        flags = 0;
+        c = getc(in);
+        if (c == EOF) {
+            if (ferror(in)) {
+                rc = io_error("Error reading stream input");
+                break;
+            }
+            flags |= STREAM_FINAL;
+        } else {
+            ungetc(c, in);
+        }
+
+        if ((rc = writer_reserve(w, 4 + (u64)filled)) != ZZK_OK) break;
+        hdr_len = encode_chunk_header(w->fmt, TYPE_STREAM, 4 + (u64)filled, hdr);
+        u32_to_be(flags, hdr + hdr_len);
+        crc = crc32_update(0xFFFFFFFFUL, hdr, hdr_len + 4) ^ 0xFFFFFFFFUL;
+        crc = crc32_combine(crc, data_crc ^ 0xFFFFFFFFUL, (u64)filled);
+
+        if (write_all(w->fp, hdr, hdr_len + 4, "Error writing stream chunk header") != 0 ||
+            write_all(w->fp, buffer, filled, "Error writing stream chunk value") != 0 ||
+            write_u32(w->fp, crc, "Error writing stream chunk CRC32") != 0) {
+            rc = ZZK_ERR_IO;
+            break;
+        }
+        if ((rc = writer_chunk_written(w, TYPE_STREAM, 4 + (u64)filled, crc)) != ZZK_OK ||
+            (rc = writer_record_done(w)) != ZZK_OK) break;
+        *total += (u64)filled;
+    } while (!(flags & STREAM_FINAL));
+
+    free(buffer);
+    return rc;
+}
+
+/*
+ * 追加长度未知的输入：元数据块 + STREAM 分片。
+ * 失败时撤回整个流中尚未提交的部分；已按策略提交的分片留在归档中，
+ * 读取方将其视为没有最后一片的不完整流。
+ */
+int zzk_writer_append_stream(zzk_writer *w, const char *source, const char *description,
+                             FILE *in, zzk_u32 piece_size, zzk_u64 *total) {
+    struct writer_mark m;
+    char metadata[1024];
+    size_t used = 0;
+    u64 bytes = 0;
+    int rc;
+
+    if ((rc = writer_usable(w)) != ZZK_OK) return rc;
+    if (piece_size == 0) piece_size = (u32)STREAM_DEFAULT_PIECE;
+    if (piece_size > STREAM_MAX_PIECE) {
+        log_msg(ZZK_LOG_ERROR, "Error: Invalid piece size (1..%lu).\n", STREAM_MAX_PIECE);
+        return ZZK_ERR_ARG;
+    }
+
+    if ((rc = writer_checkpoint(w)) != ZZK_OK) return rc;
+    metadata[0] = '\0';
+    append_str(metadata, sizeof(metadata), &used, "Stream: ");
+    append_str(metadata, sizeof(metadata), &used, source);
+    append_str(metadata, sizeof(metadata), &used, "\nDescription: ");
+    if (append_str(metadata, sizeof(metadata), &used, description) != 0) {
+        log_msg(ZZK_LOG_WARNING, "Warning: metadata truncated to %lu bytes.\n",
+                (unsigned long)(sizeof(metadata) - 1));
+    }
+
+    writer_mark(w, &m);
+    rc = writer_memory_chunk(w, TYPE_TEXT, metadata, used);
+    if (rc == ZZK_OK) rc = writer_stream_pieces(w, in, piece_size, &bytes);
+    if (rc != ZZK_OK) {
+        writer_rollback(w, &m);
+        return rc;
+    }
+    if (total) *total = bytes;
+    return ZZK_OK;
+}
+
+int zzk_writer_commit(zzk_writer *w) {
+    int rc = writer_usable(w);
+    return rc != ZZK_OK ? rc : writer_flush_group(w);
+}
+
+/*
+ * 把 [terms_from, pos) 内的文本块补充进词项表，块编号接在 covered 之后。
+ * 在写入句柄上读取：先刷新写缓冲，结束后回到写入位置。
+ */
+static int writer_collect_terms(struct zzk_writer *w) {
+    struct zzk_reader reader;
+    struct chunk_table table = { NULL, 0, 0 };
+    long i;
+    int rc;
+
+    if (fflush(w->fp) != 0) return io_error("Error flushing archive");
+    reader_attach(&reader, w->fp, w->fmt, w->pos);
+    rc = scan_chunk_range(&reader, w->terms_from, w->pos, &table);
+    if (rc == ZZK_ERR_CORRUPT) {
+        log_msg(ZZK_LOG_ERROR, "Error: archive structure is damaged after chunk #%ld.\n",
+                (long)w->terms.covered + table.count);
+    }
+    for (i = 0; rc == ZZK_OK && i < table.count; i++) {
+        w->terms.current = w->terms.covered + (u32)i + 1;
+        rc = chunk_terms_status((long)w->terms.current,
+                                chunk_terms(&reader, &table.items[i], term_table_add, &w->terms));
+    }
+    if (rc == ZZK_OK) {
+        w->terms.covered += (u32)table.count;
+        w->terms_from = w->pos;
+    }
+    free(table.items);
+    if (seek_to(w->fp, w->pos) != 0) {
+        w->failed = 1;
+        rc = ZZK_ERR_IO;
+    }
+    return rc;
+}
+
+/* 补充并写入词项索引；无法更新时只提示（归档仍然有效，find 回退为扫描），写入失败才返回错误 */
+static int writer_write_terms(struct zzk_writer *w) {
+    u64 written = 0;
+    u32 crc = 0;
+    int rc = writer_collect_terms(w);
+
+    if (rc == ZZK_OK) rc = write_terms_chunk(w->fp, w->fmt, &w->terms, &written, &crc);
+    if (rc == ZZK_OK) {
+        if (w->has_index && chunk_table_push(&w->index, TYPE_TERMS, w->pos, written - w->fmt->chunk_overhead,
+                                             crc) != 0) return ZZK_ERR_NOMEM;
+        w->pos += written;
+        return ZZK_OK;
+    }
+    if (rc == ZZK_ERR_IO || w->failed) return ZZK_ERR_IO;
+    log_msg(ZZK_LOG_WARNING, "Warning: term index not updated.\n");
+    return ZZK_OK;
+}
+
+/* 重写词项索引与尾部索引（若有），只在有未提交数据时改写文件头 */
+static int writer_write_tail(struct zzk_writer *w) {
+    u64 written;
+
+    if (w->has_terms && writer_write_terms(w) != ZZK_OK) return ZZK_ERR_IO;
+    if (w->has_index) {
+        if (write_index_chunk(w->fp, w->fmt, &w->index, w->pos, &written) != 0) return ZZK_ERR_IO;
+        w->pos += written;
+    }
+    if (w->pos != w->committed_size) {
+        if (update_total_size(w->fp, w->fmt, &w->opt, w->pos - w->committed_size, w->committed_size) != 0) {
+            return ZZK_ERR_IO;
+        }
+        w->committed_size = w->pos;
+    }
+    return ZZK_OK;
+}
+
+/* 最终提交：按需补一个检查点，再重写索引并提交 */
+static int writer_final_commit(struct zzk_writer *w) {
+    int rc = writer_checkpoint(w);
+    return rc != ZZK_OK ? rc : writer_write_tail(w);
+}
+
+static int verify_table(struct zzk_reader *r, const struct chunk_table *table, long first, int nthreads,
+                        zzk_verify_fn fn, void *ctx, long *bad, int *used);
+
+/* 打开时摘除的索引与词项索引是否仍原样留在 [start_size, tail_size)：块边界吻合且 CRC32 全部一致 */
+static int writer_tail_intact(struct zzk_writer *w) {
+    struct zzk_reader reader;
+    struct chunk_table table = { NULL, 0, 0 };
+    long bad = 1;
+    int rc;
+
+    if (fflush(w->fp) != 0) return 0;
+    reader_attach(&reader, w->fp, w->fmt, w->tail_size);
+    rc = scan_chunk_range(&reader, w->start_size, w->tail_size, &table);
+    if (rc == ZZK_OK && table.count > 0 &&
+        table.items[table.count - 1].offset + w->fmt->chunk_overhead + table.items[table.count - 1].length ==
+        w->tail_size) {
+        rc = verify_table(&reader, &table, 1, 1, NULL, NULL, &bad, NULL);
+    }
+    free(table.items);
+    return rc == ZZK_OK && bad == 0;
+}
+
+/*
+ * 放弃时恢复打开时摘除的索引：没有提交过记录且旧索引未被覆盖时只改回原来的 TotalSize，
+ * 否则撤回未提交的记录，像 close 一样在已提交的末尾重写索引。失败的句柄不再写入。
+ */
+static void writer_restore_tail(struct zzk_writer *w) {
+    struct writer_mark m;
+
+    if (w->failed || w->tail_size == w->start_size) return;
+    if (w->committed_size == w->start_size && writer_tail_intact(w)) {
+        if (write_total_size(w->fp, w->fmt, w->tail_size) == 0) {
+            sync_data(w->fp, &w->opt, "Error flushing header update");
+        }
+        return;
+    }
+    m.pos = w->committed_size;
+    m.entries = w->committed_entries;
+    m.chunks = w->committed_chunks;
+    m.ckpt = w->committed_ckpt;
+    writer_rollback(w, &m);
+    if (!w->failed && writer_write_tail(w) != ZZK_OK) {
+        log_msg(ZZK_LOG_WARNING, "Warning: index not restored; run 'index' to rebuild it.\n");
+    }
+}
+
+int zzk_writer_close(zzk_writer *w) {
+    int rc = writer_usable(w);
+
+    if (rc == ZZK_OK) rc = writer_final_commit(w);
+    if (fclose(w->fp) != 0 && rc == ZZK_OK) rc = io_error("Error writing archive");
+    free(w->index.items);
+    free(w->dedup.items);
+    free(w->dedup.buckets);
+    term_table_free(&w->terms);
+    free(w->ring);
+    free(w);
+    return rc;
+}
+
+void zzk_writer_abort(zzk_writer *w) {
+    writer_restore_tail(w);
+    fclose(w->fp);
+    free(w->index.items);
+    free(w->dedup.items);
+    free(w->dedup.buckets);
+    term_table_free(&w->terms);
+    free(w->ring);
+    free(w);
+}
+
+void zzk_writer_dedup_stats(const zzk_writer *w, struct zzk_dedup_stats *out) {
+    *out = w->dedup_stats;
+}
+
+/* 首次调用时只读块头统计一遍（没有索引可用时），之后随追加与撤回维护 */
+int zzk_writer_chunk_count(zzk_writer *w, long *count) {
+    struct zzk_reader reader;
+    struct chunk_table table = { NULL, 0, 0 };
+    int rc;
+
+    if (w->chunks < 0) {
+        if ((rc = writer_usable(w)) != ZZK_OK) return rc;
+        if (fflush(w->fp) != 0) return io_error("Error flushing archive");
+        reader_attach(&reader, w->fp, w->fmt, w->pos);
+        rc = scan_chunk_headers(&reader, w->pos, &table);
+        free(table.items);
+        if (rc == ZZK_ERR_CORRUPT) {
+            log_msg(ZZK_LOG_ERROR, "Error: archive structure is damaged after chunk #%ld.\n", table.count);
+        }
+        if (seek_to(w->fp, w->pos) != 0) w->failed = 1;
+        if (rc != ZZK_OK) return rc;
+        if (w->failed) return ZZK_ERR_IO;
+        w->chunks = table.count;
+        /* 只有 pos 与已提交末尾重合时，这次统计同时也是已提交部分的块数 */
+        w->committed_chunks = (w->pos == w->committed_size) ? w->chunks : -1;
+    }
+    *count = w->chunks;
+    return ZZK_OK;
+}
+
+/* ========== 批量文件追加 ========== */
+
+/*
+ * append-dir 的写入路径：文件按 FILES_BATCH 个一批，在任务池上打开、取大小与修改时间并计算内容的 CRC32
+ * （元数据中的 Hash），不超过 FILES_INLINE_MAX 的文件同时整个读入内存（开启 block_crc 时一并算好分块校验表）；
+ * 调用线程随后按原顺序逐个写出记录，读入内存的内容直接写出，块 CRC 由 Hash 合并得到，
+ * 更大的文件写入时再读一遍。多线程构建中下一批的读取与本批的写出同时进行，内存中至多两批。
+ * 增量模式先扫描一遍块头，读取每个 元数据块 + 二进制 / 引用 / 压缩块 记录中带 Hash 的元数据，
+ * 以 Filename 为键保留最近的一条；大小、修改时间与 Hash 都相同的文件只读取、不写入。
+ */
+#define FILES_BATCH      64
+#define FILES_INLINE_MAX (256UL * 1024)
+#define FILES_META_MAX   4096
+
+/* 归档中一个文件最近一条带 Hash 的记录 */
+struct files_seen {
+    char *name;
+    long order;
+    u64 size;
+    struct file_stamp stamp;
+};
+
+struct files_seen_table {
+    struct files_seen *items;
+    long count;
+    long cap;
+};
+
+/* 工作者为一个文件准备的内容 */
+struct files_job {
+    FILE *fp;
+    unsigned char *data;      /* 不超过 FILES_INLINE_MAX 的文件整个读入 */
+    struct file_stamp stamp;
+    struct block_sums sums;
+    int has_sums;
+    int err;                  /* 打开或读取失败时的 errno */
+};
+
+/* 一批文件：items[start, start + n) 对应 jobs[0, n) */
+struct files_ctx {
+    struct zzk_file_item *items;
+    struct files_job *jobs;
+    const struct files_seen_table *seen;
+    u32 block_crc;
+    int nthreads;
+    long start;
+    long n;
+};
+
+static int compare_seen(const void *a, const void *b) {
+    const struct files_seen *x = (const struct files_seen *)a, *y = (const struct files_seen *)b;
+    int c = strcmp(x->name, y->name);
+    if (c != 0) return c;
+    return (x->order > y->order) - (x->order < y->order);
+}
+
+static int compare_seen_name(const void *a, const void *b) {
+    return strcmp(((const struct files_seen *)a)->name, ((const struct files_seen *)b)->name);
+}
+
+/* 解析元数据中的 Filename / Size / Modified / Hash 行（text 被就地切分）。缺少 Filename、Size 或 Hash 时返回 0 */
+static int files_parse_meta(char *text, struct files_seen *e) {
+    char *line = text, *next, *end;
+    int has_size = 0, has_hash = 0;
+
+    e->name = NULL;
+    e->stamp.has_mtime = 0;
+    for (; line; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        if (strncmp(line, "Filename: ", 10) == 0) {
+            e->name = line + 10;
+        } else if (strncmp(line, "Size: ", 6) == 0) {
+            e->size = 0;
+            for (end = line + 6; *end >= '0' && *end <= '9'; end++) e->size = e->size * 10 + (u64)(*end - '0');
+            has_size = end > line + 6 && strcmp(end, " bytes") == 0;
+        } else if (strncmp(line, "Modified: ", 10) == 0) {
+            e->stamp.mtime = strtol(line + 10, &end, 10);
+            e->stamp.has_mtime = end > line + 10 && *end == '\0';
+        } else if (strncmp(line, "Hash: crc32:", 12) == 0) {
+            e->stamp.hash = (u32)strtoul(line + 12, &end, 16);
+            has_hash = end == line + 20 && *end == '\0';
+        }
+    }
+    return e->name && has_size && has_hash;
+}
+
+static void files_seen_free(struct files_seen_table *seen) {
+    long i;
+
+    for (i = 0; i < seen->count; i++) free(seen->items[i].name);
+    free(seen->items);
+    seen->items = NULL;
+    seen->count = 0;
+    seen->cap = 0;
+}
+
+static int files_seen_add(struct files_seen_table *seen, const struct files_seen *e) {
+    struct files_seen *item;
+
+    if (seen->count == seen->cap) {
+        long cap = seen->cap ? seen->cap * 2 : 256;
+        struct files_seen *items = (struct files_seen *)realloc(seen->items, sizeof(*items) * (size_t)cap);
+        if (!items) return nomem();
+        seen->items = items;
+        seen->cap = cap;
+    }
+    item = &seen->items[seen->count];
+    *item = *e;
+    item->name = (char *)malloc(strlen(e->name) + 1);
+    if (!item->name) return nomem();
+    strcpy(item->name, e->name);
+    seen->count++;
+    return ZZK_OK;
+}
+
+/* 一遍块头扫描，收集归档中各文件最近一条带 Hash 的记录，按文件名排序 */
+static int files_load_seen(struct zzk_writer *w, struct files_seen_table *seen) {
+    struct zzk_reader reader;
+    struct chunk_table table = { NULL, 0, 0 };
+    struct files_seen e;
+    unsigned char buf[FILES_META_MAX];
+    char text[FILES_META_MAX + 1];
+    const unsigned char *p;
+    long i, kept;
+    int rc;
+
+    if (fflush(w->fp) != 0) return io_error("Error flushing archive");
+    reader_attach(&reader, w->fp, w->fmt, w->pos);
+    rc = scan_chunk_headers(&reader, w->pos, &table);
+    if (rc == ZZK_ERR_CORRUPT) {
+        log_msg(ZZK_LOG_ERROR, "Error: archive structure is damaged after chunk #%ld.\n", table.count);
+    }
+    for (i = 0; rc == ZZK_OK && i + 1 < table.count; i++) {
+        const struct chunk_entry *c = &table.items[i];
+        u32 next = table.items[i + 1].type;
+
+        if (c->type != TYPE_TEXT || c->length > FILES_META_MAX ||
+            (next != TYPE_BINARY && next != TYPE_REF && next != TYPE_LZ)) continue;
+        p = reader_get(&reader, c->offset + w->fmt->chunk_header, (size_t)c->length, buf);
+        if (!p) {
+            rc = io_error("Error reading archive");
+            break;
+        }
+        memcpy(text, p, (size_t)c->length);
+        text[c->length] = '\0';
+        if (!files_parse_meta(text, &e)) continue;
+        e.order = i;
+        rc = files_seen_add(seen, &e);
+    }
+    free(table.items);
+    if (seek_to(w->fp, w->pos) != 0) w->failed = 1;
+    if (rc == ZZK_OK && w->failed) rc = ZZK_ERR_IO;
+    if (rc != ZZK_OK) return rc;
+
+    /* 同名的记录只保留最后一条 */
+    qsort(seen->items, (size_t)seen->count, sizeof(*seen->items), compare_seen);
+    for (i = 0, kept = 0; i < seen->count; i++) {
+        if (i + 1 < seen->count && strcmp(seen->items[i].name, seen->items[i + 1].name) == 0) {
+            free(seen->items[i].name);
+            continue;
+        }
+        seen->items[kept++] = seen->items[i];
+    }
+    seen->count = kept;
+    return ZZK_OK;
+}
+
+static void files_release(struct files_ctx *x) {
+    long k;
+
+    for (k = 0; k < FILES_BATCH; k++) {
+        struct files_job *j = &x->jobs[k];
+        if (j->fp) fclose(j->fp);
+        free(j->data);
+        if (j->has_sums) free(j->sums.value);
+        j->fp = NULL;
+        j->data = NULL;
+        j->has_sums = 0;
+    }
+}
+
+/* 工作者：打开文件，取大小与修改时间，计算 Hash；小文件整个读入 */
+static void files_hash_job(void *ctx, int worker, long job) {
+    struct files_ctx *x = (struct files_ctx *)ctx;
+    struct zzk_file_item *item = &x->items[x->start + job];
+    struct files_job *j = &x->jobs[job];
+    struct files_seen key, *prev;
+    unsigned char buffer[65536], *p = buffer;
+    u64 remaining;
+    u32 crc = 0xFFFFFFFFUL;
+    size_t n;
+#ifdef ZZK1_POSIX
+    struct stat st;
+#else
+    long size;
+#endif
+
+    (void)worker;
+    item->status = ZZK_OK;
+    item->skipped = 0;
+    item->size = 0;
+    j->err = 0;
+    j->fp = fopen(item->path, "rb");
+    if (!j->fp) {
+        j->err = errno;
+        item->status = ZZK_ERR_IO;
+        return;
+    }
+#ifdef ZZK1_POSIX
+    if (fstat(fileno(j->fp), &st) != 0) {
+        j->err = errno;
+        item->status = ZZK_ERR_IO;
+        return;
+    }
+    item->size = (u64)st.st_size;
+    j->stamp.has_mtime = 1;
+    j->stamp.mtime = (long)st.st_mtime;
+#else
+    if (fseek(j->fp, 0, SEEK_END) != 0 || (size = ftell(j->fp)) < 0 || fseek(j->fp, 0, SEEK_SET) != 0) {
+        j->err = errno;
+        item->status = ZZK_ERR_IO;
+        return;
+    }
+    item->size = (u64)size;
+    j->stamp.has_mtime = 0;
+#endif
+
+    if (item->size <= FILES_INLINE_MAX) {
+        j->data = (unsigned char *)malloc((size_t)item->size + 1);
+        if (!j->data) {
+            item->status = ZZK_ERR_NOMEM;
+            return;
+        }
+        p = j->data;
+        if (x->block_crc && item->size > 0) {
+            if (sums_init(&j->sums, x->block_crc, item->size) != ZZK_OK) {
+                item->status = ZZK_ERR_NOMEM;
+                return;
+            }
+            j->has_sums = 1;
+        }
+    }
+    for (remaining = item->size; remaining > 0; remaining -= (u64)n) {
+        n = (p != buffer || remaining < sizeof(buffer)) ? (size_t)remaining : sizeof(buffer);
+        if (fread(p, 1, n, j->fp) != n) {
+            j->err = ferror(j->fp) ? errno : 0;
+            item->status = ferror(j->fp) ? ZZK_ERR_IO : ZZK_ERR_INPUT;
+            return;
+        }
+        crc = crc32_update(crc, p, n);
+        if (j->has_sums) sums_update(&j->sums, p, n);
+        if (p != buffer) p += n;
+    }
+    j->stamp.hash = crc ^ 0xFFFFFFFFUL;
+    if (j->has_sums) sums_finish(&j->sums, j->stamp.hash);
+    if (fseek(j->fp, 0, SEEK_SET) != 0) {
+        j->err = errno;
+        item->status = ZZK_ERR_IO;
+        return;
+    }
+
+    if (x->seen) {
+        key.name = (char *)item->path;
+        prev = (struct files_seen *)bsearch(&key, x->seen->items, (size_t)x->seen->count, sizeof(key),
+                                            compare_seen_name);
+        item->skipped = prev && prev->size == item->size && prev->stamp.hash == j->stamp.hash &&
+                        prev->stamp.has_mtime && j->stamp.has_mtime && prev->stamp.mtime == j->stamp.mtime;
+    }
+}
+
+static void files_hash_batch(struct files_ctx *x) {
+    if (x->n > 0) run_jobs(x->nthreads, x->n, files_hash_job, x);
+}
+
+#ifdef ZZK1_THREADS
+static void *files_hash_main(void *arg) {
+    files_hash_batch((struct files_ctx *)arg);
+    return NULL;
+}
+#endif
+
+/*
+ * 写出批内第 k 个文件。文件本身的问题（无法读取、读取后被截短）记入 item->status 并返回 ZZK_OK；
+ * 写入归档失败时返回错误码。
+ */
+static int files_write(struct zzk_writer *w, struct files_ctx *x, long k, const char *description,
+                       struct zzk_files_stats *stats) {
+    struct zzk_file_item *item = &x->items[x->start + k];
+    struct files_job *j = &x->jobs[k];
+    struct file_source src;
+    int rc;
+
+    if (item->status != ZZK_OK) {
+        log_msg(ZZK_LOG_WARNING, "Warning: skipping '%s': %s.\n", item->path,
+                j->err ? strerror(j->err) : zzk_strerror(item->status));
+        stats->failed++;
+        return ZZK_OK;
+    }
+    if (item->skipped) {
+        stats->skipped++;
+        return ZZK_OK;
+    }
+    if ((rc = writer_usable(w)) != ZZK_OK || (rc = writer_checkpoint(w)) != ZZK_OK) return rc;
+
+    src.fp = j->fp;
+    src.size = item->size;
+    src.data = j->data;
+    src.has_crc = 1;
+    src.value_crc = j->stamp.hash;
+    src.sums = j->has_sums ? &j->sums : NULL;
+    src.stamp = &j->stamp;
+    rc = writer_file_record(w, item->path, description, &src);
+    if (rc == ZZK_OK) {
+        stats->written++;
+        stats->bytes += item->size;
+        return ZZK_OK;
+    }
+    item->status = rc;
+    if (rc != ZZK_ERR_INPUT) return rc;
+    /* 文件在读取 Hash 之后被截短：这一条已撤回，继续下一个 */
+    log_msg(ZZK_LOG_WARNING, "Warning: skipping '%s': file changed while being archived.\n", item->path);
+    stats->failed++;
+    return ZZK_OK;
+}
+
+int zzk_writer_append_files(zzk_writer *w, struct zzk_file_item *items, long count, const char *description,
+                            int flags, int nthreads, struct zzk_files_stats *stats) {
+    struct zzk_files_stats local;
+    struct files_seen_table seen = { NULL, 0, 0 };
+    struct files_ctx x[2];
+    struct files_job *jobs;
+    long k;
+    int cur = 0, i, rc, hashing;
+#ifdef ZZK1_THREADS
+    pthread_t hasher;
+#endif
+
+    if (!stats) stats = &local;
+    memset(stats, 0, sizeof(*stats));
+    if (nthreads < 1) nthreads = 1;
+    if (count < 0 || (count > 0 && !items) || !description) return ZZK_ERR_ARG;
+    if ((rc = writer_usable(w)) != ZZK_OK) return rc;
+    if ((flags & ZZK_FILES_INCREMENTAL) && (rc = files_load_seen(w, &seen)) != ZZK_OK) {
+        files_seen_free(&seen);
+        return rc;
+    }
+    jobs = (struct files_job *)calloc(2 * FILES_BATCH, sizeof(*jobs));
+    if (!jobs) {
+        files_seen_free(&seen);
+        return nomem();
+    }
+    for (i = 0; i < 2; i++) {
+        x[i].items = items;
+        x[i].jobs = jobs + i * FILES_BATCH;
+        x[i].seen = (flags & ZZK_FILES_INCREMENTAL) ? &seen : NULL;
+        x[i].block_crc = w->opt.block_crc;
+        x[i].nthreads = nthreads;
+        x[i].start = 0;
+        x[i].n = 0;
+    }
+
+    x[0].n = count > FILES_BATCH ? FILES_BATCH : count;
+    files_hash_batch(&x[0]);
+    while (x[cur].n > 0) {
+        struct files_ctx *next = &x[1 - cur];
+
+        /* 下一批的读取与本批的写出同时进行 */
+        next->start = x[cur].start + x[cur].n;
+        next->n = (rc != ZZK_OK) ? 0 : (count - next->start > FILES_BATCH ? FILES_BATCH : count - next->start);
+        hashing = 0;
+#ifdef ZZK1_THREADS
+        if (next->n > 0) hashing = pthread_create(&hasher, NULL, files_hash_main, next) == 0;
+#endif
+        for (k = 0; rc == ZZK_OK && k < x[cur].n; k++) rc = files_write(w, &x[cur], k, description, stats);
+        files_release(&x[cur]);
+#ifdef ZZK1_THREADS
+        if (hashing) pthread_join(hasher, NULL);
+#endif
+        if (!hashing && rc == ZZK_OK) files_hash_batch(next);
+        if (rc != ZZK_OK) {
+            files_release(next);
+            next->n = 0;
+        }
+        cur = 1 - cur;
+    }
+    free(jobs);
+    files_seen_free(&seen);
+    return rc;
+}
+
+/* ========== 归档级操作 ========== */
+
+/* 创建归档，写入文件头和初始文本块 */
+int zzk_create(const char *path, int format, const char *text, size_t len, const struct zzk_options *opt) {
+    const struct zzk_format *fmt;
+    FILE *fp;
+    u64 total_size;
+    int rc;
+
+    zzk_init();
+    if (!opt) opt = &default_options;
+    if (format == ZZK_FORMAT_ZZK1) fmt = &FORMAT_ZZK1;
+    else if (format == ZZK_FORMAT_ZZK2) fmt = &FORMAT_ZZK2;
+    else return ZZK_ERR_ARG;
+
+    /* 防止误覆盖已有归档 */
+    fp = fopen(path, "rb");
+    if (fp) {
+        fclose(fp);
+        log_msg(ZZK_LOG_ERROR, "Error: file '%s' already exists. Delete it first or use append.\n", path);
+        return ZZK_ERR_EXISTS;
+    }
+
+    if ((u64)len > fmt->max_size - fmt->header_size - fmt->chunk_overhead) {
+        log_msg(ZZK_LOG_ERROR, "Error: text too large (overflow risk).\n");
+        return ZZK_ERR_OVERFLOW;
+    }
+    total_size = fmt->header_size + fmt->chunk_overhead + (u64)len;
+
+    fp = fopen(path, "wb");
+    if (!fp) return io_error("Error creating file");
+
+    rc = write_header(fp, fmt, total_size);
+    if (rc == ZZK_OK) rc = write_chunk(fp, fmt, TYPE_TEXT, text, len, NULL);
+    if (rc == ZZK_OK) rc = sync_data(fp, opt, "Error writing archive");
+    if (fclose(fp) != 0 && rc == ZZK_OK) rc = io_error("Error writing archive");
+    if (rc != ZZK_OK) {
+        remove(path);
+        return rc;
+    }
+    sync_parent_dir(path, opt);
+    return ZZK_OK;
+}
+
+/* 扫描全部块头，重建尾部索引块 */
+int zzk_rebuild_index(const char *path, const struct zzk_options *opt, long *chunks) {
+    struct zzk_writer *w;
+    struct zzk_reader reader;
+    int rc = zzk_writer_open(&w, path, opt);
+
+    if (rc != ZZK_OK) return rc;
+    w->index.count = 0;
+    reader_attach(&reader, w->fp, w->fmt, w->start_size);
+    rc = scan_chunk_headers(&reader, w->start_size, &w->index);
+    if (rc == ZZK_ERR_CORRUPT) {
+        log_msg(ZZK_LOG_ERROR, "Error: archive structure is damaged after chunk #%ld. Index not written.\n",
+                w->index.count);
+    }
+    if (rc == ZZK_OK && seek_to(w->fp, w->pos) != 0) rc = ZZK_ERR_IO;
+    if (rc != ZZK_OK) {
+        zzk_writer_abort(w);
+        return rc;
+    }
+    w->has_index = 1;
+    if (chunks) *chunks = w->index.count;
+    return zzk_writer_close(w);
+}
+
+/* 从头收录全部文本块，重建词项索引块 */
+int zzk_rebuild_terms(const char *path, const struct zzk_options *opt, long *terms) {
+    struct zzk_writer *w;
+    int rc = zzk_writer_open(&w, path, opt);
+
+    if (rc != ZZK_OK) return rc;
+    term_table_free(&w->terms);
+    w->has_terms = 1;
+    w->terms_from = w->fmt->header_size;
+    rc = writer_collect_terms(w);
+    if (rc != ZZK_OK) {
+        zzk_writer_abort(w);
+        return rc;
+    }
+    if (terms) *terms = w->terms.count;
+    return zzk_writer_close(w);
+}
+
+/*
+ * 恢复被截断或尾部受损的归档：找出有效区内最长的完好前缀，把 TotalSize 改写为其末尾。
+ * 有效区取 TotalSize 与实际文件大小中的较小者，TotalSize 之后未提交的数据不会被恢复。
+ * 从有效区末尾向回搜索最后一个完好的检查点，它之前的部分视为完好，只逐块校验其后的块；
+ * 没有检查点或指定 ZZK_RECOVER_FULL 时从头校验，并核对沿途每个检查点记录的块数与摘要。
+ * 完好前缀止于一条未写完的记录（元数据块之后缺少内容，或流缺少最后一片）时，退到该记录的元数据块之前。
+ */
+int zzk_recover(const char *path, const struct zzk_options *opt, int flags, struct zzk_recover_stats *stats) {
+    struct zzk_recover_stats st;
+    struct zzk_reader reader;
+    struct ckpt_state state, found, expect, rec_state;
+    const struct zzk_format *fmt;
+    unsigned char buf[40];
+    const unsigned char *p;
+    u64 pos, end, length, offset, rec_pos = 0;
+    u32 reserved, type, stored_crc, crc;
+    char num[24];
+    int rc, open = 0;
+    FILE *fp;
+
+    zzk_init();
+    if (!opt) opt = &default_options;
+    memset(&st, 0, sizeof(st));
+    fp = fopen(path, (flags & ZZK_RECOVER_DRY_RUN) ? "rb" : "rb+");
+    if (!fp) return io_error("Error opening file");
+    if (!(flags & ZZK_RECOVER_DRY_RUN)) lock_for_append(fp);
+
+    rc = read_header(fp, &fmt, &st.header_size, &reserved);
+    if (rc != 0) {
+        log_msg(ZZK_LOG_ERROR, rc == -1 ? "Invalid magic number.\n" : "Error reading size.\n");
+        fclose(fp);
+        return ZZK_ERR_FORMAT;
+    }
+    if (get_file_size(fp, &st.file_size, "Error seeking/ftell file") != 0) {
+        fclose(fp);
+        return ZZK_ERR_IO;
+    }
+    end = st.header_size < st.file_size ? st.header_size : st.file_size;
+    if (st.header_size < fmt->header_size) {
+        /* TotalSize 本身已损坏，只能以实际文件大小为界 */
+        log_msg(ZZK_LOG_WARNING, "Warning: invalid total size in header (%s); using the file size.\n",
+                u64_str(st.header_size, num));
+        end = st.file_size;
+    }
+
+    reader_attach(&reader, fp, fmt, end);
+#ifdef ZZK1_POSIX
+    reader_try_map(&reader);
+#endif
+    reader_advise(&reader, 0, end, READER_SEQUENTIAL);
+    ckpt_reset(&state);
+    pos = fmt->header_size;
+    rc = ZZK_OK;
+    if (!(flags & ZZK_RECOVER_FULL)) {
+        rc = ckpt_search(&reader, pos, end, &offset, &found, &st.searched);
+        if (rc == 1) {
+            state = found;
+            pos = offset + CKPT_SIZE(fmt);
+            st.checkpoint = 1;
+            st.checkpoint_offset = offset;
+            st.checkpoint_chunk = (long)found.chunks;
+        }
+    }
+    rec_state = state;
+
+    while (rc >= 0 && pos <= end && end - pos >= fmt->chunk_header) {
+        if (reader_chunk_header(&reader, pos, &type, &length) != 0 ||
+            reader_chunk_crc(&reader, pos, length, &stored_crc) != 0) break;
+        crc = 0xFFFFFFFFUL;
+        if (reader_crc_copy(&reader, pos, fmt->chunk_header + length, &crc, NULL) != 0) {
+            rc = ZZK_ERR_IO;
+            break;
+        }
+        if ((crc ^ 0xFFFFFFFFUL) != stored_crc) break;
+
+        expect = state;
+        ckpt_fold(&expect, stored_crc, 0);
+        if (type == TYPE_CHECKPOINT && length == CKPT_VALUE_SIZE &&
+            (p = reader_get(&reader, pos, CKPT_SIZE(fmt), buf)) != NULL && ckpt_parse(fmt, p, pos, &found) &&
+            (found.chunks != expect.chunks || found.digest != expect.digest)) {
+            log_msg(ZZK_LOG_WARNING, "Warning: checkpoint at chunk #%ld does not match the chunks before it.\n",
+                    (long)expect.chunks);
+            st.mismatched++;
+        }
+
+        /* 记录边界：文件 / 流的元数据块开始一条记录，内容块或流的最后一片结束它 */
+        if (type == TYPE_TEXT) {
+            p = length >= 8 ? reader_get(&reader, pos + fmt->chunk_header, length < 10 ? 8 : 10, buf) : NULL;
+            open = p && (memcmp(p, "Stream: ", 8) == 0 || (length >= 10 && memcmp(p, "Filename: ", 10) == 0));
+            rec_pos = pos;
+            rec_state = state;
+        } else if (type == TYPE_BINARY || type == TYPE_REF || type == TYPE_LZ) {
+            open = 0;
+        } else if (type == TYPE_STREAM && length >= 4 && (p = reader_get(&reader, pos + fmt->chunk_header, 4, buf)) &&
+                   (be_to_u32(p) & STREAM_FINAL)) {
+            open = 0;
+        }
+        state = expect;
+        st.verified += fmt->chunk_overhead + length;
+        st.verified_chunks++;
+        pos += fmt->chunk_overhead + length;
+    }
+    reader_close(&reader);
+
+    /* 截断点落在一条记录中间时退到该记录之前，不留下缺少内容的元数据块 */
+    if (rc >= 0 && open && pos != st.header_size) {
+        st.incomplete = (long)(state.chunks - rec_state.chunks);
+        pos = rec_pos;
+        state = rec_state;
+    }
+    st.chunks = (long)state.chunks;
+    st.valid_size = pos;
+
+    if (rc >= 0 && !(flags & ZZK_RECOVER_DRY_RUN) && pos != st.header_size) {
+        if (write_total_size(fp, fmt, pos) != 0 || sync_data(fp, opt, "Error flushing header update") != 0) {
+            rc = ZZK_ERR_IO;
+        } else {
+            st.repaired = 1;
+        }
+    }
+    if (fclose(fp) != 0 && rc >= 0) rc = io_error("Error writing archive");
+    if (stats) *stats = st;
+    return rc < 0 ? rc : ZZK_OK;
+}
+
+/*
+ * upgrade 复制一个块：Value 只读一遍，同时得到 Value 的 CRC，与新旧块头的 CRC 经 crc32_combine
+ * 分别合并，一个用于校验原块，一个写入新块（crc 返回新块的 CRC32）。
+ */
+static int upgrade_chunk(struct zzk_reader *r, u64 offset, u32 type, u64 length, FILE *fp_out,
+                         const struct zzk_format *dst, long chunk, u32 *crc) {
+    unsigned char hdr[12];
+    unsigned old_len, new_len;
+    u32 stored_crc, value_crc;
+    int rc;
+
+    new_len = encode_chunk_header(dst, type, length, hdr);
+    if (write_all(fp_out, hdr, new_len, "Error writing chunk header") != 0) return ZZK_ERR_IO;
+    value_crc = 0xFFFFFFFFUL;
+    rc = reader_crc_copy(r, offset + r->fmt->chunk_header, length, &value_crc, fp_out);
+    if (rc == -1) {
+        log_msg(ZZK_LOG_ERROR, "Error reading chunk #%ld. Upgrade aborted.\n", chunk);
+        return ZZK_ERR_CORRUPT;
+    }
+    if (rc != 0) return io_error("Error writing to output file");
+    value_crc ^= 0xFFFFFFFFUL;
+
+    /* 原块头 CRC 与 Value CRC 合并后校验原块 */
+    old_len = encode_chunk_header(r->fmt, type, length, hdr);
+    *crc = crc32_combine(crc32_update(0xFFFFFFFFUL, hdr, old_len) ^ 0xFFFFFFFFUL, value_crc, length);
+    if (reader_chunk_crc(r, offset, length, &stored_crc) != 0 || stored_crc != *crc) {
+        log_msg(ZZK_LOG_ERROR, "Error: CRC32 mismatch in chunk #%ld. Upgrade aborted.\n", chunk);
+        return ZZK_ERR_CRC;
+    }
+
+    encode_chunk_header(dst, type, length, hdr);
+    *crc = crc32_combine(crc32_update(0xFFFFFFFFUL, hdr, new_len) ^ 0xFFFFFFFFUL, value_crc, length);
+    return write_u32(fp_out, *crc, "Error writing chunk CRC32");
+}
+
+/*
+ * 把 ZZK1 归档转换为 ZZK2，逐块流式复制（见 upgrade_chunk），内存占用与归档大小无关。
+ * 块顺序与编号不变；尾部索引与检查点按 ZZK2 布局重新生成，中间已失效的旧索引块原样保留。
+ * 省略 output 时写入 <archive>.zzk2.tmp，完成后替换原归档；任何块校验失败都放弃转换。
+ */
+int zzk_upgrade(const char *path, const char *output, const struct zzk_options *opt,
+                long *chunks, zzk_u64 *size) {
+    struct zzk_reader reader;
+    struct chunk_table index = { NULL, 0, 0 };
+    struct ckpt_state state, found;
+    const struct zzk_format *dst = &FORMAT_ZZK2;
+    FILE *fp_out;
+    char *tmp_name = NULL;
+    const char *out_name = output;
+    unsigned char buf[40], value[CKPT_VALUE_SIZE];
+    const unsigned char *p;
+    u64 end, offset, length, out_pos, index_offset, written;
+    u32 type, crc;
+    long chunk_count = 0;
+    int has_index, rc;
+
+    zzk_init();
+    if (!opt) opt = &default_options;
+    if ((rc = reader_open(&reader, path)) != ZZK_OK) return rc;
+    if (reader.fmt == dst) {
+        log_msg(ZZK_LOG_ERROR, "Error: archive is already %s.\n", dst->name);
+        reader_close(&reader);
+        return ZZK_ERR_ARG;
+    }
+
+    if (!output) {
+        tmp_name = (char *)malloc(strlen(path) + sizeof(".zzk2.tmp"));
+        if (!tmp_name) {
+            reader_close(&reader);
+            return nomem();
+        }
+        strcpy(tmp_name, path);
+        strcat(tmp_name, ".zzk2.tmp");
+        out_name = tmp_name;
+    }
+    fp_out = fopen(out_name, "rb");
+    if (fp_out) {
+        fclose(fp_out);
+        log_msg(ZZK_LOG_ERROR, "Error: file '%s' already exists. Delete it first.\n", out_name);
+        reader_close(&reader);
+        free(tmp_name);
+        return ZZK_ERR_EXISTS;
+    }
+    fp_out = fopen(out_name, "wb");
+    if (!fp_out) {
+        rc = io_error("Error creating output file");
+        reader_close(&reader);
+        free(tmp_name);
+        return rc;
+    }
+
+    /* 有尾部索引时只复制索引之前的数据块，索引在最后重建 */
+    has_index = load_index(&reader, &index, &index_offset);
+    end = has_index == 1 ? index_offset : reader.total_size;
+    index.count = 0;
+    rc = has_index < 0 ? has_index : write_header(fp_out, dst, dst->header_size);
+    out_pos = dst->header_size;
+    offset = reader.fmt->header_size;
+    ckpt_reset(&state);
+    reader_advise(&reader, offset, end - offset, READER_SEQUENTIAL);
+
+    while (rc == ZZK_OK && end - offset >= reader.fmt->chunk_header) {
+        if (reader_chunk_header(&reader, offset, &type, &length) != 0 ||
+            end - offset < reader.fmt->chunk_overhead || length > end - offset - reader.fmt->chunk_overhead) {
+            log_msg(ZZK_LOG_ERROR, "Error: archive structure is damaged after chunk #%ld. Upgrade aborted.\n",
+                    chunk_count);
+            rc = ZZK_ERR_CORRUPT;
+            break;
+        }
+
+        /* 检查点记录的是块偏移与块 CRC 序列，按新布局重新生成 */
+        if (type == TYPE_CHECKPOINT && length == CKPT_VALUE_SIZE &&
+            (p = reader_get(&reader, offset, CKPT_SIZE(reader.fmt), buf)) != NULL &&
+            ckpt_parse(reader.fmt, p, offset, &found)) {
+            ckpt_encode(&state, out_pos, value);
+            rc = write_chunk(fp_out, dst, TYPE_CHECKPOINT, value, CKPT_VALUE_SIZE, &crc);
+        } else {
+            rc = upgrade_chunk(&reader, offset, type, length, fp_out, dst, chunk_count + 1, &crc);
+        }
+        if (rc != ZZK_OK || (rc = chunk_table_push(&index, type, out_pos, length, crc)) != ZZK_OK) break;
+        ckpt_fold(&state, crc, 0);
+
+        out_pos += dst->chunk_overhead + length;
+        offset += reader.fmt->chunk_overhead + length;
+        chunk_count++;
+    }
+    reader_close(&reader);
+
+    if (rc == ZZK_OK && has_index == 1) {
+        rc = write_index_chunk(fp_out, dst, &index, out_pos, &written);
+        if (rc == ZZK_OK) out_pos += written;
+    }
+    free(index.items);
+    if (rc == ZZK_OK) rc = update_total_size(fp_out, dst, opt, out_pos - dst->header_size, dst->header_size);
+#ifdef ZZK1_POSIX
+    if (rc == ZZK_OK && fsync(fileno(fp_out)) != 0) rc = io_error("Error syncing output file");
+#endif
+    if (fclose(fp_out) != 0 && rc == ZZK_OK) rc = io_error("Error writing output file");
+    if (rc != ZZK_OK) {
+        remove(out_name);
+        free(tmp_name);
+        return rc;
+    }
+
+    if (tmp_name) {
+        /* POSIX rename 原子替换；其他平台目标存在时 rename 会失败，先删除再改名 */
+        if (rename(tmp_name, path) != 0 && (remove(path) != 0 || rename(tmp_name, path) != 0)) {
+            rc = io_error("Error replacing archive");
+            free(tmp_name);
+            return rc;
+        }
+        sync_parent_dir(path, opt);
+        free(tmp_name);
+    }
+    if (chunks) *chunks = chunk_count;
+    if (size) *size = out_pos;
+    return ZZK_OK;
+}
+
+/* ========== 读取句柄 ========== */
+
+int zzk_reader_open(zzk_reader **out, const char *path) {
+    struct zzk_reader *r;
+    int rc;
+
+    zzk_init();
+    *out = NULL;
+    r = (struct zzk_reader *)malloc(sizeof(*r));
+    if (!r) return nomem();
+    r->path = (char *)malloc(strlen(path) + 1);
+    if (!r->path) {
+        free(r);
+        return nomem();
+    }
+    strcpy(r->path, path);
+    STATS_TIME(ZZK_PHASE_OPEN, rc = reader_open(r, path));
+    if (rc != ZZK_OK) {
+        free(r->path);
+        free(r);
+        return rc;
+    }
+    *out = r;
+    return ZZK_OK;
+}
+
+void zzk_reader_close(zzk_reader *r) {
+    reader_close(r);
+    free(r->path);
+    free(r);
+}
+
+int zzk_reader_format(const zzk_reader *r) {
+    return format_id(r->fmt);
+}
+
+zzk_u64 zzk_reader_size(const zzk_reader *r) {
+    return r->total_size;
+}
+
+int zzk_reader_mapped(const zzk_reader *r) {
+    return r->map != NULL;
+}
+
+static void fill_chunk(const struct zzk_reader *r, struct zzk_chunk *c, long index, u32 type, u64 offset,
+                       u64 length) {
+    c->index = index;
+    c->type = type;
+    c->offset = offset;
+    c->value_offset = offset + r->fmt->chunk_header;
+    c->length = length;
+}
+
+int zzk_reader_foreach(zzk_reader *r, zzk_chunk_fn fn, void *ctx) {
+    const struct zzk_format *fmt = r->fmt;
+    struct zzk_chunk chunk;
+    u64 offset = fmt->header_size, length;
+    u32 type;
+    long count = 0;
+    char num[24];
+    int rc;
+
+    reader_advise(r, offset, r->total_size - offset, READER_SEQUENTIAL);
+    /* 只在 total_size 声明的范围内遍历，不读取尾部垃圾 */
+    while (r->total_size - offset >= fmt->chunk_header) {
+        rc = reader_chunk_header(r, offset, &type, &length);
+        if (rc == -1) {
+            log_msg(ZZK_LOG_WARNING, "Warning: Unexpected EOF reading chunk header.\n");
+            return ZZK_ERR_CORRUPT;
+        }
+        if (rc == -2) {
+            log_msg(ZZK_LOG_WARNING, "Warning: chunk #%ld length (%s) exceeds remaining data. Stopping.\n",
+                    count + 1, u64_str(length, num));
+            return ZZK_ERR_CORRUPT;
+        }
+
+        fill_chunk(r, &chunk, ++count, type, offset, length);
+        rc = fn(ctx, r, &chunk);
+        if (rc != 0) return rc;
+        offset += fmt->chunk_overhead + length;
+    }
+    return ZZK_OK;
+}
+
+/*
+ * 借助尾部索引定位第 target 个块，成功时返回 1。
+ * 索引不存在、条目越界或与实际块头不符（过期）时返回 0，由调用方回退到线性扫描。
+ */
+static int index_seek_chunk(struct zzk_reader *r, u32 target, struct zzk_chunk *out) {
+    const struct zzk_format *fmt = r->fmt;
+    unsigned w = fmt->size_width, entry_size = INDEX_ENTRY_SIZE(fmt);
+    unsigned char buf[INDEX_ENTRY_MAX];
+    const unsigned char *p;
+    u64 index_offset, offset, length;
+    u32 count, type;
+
+    if (!locate_index(r, &index_offset, &count)) return 0;
+    if (target < 1 || target > count) return 0;
+
+    p = reader_get(r, index_offset + fmt->chunk_header + 4 + (u64)(target - 1) * entry_size, entry_size, buf);
+    if (!p || be_to_u32(p) != target) return 0;
+    offset = be_to_uint(p + 8, w);
+    type = be_to_u32(p + 4);
+    length = be_to_uint(p + 8 + w, w);
+    if (offset < fmt->header_size || offset > index_offset || index_offset - offset < fmt->chunk_overhead ||
+        length > index_offset - offset - fmt->chunk_overhead) return 0;
+
+    STATS_TIME(ZZK_PHASE_SCAN, p = reader_get(r, offset, fmt->chunk_header, buf));
+    STATS_COUNT(STATS_CHUNKS, 1);
+    if (!p || be_to_u32(p) != type || be_to_uint(p + 4, w) != length) return 0;
+
+    fill_chunk(r, out, (long)target, type, offset, length);
+    return 1;
+}
+
+int zzk_reader_find(zzk_reader *r, long index, struct zzk_chunk *out) {
+    u64 offset, length;
+    u32 type;
+    long current = 0;
+    int rc;
+
+    if (index < 1 || (unsigned long)index > 0xFFFFFFFFUL) return ZZK_ERR_ARG;
+
+    /* 有效的尾部索引可直接跳转到目标块 */
+    if (index_seek_chunk(r, (u32)index, out)) return ZZK_OK;
+
+    offset = r->fmt->header_size;
+    reader_advise(r, offset, r->total_size - offset, READER_SEQUENTIAL);
+    while (r->total_size - offset >= r->fmt->chunk_header) {
+        rc = reader_chunk_header(r, offset, &type, &length);
+        if (rc == -1) {
+            log_msg(ZZK_LOG_WARNING, "Warning: Unexpected EOF reading chunk header.\n");
+            break;
+        }
+        if (rc == -2) {
+            log_msg(ZZK_LOG_WARNING, "Warning: chunk length exceeds remaining data.\n");
+            break;
+        }
+        if (++current == index) {
+            fill_chunk(r, out, index, type, offset, length);
+            return ZZK_OK;
+        }
+        offset += r->fmt->chunk_overhead + length;
+    }
+    return ZZK_ERR_NOT_FOUND;
+}
+
+const void *zzk_reader_peek(zzk_reader *r, zzk_u64 offset, size_t len, void *buf) {
+    return reader_get(r, offset, len, (unsigned char *)buf);
+}
+
+int zzk_reader_stored_crc(zzk_reader *r, const struct zzk_chunk *c, zzk_u32 *crc) {
+    return reader_chunk_crc(r, c->offset, c->length, crc) == 0 ? ZZK_OK : ZZK_ERR_IO;
+}
+
+zzk_u32 zzk_reader_header_crc(const zzk_reader *r, const struct zzk_chunk *c) {
+    unsigned char hdr[12];
+    unsigned hdr_len = encode_chunk_header(r->fmt, c->type, c->length, hdr);
+    return crc32_update(0xFFFFFFFFUL, hdr, hdr_len);
+}
+
+/*
+ * 大于这么多字节的块按片处理，映射模式下每处理完一片就释放对应的页，驻留内存不随块增大。
+ * 小块一次算完，不发额外的 madvise：调用方已对整个范围给出顺序访问的提示。
+ */
+#define VALUE_SLICE_SIZE (8 * 1024 * 1024)
+
+int zzk_reader_value_crc(zzk_reader *r, const struct zzk_chunk *c, FILE *out, zzk_u32 *crc) {
+    u32 state = zzk_reader_header_crc(r, c);
+    u64 done = 0, step;
+    int rc = 0;
+
+    if (c->length <= VALUE_SLICE_SIZE) {
+        rc = reader_crc_copy(r, c->value_offset, c->length, &state, out);
+    }
+    while (rc == 0 && c->length > VALUE_SLICE_SIZE && done < c->length) {
+        step = c->length - done > VALUE_SLICE_SIZE ? VALUE_SLICE_SIZE : c->length - done;
+        rc = reader_crc_copy(r, c->value_offset + done, step, &state, out);
+        reader_advise(r, c->value_offset + done, step, READER_DONE);
+        done += step;
+    }
+    if (rc == -1) {
+        log_msg(ZZK_LOG_ERROR, "Error reading chunk data.\n");
+        return ZZK_ERR_IO;
+    }
+    if (rc != 0) return io_error("Error writing output");
+    *crc = state ^ 0xFFFFFFFFUL;
+    return ZZK_OK;
+}
+
+/*
+ * 从 STREAM 分片 c 开始，依次拼接后续分片直到带 FINAL 标记的一片，
+ * 输出为一个连续文件。每个分片独立校验 CRC32。
+ */
+static int extract_stream_group(struct zzk_reader *r, const struct zzk_chunk *c, FILE *out, int verify,
+                                struct zzk_extract_info *info) {
+    const struct zzk_format *fmt = r->fmt;
+    unsigned char hdr[16];
+    const unsigned char *p;
+    u64 offset = c->offset, length = c->length;
+    u32 type = TYPE_STREAM, flags, crc, stored_crc;
+
+    for (;;) {
+        if (type != TYPE_STREAM || length < 4) {
+            log_msg(ZZK_LOG_WARNING, "WARNING: stream is incomplete after %ld pieces (no final piece).\n",
+                    info->pieces);
+            return ZZK_ERR_CORRUPT;
+        }
+        reader_advise(r, offset, fmt->chunk_overhead + length, READER_WILLNEED);
+        p = reader_get(r, offset, fmt->chunk_header + 4, hdr);
+        if (!p) {
+            log_msg(ZZK_LOG_ERROR, "Error reading chunk data.\n");
+            return ZZK_ERR_IO;
+        }
+        flags = be_to_u32(p + fmt->chunk_header);
+        crc = crc32_update(0xFFFFFFFFUL, p, fmt->chunk_header + 4);
+        if (reader_crc_copy(r, offset + fmt->chunk_header + 4, length - 4, verify ? &crc : NULL, out) != 0) {
+            log_msg(ZZK_LOG_ERROR, "Error copying stream piece #%ld.\n", info->pieces + 1);
+            return ZZK_ERR_IO;
+        }
+        crc ^= 0xFFFFFFFFUL;
+        if (verify && (reader_chunk_crc(r, offset, length, &stored_crc) != 0 || stored_crc != crc)) {
+            log_msg(ZZK_LOG_WARNING,
+                    "WARNING: CRC32 MISMATCH in stream piece #%ld (Chunk #%ld). Data may be corrupted!\n",
+                    info->pieces + 1, c->index + info->pieces);
+            info->stored_crc = stored_crc;
+            info->computed_crc = crc;
+            return ZZK_ERR_CRC;
+        }
+        info->pieces++;
+        info->bytes += length - 4;
+
+        if (flags & STREAM_FINAL) break;
+        offset += fmt->chunk_overhead + length;
+        if (reader_chunk_header(r, offset, &type, &length) != 0) type = 0;
+    }
+    info->crc_checked = verify ? 1 : 0;
+    return ZZK_OK;
+}
+
+/* 读取压缩块的前缀，校验 BlockSize；prefix_crc 为块头与前缀的 CRC32 */
+static int lz_read_prefix(struct zzk_reader *r, const struct zzk_chunk *c, u32 *type, u64 *length, u64 *block_size,
+                          u32 *prefix_crc) {
+    unsigned char buf[LZ_PREFIX_SIZE];
+    const unsigned char *p = NULL;
+
+    if (c->length >= LZ_PREFIX_SIZE + 4) p = reader_get(r, c->value_offset, LZ_PREFIX_SIZE, buf);
+    if (p) {
+        *type = be_to_u32(p);
+        *length = be_to_uint(p + 4, 8);
+        *block_size = be_to_u32(p + 12);
+        *prefix_crc = crc32_update(zzk_reader_header_crc(r, c), p, LZ_PREFIX_SIZE) ^ 0xFFFFFFFFUL;
+        if (*block_size > 0 && *block_size <= LZ_MAX_BLOCK) return ZZK_OK;
+    }
+    log_msg(ZZK_LOG_ERROR, "Error: compressed chunk #%ld has an invalid header.\n", c->index);
+    return ZZK_ERR_CORRUPT;
+}
+
+int zzk_reader_lz_info(zzk_reader *r, const struct zzk_chunk *c, zzk_u32 *type, zzk_u64 *length) {
+    u64 block_size;
+    u32 prefix_crc;
+
+    if (c->type != TYPE_LZ) return ZZK_ERR_ARG;
+    return lz_read_prefix(r, c, type, length, &block_size, &prefix_crc);
+}
+
+/*
+ * 解压 LZ 块写到 out（格式见"LZ 压缩"）。顺序读取 lz_window 个块的 BlockLen 与数据，
+ * 在任务池上并行解码，再按顺序写出并合并各块的 CRC32；
+ * verify 时核对解压内容与 ContentCRC，以及块存储的 CRC32。
+ */
+static int extract_lz(struct zzk_reader *r, const struct zzk_chunk *c, FILE *out, int verify,
+                      struct zzk_extract_info *info) {
+    struct lz_ctx ctx;
+    struct lz_job *j;
+    unsigned char word[4];
+    const unsigned char *p;
+    unsigned char *raw = NULL, *packed = NULL;
+    u64 orig_len, block_size, done = 0, pos, end, window_start;
+    u32 type, block_len, value_crc, content_crc = 0, stored_crc;
+    long block = 0;
+    int nthreads = default_thread_count(), window, count = 0, i, rc;
+
+    if ((rc = lz_read_prefix(r, c, &type, &orig_len, &block_size, &value_crc)) != ZZK_OK) return rc;
+    pos = c->value_offset + LZ_PREFIX_SIZE;
+    end = c->value_offset + c->length - 4;
+
+    window = lz_window(nthreads, block_size);
+    ctx.verify = verify;
+    ctx.tables = NULL;
+    ctx.jobs = (struct lz_job *)malloc(sizeof(struct lz_job) * (size_t)window);
+    raw = (unsigned char *)malloc((size_t)window * (size_t)block_size);
+    if (!r->map) packed = (unsigned char *)malloc((size_t)window * (size_t)block_size);
+    if (!ctx.jobs || !raw || (!r->map && !packed)) {
+        lz_free(&ctx, 0, raw, packed);
+        return nomem();
+    }
+    reader_advise(r, c->offset, r->fmt->chunk_overhead + c->length, READER_SEQUENTIAL);
+
+    while (rc == ZZK_OK && done < orig_len) {
+        window_start = pos;
+        for (count = 0; rc == ZZK_OK && count < window && done < orig_len; count++) {
+            j = &ctx.jobs[count];
+            memset(j, 0, sizeof(*j));
+            j->raw_len = orig_len - done > block_size ? (size_t)block_size : (size_t)(orig_len - done);
+            j->raw_buf = raw + (size_t)count * (size_t)block_size;
+            p = end - pos >= 4 ? reader_get(r, pos, 4, word) : NULL;
+            if (!p) {
+                rc = ZZK_ERR_CORRUPT;
+                break;
+            }
+            block_len = be_to_u32(p);
+            j->stored_raw = (block_len & LZ_RAW) != 0;
+            j->packed_len = (size_t)(block_len & ~LZ_RAW);
+            pos += 4;
+            if ((u64)j->packed_len > end - pos || (u64)j->packed_len > block_size ||
+                (j->stored_raw && j->packed_len != j->raw_len)) {
+                rc = ZZK_ERR_CORRUPT;
+                break;
+            }
+            j->packed = reader_get(r, pos, j->packed_len, packed ? packed + (size_t)count * (size_t)block_size : NULL);
+            if (!j->packed) {
+                log_msg(ZZK_LOG_ERROR, "Error reading chunk data.\n");
+                rc = ZZK_ERR_IO;
+                break;
+            }
+            pos += (u64)j->packed_len;
+            done += (u64)j->raw_len;
+        }
+        if (rc != ZZK_OK) {
+            block += count;
+            break;
+        }
+
+        run_jobs(nthreads, count, lz_decompress_job, &ctx);
+        for (i = 0; i < count; i++, block++) {
+            j = &ctx.jobs[i];
+            if (j->failed) {
+                rc = ZZK_ERR_CORRUPT;
+                break;
+            }
+            if (out && fwrite(j->raw, 1, j->raw_len, out) != j->raw_len) {
+                rc = io_error("Error writing to output file");
+                break;
+            }
+            content_crc = crc32_combine(content_crc, j->raw_crc, j->raw_len);
+            if (verify) value_crc = crc32_combine(value_crc, j->packed_crc, j->packed_len + 4);
+        }
+        /* 这一窗的压缩数据已解码写出，映射内的页不再需要 */
+        reader_advise(r, window_start, pos - window_start, READER_DONE);
+    }
+    lz_free(&ctx, 0, raw, packed);
+    if (rc == ZZK_OK && pos != end) rc = ZZK_ERR_CORRUPT;
+    if (rc == ZZK_ERR_CORRUPT) {
+        log_msg(ZZK_LOG_ERROR, "Error: compressed chunk #%ld is damaged (block %ld).\n", c->index, block + 1);
+    }
+    if (rc != ZZK_OK) return rc;
+
+    info->pieces = 1;
+    info->bytes = orig_len;
+    if (!verify) return ZZK_OK;
+
+    p = reader_get(r, end, 4, word);
+    if (!p || reader_chunk_crc(r, c->offset, c->length, &stored_crc) != 0) {
+        log_msg(ZZK_LOG_WARNING, "Warning: could not read CRC32.\n");
+        info->crc_checked = -1;
+        return ZZK_OK;
+    }
+    value_crc = crc32_combine(value_crc, crc32_update(0xFFFFFFFFUL, p, 4) ^ 0xFFFFFFFFUL, 4);
+    info->crc_checked = 1;
+    info->stored_crc = be_to_u32(p);
+    info->computed_crc = content_crc;
+    if (info->stored_crc != content_crc) {
+        log_msg(ZZK_LOG_WARNING, "WARNING: CRC32 MISMATCH in decompressed content (stored: %08lX, computed: %08lX). "
+                "Data may be corrupted!\n", (unsigned long)info->stored_crc, (unsigned long)content_crc);
+        return ZZK_ERR_CRC;
+    }
+    if (stored_crc != value_crc) {
+        log_msg(ZZK_LOG_WARNING, "WARNING: CRC32 MISMATCH (stored: %08lX, computed: %08lX). Data may be corrupted!\n",
+                (unsigned long)stored_crc, (unsigned long)value_crc);
+        info->stored_crc = stored_crc;
+        info->computed_crc = value_crc;
+        return ZZK_ERR_CRC;
+    }
+    return ZZK_OK;
+}
+
+/*
+ * 定位引用块指向的 BINARY 块。verify 时同时校验引用块自身的 CRC32；
+ * 目标不存在、类型或长度不符、内容 CRC32 与引用记录不一致时返回 ZZK_ERR_CORRUPT。
+ * 目标内容的 CRC32 由块存储的 CRC32 核对，不读取内容。
+ */
+static int resolve_ref(struct zzk_reader *r, const struct zzk_chunk *c, const struct chunk_table *table, int verify,
+                       struct zzk_chunk *target) {
+    unsigned char buf[REF_SIZE];
+    const unsigned char *p = NULL;
+    u64 length;
+    u32 value_crc, crc, stored_crc;
+    long index;
+
+    if (c->length == REF_SIZE) p = reader_get(r, c->value_offset, REF_SIZE, buf);
+    if (!p) {
+        log_msg(ZZK_LOG_ERROR, "Error: invalid reference chunk #%ld.\n", c->index);
+        return ZZK_ERR_CORRUPT;
+    }
+    index = (long)be_to_u32(p);
+    length = be_to_uint(p + 4, 8);
+    value_crc = be_to_u32(p + 12);
+    if (verify) {
+        crc = crc32_update(zzk_reader_header_crc(r, c), p, REF_SIZE) ^ 0xFFFFFFFFUL;
+        if (reader_chunk_crc(r, c->offset, c->length, &stored_crc) != 0 || stored_crc != crc) {
+            log_msg(ZZK_LOG_WARNING, "WARNING: CRC32 MISMATCH in reference chunk #%ld. Data may be corrupted!\n",
+                    c->index);
+            return ZZK_ERR_CRC;
+        }
+    }
+
+    if (index >= 1 && table && index <= table->count) {
+        const struct chunk_entry *e = &table->items[index - 1];
+        fill_chunk(r, target, index, e->type, e->offset, e->length);
+    } else if (index < 1 || zzk_reader_find(r, index, target) != ZZK_OK) {
+        index = 0;
+    }
+    if (index < 1 || index >= c->index ||
+        target->type != TYPE_BINARY || target->length != length ||
+        reader_chunk_crc(r, target->offset, length, &stored_crc) != 0 ||
+        stored_crc != crc32_combine(zzk_reader_header_crc(r, target) ^ 0xFFFFFFFFUL, value_crc, length)) {
+        log_msg(ZZK_LOG_ERROR, "Error: reference chunk #%ld does not resolve (target chunk #%ld).\n",
+                c->index, index);
+        return ZZK_ERR_CORRUPT;
+    }
+    return ZZK_OK;
+}
+
+/* 读取块存储的 CRC32 与 crc（覆盖 Type + Length + Value 的中间状态）比较 */
+static int check_chunk_crc(struct zzk_reader *r, const struct zzk_chunk *c, u32 crc,
+                           struct zzk_extract_info *info) {
+    u32 stored_crc;
+
+    crc ^= 0xFFFFFFFFUL;
+    info->computed_crc = crc;
+    if (reader_chunk_crc(r, c->offset, c->length, &stored_crc) != 0) {
+        log_msg(ZZK_LOG_WARNING, "Warning: could not read CRC32.\n");
+        info->crc_checked = -1;
+        return ZZK_OK;
+    }
+    info->crc_checked = 1;
+    info->stored_crc = stored_crc;
+    if (stored_crc != crc) {
+        log_msg(ZZK_LOG_WARNING, "WARNING: CRC32 MISMATCH (stored: %08lX, computed: %08lX). Data may be corrupted!\n",
+                (unsigned long)stored_crc, (unsigned long)crc);
+        return ZZK_ERR_CRC;
+    }
+    return ZZK_OK;
+}
+
+static void extract_info_init(struct zzk_extract_info *info) {
+    info->pieces = 0;
+    info->bytes = 0;
+    info->crc_checked = 0;
+    info->stored_crc = 0;
+    info->computed_crc = 0;
+    info->blocks = 0;
+}
+
+/* table 非 NULL 时为已扫描的块表，引用块的目标直接从中取得 */
+static int extract_chunk(struct zzk_reader *r, const struct zzk_chunk *c, const struct chunk_table *table, FILE *out,
+                         int verify, struct zzk_extract_info *info) {
+    struct zzk_chunk target;
+    u32 crc;
+    int rc;
+
+    extract_info_init(info);
+    if (c->type == TYPE_STREAM) return extract_stream_group(r, c, out, verify, info);
+    if (c->type == TYPE_REF) {
+        /* 引用块透明地提取其目标内容 */
+        if ((rc = resolve_ref(r, c, table, verify, &target)) != ZZK_OK) return rc;
+        c = &target;
+    }
+    if (c->type == TYPE_LZ) return extract_lz(r, c, out, verify, info);
+
+    /* CRC 计算：包含 Type + Length */
+    crc = zzk_reader_header_crc(r, c);
+    reader_advise(r, c->offset, r->fmt->chunk_overhead + c->length, READER_WILLNEED);
+    rc = reader_crc_copy(r, c->value_offset, c->length, verify ? &crc : NULL, out);
+    if (rc != 0) {
+        if (rc == -1) {
+            log_msg(ZZK_LOG_ERROR, "Error reading chunk data.\n");
+            return ZZK_ERR_IO;
+        }
+        return io_error("Error writing to output file");
+    }
+    info->pieces = 1;
+    info->bytes = c->length;
+    return verify ? check_chunk_crc(r, c, crc, info) : ZZK_OK;
+}
+
+int zzk_reader_extract(zzk_reader *r, const struct zzk_chunk *c, FILE *out, int verify,
+                       struct zzk_extract_info *info) {
+    struct zzk_extract_info local;
+
+    return extract_chunk(r, c, NULL, out, verify, info ? info : &local);
+}
+
+/* 没有分块校验表时的字节范围：直接定位到范围写出；verify 时范围前后的数据只参与 CRC 计算 */
+static int extract_plain_range(struct zzk_reader *r, const struct zzk_chunk *c, u64 offset, u64 len, FILE *out,
+                               int verify, struct zzk_extract_info *info) {
+    u32 crc = zzk_reader_header_crc(r, c);
+    int rc = 0;
+
+    if (verify) {
+        reader_advise(r, c->offset, r->fmt->chunk_overhead + c->length, READER_WILLNEED);
+        rc = reader_crc_copy(r, c->value_offset, offset, &crc, NULL);
+    }
+    if (rc == 0) rc = reader_crc_copy(r, c->value_offset + offset, len, verify ? &crc : NULL, out);
+    if (rc == 0 && verify) {
+        rc = reader_crc_copy(r, c->value_offset + offset + len, c->length - offset - len, &crc, NULL);
+    }
+    if (rc != 0) {
+        if (rc == -1) {
+            log_msg(ZZK_LOG_ERROR, "Error reading chunk data.\n");
+            return ZZK_ERR_IO;
+        }
+        return io_error("Error writing to output file");
+    }
+    return verify ? check_chunk_crc(r, c, crc, info) : ZZK_OK;
+}
+
+/*
+ * 按分块校验表提取字节范围：只读取范围所在的段，每段先校验再写出，
+ * 不一致的段不会写到 out。
+ */
+static int extract_sums_range(struct zzk_reader *r, const struct zzk_chunk *c, const struct sums_ref *s,
+                              u64 offset, u64 len, FILE *out, struct zzk_extract_info *info) {
+    u64 first = offset / s->block_size, last = (offset + len - 1) / s->block_size, count, b, start;
+    unsigned char *buffer = NULL, *table = NULL;
+    const unsigned char *p, *sums;
+    size_t n, lo, hi;
+    u32 crc, expected;
+    char num[24];
+    int rc = ZZK_OK;
+
+    info->crc_checked = 1;
+    if (len == 0) return ZZK_OK;
+    count = last - first + 1;
+    if ((u64)(size_t)(4 * count) != 4 * count) return nomem();
+    if (!r->map) {
+        table = (unsigned char *)malloc((size_t)(4 * count));
+        buffer = (unsigned char *)malloc(s->block_size);
+        if (!table || !buffer) {
+            free(table);
+            free(buffer);
+            return nomem();
+        }
+    }
+    sums = reader_get(r, s->entries + 4 * first, (size_t)(4 * count), table);
+    if (!sums) {
+        log_msg(ZZK_LOG_ERROR, "Error reading block checksum table.\n");
+        rc = ZZK_ERR_IO;
+    }
+    reader_advise(r, c->value_offset + first * s->block_size, count * s->block_size, READER_WILLNEED);
+
+    for (b = first; rc == ZZK_OK && b <= last; b++) {
+        start = b * s->block_size;
+        n = c->length - start > s->block_size ? (size_t)s->block_size : (size_t)(c->length - start);
+        p = reader_get(r, c->value_offset + start, n, buffer);
+        if (!p) {
+            log_msg(ZZK_LOG_ERROR, "Error reading chunk data.\n");
+            rc = ZZK_ERR_IO;
+            break;
+        }
+        crc = crc32_update(0xFFFFFFFFUL, p, n) ^ 0xFFFFFFFFUL;
+        expected = be_to_u32(sums + 4 * (size_t)(b - first));
+        if (crc != expected) {
+            log_msg(ZZK_LOG_WARNING, "WARNING: CRC32 MISMATCH in block %s of Chunk #%ld (stored: %08lX, "
+                    "computed: %08lX). Data may be corrupted!\n", u64_str(b + 1, num), c->index,
+                    (unsigned long)expected, (unsigned long)crc);
+            info->stored_crc = expected;
+            info->computed_crc = crc;
+            rc = ZZK_ERR_CRC;
+            break;
+        }
+        lo = b == first ? (size_t)(offset - start) : 0;
+        hi = b == last ? (size_t)(offset + len - start) : n;
+        if (out && fwrite(p + lo, 1, hi - lo, out) != hi - lo) {
+            rc = io_error("Error writing to output file");
+            break;
+        }
+        info->blocks++;
+    }
+    free(table);
+    free(buffer);
+    return rc;
+}
+
+/*
+ * 压缩块的字节范围：沿 BlockLen 跳过范围之前的块，只解码与范围相交的块，到范围末尾为止。
+ * 压缩块没有按段的校验，verify 时对存储的字节做整块校验（其余的块只参与 CRC，不解码）。
+ */
+static int extract_lz_range(struct zzk_reader *r, const struct zzk_chunk *c, u64 orig_len, u64 block_size,
+                            u64 offset, u64 len, FILE *out, int verify, struct zzk_extract_info *info) {
+    unsigned char word[4];
+    const unsigned char *p, *data;
+    unsigned char *raw, *packed = NULL;
+    u64 pos = c->value_offset + LZ_PREFIX_SIZE, end = c->value_offset + c->length - 4, done = 0;
+    u32 block_len, crc;
+    size_t raw_len, packed_len, lo, hi;
+    long block = 0;
+    int rc = ZZK_OK;
+
+    raw = (unsigned char *)malloc((size_t)block_size);
+    if (!r->map) packed = (unsigned char *)malloc((size_t)block_size);
+    if (!raw || (!r->map && !packed)) {
+        free(raw);
+        free(packed);
+        return nomem();
+    }
+    for (; done < offset + len; block++) {
+        raw_len = orig_len - done > block_size ? (size_t)block_size : (size_t)(orig_len - done);
+        p = end - pos >= 4 ? reader_get(r, pos, 4, word) : NULL;
+        if (!p) {
+            rc = ZZK_ERR_CORRUPT;
+            break;
+        }
+        block_len = be_to_u32(p);
+        packed_len = (size_t)(block_len & ~LZ_RAW);
+        pos += 4;
+        if ((u64)packed_len > end - pos || (u64)packed_len > block_size ||
+            ((block_len & LZ_RAW) && packed_len != raw_len)) {
+            rc = ZZK_ERR_CORRUPT;
+            break;
+        }
+        if (done + raw_len > offset) {
+            data = reader_get(r, pos, packed_len, packed);
+            if (!data) {
+                log_msg(ZZK_LOG_ERROR, "Error reading chunk data.\n");
+                rc = ZZK_ERR_IO;
+                break;
+            }
+            if (!(block_len & LZ_RAW)) {
+                if (lz_decompress(data, packed_len, raw, raw_len) != 0) {
+                    rc = ZZK_ERR_CORRUPT;
+                    break;
+                }
+                data = raw;
+            }
+            lo = offset > done ? (size_t)(offset - done) : 0;
+            hi = offset + len - done < (u64)raw_len ? (size_t)(offset + len - done) : raw_len;
+            if (out && fwrite(data + lo, 1, hi - lo, out) != hi - lo) {
+                rc = io_error("Error writing to output file");
+                break;
+            }
+        }
+        pos += (u64)packed_len;
+        done += (u64)raw_len;
+    }
+    free(raw);
+    free(packed);
+    if (rc == ZZK_ERR_CORRUPT) {
+        log_msg(ZZK_LOG_ERROR, "Error: compressed chunk #%ld is damaged (block %ld).\n", c->index, block + 1);
+    }
+    if (rc != ZZK_OK || !verify) return rc;
+
+    crc = zzk_reader_header_crc(r, c);
+    if (reader_crc_copy(r, c->value_offset, c->length, &crc, NULL) != 0) {
+        log_msg(ZZK_LOG_ERROR, "Error reading chunk data.\n");
+        return ZZK_ERR_IO;
+    }
+    return check_chunk_crc(r, c, crc, info);
+}
+
+int zzk_reader_extract_range(zzk_reader *r, const struct zzk_chunk *c, zzk_u64 offset, zzk_u64 len, FILE *out,
+                             int verify, struct zzk_extract_info *info) {
+    struct zzk_extract_info local;
+    struct zzk_chunk target;
+    struct sums_ref sums;
+    u64 content = c->length, block_size = 0;
+    u32 type, prefix_crc;
+    char num[24];
+    int rc;
+
+    if (!info) info = &local;
+    extract_info_init(info);
+    if (c->type == TYPE_STREAM) {
+        log_msg(ZZK_LOG_ERROR, "Error: byte ranges are not supported for stream chunks.\n");
+        return ZZK_ERR_UNSUPPORTED;
+    }
+    if (c->type == TYPE_REF) {
+        if ((rc = resolve_ref(r, c, NULL, verify, &target)) != ZZK_OK) return rc;
+        c = &target;
+        content = c->length;
+    }
+    if (c->type == TYPE_LZ && (rc = lz_read_prefix(r, c, &type, &content, &block_size, &prefix_crc)) != ZZK_OK) {
+        return rc;
+    }
+    if (offset > content || len > content - offset) {
+        log_msg(ZZK_LOG_ERROR, "Error: range exceeds chunk content (%s bytes).\n", u64_str(content, num));
+        return ZZK_ERR_ARG;
+    }
+    info->pieces = 1;
+    info->bytes = len;
+    /* 空范围：块头（压缩块的前缀、引用块的目标）已核对，不读取 Value，也不做 CRC 校验 */
+    if (len == 0) return ZZK_OK;
+
+    if (c->type == TYPE_LZ) return extract_lz_range(r, c, content, block_size, offset, len, out, verify, info);
+    if (verify && find_block_sums(r, c, &sums)) return extract_sums_range(r, c, &sums, offset, len, out, info);
+    return extract_plain_range(r, c, offset, len, out, verify, info);
+}
+
+/*
+ * verify 的任务划分：Type + Length + Value 不超过 VERIFY_SEGMENT_SIZE 的块按顺序合成约 VERIFY_BATCH_SIZE
+ * 字节的一组，组内逐块从块头算起直接得到整块 CRC；更大的块拆成多段并行计算，再用 crc32_combine 合并。
+ */
+#define VERIFY_SEGMENT_SIZE (16UL * 1024 * 1024)
+#define VERIFY_BATCH_SIZE   (1024UL * 1024)
+#define VERIFY_BUFFER_SIZE  (256 * 1024)
+
+struct verify_job {
+    long first;  /* 组任务：覆盖块表 [first, first + count)；分段任务：所属块，count 为 0 */
+    long count;
+    long done;   /* 组任务中已算完的块数，其余块读取失败 */
+    u64 offset;  /* 分段任务：本段在文件中的绝对偏移（首段从块头开始） */
+    u64 length;
+    u32 crc;     /* 分段任务：本段的最终 CRC */
+    int failed;
+};
+
+/* stdio 模式下每个工作者独立的文件句柄与缓冲区（映射模式下各工作者直接访问映射） */
+struct worker_files {
+    FILE **files;
+    unsigned char **buffers;
+};
+
+struct verify_ctx {
+    struct verify_job *jobs;
+    struct zzk_reader *reader;
+    const struct chunk_table *table;
+    u32 *crcs;   /* 组任务算出的各块 CRC，按块表下标 */
+    struct worker_files io;
+};
+
+/* 经 fp 读 length 字节并累加 CRC，返回 0 成功、-1 读取失败 */
+static int verify_read_crc(FILE *fp, unsigned char *buffer, u64 length, u32 *crc) {
+    size_t to_read, got;
+
+    while (length > 0) {
+        to_read = (length > VERIFY_BUFFER_SIZE) ? VERIFY_BUFFER_SIZE : (size_t)length;
+        STATS_TIME(ZZK_PHASE_READ, got = fread(buffer, 1, to_read, fp));
+        STATS_COUNT(STATS_BYTES_READ, got);
+        if (got != to_read) return -1;
+        STATS_TIME(ZZK_PHASE_CRC, *crc = crc32_update(*crc, buffer, to_read));
+        length -= (u64)to_read;
+    }
+    return 0;
+}
+
+/* 映射模式下逐块计算一组小块的 CRC */
+static void verify_batch_map(struct verify_ctx *ctx, struct verify_job *job) {
+    const struct chunk_entry *e = &ctx->table->items[job->first];
+    unsigned header = ctx->reader->fmt->chunk_header;
+    long i;
+
+    for (i = 0; i < job->count; i++, e++) {
+        ctx->crcs[job->first + i] =
+            crc32_update(0xFFFFFFFFUL, ctx->reader->map + (size_t)e->offset, (size_t)(header + e->length)) ^
+            0xFFFFFFFFUL;
+    }
+    job->done = job->count;
+}
+
+/* stdio 模式下顺序读一组小块；块间的 CRC 尾等短间隙直接读过，不必 seek */
+static void verify_batch_stdio(struct verify_ctx *ctx, struct verify_job *job, FILE *fp, unsigned char *buffer) {
+    const struct chunk_entry *e = &ctx->table->items[job->first];
+    unsigned header = ctx->reader->fmt->chunk_header;
+    u64 pos = 0;
+    u32 crc;
+    size_t gap, got;
+    long i;
+
+    for (i = 0; i < job->count; i++, e++) {
+        if (i > 0 && e->offset >= pos && e->offset - pos <= VERIFY_BUFFER_SIZE) {
+            gap = (size_t)(e->offset - pos);
+            STATS_TIME(ZZK_PHASE_READ, got = fread(buffer, 1, gap, fp));
+            STATS_COUNT(STATS_BYTES_READ, got);
+            if (got != gap) return;
+        } else if (seek_to(fp, e->offset) != 0) {
+            return;
+        }
+        crc = 0xFFFFFFFFUL;
+        if (verify_read_crc(fp, buffer, header + e->length, &crc) != 0) return;
+        ctx->crcs[job->first + i] = crc ^ 0xFFFFFFFFUL;
+        pos = e->offset + header + e->length;
+        job->done++;
+    }
+}
+
+static void verify_segment(void *arg, int worker, long job_index) {
+    struct verify_ctx *ctx = (struct verify_ctx *)arg;
+    struct verify_job *job = &ctx->jobs[job_index];
+    FILE *fp = ctx->io.files ? ctx->io.files[worker] : NULL;
+    unsigned char *buffer = ctx->io.buffers ? ctx->io.buffers[worker] : NULL;
+    u32 crc = 0xFFFFFFFFUL;
+
+    if (job->count > 0) {
+        const struct chunk_entry *last = &ctx->table->items[job->first + job->count - 1];
+        u64 start = ctx->table->items[job->first].offset;
+        u64 end = last->offset + ctx->reader->fmt->chunk_header + last->length;
+        if (!ctx->reader->map) {
+            verify_batch_stdio(ctx, job, fp, buffer);
+            return;
+        }
+        if (end > start) {
+            reader_advise(ctx->reader, start, end - start, READER_WILLNEED);
+            STATS_COUNT(STATS_BYTES_READ, end - start);
+        }
+        STATS_TIME(ZZK_PHASE_CRC, verify_batch_map(ctx, job));
+        return;
+    }
+
+    if (ctx->reader->map) {
+        reader_advise(ctx->reader, job->offset, job->length, READER_WILLNEED);
+        STATS_TIME(ZZK_PHASE_CRC, crc = crc32_update(crc, ctx->reader->map + (size_t)job->offset, (size_t)job->length));
+        STATS_COUNT(STATS_BYTES_READ, job->length);
+        job->crc = crc ^ 0xFFFFFFFFUL;
+        return;
+    }
+
+    if (seek_to(fp, job->offset) != 0 || verify_read_crc(fp, buffer, job->length, &crc) != 0) {
+        job->failed = 1;
+        return;
+    }
+    job->crc = crc ^ 0xFFFFFFFFUL;
+}
+
+/* 为每个工作者打开独立的文件句柄并分配 buffer_size 字节的缓冲区，全部成功返回 ZZK_OK */
+static int workers_open(struct worker_files *io, const char *path, int nthreads, size_t buffer_size) {
+    int i;
+
+    io->files = (FILE **)calloc((size_t)nthreads, sizeof(FILE *));
+    io->buffers = (unsigned char **)calloc((size_t)nthreads, sizeof(unsigned char *));
+    if (!io->files || !io->buffers) return nomem();
+    for (i = 0; i < nthreads; i++) {
+        io->files[i] = fopen(path, "rb");
+        if (!io->files[i]) return io_error("Error opening file");
+        io->buffers[i] = (unsigned char *)malloc(buffer_size);
+        if (!io->buffers[i]) return nomem();
+    }
+    return ZZK_OK;
+}
+
+static void workers_close(struct worker_files *io, int nthreads) {
+    int i;
+
+    for (i = 0; io->files && i < nthreads; i++) {
+        if (io->files[i]) fclose(io->files[i]);
+    }
+    for (i = 0; io->buffers && i < nthreads; i++) free(io->buffers[i]);
+    free(io->files);
+    free(io->buffers);
+    io->files = NULL;
+    io->buffers = NULL;
+}
+
+/* 每个块对应的任务区间：njobs 为 0 时 first_job 是它所在的组任务 */
+struct verify_range {
+    long first_job;
+    long njobs;
+};
+
+static int verify_push_job(struct verify_job **jobs, long *njobs, long *cap, long first, long count, u64 offset,
+                           u64 length) {
+    struct verify_job *j;
+
+    if (*njobs == *cap) {
+        long n = *cap ? *cap * 2 : 64;
+        j = (struct verify_job *)realloc(*jobs, sizeof(**jobs) * (size_t)n);
+        if (!j) return nomem();
+        *jobs = j;
+        *cap = n;
+    }
+    j = &(*jobs)[(*njobs)++];
+    memset(j, 0, sizeof(*j));
+    j->first = first;
+    j->count = count;
+    j->offset = offset;
+    j->length = length;
+    return ZZK_OK;
+}
+
+/* 相邻的小块合成约 VERIFY_BATCH_SIZE 字节的组任务，大块从块头起切成至多 VERIFY_SEGMENT_SIZE 的分段任务 */
+static int verify_plan(const struct zzk_format *fmt, const struct chunk_table *table,
+                       struct verify_range *ranges, struct verify_job **jobs_out, long *njobs_out) {
+    struct verify_job *jobs = NULL;
+    long njobs = 0, jobs_cap = 0, open = -1, i;
+    u64 open_bytes = 0;
+    int rc = ZZK_OK;
+
+    for (i = 0; rc == ZZK_OK && i < table->count; i++) {
+        const struct chunk_entry *e = &table->items[i];
+        u64 seg_off = e->offset, remaining = fmt->chunk_header + e->length;
+
+        ranges[i].njobs = 0;
+        if (remaining <= VERIFY_SEGMENT_SIZE) {
+            if (open >= 0 && open_bytes + remaining <= VERIFY_BATCH_SIZE) {
+                jobs[open].count++;
+                open_bytes += remaining;
+            } else if ((rc = verify_push_job(&jobs, &njobs, &jobs_cap, i, 1, 0, 0)) == ZZK_OK) {
+                open = njobs - 1;
+                open_bytes = remaining;
+            }
+            ranges[i].first_job = open;
+            continue;
+        }
+        open = -1;
+        ranges[i].first_job = njobs;
+        while (rc == ZZK_OK && remaining > 0) {
+            u64 seg_len = (remaining > VERIFY_SEGMENT_SIZE) ? (u64)VERIFY_SEGMENT_SIZE : remaining;
+            rc = verify_push_job(&jobs, &njobs, &jobs_cap, i, 0, seg_off, seg_len);
+            ranges[i].njobs++;
+            seg_off += seg_len;
+            remaining -= seg_len;
+        }
+    }
+    if (rc != ZZK_OK) {
+        free(jobs);
+        return rc;
+    }
+    *jobs_out = jobs;
+    *njobs_out = njobs;
+    return ZZK_OK;
+}
+
+/* 在任务池上计算各组与各段 CRC：映射模式直接在映射上算，stdio 模式每个工作者独立打开文件 */
+static int verify_run(struct zzk_reader *r, const struct chunk_table *table, struct verify_job *jobs, long njobs,
+                      u32 *crcs, int nthreads, int *used) {
+    struct verify_ctx ctx;
+    int rc = ZZK_OK;
+
+    ctx.jobs = jobs;
+    ctx.reader = r;
+    ctx.table = table;
+    ctx.crcs = crcs;
+    ctx.io.files = NULL;
+    ctx.io.buffers = NULL;
+    if (r->map) {
+        *used = run_jobs(nthreads, njobs, verify_segment, &ctx);
+        return ZZK_OK;
+    }
+    rc = workers_open(&ctx.io, r->path, nthreads, VERIFY_BUFFER_SIZE);
+    if (rc == ZZK_OK) *used = run_jobs(nthreads, njobs, verify_segment, &ctx);
+    workers_close(&ctx.io, nthreads);
+    return rc;
+}
+
+/*
+ * 在任务池上并行校验块表中每个块的 CRC32，再按块顺序对每个块调用 fn（first 为第一个块的编号）。
+ * 小块在组任务中直接得到整块 CRC；大块各段 CRC 经 crc32_combine 拼接。
+ * bad 返回不一致或读取失败的块数；used（可为 NULL）返回实际使用的工作者数。
+ */
+static int verify_table(struct zzk_reader *r, const struct chunk_table *table, long first, int nthreads,
+                        zzk_verify_fn fn, void *ctx, long *bad, int *used) {
+    struct verify_range *ranges;
+    struct verify_job *jobs = NULL;
+    u32 *crcs;
+    long njobs = 0, i, j;
+    int rc, workers = 1;
+
+    *bad = 0;
+    ranges = (struct verify_range *)malloc(sizeof(*ranges) * (size_t)(table->count ? table->count : 1));
+    crcs = (u32 *)malloc(sizeof(*crcs) * (size_t)(table->count ? table->count : 1));
+    rc = ranges && crcs ? verify_plan(r->fmt, table, ranges, &jobs, &njobs) : nomem();
+
+    /* 并行计算各组与各段 CRC */
+    if (rc == ZZK_OK && njobs > 0) rc = verify_run(r, table, jobs, njobs, crcs, nthreads, &workers);
+
+    /* 汇总：大块的各段 CRC 依次拼接 */
+    for (i = 0; rc == ZZK_OK && i < table->count; i++) {
+        const struct chunk_entry *e = &table->items[i];
+        const struct verify_job *job = &jobs[ranges[i].first_job];
+        struct zzk_verify_item item;
+        u32 crc = 0;
+        int read_failed = 0;
+
+        if (ranges[i].njobs == 0) {
+            if (i < job->first + job->done) crc = crcs[i];
+            else read_failed = 1;
+        }
+        for (j = ranges[i].first_job; j < ranges[i].first_job + ranges[i].njobs; j++) {
+            if (jobs[j].failed) read_failed = 1;
+            crc = j == ranges[i].first_job ? jobs[j].crc : crc32_combine(crc, jobs[j].crc, jobs[j].length);
+        }
+
+        fill_chunk(r, &item.chunk, first + i, e->type, e->offset, e->length);
+        item.stored_crc = e->crc;
+        item.computed_crc = crc;
+        if (read_failed) item.status = ZZK_ERR_IO;
+        else if (crc != e->crc) item.status = ZZK_ERR_CRC;
+        else item.status = ZZK_OK;
+        if (item.status != ZZK_OK) (*bad)++;
+        if (fn) fn(ctx, &item);
+    }
+    free(ranges);
+    free(crcs);
+    free(jobs);
+    if (used) *used = workers;
+    return rc;
+}
+
+/* 一次遍历收集所有块头，再在任务池上并行校验每个块的 CRC32 */
+int zzk_reader_verify(zzk_reader *r, int nthreads, zzk_verify_fn fn, void *ctx, long *chunks, int *threads) {
+    const struct zzk_format *fmt = r->fmt;
+    struct chunk_table table = { NULL, 0, 0 };
+    long bad_count = 0;
+    int structural_error = 0, rc;
+
+    if (nthreads < 1) nthreads = 1;
+    if (chunks) *chunks = 0;
+    if (threads) *threads = 1;
+
+    /* 第一遍：只读块头与存储的 CRC，建立分段任务表 */
+    reader_advise(r, fmt->header_size, r->total_size - fmt->header_size, READER_SEQUENTIAL);
+    rc = scan_chunk_headers(r, r->total_size, &table);
+    if (rc == ZZK_ERR_CORRUPT) {
+        structural_error = 1;
+        rc = ZZK_OK;
+    }
+    /* 第二遍：并行计算各段 CRC */
+    if (rc == ZZK_OK) rc = verify_table(r, &table, 1, nthreads, fn, ctx, &bad_count, threads);
+    if (rc == ZZK_OK) {
+        if (chunks) *chunks = table.count;
+        if (structural_error) rc = ZZK_ERR_CORRUPT;
+        else if (bad_count) rc = ZZK_ERR_CRC;
+    }
+
+    free(table.items);
+    return rc;
+}
+
+/* ========== 批量提取 ========== */
+
+/*
+ * 一遍提取多个块：先扫描一遍块头（以及被选中块之前的元数据块的开头），把选中的块按偏移排序，
+ * 再按批顺序向前推进。每批在主线程依次打开输出（由调用方决定文件名），
+ * 然后在任务池上并行提取：每个工作者对自己的块边读边算 CRC 边写出，
+ * 一个块的写出与其他块的 CRC 计算同时进行。整批完成后按偏移顺序回调 done。
+ * 映射模式各工作者共享映射；stdio 模式每个工作者另开一个读取句柄。
+ * 引用块的目标直接从块表取得，不再逐个定位。
+ */
+#define EXTRACT_BATCH     ZZK_EXTRACT_BATCH
+#define EXTRACT_META_SCAN 1024     /* 元数据块只读取开头这么多字节（写入方的元数据上限） */
+
+struct extract_many_ctx {
+    struct zzk_reader *reader;
+    struct zzk_reader **workers;   /* stdio 模式下各工作者的读取句柄；NULL 表示共享 reader */
+    const struct chunk_table *table;
+    struct zzk_extract_item *items;
+    int verify;
+};
+
+static void extract_many_job(void *arg, int worker, long job) {
+    struct extract_many_ctx *ctx = (struct extract_many_ctx *)arg;
+    struct zzk_extract_item *item = &ctx->items[job];
+    struct zzk_reader *r = (ctx->workers && ctx->workers[worker]) ? ctx->workers[worker] : ctx->reader;
+
+    if (!item->out) return;
+    item->status = extract_chunk(r, &item->chunk, ctx->table, item->out, ctx->verify, &item->info);
+}
+
+/* 元数据块中 Filename:（流为 Stream:，标准输入除外）一行的值，写入 name；没有时返回 0 */
+static int extract_meta_name(struct zzk_reader *r, const struct chunk_entry *meta, char *name, size_t cap) {
+    unsigned char buf[EXTRACT_META_SCAN];
+    const unsigned char *p;
+    size_t n = (meta->length > EXTRACT_META_SCAN) ? EXTRACT_META_SCAN : (size_t)meta->length;
+    size_t pos = 0, end, skip;
+
+    p = reader_get(r, meta->offset + r->fmt->chunk_header, n, buf);
+    if (!p) return 0;
+    while (pos < n) {
+        for (end = pos; end < n && p[end] != '\n'; end++) {
+        }
+        skip = 0;
+        if (end - pos > 10 && memcmp(p + pos, "Filename: ", 10) == 0) skip = 10;
+        else if (end - pos > 8 && memcmp(p + pos, "Stream: ", 8) == 0 &&
+                 !(end - pos == 15 && memcmp(p + pos + 8, "<stdin>", 7) == 0)) skip = 8;
+        if (skip && end - pos - skip < cap) {
+            memcpy(name, p + pos + skip, end - pos - skip);
+            name[end - pos - skip] = '\0';
+            return 1;
+        }
+        pos = end + 1;
+    }
+    return 0;
+}
+
+/* 流分片的 Flags；读取失败视为最后一片 */
+static u32 extract_stream_flags(struct zzk_reader *r, const struct chunk_entry *e) {
+    unsigned char buf[4];
+    const unsigned char *p = (e->length >= 4) ? reader_get(r, e->offset + r->fmt->chunk_header, 4, buf) : NULL;
+    return p ? be_to_u32(p) : STREAM_FINAL;
+}
+
+/* 内容的类型：压缩块为原类型，引用块为 BINARY；压缩块前缀损坏时返回 0 */
+static u32 extract_content_type(struct zzk_reader *r, const struct chunk_table *t, long i) {
+    const struct chunk_entry *e = &t->items[i];
+    struct zzk_chunk c;
+    u64 length, block_size;
+    u32 type, prefix_crc;
+
+    if (e->type == TYPE_REF) return TYPE_BINARY;
+    if (e->type != TYPE_LZ) return e->type;
+    fill_chunk(r, &c, i + 1, e->type, e->offset, e->length);
+    return lz_read_prefix(r, &c, &type, &length, &block_size, &prefix_crc) == ZZK_OK ? type : 0;
+}
+
+/*
+ * 全部提取时是否选中第 i 块：文本、二进制、引用、压缩块与每个流的第一片。
+ * 紧邻二进制内容或流之前的文本块是元数据，只用于命名；索引、校验表、检查点等内部块跳过。
+ */
+static int extract_select_all(struct zzk_reader *r, const struct chunk_table *t, long i) {
+    u32 type = extract_content_type(r, t, i);
+
+    if (type == TYPE_TEXT) {
+        if (i + 1 >= t->count) return 1;
+        if (t->items[i + 1].type == TYPE_STREAM) return 0;
+        return extract_content_type(r, t, i + 1) != TYPE_BINARY;
+    }
+    if (type == TYPE_BINARY || t->items[i].type == TYPE_LZ) return 1;
+    if (t->items[i].type == TYPE_STREAM) {
+        return i == 0 || t->items[i - 1].type != TYPE_STREAM ||
+               (extract_stream_flags(r, &t->items[i - 1]) & STREAM_FINAL) != 0;
+    }
+    return 0;
+}
+
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+/* stdio 模式下为工作者 1..nthreads-1 各开一个读取句柄（工作者 0 使用 r）；失败时返回 NULL，改为单线程 */
+static struct zzk_reader **extract_workers_open(struct zzk_reader *r, int nthreads) {
+    struct zzk_reader **workers;
+    int i;
+
+    if (r->map || !r->path || nthreads < 2) return NULL;
+    workers = (struct zzk_reader **)calloc((size_t)nthreads, sizeof(*workers));
+    if (!workers) return NULL;
+    for (i = 1; i < nthreads; i++) {
+        if (zzk_reader_open(&workers[i], r->path) != ZZK_OK) {
+            while (--i >= 1) zzk_reader_close(workers[i]);
+            free(workers);
+            return NULL;
+        }
+    }
+    return workers;
+}
+
+static void extract_workers_close(struct zzk_reader **workers, int nthreads) {
+    int i;
+
+    if (!workers) return;
+    for (i = 1; i < nthreads; i++) zzk_reader_close(workers[i]);
+    free(workers);
+}
+
+int zzk_reader_extract_many(zzk_reader *r, const long *indices, long count, int nthreads, int verify,
+                            zzk_extract_open_fn open_fn, zzk_extract_done_fn done_fn, void *ctx, long *extracted) {
+    const struct zzk_format *fmt = r->fmt;
+    struct chunk_table table = { NULL, 0, 0 };
+    struct zzk_extract_item items[EXTRACT_BATCH];
+    struct extract_many_ctx x;
+    long *selected = NULL;
+    char *names = NULL;
+    long nselected = 0, start, n, i, k;
+    int structural_error = 0, failed = ZZK_OK, rc;
+
+    if (nthreads < 1) nthreads = 1;
+    if (extracted) *extracted = 0;
+    if (!open_fn || (count > 0 && !indices)) return ZZK_ERR_ARG;
+
+    /* 第一遍：只读块头，建立块表 */
+    reader_advise(r, fmt->header_size, r->total_size - fmt->header_size, READER_SEQUENTIAL);
+    rc = scan_chunk_headers(r, r->total_size, &table);
+    if (rc == ZZK_ERR_CORRUPT) {
+        structural_error = 1;
+        rc = ZZK_OK;
+    }
+    if (rc == ZZK_OK) {
+        selected = (long *)malloc(sizeof(long) * (size_t)((count < 0 ? table.count : count) + 1));
+        names = (char *)malloc((size_t)EXTRACT_BATCH * EXTRACT_META_SCAN);
+        if (!selected || !names) rc = nomem();
+    }
+
+    /* 选择：全部内容块，或排序去重后的编号（编号顺序即偏移顺序） */
+    if (rc == ZZK_OK && count < 0) {
+        for (i = 0; i < table.count; i++) {
+            if (extract_select_all(r, &table, i)) selected[nselected++] = i;
+        }
+    } else if (rc == ZZK_OK) {
+        if (count > 0) memcpy(selected, indices, sizeof(long) * (size_t)count);
+        qsort(selected, (size_t)count, sizeof(long), compare_long);
+        for (k = 0; k < count; k++) {
+            if (selected[k] < 1 || selected[k] > table.count) {
+                log_msg(ZZK_LOG_ERROR, "Error: Chunk #%ld not found.\n", selected[k]);
+                rc = ZZK_ERR_NOT_FOUND;
+                break;
+            }
+            if (nselected == 0 || selected[nselected - 1] != selected[k] - 1) selected[nselected++] = selected[k] - 1;
+        }
+    }
+
+    /* 第二遍：按批向前推进，批内并行提取 */
+    x.reader = r;
+    x.workers = NULL;
+    x.table = &table;
+    x.items = items;
+    x.verify = verify;
+    if (rc == ZZK_OK && nselected > 0) {
+        if (nthreads > nselected) nthreads = (int)nselected;
+        x.workers = extract_workers_open(r, nthreads);
+        if (!r->map && !x.workers) nthreads = 1;
+    }
+    for (start = 0; rc == ZZK_OK && start < nselected; start += n) {
+        n = (nselected - start > EXTRACT_BATCH) ? EXTRACT_BATCH : nselected - start;
+        for (k = 0; k < n; k++) {
+            const struct chunk_entry *e = &table.items[selected[start + k]];
+            struct zzk_extract_item *item = &items[k];
+
+            i = selected[start + k];
+            fill_chunk(r, &item->chunk, i + 1, e->type, e->offset, e->length);
+            item->content_type = extract_content_type(r, &table, i);
+            item->filename = NULL;
+            if (i > 0 && table.items[i - 1].type == TYPE_TEXT &&
+                (item->content_type == TYPE_BINARY || e->type == TYPE_STREAM) &&
+                extract_meta_name(r, &table.items[i - 1], names + (size_t)k * EXTRACT_META_SCAN, EXTRACT_META_SCAN)) {
+                item->filename = names + (size_t)k * EXTRACT_META_SCAN;
+            }
+            extract_info_init(&item->info);
+            item->status = ZZK_OK;
+            item->out = open_fn(ctx, item);
+            if (!item->out) item->status = ZZK_ERR_IO;
+        }
+        run_jobs(nthreads, n, extract_many_job, &x);
+        for (k = 0; k < n; k++) {
+            if (done_fn) done_fn(ctx, &items[k]);
+            if (items[k].status == ZZK_OK) {
+                if (extracted) (*extracted)++;
+            } else if (failed == ZZK_OK || items[k].status == ZZK_ERR_CRC) {
+                failed = items[k].status;
+            }
+        }
+    }
+    extract_workers_close(x.workers, nthreads);
+
+    if (rc == ZZK_OK) rc = structural_error ? ZZK_ERR_CORRUPT : failed;
+    free(table.items);
+    free(selected);
+    free(names);
+    return rc;
+}
+
+/* ========== 归档合并 ========== */
+
+/*
+ * 把另一个归档的数据区逐段原样复制到写入句柄末尾（reader_crc_copy：映射模式在 Linux 构建中走内核侧拷贝），
+ * 块的边界与字节不变，存储的 CRC32 不重新计算，只把块表登记到写入句柄（索引条目、块数、去重表、检查点摘要）。
+ * 例外只有两类：描述绝对位置的内部块（尾部索引、词项索引、检查点）不复制，由写入句柄在提交时为合并后的归档重建；
+ * 引用块记录的是目标块的编号，合并后整体后移，这些 16 字节的块按新编号重新编码（先核对其原有的 CRC32）。
+ * 整个来源是一条记录，默认持久化策略下关闭时只改写一次 TotalSize。
+ * ZZK_MERGE_VERIFY 时另起线程在任务池上校验来源全部块的 CRC32，与复制同时进行，
+ * 有不一致时撤回整条记录；非多线程构建先校验后复制。
+ */
+#define MERGE_DROPPED(type) ((type) == TYPE_INDEX || (type) == TYPE_TERMS || (type) == TYPE_CHECKPOINT)
+
+struct merge_verify {
+    struct zzk_reader *reader;
+    const struct chunk_table *table;
+    int nthreads;
+    long bad;
+    int rc;
+};
+
+static void merge_verify_report(void *ctx, const struct zzk_verify_item *item) {
+    (void)ctx;
+    if (item->status == ZZK_ERR_CRC) {
+        log_msg(ZZK_LOG_WARNING, "WARNING: CRC32 MISMATCH in source chunk #%ld (stored: %08lX, computed: %08lX).\n",
+                item->chunk.index, (unsigned long)item->stored_crc, (unsigned long)item->computed_crc);
+    } else if (item->status != ZZK_OK) {
+        log_msg(ZZK_LOG_ERROR, "Error reading source chunk #%ld.\n", item->chunk.index);
+    }
+}
+
+static void merge_verify_run(struct merge_verify *v) {
+    v->rc = verify_table(v->reader, v->table, 1, v->nthreads, merge_verify_report, NULL, &v->bad, NULL);
+}
+
+#ifdef ZZK1_THREADS
+static void *merge_verify_main(void *arg) {
+    merge_verify_run((struct merge_verify *)arg);
+    return NULL;
+}
+#endif
+
+/* 来源与目标是否为同一个文件（纯 C89 构建无法判断） */
+static int merge_same_file(const struct zzk_writer *w, const struct zzk_reader *src) {
+#ifdef ZZK1_POSIX
+    struct stat a, b;
+    return fstat(fileno(w->fp), &a) == 0 && fstat(fileno(src->fp), &b) == 0 &&
+           a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+#else
+    (void)w;
+    (void)src;
+    return 0;
+#endif
+}
+
+/* 原样复制来源中 [from, to) 号块（连续的一段），再依次登记 */
+static int merge_copy_run(struct zzk_writer *w, struct zzk_reader *src, const struct chunk_table *t,
+                          long from, long to) {
+    const struct chunk_entry *last = &t->items[to - 1];
+    u64 offset = t->items[from].offset, end = last->offset + src->fmt->chunk_overhead + last->length;
+    long i;
+    int rc;
+
+    reader_advise(src, offset, end - offset, READER_WILLNEED);
+    rc = reader_crc_copy(src, offset, end - offset, NULL, w->fp);
+    if (rc == -1) {
+        log_msg(ZZK_LOG_ERROR, "Error reading source archive.\n");
+        return ZZK_ERR_IO;
+    }
+    if (rc != 0) return io_error("Error writing archive");
+    for (i = from; i < to; i++) {
+        rc = writer_chunk_written(w, t->items[i].type, t->items[i].length, t->items[i].crc);
+        if (rc != ZZK_OK) return rc;
+    }
+    return ZZK_OK;
+}
+
+/* 按新编号重新编码来源中的第 index 号块（引用块）；renumber 为来源块到合并后编号的映射 */
+static int merge_ref(struct zzk_writer *w, struct zzk_reader *src, const struct chunk_table *t, long index,
+                     const long *renumber) {
+    const struct chunk_entry *e = &t->items[index - 1];
+    unsigned char buf[REF_SIZE], value[REF_SIZE], hdr[16];
+    const unsigned char *p = NULL;
+    unsigned hdr_len;
+    long target = 0;
+
+    if (e->length == REF_SIZE) p = reader_get(src, e->offset + src->fmt->chunk_header, REF_SIZE, buf);
+    if (p) {
+        memcpy(value, p, REF_SIZE);
+        hdr_len = encode_chunk_header(src->fmt, e->type, e->length, hdr);
+        if ((crc32_update(crc32_update(0xFFFFFFFFUL, hdr, hdr_len), value, REF_SIZE) ^ 0xFFFFFFFFUL) != e->crc) {
+            log_msg(ZZK_LOG_WARNING, "WARNING: CRC32 MISMATCH in source reference chunk #%ld.\n", index);
+            return ZZK_ERR_CRC;
+        }
+        target = (long)be_to_u32(value);
+    }
+    if (target < 1 || target >= index || t->items[target - 1].type != TYPE_BINARY) {
+        log_msg(ZZK_LOG_ERROR, "Error: source reference chunk #%ld does not resolve (target chunk #%ld).\n",
+                index, target);
+        return ZZK_ERR_CORRUPT;
+    }
+    u32_to_be((u32)renumber[target - 1], value);
+    return writer_memory_chunk(w, TYPE_REF, value, REF_SIZE);
+}
+
+int zzk_writer_merge(zzk_writer *w, const char *path, int flags, int nthreads, struct zzk_merge_stats *stats) {
+    struct zzk_merge_stats local;
+    struct zzk_reader *src;
+    struct chunk_table table = { NULL, 0, 0 };
+    struct writer_mark m;
+    struct merge_verify v;
+    long *renumber = NULL, i, run = -1, base = 0, refs = 0;
+    int rc, verifying = 0;
+#ifdef ZZK1_THREADS
+    pthread_t verifier;
+#endif
+
+    if (!stats) stats = &local;
+    memset(stats, 0, sizeof(*stats));
+    if (nthreads < 1) nthreads = 1;
+    if ((rc = writer_usable(w)) != ZZK_OK || (rc = writer_checkpoint(w)) != ZZK_OK) return rc;
+    if ((rc = zzk_reader_open(&src, path)) != ZZK_OK) return rc;
+
+    if (src->fmt != w->fmt) {
+        log_msg(ZZK_LOG_ERROR, "Error: '%s' is a %s archive and the target is %s; upgrade it first.\n",
+                path, src->fmt->name, w->fmt->name);
+        rc = ZZK_ERR_FORMAT;
+    } else if (merge_same_file(w, src)) {
+        log_msg(ZZK_LOG_ERROR, "Error: cannot merge an archive into itself.\n");
+        rc = ZZK_ERR_ARG;
+    } else if (w->pos > w->fmt->max_size || src->total_size - src->fmt->header_size > w->fmt->max_size - w->pos) {
+        rc = report_size_overflow(w->fmt);
+    }
+
+    /* 只读一遍来源的块头（含存储的 CRC32） */
+    if (rc == ZZK_OK) {
+        reader_advise(src, src->fmt->header_size, src->total_size - src->fmt->header_size, READER_SEQUENTIAL);
+        rc = scan_chunk_headers(src, src->total_size, &table);
+        if (rc == ZZK_ERR_CORRUPT) {
+            log_msg(ZZK_LOG_ERROR, "Error: source archive '%s' is damaged after chunk #%ld.\n", path, table.count);
+        }
+    }
+    if (rc == ZZK_OK) {
+        renumber = (long *)malloc(sizeof(long) * (size_t)(table.count ? table.count : 1));
+        if (!renumber) rc = nomem();
+        for (i = 0; rc == ZZK_OK && i < table.count; i++) {
+            if (table.items[i].type == TYPE_REF) refs++;
+        }
+        /* 只有引用块需要知道目标已有的块数 */
+        if (rc == ZZK_OK && refs > 0) rc = zzk_writer_chunk_count(w, &base);
+    }
+
+    writer_mark(w, &m);
+    if (rc == ZZK_OK && (flags & ZZK_MERGE_VERIFY)) {
+        v.reader = src;
+        v.table = &table;
+        v.nthreads = nthreads;
+        v.bad = 0;
+        v.rc = ZZK_OK;
+#ifdef ZZK1_THREADS
+        verifying = pthread_create(&verifier, NULL, merge_verify_main, &v) == 0;
+#endif
+        if (!verifying) merge_verify_run(&v);
+    }
+
+    /* 连续的普通块整段复制；遇到不复制的内部块或引用块时先写出之前的一段 */
+    for (i = 0; rc == ZZK_OK && i <= table.count; i++) {
+        u32 type = (i < table.count) ? table.items[i].type : TYPE_INDEX;
+
+        if (!MERGE_DROPPED(type) && type != TYPE_REF) {
+            if (run < 0) run = i;
+            renumber[i] = base + ++stats->chunks;
+            continue;
+        }
+        if (run >= 0) rc = merge_copy_run(w, src, &table, run, i);
+        run = -1;
+        if (rc != ZZK_OK || i == table.count) continue;
+        if (MERGE_DROPPED(type)) {
+            renumber[i] = 0;
+            stats->dropped++;
+            continue;
+        }
+        renumber[i] = base + ++stats->chunks;
+        rc = merge_ref(w, src, &table, i + 1, renumber);
+        if (rc == ZZK_OK) stats->refs++;
+    }
+    stats->bytes = w->pos - m.pos;
+
+#ifdef ZZK1_THREADS
+    if (verifying) pthread_join(verifier, NULL);
+#endif
+    if (rc == ZZK_OK && (flags & ZZK_MERGE_VERIFY)) {
+        stats->bad = v.bad;
+        if (v.rc != ZZK_OK) rc = v.rc;
+        else if (v.bad > 0) rc = ZZK_ERR_CRC;
+    }
+    rc = writer_finish_record(w, &m, rc);
+    free(renumber);
+    free(table.items);
+    zzk_reader_close(src);
+    return rc;
+}
+
+/* ========== 增量读取 ========== */
+
+/*
+ * follow 的读取路径。游标记录下一个块的偏移与已经过的块数，每轮只读取游标之后、TotalSize 之内的块头，
+ * 不重新扫描之前的内容。写入方总是先写数据、后改 TotalSize，TotalSize 之内的块都已完整提交；
+ * 唯一的例外是末尾的索引与词项索引：追加时写入方先把 TotalSize 收缩到它们之前，再用新数据覆盖。
+ * 因此游标从不越过末尾的索引块，并且每轮在交出块之前再读一次 TotalSize，
+ * 丢弃已不在其范围内的块（读取期间被收缩、随后被覆盖的区域）。
+ */
+#define FOLLOW_INTERNAL(type) ((type) == TYPE_INDEX || (type) == TYPE_TERMS || \
+                               (type) == TYPE_CHECKPOINT || (type) == TYPE_PADDING)
+
+/* 重新读取文件头中的 TotalSize。stdio 模式先丢弃读缓冲（POSIX 对可定位输入流的 fflush），以免读到旧内容 */
+static int reader_read_total(struct zzk_reader *r, u64 *total) {
+    const struct zzk_format *fmt = r->fmt;
+    unsigned char buf[8];
+
+    if (r->map) {
+        *total = be_to_uint(r->map + 4, fmt->size_width);
+    } else {
+#ifdef ZZK1_POSIX
+        fflush(r->fp);
+#endif
+        r->pos_known = 0;
+        if (fseek(r->fp, 4, SEEK_SET) != 0 || fread(buf, 1, fmt->size_width, r->fp) != fmt->size_width) {
+            return io_error("Error reading header");
+        }
+        r->pos = 4 + fmt->size_width;
+        r->pos_known = 1;
+        *total = be_to_uint(buf, fmt->size_width);
+    }
+    if (*total < fmt->header_size) {
+        log_msg(ZZK_LOG_ERROR, "Error: invalid total size in header.\n");
+        return ZZK_ERR_FORMAT;
+    }
+    return ZZK_OK;
+}
+
+int zzk_reader_refresh(zzk_reader *r) {
+    u64 total;
+    int rc = reader_read_total(r, &total);
+
+    if (rc != ZZK_OK) return rc;
+#ifdef ZZK1_POSIX
+    /* 映射只覆盖打开时的长度，归档增长后重新映射 */
+    if (r->map && total > (u64)r->map_len) {
+        munmap((void *)r->map, r->map_len);
+        r->map = NULL;
+        r->map_len = 0;
+    }
+    r->total_size = total;
+    if (!r->map) reader_try_map(r);
+#endif
+    r->total_size = total;
+    return ZZK_OK;
+}
+
+/* 游标须落在块边界上，且之前那个块存储的 CRC32 与记录的相同 */
+static int follow_check_cursor(struct zzk_reader *r, const struct zzk_cursor *cur) {
+    const struct zzk_format *fmt = r->fmt;
+    unsigned char buf[4];
+    const unsigned char *p = NULL;
+    char num[24];
+
+    if (cur->chunk >= 0 && cur->offset >= fmt->header_size && cur->offset <= r->total_size) {
+        if (cur->chunk == 0) {
+            if (cur->offset == fmt->header_size) return ZZK_OK;
+        } else if (cur->offset - fmt->header_size >= fmt->chunk_overhead) {
+            p = reader_get(r, cur->offset - 4, 4, buf);
+            if (p && be_to_u32(p) == cur->last_crc) return ZZK_OK;
+        }
+    }
+    log_msg(ZZK_LOG_ERROR, "Error: cursor (chunk #%ld at offset %s) does not match this archive; "
+            "it was replaced or truncated.\n", cur->chunk, u64_str(cur->offset, num));
+    return ZZK_ERR_ARG;
+}
+
+/* offset 起到 TotalSize 是否只剩索引 / 词项索引块（下一次追加会覆盖它们） */
+static int follow_at_tail(struct zzk_reader *r, u64 offset) {
+    u64 length;
+    u32 type;
+
+    while (offset < r->total_size) {
+        if (reader_chunk_header(r, offset, &type, &length) != 0) return 1;
+        if (type != TYPE_INDEX && type != TYPE_TERMS) return 0;
+        offset += r->fmt->chunk_overhead + length;
+    }
+    return 1;
+}
+
+int zzk_reader_follow(zzk_reader *r, struct zzk_cursor *cursor, zzk_chunk_fn fn, void *ctx, long *count) {
+    const struct zzk_format *fmt;
+    struct chunk_table table = { NULL, 0, 0 };
+    struct zzk_chunk chunk;
+    u64 offset, length, total;
+    u32 type, crc;
+    long i;
+    int damaged = 0, rc;
+
+    if (count) *count = 0;
+    if ((rc = zzk_reader_refresh(r)) != ZZK_OK) return rc;
+    fmt = r->fmt;
+    if (cursor->offset == 0 && cursor->chunk == 0) cursor->offset = fmt->header_size;
+    if ((rc = follow_check_cursor(r, cursor)) != ZZK_OK) return rc;
+
+    /* 只读游标之后的块头 */
+    offset = cursor->offset;
+    reader_advise(r, offset, r->total_size - offset, READER_SEQUENTIAL);
+    while (rc == ZZK_OK && r->total_size - offset >= fmt->chunk_header) {
+        if (reader_chunk_header(r, offset, &type, &length) != 0 || reader_chunk_crc(r, offset, length, &crc) != 0) {
+            damaged = 1;
+            break;
+        }
+        if ((type == TYPE_INDEX || type == TYPE_TERMS) && follow_at_tail(r, offset)) break;
+        rc = chunk_table_push(&table, type, offset, length, crc);
+        offset += fmt->chunk_overhead + length;
+    }
+
+    /* 读取期间 TotalSize 变化（收缩后覆盖末尾的索引，或已提交更多记录）时，只交出仍在其范围内的块 */
+    total = r->total_size;
+    if (rc == ZZK_OK && (table.count > 0 || damaged)) rc = reader_read_total(r, &total);
+    if (rc == ZZK_OK && total != r->total_size) {
+        while (table.count > 0 &&
+               table.items[table.count - 1].offset + fmt->chunk_overhead + table.items[table.count - 1].length > total) {
+            table.count--;
+        }
+        damaged = 0;
+    }
+    if (rc == ZZK_OK && damaged && table.count == 0) {
+        log_msg(ZZK_LOG_ERROR, "Error: archive structure is damaged after chunk #%ld.\n", cursor->chunk);
+        rc = ZZK_ERR_CORRUPT;
+    }
+
+    for (i = 0; rc == ZZK_OK && i < table.count; i++) {
+        const struct chunk_entry *e = &table.items[i];
+
+        if (fn && !FOLLOW_INTERNAL(e->type)) {
+            fill_chunk(r, &chunk, cursor->chunk + 1, e->type, e->offset, e->length);
+            rc = fn(ctx, r, &chunk);
+            if (rc != 0) break;
+            if (count) (*count)++;
+        }
+        cursor->offset = e->offset + fmt->chunk_overhead + e->length;
+        cursor->chunk++;
+        cursor->last_crc = e->crc;
+    }
+    free(table.items);
+    return rc;
+}
+
+#ifdef ZZK1_POSIX
+/* 路径是否已指向另一个文件（被替换或删除） */
+static int reader_replaced(const struct zzk_reader *r) {
+    struct stat a, b;
+    return stat(r->path, &a) != 0 || fstat(fileno(r->fp), &b) != 0 || a.st_dev != b.st_dev || a.st_ino != b.st_ino;
+}
+#endif
+
+int zzk_reader_wait(zzk_reader *r, int timeout_ms) {
+#ifdef ZZK1_POSIX
+    double deadline = now_ms() + (double)timeout_ms;
+    int wait_ms, rc;
+    u64 total;
+
+    if (!r->path) return ZZK_ERR_ARG;
+#ifdef ZZK1_LINUX
+    /* IN_ATTRIB 覆盖链接数变化（被改名覆盖或删除）；建立失败时退回定时检查 */
+    if (r->notify_fd < 0) {
+        r->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (r->notify_fd >= 0 &&
+            inotify_add_watch(r->notify_fd, r->path, IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+            close(r->notify_fd);
+            r->notify_fd = -1;
+        }
+    }
+#endif
+    for (;;) {
+        if (reader_replaced(r)) return ZZK_ERR_NOT_FOUND;
+        if ((rc = reader_read_total(r, &total)) != ZZK_OK) return rc;
+        if (total != r->total_size) return ZZK_OK;
+        wait_ms = -1;
+        if (timeout_ms >= 0) {
+            double left = deadline - now_ms();
+            if (left <= 0) return ZZK_OK;
+            wait_ms = (int)left + 1;
+        }
+#ifdef ZZK1_LINUX
+        if (r->notify_fd >= 0) {
+            struct pollfd pfd;
+            char events[4096];
+
+            pfd.fd = r->notify_fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, wait_ms) > 0) {
+                while (read(r->notify_fd, events, sizeof(events)) > 0) {
+                }
+            }
+            continue;
+        }
+#endif
+        if (wait_ms < 0 || wait_ms > ZZK_FOLLOW_POLL_MS) wait_ms = ZZK_FOLLOW_POLL_MS;
+        poll(NULL, 0, wait_ms);
+    }
+#else
+    (void)r;
+    (void)timeout_ms;
+    log_msg(ZZK_LOG_ERROR, "Error: waiting for new records needs a POSIX build.\n");
+    return ZZK_ERR_UNSUPPORTED;
+#endif
+}
+
+int zzk_reader_write_frame(zzk_reader *r, const struct zzk_chunk *c, FILE *out) {
+    unsigned char hdr[ZZK_FRAME_HEADER];
+    u32 stored, crc = zzk_reader_header_crc(r, c);
+    int rc;
+
+    /* 先校验，确认无误后再写出：下游收到的帧总是完整可信的 */
+    if (reader_chunk_crc(r, c->offset, c->length, &stored) != 0 ||
+        reader_crc_copy(r, c->value_offset, c->length, &crc, NULL) != 0) {
+        log_msg(ZZK_LOG_ERROR, "Error reading chunk #%ld.\n", c->index);
+        return ZZK_ERR_IO;
+    }
+    crc ^= 0xFFFFFFFFUL;
+    if (crc != stored) {
+        log_msg(ZZK_LOG_WARNING, "WARNING: CRC32 MISMATCH in chunk #%ld (stored: %08lX, computed: %08lX).\n",
+                c->index, (unsigned long)stored, (unsigned long)crc);
+        return ZZK_ERR_CRC;
+    }
+
+    /* 帧 CRC 以帧头为起点，在写出 Value 的同一遍中算出 */
+    uint_to_be((u64)c->index, hdr, 8);
+    u32_to_be(c->type, hdr + 8);
+    uint_to_be(c->length, hdr + 12, 8);
+    crc = crc32_update(0xFFFFFFFFUL, hdr, sizeof(hdr));
+    if (write_all(out, hdr, sizeof(hdr), "Error writing frame") != 0) return ZZK_ERR_IO;
+    rc = reader_crc_copy(r, c->value_offset, c->length, &crc, out);
+    if (rc == -1) {
+        log_msg(ZZK_LOG_ERROR, "Error reading chunk #%ld.\n", c->index);
+        return ZZK_ERR_IO;
+    }
+    if (rc != 0) return io_error("Error writing frame");
+    return write_u32(out, crc ^ 0xFFFFFFFFUL, "Error writing frame");
+}
+
+/* 游标文件: "zzk-cursor 1 <offset> <chunk> <last_crc>" */
+#define CURSOR_TAG "zzk-cursor 1 "
+
+int zzk_cursor_load(const char *path, struct zzk_cursor *cursor) {
+    FILE *fp;
+    char line[128], *p, *end;
+    size_t n;
+
+    memset(cursor, 0, sizeof(*cursor));
+    fp = fopen(path, "r");
+    if (!fp) {
+        if (errno == ENOENT) return ZZK_ERR_NOT_FOUND;
+        return io_error("Error opening cursor file");
+    }
+    n = fread(line, 1, sizeof(line) - 1, fp);
+    fclose(fp);
+    line[n] = '\0';
+
+    p = line + strlen(CURSOR_TAG);
+    if (strncmp(line, CURSOR_TAG, strlen(CURSOR_TAG)) != 0 || *p < '0' || *p > '9') p = NULL;
+    for (; p && *p >= '0' && *p <= '9'; p++) cursor->offset = cursor->offset * 10 + (u64)(*p - '0');
+    if (p && *p == ' ') {
+        cursor->chunk = strtol(p + 1, &end, 10);
+        p = (end > p + 1 && *end == ' ') ? end + 1 : NULL;
+    } else {
+        p = NULL;
+    }
+    if (p) {
+        cursor->last_crc = (u32)strtoul(p, &end, 16);
+        if (end == p || (*end != '\n' && *end != '\0')) p = NULL;
+    }
+    if (!p || cursor->chunk < 0) {
+        memset(cursor, 0, sizeof(*cursor));
+        log_msg(ZZK_LOG_ERROR, "Error: '%s' is not a cursor file.\n", path);
+        return ZZK_ERR_FORMAT;
+    }
+    return ZZK_OK;
+}
+
+int zzk_cursor_save(const char *path, const struct zzk_cursor *cursor) {
+    FILE *fp;
+    char *tmp, num[24];
+    int ok;
+
+    tmp = (char *)malloc(strlen(path) + 5);
+    if (!tmp) return nomem();
+    strcpy(tmp, path);
+    strcat(tmp, ".tmp");
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        free(tmp);
+        return io_error("Error writing cursor file");
+    }
+    ok = fprintf(fp, "%s%s %ld %08lX\n", CURSOR_TAG, u64_str(cursor->offset, num), cursor->chunk,
+                 (unsigned long)cursor->last_crc) > 0 && fflush(fp) == 0;
+#ifdef ZZK1_POSIX
+    if (ok) ok = fsync(fileno(fp)) == 0;
+#endif
+    if (fclose(fp) != 0) ok = 0;
+    /* 改名是原子的：崩溃后游标文件要么是旧值，要么是新值 */
+    if (ok && rename(tmp, path) != 0) ok = remove(path) == 0 && rename(tmp, path) == 0;
+    if (!ok) {
+        io_error("Error writing cursor file");
+        remove(tmp);
+    }
+    free(tmp);
+    return ok ? ZZK_OK : ZZK_ERR_IO;
+}
+
+/* ========== 文本检索 ========== */
+
+/*
+ * grep：在全部 TEXT 块（含原类型为 TEXT 的压缩块）的内容中查找字面子串。
+ * 扫描一遍块头后把文本块按顺序分成任务：相邻的小块合为一组（每组约 GREP_SEGMENT_SIZE 字节），
+ * 更大的块拆成多段（每段向后多读 模式长度-1 字节，跨段的匹配归起点所在的段），
+ * 压缩块各自成为一个任务，在内存中整体解压后查找。任务在任务池上并行执行，
+ * 只收集匹配的偏移与所在行的摘要，主线程按块顺序回调，不匹配的内容不会复制出去。
+ * 可选的 CRC32 校验在同一遍读取中完成，首段从块头算起，只有分段的大块经 crc32_combine 合并。
+ */
+#define GREP_SEGMENT_SIZE (4UL * 1024 * 1024)
+#define GREP_CONTEXT      80               /* 行摘要在匹配前后最多保留的字节数 */
+#define GREP_LZ_MAX       0x10000000UL     /* 压缩文本解压后的上限（同 list 显示文本的上限） */
+
+#if !defined(ZZK1_NO_SIMD) && defined(__x86_64__) && defined(__GNUC__)
+#define ZZK1_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+/* icase 时 pat 已折叠为小写 */
+static int grep_match_at(const unsigned char *p, const unsigned char *pat, size_t m, int icase) {
+    size_t i;
+
+    if (!icase) return memcmp(p, pat, m) == 0;
+    for (i = 0; i < m; i++) {
+        if (fold_ascii(p[i]) != pat[i]) return 0;
+    }
+    return 1;
+}
+
+/* 可移植实现：memchr 定位首字节后比较（icase 时逐字节折叠） */
+static const unsigned char *grep_find_scalar(const unsigned char *hay, size_t n, const unsigned char *pat, size_t m,
+                                             int icase) {
+    const unsigned char *p = hay, *last;
+
+    if (n < m) return NULL;
+    last = hay + (n - m);
+    if (!icase) {
+        while (p <= last && (p = (const unsigned char *)memchr(p, pat[0], (size_t)(last - p) + 1)) != NULL) {
+            if (memcmp(p, pat, m) == 0) return p;
+            p++;
+        }
+        return NULL;
+    }
+    for (; p <= last; p++) {
+        if (fold_ascii(*p) == pat[0] && grep_match_at(p, pat, m, 1)) return p;
+    }
+    return NULL;
+}
+
+#ifdef ZZK1_HAVE_SSE2
+/*
+ * SSE2 实现（x86-64 的基线指令集，无需运行时检测）：每轮取 16 个候选起点，
+ * 同时比较模式的首字节与尾字节，两者都相等的起点才逐字节确认；icase 时两种大小写各比较一次。
+ */
+static const unsigned char *grep_find_sse2(const unsigned char *hay, size_t n, const unsigned char *pat, size_t m,
+                                           int icase) {
+    unsigned char f = pat[0], l = pat[m - 1];
+    unsigned char f_alt = (icase && f >= 'a' && f <= 'z') ? (unsigned char)(f - ('a' - 'A')) : f;
+    unsigned char l_alt = (icase && l >= 'a' && l <= 'z') ? (unsigned char)(l - ('a' - 'A')) : l;
+    __m128i first = _mm_set1_epi8((char)f), first_alt = _mm_set1_epi8((char)f_alt);
+    __m128i last = _mm_set1_epi8((char)l), last_alt = _mm_set1_epi8((char)l_alt);
+    __m128i bf, bl, eq;
+    const unsigned char *tail;
+    size_t i = 0;
+    unsigned mask;
+
+    if (n < m) return NULL;
+    for (; n - m + 1 - i >= 16; i += 16) {
+        bf = _mm_loadu_si128((const __m128i *)(hay + i));
+        bl = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        eq = _mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bf, first_alt)),
+                           _mm_or_si128(_mm_cmpeq_epi8(bl, last), _mm_cmpeq_epi8(bl, last_alt)));
+        mask = (unsigned)_mm_movemask_epi8(eq);
+        while (mask != 0) {
+            tail = hay + i + (size_t)__builtin_ctz(mask);
+            if (grep_match_at(tail, pat, m, icase)) return tail;
+            mask &= mask - 1;
+        }
+    }
+    return grep_find_scalar(hay + i, n - i, pat, m, icase);
+}
+#endif
+
+static const unsigned char *grep_find(const unsigned char *hay, size_t n, const unsigned char *pat, size_t m,
+                                      int icase) {
+#ifdef ZZK1_HAVE_SSE2
+    return grep_find_sse2(hay, n, pat, m, icase);
+#else
+    return grep_find_scalar(hay, n, pat, m, icase);
+#endif
+}
+
+/* 被搜索的文本块 */
+struct grep_item {
+    long index;
+    u64 offset;          /* 块起始偏移 */
+    u64 length;          /* Value 长度（压缩块为存储的长度） */
+    u64 text_length;     /* 文本长度（压缩块为解压后的长度） */
+    u32 stored_crc;
+    u32 value_crc;       /* 多块任务中由工作者计算的整块 CRC32 */
+    int lz;
+    int status;          /* ZZK_OK / ZZK_ERR_CRC / ZZK_ERR_CORRUPT（压缩块无法解码） */
+    long first_job;      /* 单块任务（含分段）的任务区间；njobs 为 0 表示该块属于多块任务 */
+    long njobs;
+};
+
+struct grep_hit {
+    long item;
+    u64 offset;          /* 文本内偏移 */
+    size_t line;         /* 行摘要在任务摘要池中的位置 */
+    size_t line_len;
+};
+
+struct grep_job {
+    long first;          /* 覆盖的文本块 [first, first + count) */
+    long count;
+    u64 start;           /* count 为 1 时负责的 Value 范围 [start, end) */
+    u64 end;
+    u32 crc;             /* count 为 1 时 [start, end) 的 CRC32，首段从块头算起 */
+    int status;          /* 读取失败或内存不足 */
+    struct grep_hit *hits;
+    long nhits;
+    long hits_cap;
+    char *pool;
+    size_t pool_len;
+    size_t pool_cap;
+};
+
+struct grep_ctx {
+    struct zzk_reader *reader;
+    struct worker_files io;
+    struct grep_item *items;
+    struct grep_job *jobs;
+    const unsigned char *pattern;   /* icase 时已折叠为小写 */
+    size_t len;
+    int icase;
+    int check_crc;
+};
+
+/* 块头（Type + Length）的 CRC32 中间状态，作为块内首段 CRC 的起点 */
+static u32 grep_header_crc(struct grep_ctx *x, const struct grep_item *it) {
+    unsigned char hdr[12];
+    unsigned hdr_len = encode_chunk_header(x->reader->fmt, it->lz ? TYPE_LZ : TYPE_TEXT, it->length, hdr);
+    return crc32_update(0xFFFFFFFFUL, hdr, hdr_len);
+}
+
+/* 工作者读取 [offset, offset+len)：映射模式返回映射内指针，stdio 模式经自己的文件句柄读入 buf */
+static const unsigned char *grep_read(struct grep_ctx *x, int worker, u64 offset, size_t len, unsigned char *buf) {
+    struct zzk_reader *r = x->reader;
+    FILE *fp;
+    size_t got;
+
+    if (r->map) {
+        if (offset > (u64)r->map_len || len > r->map_len - (size_t)offset) return NULL;
+        reader_advise(r, offset, (u64)len, READER_WILLNEED);
+        STATS_COUNT(STATS_BYTES_READ, len);
+        return r->map + (size_t)offset;
+    }
+    fp = x->io.files[worker];
+    if (seek_to(fp, offset) != 0) return NULL;
+    STATS_TIME(ZZK_PHASE_READ, got = fread(buf, 1, len, fp));
+    STATS_COUNT(STATS_BYTES_READ, got);
+    return got == len ? buf : NULL;
+}
+
+static int grep_add_hit(struct grep_job *j, long item, u64 offset, const unsigned char *line, size_t line_len) {
+    struct grep_hit *hits;
+    char *pool;
+    size_t cap;
+
+    if (j->nhits == j->hits_cap) {
+        long n = j->hits_cap ? j->hits_cap * 2 : 16;
+        hits = (struct grep_hit *)realloc(j->hits, sizeof(*hits) * (size_t)n);
+        if (!hits) return ZZK_ERR_NOMEM;
+        j->hits = hits;
+        j->hits_cap = n;
+    }
+    if (j->pool_cap - j->pool_len < line_len) {
+        cap = j->pool_cap ? j->pool_cap : 1024;
+        while (cap - j->pool_len < line_len) cap *= 2;
+        pool = (char *)realloc(j->pool, cap);
+        if (!pool) return ZZK_ERR_NOMEM;
+        j->pool = pool;
+        j->pool_cap = cap;
+    }
+    memcpy(j->pool + j->pool_len, line, line_len);
+    j->hits[j->nhits].item = item;
+    j->hits[j->nhits].offset = offset;
+    j->hits[j->nhits].line = j->pool_len;
+    j->hits[j->nhits].line_len = line_len;
+    j->nhits++;
+    j->pool_len += line_len;
+    return ZZK_OK;
+}
+
+/*
+ * 在 text[0, n) 中查找起点位于 [from, to) 的匹配（不重叠），base 为 text[0] 在块文本中的偏移。
+ * 行摘要取匹配所在的行，前后各至多 GREP_CONTEXT 字节，不越出 text。
+ */
+static int grep_scan(struct grep_ctx *x, struct grep_job *j, long item, const unsigned char *text, size_t n,
+                     size_t from, size_t to, u64 base) {
+    const unsigned char *p;
+    size_t pos = from, limit, a, b;
+
+    while (pos < to) {
+        limit = to - 1 + x->len;
+        if (limit > n) limit = n;
+        p = grep_find(text + pos, limit - pos, x->pattern, x->len, x->icase);
+        if (!p) break;
+        pos = (size_t)(p - text);
+        for (a = pos; a > 0 && pos - a < GREP_CONTEXT && text[a - 1] != '\n'; a--) {
+        }
+        for (b = pos + x->len; b < n && b - (pos + x->len) < GREP_CONTEXT && text[b] != '\n'; b++) {
+        }
+        if (grep_add_hit(j, item, base + (u64)pos, text + a, b - a) != ZZK_OK) return ZZK_ERR_NOMEM;
+        pos += x->len;
+    }
+    return ZZK_OK;
+}
+
+static void grep_text_item(struct grep_ctx *x, struct grep_job *j, int worker, long i) {
+    struct grep_item *it = &x->items[i];
+    u64 start = j->count == 1 ? j->start : 0, end = j->count == 1 ? j->end : it->length;
+    u64 from = start > GREP_CONTEXT ? start - GREP_CONTEXT : 0, to = end + x->len - 1 + GREP_CONTEXT;
+    const unsigned char *text;
+    u32 crc;
+
+    if (to > it->length) to = it->length;
+    text = grep_read(x, worker, it->offset + x->reader->fmt->chunk_header + from, (size_t)(to - from),
+                     x->io.buffers ? x->io.buffers[worker] : NULL);
+    if (!text) {
+        j->status = ZZK_ERR_IO;
+        return;
+    }
+    if (x->check_crc) {
+        crc = start == 0 ? grep_header_crc(x, it) : 0xFFFFFFFFUL;
+        crc = crc32_update(crc, text + (size_t)(start - from), (size_t)(end - start)) ^ 0xFFFFFFFFUL;
+        if (j->count == 1) j->crc = crc;
+        else it->value_crc = crc;
+    }
+    j->status = grep_scan(x, j, i, text, (size_t)(to - from), (size_t)(start - from), (size_t)(end - from), from);
+}
+
+static void grep_lz_item(struct grep_ctx *x, struct grep_job *j, int worker, long i) {
+    struct grep_item *it = &x->items[i];
+    unsigned char *stored = NULL, *text;
+    const unsigned char *value = NULL;
+    int rc;
+
+    text = (unsigned char *)malloc(it->text_length > 0 ? (size_t)it->text_length : 1);
+    if (text && !x->reader->map) stored = (unsigned char *)malloc((size_t)it->length);
+    if (text && (x->reader->map || stored)) {
+        value = grep_read(x, worker, it->offset + x->reader->fmt->chunk_header, (size_t)it->length, stored);
+        j->status = value ? ZZK_OK : ZZK_ERR_IO;
+    } else {
+        j->status = ZZK_ERR_NOMEM;
+    }
+    if (value) {
+        if (x->check_crc) j->crc = crc32_update(grep_header_crc(x, it), value, (size_t)it->length) ^ 0xFFFFFFFFUL;
+        rc = lz_decode_value(value, it->length, text);
+        if (rc == -1) it->status = ZZK_ERR_CORRUPT;
+        else if (rc == -2 && x->check_crc) it->status = ZZK_ERR_CRC;
+        if (rc != -1) {
+            j->status = grep_scan(x, j, i, text, (size_t)it->text_length, 0, (size_t)it->text_length, 0);
+        }
+    }
+    free(stored);
+    free(text);
+}
+
+static void grep_job_run(void *arg, int worker, long job_index) {
+    struct grep_ctx *x = (struct grep_ctx *)arg;
+    struct grep_job *j = &x->jobs[job_index];
+    long i;
+
+    for (i = j->first; j->status == ZZK_OK && i < j->first + j->count; i++) {
+        if (x->items[i].lz) grep_lz_item(x, j, worker, i);
+        else grep_text_item(x, j, worker, i);
+    }
+}
+
+static int grep_push_job(struct grep_job **jobs, long *njobs, long *cap, long first, u64 start, u64 end) {
+    struct grep_job *j;
+
+    if (*njobs == *cap) {
+        long n = *cap ? *cap * 2 : 64;
+        j = (struct grep_job *)realloc(*jobs, sizeof(**jobs) * (size_t)n);
+        if (!j) return nomem();
+        *jobs = j;
+        *cap = n;
+    }
+    j = &(*jobs)[(*njobs)++];
+    memset(j, 0, sizeof(*j));
+    j->first = first;
+    j->count = 1;
+    j->start = start;
+    j->end = end;
+    return ZZK_OK;
+}
+
+/* 相邻的小块合成一组，大块按 GREP_SEGMENT_SIZE 分段，压缩块单独一个任务 */
+static int grep_plan(struct grep_item *items, long nitems, struct grep_job **jobs_out, long *njobs_out) {
+    struct grep_job *jobs = NULL;
+    long njobs = 0, cap = 0, open = -1, i;
+    u64 open_bytes = 0, start, end;
+    int rc = ZZK_OK;
+
+    for (i = 0; rc == ZZK_OK && i < nitems; i++) {
+        struct grep_item *it = &items[i];
+        if (!it->lz && it->length <= GREP_SEGMENT_SIZE) {
+            if (open >= 0 && open_bytes + it->length <= GREP_SEGMENT_SIZE) {
+                jobs[open].count++;
+                open_bytes += it->length;
+            } else if ((rc = grep_push_job(&jobs, &njobs, &cap, i, 0, it->length)) == ZZK_OK) {
+                open = njobs - 1;
+                open_bytes = it->length;
+            }
+            continue;
+        }
+        open = -1;
+        it->first_job = njobs;
+        start = 0;
+        do {
+            end = (it->lz || it->length - start <= GREP_SEGMENT_SIZE) ? it->length : start + GREP_SEGMENT_SIZE;
+            rc = grep_push_job(&jobs, &njobs, &cap, i, start, end);
+            it->njobs++;
+            start = end;
+        } while (rc == ZZK_OK && start < it->length);
+    }
+    /* 只含一个块的组与分段任务一样由任务记录 CRC */
+    for (i = 0; rc == ZZK_OK && i < njobs; i++) {
+        if (jobs[i].count == 1 && items[jobs[i].first].njobs == 0) {
+            items[jobs[i].first].first_job = i;
+            items[jobs[i].first].njobs = 1;
+        }
+    }
+    if (rc != ZZK_OK) {
+        free(jobs);
+        return rc;
+    }
+    *jobs_out = jobs;
+    *njobs_out = njobs;
+    return ZZK_OK;
+}
+
+/* 收集 TEXT 块与原类型为 TEXT 的压缩块 */
+static int grep_collect(struct zzk_reader *r, const struct chunk_table *table, struct grep_item **items_out,
+                        long *nitems_out) {
+    struct grep_item *items, *it;
+    unsigned char buf[LZ_PREFIX_SIZE];
+    const unsigned char *p;
+    long nitems = 0, i;
+    u64 text_length;
+    char num[24];
+
+    items = (struct grep_item *)malloc(sizeof(*items) * (size_t)(table->count ? table->count : 1));
+    if (!items) return nomem();
+    for (i = 0; i < table->count; i++) {
+        const struct chunk_entry *e = &table->items[i];
+        text_length = e->length;
+        if (e->type == TYPE_LZ) {
+            p = e->length >= LZ_PREFIX_SIZE + 4 ? reader_get(r, e->offset + r->fmt->chunk_header, LZ_PREFIX_SIZE, buf)
+                                                : NULL;
+            if (!p || be_to_u32(p) != TYPE_TEXT) continue;
+            text_length = be_to_uint(p + 4, 8);
+            if (text_length > GREP_LZ_MAX || (u64)(size_t)e->length != e->length) {
+                log_msg(ZZK_LOG_WARNING, "Warning: compressed text chunk #%ld too large (%s). Skipping.\n",
+                        i + 1, u64_str(text_length, num));
+                continue;
+            }
+        } else if (e->type != TYPE_TEXT) {
+            continue;
+        }
+        it = &items[nitems++];
+        memset(it, 0, sizeof(*it));
+        it->index = i + 1;
+        it->offset = e->offset;
+        it->length = e->length;
+        it->text_length = text_length;
+        it->stored_crc = e->crc;
+        it->lz = e->type == TYPE_LZ;
+    }
+    *items_out = items;
+    *nitems_out = nitems;
+    return ZZK_OK;
+}
+
+/* 按块的 CRC32 核对各文本块（首段已含块头，分段的块再依次拼接其余各段） */
+static void grep_check_crc(struct grep_item *it, const struct grep_job *jobs) {
+    u32 crc = it->value_crc;
+    long k;
+
+    if (it->status == ZZK_ERR_CORRUPT) {
+        log_msg(ZZK_LOG_ERROR, "Error: compressed chunk #%ld is damaged.\n", it->index);
+        return;
+    }
+    if (it->status == ZZK_ERR_CRC) {
+        log_msg(ZZK_LOG_WARNING, "WARNING: CRC32 MISMATCH in decompressed content of Chunk #%ld. "
+                "Data may be corrupted!\n", it->index);
+        return;
+    }
+    if (it->njobs > 0) {
+        crc = jobs[it->first_job].crc;
+        for (k = it->first_job + 1; k < it->first_job + it->njobs; k++) {
+            crc = crc32_combine(crc, jobs[k].crc, jobs[k].end - jobs[k].start);
+        }
+    }
+    if (crc != it->stored_crc) {
+        log_msg(ZZK_LOG_WARNING, "WARNING: CRC32 MISMATCH in Chunk #%ld (stored: %08lX, computed: %08lX). "
+                "Data may be corrupted!\n", it->index, (unsigned long)it->stored_crc, (unsigned long)crc);
+        it->status = ZZK_ERR_CRC;
+    }
+}
+
+int zzk_reader_grep(zzk_reader *r, const void *pattern, size_t len, int flags, int nthreads, zzk_grep_fn fn,
+                    void *ctx, struct zzk_grep_stats *stats) {
+    struct chunk_table table = { NULL, 0, 0 };
+    struct grep_ctx x;
+    struct zzk_grep_match m;
+    struct zzk_grep_stats local;
+    struct grep_item *items = NULL;
+    struct grep_job *jobs = NULL;
+    unsigned char *folded = NULL;
+    long nitems = 0, njobs = 0, i, k, last_item = -1;
+    int structural_error = 0, rc;
+    size_t n;
+
+    if (!stats) stats = &local;
+    memset(stats, 0, sizeof(*stats));
+    stats->threads = 1;
+    if (len == 0) return ZZK_ERR_ARG;
+    if (nthreads < 1) nthreads = 1;
+
+    memset(&x, 0, sizeof(x));
+    x.reader = r;
+    x.pattern = (const unsigned char *)pattern;
+    x.len = len;
+    x.icase = (flags & ZZK_GREP_ICASE) != 0;
+    x.check_crc = (flags & ZZK_GREP_CRC) != 0;
+    if (x.icase) {
+        folded = (unsigned char *)malloc(len);
+        if (!folded) return nomem();
+        for (n = 0; n < len; n++) folded[n] = fold_ascii(x.pattern[n]);
+        x.pattern = folded;
+    }
+
+    reader_advise(r, r->fmt->header_size, r->total_size - r->fmt->header_size, READER_SEQUENTIAL);
+    rc = scan_chunk_headers(r, r->total_size, &table);
+    if (rc == ZZK_ERR_CORRUPT) {
+        log_msg(ZZK_LOG_WARNING, "Warning: archive structure is damaged after chunk #%ld; "
+                "searching what precedes it.\n", table.count);
+        structural_error = 1;
+        rc = ZZK_OK;
+    }
+    if (rc == ZZK_OK) rc = grep_collect(r, &table, &items, &nitems);
+    if (rc == ZZK_OK) rc = grep_plan(items, nitems, &jobs, &njobs);
+    if (rc == ZZK_OK && njobs > 0) {
+        x.items = items;
+        x.jobs = jobs;
+        if (!r->map) rc = workers_open(&x.io, r->path, nthreads, GREP_SEGMENT_SIZE + 2 * GREP_CONTEXT + len);
+        if (rc == ZZK_OK) stats->threads = run_jobs(nthreads, njobs, grep_job_run, &x);
+        workers_close(&x.io, nthreads);
+    }
+    for (k = 0; rc == ZZK_OK && k < njobs; k++) {
+        if (jobs[k].status == ZZK_ERR_IO) log_msg(ZZK_LOG_ERROR, "Error reading chunk data.\n");
+        else if (jobs[k].status != ZZK_OK) nomem();
+        rc = jobs[k].status;
+    }
+
+    /* 先核对 CRC，再按块顺序回调匹配 */
+    for (i = 0; rc == ZZK_OK && i < nitems; i++) {
+        if (x.check_crc || items[i].status == ZZK_ERR_CORRUPT) grep_check_crc(&items[i], jobs);
+        if (items[i].status != ZZK_OK) stats->bad++;
+        stats->chunks++;
+        stats->bytes += items[i].text_length;
+    }
+    for (k = 0; rc == ZZK_OK && k < njobs; k++) {
+        for (i = 0; i < jobs[k].nhits; i++) {
+            const struct grep_hit *h = &jobs[k].hits[i];
+            m.chunk = items[h->item].index;
+            m.offset = h->offset;
+            m.line = jobs[k].pool + h->line;
+            m.line_len = h->line_len;
+            m.status = items[h->item].status;
+            stats->matches++;
+            if (h->item != last_item) stats->matched_chunks++;
+            last_item = h->item;
+            if (fn) fn(ctx, &m);
+        }
+    }
+    if (rc == ZZK_OK) {
+        if (structural_error) rc = ZZK_ERR_CORRUPT;
+        else if (stats->bad > 0) rc = ZZK_ERR_CRC;
+    }
+
+    for (k = 0; k < njobs; k++) {
+        free(jobs[k].hits);
+        free(jobs[k].pool);
+    }
+    free(jobs);
+    free(items);
+    free(table.items);
+    free(folded);
+    return rc;
+}
+
+/* ========== 词项查找 ========== */
+
+/* 查询中的词项（按收录规则切分与折叠，去重） */
+struct term_key {
+    unsigned char text[TERM_MAX];
+    size_t len;
+    int seen;          /* 回退扫描时：在当前块中出现过 */
+};
+
+struct term_query {
+    struct term_key *keys;
+    long count;
+    long cap;
+    long seen;         /* 当前块中已出现的词项数 */
+};
+
+static int query_add(void *ctx, const unsigned char *term, size_t len) {
+    struct term_query *q = (struct term_query *)ctx;
+    struct term_key *keys;
+    long i;
+
+    for (i = 0; i < q->count; i++) {
+        if (q->keys[i].len == len && memcmp(q->keys[i].text, term, len) == 0) return 0;
+    }
+    if (q->count == q->cap) {
+        long cap = q->cap ? q->cap * 2 : 8;
+        keys = (struct term_key *)realloc(q->keys, sizeof(*keys) * (size_t)cap);
+        if (!keys) return nomem();
+        q->keys = keys;
+        q->cap = cap;
+    }
+    memcpy(q->keys[q->count].text, term, len);
+    q->keys[q->count].len = len;
+    q->count++;
+    return 0;
+}
+
+/* 以 name 开头（不区分大小写）的参数整体作为字段词项 */
+static int query_field(const char *arg, const char *name) {
+    size_t i;
+
+    for (i = 0; name[i] != '\0'; i++) {
+        if (fold_ascii((unsigned char)arg[i]) != (unsigned char)name[i]) return 0;
+    }
+    return 1;
+}
+
+static int query_parse(struct term_query *q, const char *const *args, int nargs) {
+    struct tokenizer t;
+    size_t len;
+    int i, rc = 0;
+
+    for (i = 0; rc == 0 && i < nargs; i++) {
+        len = strlen(args[i]);
+        if (query_field(args[i], "filename:")) {
+            rc = field_term(query_add, q, "filename:", (const unsigned char *)args[i] + 9, len - 9);
+        } else if (query_field(args[i], "description:")) {
+            rc = field_term(query_add, q, "description:", (const unsigned char *)args[i] + 12, len - 12);
+        } else {
+            tokenizer_init(&t, query_add, q);
+            tokenizer_feed(&t, (const unsigned char *)args[i], len);
+            tokenizer_flush(&t);
+            rc = t.rc;
+        }
+    }
+    if (rc == 0 && q->count == 0) {
+        log_msg(ZZK_LOG_ERROR, "Error: query has no searchable terms (words need at least %d characters).\n",
+                TERM_WORD_MIN);
+        rc = ZZK_ERR_ARG;
+    }
+    return rc;
+}
+
+/* term_fn：回退扫描时标记当前块中出现的查询词项，全部出现后提前结束 */
+static int query_match(void *ctx, const unsigned char *term, size_t len) {
+    struct term_query *q = (struct term_query *)ctx;
+    long i;
+
+    for (i = 0; i < q->count; i++) {
+        struct term_key *k = &q->keys[i];
+        if (!k->seen && k->len == len && memcmp(k->text, term, len) == 0) {
+            k->seen = 1;
+            if (++q->seen == q->count) return 1;
+        }
+    }
+    return 0;
+}
+
+/* 在词项索引的目录上二分查找 key。找到返回 1 并给出记录在 Value 中的范围，没有返回 0，损坏返回 -1 */
+static int terms_search(struct zzk_reader *r, u64 value, u64 length, u32 count, const struct term_key *key,
+                        u64 *rec_off, u64 *rec_end) {
+    unsigned char buf[1 + TERM_MAX];
+    const unsigned char *p;
+    u32 lo = 0, hi = count, mid;
+    u64 off, avail, dir = value + 8;
+    size_t n;
+    int c;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (!(p = reader_get(r, dir + 4 * (u64)mid, 4, buf))) return -1;
+        off = be_to_u32(p);
+        if (off < 8 + 4 * (u64)count || off >= length - 8) return -1;
+        avail = length - 8 - off;
+        n = avail > sizeof(buf) ? sizeof(buf) : (size_t)avail;
+        if (!(p = reader_get(r, value + off, n, buf)) || p[0] == 0 || (size_t)p[0] + 1 > n) return -1;
+        c = memcmp(p + 1, key->text, p[0] < key->len ? p[0] : key->len);
+        if (c == 0) c = p[0] < key->len ? -1 : (p[0] > key->len ? 1 : 0);
+        if (c < 0) {
+            lo = mid + 1;
+        } else if (c > 0) {
+            hi = mid;
+        } else {
+            *rec_off = off;
+            *rec_end = length - 8;
+            if (mid + 1 < count) {
+                if (!(p = reader_get(r, dir + 4 * (u64)(mid + 1), 4, buf))) return -1;
+                *rec_end = be_to_u32(p);
+                if (*rec_end < off || *rec_end > length - 8) return -1;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* 读取并解码一个词项的块编号；*chunks 由调用方释放 */
+static int terms_postings(struct zzk_reader *r, u64 value, u64 rec_off, u64 rec_end, u32 covered,
+                          u32 **chunks, u32 *count) {
+    struct term_record rec;
+    unsigned char *buf = NULL;
+    const unsigned char *p;
+    size_t n = (size_t)(rec_end - rec_off);
+    int rc = ZZK_OK;
+
+    *chunks = NULL;
+    if (!r->map && !(buf = (unsigned char *)malloc(n > 0 ? n : 1))) return nomem();
+    p = reader_get(r, value + rec_off, n, buf);
+    if (!p || term_record_parse(p, n, &rec) != 0) {
+        rc = ZZK_ERR_CORRUPT;
+    } else if (!(*chunks = (u32 *)malloc(sizeof(u32) * (size_t)(rec.count ? rec.count : 1)))) {
+        rc = nomem();
+    } else if (term_record_chunks(&rec, covered, *chunks) != 0) {
+        free(*chunks);
+        *chunks = NULL;
+        rc = ZZK_ERR_CORRUPT;
+    } else {
+        *count = rec.count;
+    }
+    free(buf);
+    return rc;
+}
+
+/* 两个升序块编号表取交集，结果留在 a 中 */
+static u32 postings_intersect(u32 *a, u32 na, const u32 *b, u32 nb) {
+    u32 i = 0, j = 0, n = 0;
+
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (a[i] > b[j]) {
+            j++;
+        } else {
+            a[n++] = a[i];
+            i++;
+            j++;
+        }
+    }
+    return n;
+}
+
+/* 经词项索引查询：每个词项二分定位后取块编号的交集。索引损坏返回 ZZK_ERR_CORRUPT */
+static int lookup_index(struct zzk_reader *r, u64 offset, u64 length, u32 count, struct term_query *q,
+                        zzk_lookup_fn fn, void *ctx, struct zzk_lookup_stats *stats) {
+    unsigned char buf[4];
+    const unsigned char *p;
+    u64 value = offset + r->fmt->chunk_header, rec_off, rec_end;
+    u32 *result = NULL, *chunks, nresult = 0, n = 0, covered, i;
+    long k;
+    int rc = ZZK_OK, found;
+
+    if (!(p = reader_get(r, value, 4, buf))) return ZZK_ERR_CORRUPT;
+    covered = be_to_u32(p);
+    for (k = 0; rc == ZZK_OK && k < q->count && (k == 0 || nresult > 0); k++) {
+        found = terms_search(r, value, length, count, &q->keys[k], &rec_off, &rec_end);
+        if (found < 0) {
+            rc = ZZK_ERR_CORRUPT;
+        } else if (found == 0) {
+            nresult = 0;
+        } else if ((rc = terms_postings(r, value, rec_off, rec_end, covered, &chunks, &n)) == ZZK_OK) {
+            if (k == 0) {
+                result = chunks;
+                nresult = n;
+            } else {
+                nresult = postings_intersect(result, nresult, chunks, n);
+                free(chunks);
+            }
+        }
+    }
+    if (rc == ZZK_OK) {
+        stats->indexed = 1;
+        stats->terms = (long)count;
+        for (i = 0; i < nresult; i++) {
+            stats->matches++;
+            if (fn) fn(ctx, (long)result[i]);
+        }
+    }
+    free(result);
+    return rc;
+}
+
+/* 没有可用的词项索引时逐块切分文本 */
+static int lookup_scan(struct zzk_reader *r, struct term_query *q, zzk_lookup_fn fn, void *ctx,
+                       struct zzk_lookup_stats *stats) {
+    struct chunk_table table = { NULL, 0, 0 };
+    long i, k;
+    int rc, structural_error = 0;
+
+    reader_advise(r, r->fmt->header_size, r->total_size - r->fmt->header_size, READER_SEQUENTIAL);
+    rc = scan_chunk_headers(r, r->total_size, &table);
+    if (rc == ZZK_ERR_CORRUPT) {
+        log_msg(ZZK_LOG_WARNING, "Warning: archive structure is damaged after chunk #%ld; "
+                "searching what precedes it.\n", table.count);
+        structural_error = 1;
+        rc = ZZK_OK;
+    }
+    for (i = 0; rc == ZZK_OK && i < table.count; i++) {
+        const struct chunk_entry *e = &table.items[i];
+        if (e->type == TYPE_TERMS) stats->stale = 1;
+        if (e->type != TYPE_TEXT && e->type != TYPE_LZ) continue;
+        for (k = 0; k < q->count; k++) q->keys[k].seen = 0;
+        q->seen = 0;
+        stats->scanned++;
+        rc = chunk_terms_status(i + 1, chunk_terms(r, e, query_match, q));
+        if (rc == ZZK_OK && q->seen == q->count) {
+            stats->matches++;
+            if (fn) fn(ctx, i + 1);
+        }
+    }
+    free(table.items);
+    if (rc == ZZK_OK && structural_error) rc = ZZK_ERR_CORRUPT;
+    return rc;
+}
+
+int zzk_reader_lookup(zzk_reader *r, const char *const *query, int nquery, zzk_lookup_fn fn, void *ctx,
+                      struct zzk_lookup_stats *stats) {
+    struct term_query q;
+    struct zzk_lookup_stats local;
+    unsigned char buf[8];
+    const unsigned char *p;
+    u64 end = r->total_size, index_offset, offset, length;
+    u32 index_count = 0, count;
+    int rc, has_index;
+
+    if (!stats) stats = &local;
+    memset(stats, 0, sizeof(*stats));
+    memset(&q, 0, sizeof(q));
+    if ((rc = query_parse(&q, query, nquery)) != ZZK_OK) {
+        free(q.keys);
+        return rc;
+    }
+
+    /* 词项索引须紧邻末尾（或尾部索引之前），且覆盖其前的全部块 */
+    has_index = locate_index(r, &index_offset, &index_count);
+    if (has_index) end = index_offset;
+    rc = ZZK_ERR_NOT_FOUND;
+    if (locate_terms(r, end, &offset, &length, &count)) {
+        p = reader_get(r, offset + r->fmt->chunk_header, 4, buf);
+        if (p && has_index && (u64)be_to_u32(p) + 1 != (u64)index_count) {
+            stats->stale = 1;
+        } else if (p) {
+            rc = lookup_index(r, offset, length, count, &q, fn, ctx, stats);
+            if (rc == ZZK_ERR_CORRUPT) {
+                log_msg(ZZK_LOG_WARNING, "Warning: term index is damaged; scanning instead.\n");
+            }
+        }
+    }
+    if (rc == ZZK_ERR_NOT_FOUND || rc == ZZK_ERR_CORRUPT) {
+        stats->matches = 0;
+        rc = lookup_scan(r, &q, fn, ctx, stats);
+    }
+    free(q.keys);
+    return rc;
+}
+
+/* ========== 追加服务 ========== */
+
+/*
+ * 服务端需要线程与原子操作：无锁队列使用 GCC 的 __sync 内建函数（GCC / Clang 均支持）。
+ * 客户端只需要 POSIX 套接字。
+ */
+#if defined(ZZK1_THREADS) && defined(__GNUC__)
+#define ZZK1_SERVE
+#endif
+
+#ifdef ZZK1_POSIX
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+/* 读满 len 字节。成功返回 1，开头即遇 EOF 返回 0，中途 EOF 或出错返回 -1 */
+static int read_full(int fd, void *buf, size_t len) {
+    unsigned char *p = (unsigned char *)buf;
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = read(fd, p + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return (n == 0 && done == 0) ? 0 : -1;
+        done += (size_t)n;
+    }
+    return 1;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    const unsigned char *p = (const unsigned char *)buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(fd, p, len, SEND_FLAGS);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* 填充 Unix 套接字地址；路径过长返回 ZZK_ERR_ARG */
+static int socket_address(struct sockaddr_un *addr, const char *path) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        log_msg(ZZK_LOG_ERROR, "Error: socket path is too long: %s\n", path);
+        return ZZK_ERR_ARG;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return ZZK_OK;
+}
+
+#endif /* ZZK1_POSIX */
+
+#ifdef ZZK1_SERVE
+
+/* 每个连接最多在途的请求数。应答 8 字节，窗口内的应答总能放进套接字缓冲区，写入线程不会被慢客户端阻塞 */
+#define SERVE_WINDOW 256
+
+struct serve_conn {
+    int fd;
+    long refs;                 /* 读取线程 + 在途请求，归零时关闭并释放 */
+    long inflight;
+    struct serve_conn *prev, *next;
+};
+
+struct serve_request {
+    struct serve_request *next;
+    struct serve_conn *conn;
+    u32 type;
+    size_t len;
+    int status;                /* 读取线程预先拒绝时非 ZZK_OK */
+    long chunk;
+    unsigned char *data;       /* 紧跟在结构体之后 */
+};
+
+struct serve_state {
+    struct serve_request *head;   /* 无锁栈：生产者 CAS 压入，写入线程整体取走 */
+    int wake[2];                  /* 自管道：栈由空变非空时唤醒写入线程 */
+    int stopping;
+    int fatal;
+    zzk_writer *writer;
+    struct zzk_serve_stats stats;
+
+    pthread_mutex_t lock;         /* 保护连接登记表与 live */
+    pthread_cond_t idle;
+    struct serve_conn *conns;
+    long live;
+};
+
+static int atomic_get(int *p) {
+    return __sync_fetch_and_add(p, 0);
+}
+
+static void atomic_set(int *p) {
+    __sync_lock_test_and_set(p, 1);
+}
+
+static void serve_wake(struct serve_state *s) {
+    char c = 0;
+    /* 管道写满说明已有未处理的唤醒，丢弃即可 */
+    if (write(s->wake[1], &c, 1) < 0) {
+    }
+}
+
+static void serve_push(struct serve_state *s, struct serve_request *req) {
+    struct serve_request *old;
+
+    do {
+        old = s->head;
+        req->next = old;
+    } while (!__sync_bool_compare_and_swap(&s->head, old, req));
+    if (!old) serve_wake(s);
+}
+
+/* 取走栈中的全部请求并反转为到达顺序 */
+static struct serve_request *serve_take(struct serve_state *s) {
+    struct serve_request *list, *fifo = NULL, *next;
+
+    do {
+        list = s->head;
+    } while (list && !__sync_bool_compare_and_swap(&s->head, list, (struct serve_request *)NULL));
+    while (list) {
+        next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+    }
+    return fifo;
+}
+
+static void conn_release(struct serve_conn *c) {
+    if (__sync_sub_and_fetch(&c->refs, 1) == 0) {
+        close(c->fd);
+        free(c);
+    }
+}
+
+/* 写入线程：每批逐条追加，整批提交一次，再按顺序应答 */
+static void serve_batch(struct serve_state *s, struct serve_request *batch) {
+    struct serve_request *req, *next;
+    long appended = 0;
+    int rc;
+
+    for (req = batch; req; req = req->next) {
+        if (req->status != ZZK_OK) continue;
+        if (atomic_get(&s->fatal)) {
+            req->status = ZZK_ERR_IO;
+            continue;
+        }
+        rc = zzk_writer_append(s->writer, req->type, req->data, req->len);
+        if (rc == ZZK_OK) rc = zzk_writer_chunk_count(s->writer, &req->chunk);
+        req->status = rc;
+        if (rc == ZZK_OK) appended++;
+        else if (writer_usable(s->writer) != ZZK_OK) atomic_set(&s->fatal);
+    }
+    if (appended > 0) {
+        rc = zzk_writer_commit(s->writer);
+        if (rc == ZZK_OK) {
+            s->stats.batches++;
+            s->stats.records += appended;
+        } else {
+            /* 文件头没有声明这些块，客户端不能认为写入成功 */
+            for (req = batch; req; req = req->next) {
+                if (req->status == ZZK_OK) req->status = rc;
+            }
+            atomic_set(&s->fatal);
+        }
+    }
+
+    for (req = batch; req; req = next) {
+        unsigned char reply[8];
+        next = req->next;
+        if (req->status != ZZK_OK) s->stats.failed++;
+        u32_to_be((u32)-req->status, reply);
+        u32_to_be(req->status == ZZK_OK ? (u32)req->chunk : 0, reply + 4);
+        write_full(req->conn->fd, reply, sizeof(reply));  /* 客户端已断开时忽略 */
+        __sync_sub_and_fetch(&req->conn->inflight, 1);
+        conn_release(req->conn);
+        free(req);
+    }
+}
+
+static void *serve_writer_main(void *arg) {
+    struct serve_state *s = (struct serve_state *)arg;
+    struct serve_request *batch;
+    struct pollfd pfd;
+    char drain[64];
+
+    for (;;) {
+        batch = serve_take(s);
+        if (batch) {
+            serve_batch(s, batch);
+            continue;
+        }
+        if (atomic_get(&s->stopping)) break;
+        pfd.fd = s->wake[0];
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, -1) > 0) {
+            while (read(s->wake[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+    }
+    return NULL;
+}
+
+/* 构造一条请求；内存不足时退而构造不带数据的失败应答 */
+static struct serve_request *serve_request_new(struct serve_conn *c, u32 type, size_t len) {
+    struct serve_request *req = (struct serve_request *)malloc(sizeof(*req) + len);
+
+    if (!req) {
+        req = (struct serve_request *)malloc(sizeof(*req));
+        if (!req) return NULL;
+        req->status = ZZK_ERR_NOMEM;
+        len = 0;
+    } else {
+        req->status = ZZK_OK;
+    }
+    req->conn = c;
+    req->type = type;
+    req->len = len;
+    req->chunk = 0;
+    req->data = (unsigned char *)(req + 1);
+    return req;
+}
+
+struct serve_conn_arg {
+    struct serve_state *state;
+    struct serve_conn *conn;
+};
+
+/* 连接线程：读取请求并送入队列，超出在途窗口时稍候 */
+static void *serve_conn_main(void *arg) {
+    struct serve_conn_arg a = *(struct serve_conn_arg *)arg;
+    struct serve_state *s = a.state;
+    struct serve_conn *c = a.conn;
+    unsigned char hdr[8], scratch[4096];
+    struct serve_request *req;
+    struct timespec pause;
+    u32 type, len;
+    int ok = 1;
+
+    free(arg);
+    pause.tv_sec = 0;
+    pause.tv_nsec = 1000000;
+    while (ok && read_full(c->fd, hdr, sizeof(hdr)) == 1) {
+        type = be_to_u32(hdr);
+        len = be_to_u32(hdr + 4);
+
+        if (len > ZZK_SERVE_MAX_RECORD) {
+            /* 不读取超限的正文：应答后结束连接 */
+            req = serve_request_new(c, type, 0);
+            if (!req) break;
+            req->status = ZZK_ERR_OVERFLOW;
+            ok = 0;
+        } else {
+            req = serve_request_new(c, type, len);
+            if (!req) break;
+            if (req->status == ZZK_OK) {
+                if (read_full(c->fd, req->data, len) != 1) {
+                    free(req);
+                    break;
+                }
+            } else {
+                u32 left = len;
+                while (ok && left > 0) {
+                    size_t n = left < sizeof(scratch) ? left : sizeof(scratch);
+                    if (read_full(c->fd, scratch, n) != 1) ok = 0;
+                    left -= (u32)n;
+                }
+                if (!ok) {
+                    free(req);
+                    break;
+                }
+            }
+            if (req->status == ZZK_OK && type != TYPE_TEXT && type != TYPE_BINARY) req->status = ZZK_ERR_ARG;
+        }
+
+        while (__sync_fetch_and_add(&c->inflight, 0) >= SERVE_WINDOW) nanosleep(&pause, NULL);
+        __sync_add_and_fetch(&c->inflight, 1);
+        __sync_add_and_fetch(&c->refs, 1);
+        serve_push(s, req);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if (c->prev) c->prev->next = c->next;
+    else s->conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+    s->live--;
+    pthread_cond_signal(&s->idle);
+    pthread_mutex_unlock(&s->lock);
+    conn_release(c);
+    return NULL;
+}
+
+/* 登记连接并启动其线程；失败时关闭连接 */
+static void serve_accept(struct serve_state *s, int fd) {
+    struct serve_conn *c = (struct serve_conn *)malloc(sizeof(*c));
+    struct serve_conn_arg *a = (struct serve_conn_arg *)malloc(sizeof(*a));
+    pthread_attr_t attr;
+    pthread_t thread;
+    int started;
+
+    if (!c || !a) {
+        nomem();
+        free(c);
+        free(a);
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    c->refs = 1;
+    c->inflight = 0;
+    a->state = s;
+    a->conn = c;
+
+    pthread_mutex_lock(&s->lock);
+    c->prev = NULL;
+    c->next = s->conns;
+    if (s->conns) s->conns->prev = c;
+    s->conns = c;
+    s->live++;
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    started = pthread_create(&thread, &attr, serve_conn_main, a) == 0;
+    pthread_attr_destroy(&attr);
+    if (started) {
+        s->stats.connections++;
+        return;
+    }
+
+    log_msg(ZZK_LOG_WARNING, "Warning: cannot start connection thread; connection dropped.\n");
+    pthread_mutex_lock(&s->lock);
+    if (c->next) c->next->prev = NULL;
+    s->conns = c->next;
+    s->live--;
+    pthread_mutex_unlock(&s->lock);
+    free(a);
+    conn_release(c);
+}
+
+/* 路径已被占用时探测：连接被拒绝说明是上次异常退出残留的套接字 */
+static int socket_is_stale(const struct sockaddr_un *addr) {
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0), stale;
+
+    if (probe < 0) return 0;
+    stale = connect(probe, (const struct sockaddr *)addr, sizeof(*addr)) != 0 && errno == ECONNREFUSED;
+    close(probe);
+    return stale;
+}
+
+static int serve_listen(const char *path, int *fd_out) {
+    struct sockaddr_un addr;
+    int fd, rc, bound;
+
+    if ((rc = socket_address(&addr, path)) != ZZK_OK) return rc;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return io_error("Error creating socket");
+
+    bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    if (!bound && errno == EADDRINUSE) {
+        if (socket_is_stale(&addr)) {
+            log_msg(ZZK_LOG_WARNING, "Warning: replacing stale socket %s\n", path);
+            unlink(path);
+            bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        } else {
+            errno = EADDRINUSE;
+        }
+    }
+    if (!bound || listen(fd, 64) != 0) {
+        rc = io_error("Error binding socket");
+        close(fd);
+        return rc;
+    }
+    *fd_out = fd;
+    return ZZK_OK;
+}
+
+#endif /* ZZK1_SERVE */
+
+#ifdef ZZK1_SERVE
+/* 启动失败或退出时释放监听套接字、自管道与锁 */
+static void serve_cleanup(struct serve_state *s, int listen_fd, const char *socket_path) {
+    close(listen_fd);
+    unlink(socket_path);
+    close(s->wake[0]);
+    close(s->wake[1]);
+    pthread_cond_destroy(&s->idle);
+    pthread_mutex_destroy(&s->lock);
+}
+#endif
+
+/*
+ * 主线程接受连接并等待停止；退出时先断开全部连接的读取端，
+ * 等连接线程把已读到的请求送入队列后，写入线程处理完剩余请求再关闭归档。
+ */
+int zzk_serve(const char *archive, const char *socket_path, const struct zzk_options *opt,
+              const volatile sig_atomic_t *stop, struct zzk_serve_stats *stats) {
+#ifdef ZZK1_SERVE
+    struct serve_state s;
+    struct zzk_options wopt = opt ? *opt : default_options;
+    struct serve_conn *c;
+    struct pollfd pfd;
+    pthread_t writer_thread;
+    long chunks;
+    int listen_fd = -1, fd, rc, close_rc;
+
+    zzk_init();
+    memset(&s, 0, sizeof(s));
+    if (stats) memset(stats, 0, sizeof(*stats));
+
+    /* 每批只提交一次：data / group 都改为只在批末提交时落盘 */
+    if (wopt.sync_mode != ZZK_SYNC_NONE) {
+        wopt.sync_mode = ZZK_SYNC_GROUP;
+        wopt.group_records = 0;
+        wopt.group_ms = 0;
+    }
+    if ((rc = zzk_writer_open(&s.writer, archive, &wopt)) != ZZK_OK) return rc;
+    /* 先统计已有块数，之后每条记录的编号随追加递增 */
+    rc = zzk_writer_chunk_count(s.writer, &chunks);
+    if (rc == ZZK_OK) rc = serve_listen(socket_path, &listen_fd);
+    if (rc == ZZK_OK && pipe(s.wake) != 0) {
+        rc = io_error("Error creating pipe");
+        close(listen_fd);
+        unlink(socket_path);
+    }
+    if (rc != ZZK_OK) {
+        zzk_writer_abort(s.writer);
+        return rc;
+    }
+    fcntl(s.wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(s.wake[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.idle, NULL);
+    if (pthread_create(&writer_thread, NULL, serve_writer_main, &s) != 0) {
+        log_msg(ZZK_LOG_ERROR, "Error: cannot start writer thread.\n");
+        serve_cleanup(&s, listen_fd, socket_path);
+        zzk_writer_abort(s.writer);
+        return ZZK_ERR_IO;
+    }
+
+    pfd.fd = listen_fd;
+    pfd.events = POLLIN;
+    while (!(stop && *stop) && !atomic_get(&s.fatal)) {
+        if (poll(&pfd, 1, 200) <= 0) continue;
+        fd = accept(listen_fd, NULL, NULL);
+        if (fd >= 0) serve_accept(&s, fd);
+    }
+
+    pthread_mutex_lock(&s.lock);
+    for (c = s.conns; c; c = c->next) shutdown(c->fd, SHUT_RD);
+    while (s.live > 0) pthread_cond_wait(&s.idle, &s.lock);
+    pthread_mutex_unlock(&s.lock);
+    atomic_set(&s.stopping);
+    serve_wake(&s);
+    pthread_join(writer_thread, NULL);
+
+    rc = s.fatal ? ZZK_ERR_IO : ZZK_OK;
+    close_rc = zzk_writer_close(s.writer);
+    if (rc == ZZK_OK) rc = close_rc;
+    serve_cleanup(&s, listen_fd, socket_path);
+    if (stats) *stats = s.stats;
+    return rc;
+#else
+    (void)archive;
+    (void)socket_path;
+    (void)opt;
+    (void)stop;
+    (void)stats;
+    log_msg(ZZK_LOG_ERROR, "Error: serve requires a build with -DZZK1_THREADS.\n");
+    return ZZK_ERR_UNSUPPORTED;
+#endif
+}
+
+struct zzk_client {
+    int fd;
+};
+
+int zzk_client_connect(zzk_client **out, const char *socket_path) {
+#ifdef ZZK1_POSIX
+    struct sockaddr_un addr;
+    zzk_client *c;
+    int fd, rc;
+
+    if ((rc = socket_address(&addr, socket_path)) != ZZK_OK) return rc;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return io_error("Error creating socket");
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        rc = io_error("Error connecting to server");
+        close(fd);
+        return rc;
+    }
+    c = (zzk_client *)malloc(sizeof(*c));
+    if (!c) {
+        close(fd);
+        return nomem();
+    }
+    c->fd = fd;
+    *out = c;
+    return ZZK_OK;
+#else
+    (void)out;
+    (void)socket_path;
+    log_msg(ZZK_LOG_ERROR, "Error: the client requires a build with -DZZK1_POSIX.\n");
+    return ZZK_ERR_UNSUPPORTED;
+#endif
+}
+
+int zzk_client_append(zzk_client *c, zzk_u32 type, const void *data, size_t len, long *chunk) {
+#ifdef ZZK1_POSIX
+    unsigned char hdr[8], reply[8];
+    u32 status;
+
+    if (len > ZZK_SERVE_MAX_RECORD) {
+        log_msg(ZZK_LOG_ERROR, "Error: record exceeds the server limit (%lu bytes).\n", ZZK_SERVE_MAX_RECORD);
+        return ZZK_ERR_OVERFLOW;
+    }
+    u32_to_be(type, hdr);
+    u32_to_be((u32)len, hdr + 4);
+    if (write_full(c->fd, hdr, sizeof(hdr)) != 0 || write_full(c->fd, data, len) != 0) {
+        return io_error("Error sending request");
+    }
+    if (read_full(c->fd, reply, sizeof(reply)) != 1) {
+        log_msg(ZZK_LOG_ERROR, "Error: connection closed by server.\n");
+        return ZZK_ERR_IO;
+    }
+    status = be_to_u32(reply);
+    if (status != 0) {
+        log_msg(ZZK_LOG_ERROR, "Error: server rejected record: %s\n", zzk_strerror(-(int)status));
+        return -(int)status;
+    }
+    if (chunk) *chunk = (long)be_to_u32(reply + 4);
+    return ZZK_OK;
+#else
+    (void)c;
+    (void)type;
+    (void)data;
+    (void)len;
+    (void)chunk;
+    return ZZK_ERR_UNSUPPORTED;
+#endif
+}
+
+void zzk_client_close(zzk_client *c) {
+#ifdef ZZK1_POSIX
+    close(c->fd);
+#endif
+    free(c);
+}
@@ -12,7 +12,7 @@
  *   - UTF-8 文本优先，人眼可读
  *   - 追加模式，只增不改，降低数据丢失风险
  *   - 大端序，消除硬件架构差异
- *   - 32 位整数，4GB 上限，保持简单
+ *   - 32 位长度字段，4GB 上限，保持简单；需要更大归档时使用 64 位的 ZZK2 变体
  *
  * 文件结构:
  *   [文件头: Magic(4B) + TotalSize(4B) + Reserved(4B)]
@@ -20,754 +20,2409 @@
  *
  *   Magic Number: 0x5A5A4B31 ("ZZK1")
  *
+ *   ZZK2 变体（create --zzk2 或 upgrade 生成）: TotalSize 与 Length 扩展为 8 字节，
+ *   其余字段不变，CRC32 仍覆盖 Type + Length + Value:
+ *   [文件头: Magic(4B) + TotalSize(8B) + Reserved(4B)]
+ *   [数据块: Type(4B) + Length(8B) + Value(Length B) + CRC32(4B)] ...
+ *   Magic Number: 0x5A5A4B32 ("ZZK2")。所有命令按 Magic 自动识别两种格式。
+ *
  *   数据类型:
  *     0x00000001 - UTF-8 文本
  *     0x00000002 - 二进制文件（前一个块为其元数据）
+ *     0x00000003 - 尾部索引（可选，见"索引块"一节）
+ *     0x00000004 - 流分片: Flags(4B) + Data；连续的分片组成一个流，
+ *                  Flags 位 0 标记最后一片（前一个块为流的元数据）
+ *     0x00000005 - 内容引用: Chunk(4B) + Length(8B) + CRC32(4B)，指向内容相同的二进制块
+ *     0x00000006 - 压缩块: 内置 LZ 编码的文本或二进制内容，编码规则见 libzzk1.c "LZ 压缩"
+ *     0x00000007 - 分块校验表: BlockSize(4B) + Length(8B) + CRC32(4B) + N × CRC32(4B)，
+ *                  前一个二进制块按段的 CRC32
+ *     0x00000008 - 词项索引: 文本块中的词项及其所在块，find 据此查找，布局见 libzzk1.c "词项索引"
+ *     0x00000009 - 检查点: "ZCKP" + Offset(8B) + Chunks(8B) + Digest(4B)，
+ *                  之前的块数与全部块 CRC32 的滚动摘要，recover 据此只校验受损的尾部
  *     0xFFFFFFFF - 填充/对齐
  *
  * 编译与使用:
- *   gcc -std=c89 -Wall -o zzk1 zzk1.c
+ *   gcc -std=c89 -Wall -o zzk1 zzk1.c libzzk1.c
+ *
+ *   读写逻辑位于库 libzzk1（接口 zzk1.h，实现 libzzk1.c），本文件只负责命令行解析与输出；
+ *   其他程序可直接链接该库，静态库与共享库的构建方法见 zzk1.h。平台选项对库生效。
+ *
+ *   x86-64 上的 GCC/Clang 会自动编入 PCLMUL 加速的 CRC32 内核（运行时检测 CPU），
+ *   -DZZK1_NO_SIMD 可禁用，回到纯可移植实现。
+ *
+ *   POSIX 构建（list/extract/verify 通过 mmap 零拷贝读取，64 位文件偏移）:
+ *   gcc -std=c89 -Wall -DZZK1_POSIX -o zzk1 zzk1.c libzzk1.c
  *
- *   ./zzk1 create    <archive> <text>                 创建归档
- *   ./zzk1 append    <archive> <text>                 追加文本
- *   ./zzk1 append-file <archive> <file> <description> 追加文件
- *   ./zzk1 list      <archive>                        列出内容
- *   ./zzk1 extract   <archive> <chunk_index> <output>  提取块
+ *   多线程构建（verify 等命令在多核上并行，同时启用 POSIX 扩展）:
+ *   gcc -std=c89 -Wall -DZZK1_THREADS -pthread -o zzk1 zzk1.c libzzk1.c
+ *
+ *   Linux 构建（append-file/extract 由内核 copy_file_range/sendfile 直接搬运数据，follow 用 inotify 等待）:
+ *   gcc -std=c89 -Wall -DZZK1_LINUX -DZZK1_THREADS -pthread -o zzk1 zzk1.c libzzk1.c
+ *
+ *   任一构建加 -DZZK1_STATS 编入运行统计（--stats）；不加时插桩不产生任何代码。
+ *
+ *   ./zzk1 [--sync MODE] [--sync-report] [--stats[=json]] [--dedup] [--block-crc] [--checkpoint]
+ *          [--pipeline[=N:SIZE]] <command> ...
+ *                                                     全局选项，见 libzzk1.c "持久化策略"
+ *   ./zzk1 create    [--zzk2] <archive> <text>        创建归档（--zzk2 使用 64 位格式）
+ *   ./zzk1 append    [--compress] <archive> <text>    追加文本（--compress 写成压缩块）
+ *   ./zzk1 append-file [--compress] <archive> <file> <description> 追加文件
+ *   ./zzk1 append-batch <archive> <manifest|->        单次事务批量追加
+ *   ./zzk1 append-dir [--incremental] [--compress] [--threads N] [--description TEXT] <archive> <dir>  并行追加目录树中的文件
+ *   ./zzk1 append-stream <archive> <desc> [src] [piece] 流式追加长度未知的输入
+ *   ./zzk1 list      [--headers-only] [--format text|tsv|json] <archive>  列出内容
+ *   ./zzk1 extract   [--no-verify] [--range OFF:LEN] <archive> <index> <output>  提取块（或其中的字节范围）
+ *   ./zzk1 extract-many [--no-verify] [--threads N] <archive> <dir> <index|A-B>...  一遍提取多个块到 dir
+ *   ./zzk1 extract-all  [--no-verify] [--threads N] <archive> <dir>  一遍提取全部内容块到 dir
+ *   ./zzk1 merge     [--verify] [--threads N] <target> <source>...  把来源归档的块原样追加到 target
+ *   ./zzk1 follow    [--once] [--from-end] [--cursor FILE] <archive>  按帧输出新追加的块并等待增长
+ *   ./zzk1 index     [--terms] <archive>              重建尾部索引块（--terms 同时重建词项索引）
+ *   ./zzk1 verify    <archive> [threads]              并行校验全部块的 CRC32
+ *   ./zzk1 grep      [-i] [--crc] <archive> <pattern> [threads]  并行查找文本块中的子串
+ *   ./zzk1 find      <archive> <word|filename:NAME|description:TEXT>...  查找包含全部词项的文本块
+ *   ./zzk1 upgrade   <archive> [output]               ZZK1 转换为 ZZK2（省略 output 时原地替换）
+ *   ./zzk1 recover   [--full] [--dry-run] <archive>   截掉受损的尾部，TotalSize 回到最长的完好前缀
+ *   ./zzk1 serve     <archive> <socket>               追加服务（多线程构建），经 Unix 套接字接收记录
+ *   ./zzk1 submit    <socket> <text>                  经 serve 追加文本
+ *   ./zzk1 serve-load <socket> [clients] [records] [size]  并发压测 serve
+ *   ./zzk1 generate  [options] <archive>              生成合成归档（块数、大小分布、文本/二进制比例可配）
+ *   ./zzk1 bench     [options] <dir>                  在 dir 下生成合成归档并计时各项操作
+ *   ./zzk1 selftest                                   自检（CRC32 内核一致性）
  *
  *   append-file 生成两个相邻块：元数据(文本) + 文件内容(二进制)。
  *   提取二进制文件时，使用二进制块的索引（元数据块索引 + 1）。
+ *   append-stream 生成 元数据块 + 若干 STREAM 分片；提取第一片即可还原整个流。
+ *   执行过 index 的归档在每次追加时自动刷新索引，extract 据此直接跳转。
+ *   extract-many / extract-all 只打开一次归档、扫描一遍块头，按偏移顺序一遍提取全部选中的块：
+ *   二进制内容写到 dir 下其元数据记录的 Filename（去掉开头的 / 与 .. 路径段；纯 C89 构建只取文件名），
+ *   其他块写为 chunk-N.txt / chunk-N.bin，已有的文件不覆盖（改名为 name.N）；
+ *   extract-all 跳过元数据与索引等内部块。提取在少量工作者（默认至多 4 个）上并行，
+ *   一个块的写出与其他块的 CRC 校验同时进行。
+ *   默认只 fflush；--sync data 逐次 fdatasync，--sync group:64,10ms 按 64 条或 10 毫秒组提交，
+ *   数据总是先于 TotalSize 落盘。--sync-report 输出提交次数与延迟，便于比较各模式的代价。
+ *   --compress 把内容按 256KB 切成独立的块并行压缩，块的 CRC32 照常覆盖压缩后的字节，
+ *   另存解压内容的 CRC32，extract / list 解压时核对；verify 只校验存储的字节，无需解压。
+ *   --dedup 时 append-file / append-batch 遇到归档中已有的文件内容只写 元数据块 + 引用块，
+ *   去重表在打开时由索引或一遍块头扫描建立（以块的 CRC32 与长度为键，命中后逐字节确认）；
+ *   extract 引用块得到原内容。
+ *   --block-crc 时 append-file 与 append-batch 的文件记录在二进制块后追加分块校验表（每 64KB 一个 CRC32），
+ *   extract --range 据此只读取并校验范围所在的段；没有校验表的块回退为整块校验，
+ *   压缩块只解码与范围相交的块。
+ *   grep 在 TEXT 块（含压缩的文本块）中并行查找字面子串（SSE2 首尾字节过滤），
+ *   按块顺序输出 块编号 @ 文本偏移 与匹配所在行的摘要；-i 忽略 ASCII 大小写，
+ *   --crc 在同一遍读取中校验被搜索块的 CRC32。
+ *   index --terms 另建词项索引块（文本块中的单词与元数据的 Filename / Description 字段），
+ *   之后每次追加在关闭时只补充新写入的文本块；find 在索引上二分查找，只读取命中的记录，
+ *   没有词项索引或索引已过时（其后有旧版工具追加的块）时逐块扫描，结果相同。
+ *   --pipeline（多线程构建）时 append-file 等把大于一个缓冲区的内容经三段流水线写入：读取线程、CRC 线程
+ *   与写出共用一组环形缓冲区（默认 4 个 1MB，--pipeline=8:4M 指定个数与大小），读源、算 CRC 与写归档同时进行，
+ *   吞吐接近源与目标中较慢的设备；Linux 构建中它取代内核侧拷贝。
+ *   append-dir（POSIX 构建）遍历目录树，把普通文件按路径顺序各追加为一条 元数据块 + 二进制块 记录，
+ *   元数据另含 Modified（修改时间，Unix 秒）与 Hash（内容的 CRC32，如 crc32:1a2b3c4d）两行；
+ *   文件在工作者上读取并计算 Hash，由一个写入者按顺序写出，结束时只更新一次 TotalSize。
+ *   --incremental 跳过大小、修改时间与 Hash 都与归档中同名文件最近一条记录相同的文件（仍需读取以计算 Hash）；
+ *   Filename 即遍历得到的路径，增量运行须使用同样的目录参数。--compress 与 append-file 相同；--dedup / --block-crc 等全局选项照常生效。
+ *   merge 只读一遍来源的块头，把数据区按块边界整段复制到 target（Linux 构建映射模式下走内核侧拷贝），
+ *   块的 CRC32 原样保留、不重新计算；尾部索引、词项索引与检查点不复制，引用块按合并后的编号重写，
+ *   全部来源写完后只更新一次 TotalSize，任一来源失败时整次合并撤回。来源须与 target 同格式（ZZK1 先 upgrade）；
+ *   --verify 在复制的同时并行校验来源全部块的 CRC32（--threads 指定工作者数），有不一致时不合并。
+ *   follow 从游标（--cursor 文件，没有时从第一个块开始；--from-end 从当前末尾开始）起只读取此后提交的块头，
+ *   把内容块写成帧 Chunk(8B) + Type(4B) + Length(8B) + Value + CRC32(4B)（大端序，CRC32 覆盖帧内之前的全部字节），
+ *   然后等待归档增长（Linux 构建用 inotify，其他 POSIX 构建定时检查文件头），--once 只输出一轮就退出。
+ *   游标是 下一个块的偏移 + 已经过的块数 + 最后一个块的 CRC32，每轮输出后保存；归档被替换或截短时拒绝继续。
+ *   末尾的索引块会被下一次追加覆盖，游标总停在它之前。
+ *   list 按片（每次至多 1MB）写出文本块并计算 CRC32，压缩的文本块逐块解压写出，内存占用都与块大小无关；--headers-only 只读取块头与
+ *   存储的 CRC32，列出 编号、类型、偏移、长度与 CRC32，不读取任何内容字节。--format tsv 每块一行（首行为列名
+ *   chunk type offset length crc32 check），--format json 每块一个 JSON 对象（JSON Lines）；
+ *   不带 --headers-only 时 check 为逐片重新计算的 CRC32 与存储值的比较结果（ok / mismatch / error）。
+ *   --checkpoint 时追加命令每写入约 4MB 在记录之间插入检查点块（记录其偏移、之前的块数与滚动摘要）。
+ *   recover 从末尾向回找到最后一个完好的检查点，只逐块校验其后的数据，耗时取决于受损的尾部而不是归档大小；
+ *   没有检查点或指定 --full 时从头校验。截断点落在一条记录中间时连同其元数据块一起截掉，不留下没有内容的元数据；
+ *   从检查点开始时不校验检查点之前的块。TotalSize 之后尚未提交的数据不会被恢复；--dry-run 只报告。
+ *   generate / bench 的选项: --chunks N 内容块数（默认 1000），--size MIN:MAX 块大小范围（默认 64:262144），
+ *   --log（默认，按位数均匀，小块多）或 --uniform 大小分布，--text PCT 文本块比例（默认 50），--seed N，
+ *   --repeat N 读取类测试的重复次数（默认 5），--zzk2。同样的参数总是生成同样的内容。
+ *   --stats 在退出时向 stderr 输出各阶段（open/scan/read/crc/write/sync）的墙钟与 CPU 时间、
+ *   读写字节数、读取的块头数、定位次数与有效吞吐；--stats=json 输出为一行 JSON，便于脚本收集。
+ *   bench 依次计时 crc32、generate、create、append、append-file、list、extract-first/middle/last，
+ *   每项一行 name=... ops=... bytes=... seconds=... mb_per_s=... ops_per_s=...，# 开头的行是构建与参数信息，
+ *   便于脚本比较不同构建；全局选项（--sync 等）照常生效。
+ *   serve 把同时到达的请求合并为一批，整批只更新一次 TotalSize（--sync 下只同步一次），
+ *   并向每个客户端返回其记录的块编号；运行期间其他追加命令等待其退出（fcntl 写锁）。
+ *   ZZK1 归档追加超过 4GB 时报错并提示先 upgrade；纯 C89 构建受 long 型 fseek/ftell 限制，
+ *   超过 2GB 的 ZZK2 归档需要 POSIX 构建。
  *
  * 局限性:
- *   - 无压缩、无加密
- *   - 无随机访问（线性扫描）
+ *   - 压缩只有内置的简单 LZ 编码（--compress），无加密
+ *   - 无索引时只能线性扫描（index 命令可建立尾部索引）
  *   - 无删除/修改（追加模式，只能重建整个归档）
  */
 
+
+/* extract-many 在 POSIX 构建中按存储的路径创建子目录 */
+#if (defined(ZZK1_THREADS) || defined(ZZK1_LINUX)) && !defined(ZZK1_POSIX)
+#define ZZK1_POSIX
+#endif
+#ifdef ZZK1_POSIX
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include "zzk1.h"
+
+/* serve-load 的并发客户端使用 POSIX 线程；其他构建依次运行各客户端 */
+#ifdef ZZK1_THREADS
+#include <pthread.h>
+#endif
+#ifdef ZZK1_POSIX
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+/* ========== 全局选项 ========== */
+
+static struct zzk_options options;
+static struct zzk_sync_stats sync_stats;
+static struct zzk_stats run_stats;
+static int stats_json;
+static double stats_start_ms;
+static clock_t stats_start_cpu;
+
+/* 库的诊断信息原样写到 stderr */
+static void log_to_stderr(void *ctx, int level, const char *fmt, va_list ap) {
+    (void)ctx;
+    (void)level;
+    vfprintf(stderr, fmt, ap);
+}
 
-#define MAGIC_NUMBER 0x5A5A4B31  /* "ZZK1" */
-#define RESERVED     0x00000000
-#define HEADER_SIZE  12          /* Magic(4) + TotalSize(4) + Reserved(4) */
-#define CHUNK_OVERHEAD 12        /* Type(4) + Length(4) + CRC32(4) */
+static void print_sync_report(void) {
+    static const char *names[] = { "none", "data", "group" };
+    fprintf(stderr, "Sync: mode=%s", names[options.sync_mode]);
+    if (options.sync_mode == ZZK_SYNC_GROUP) {
+        fprintf(stderr, " (%ld records, %ld ms)", options.group_records, options.group_ms);
+    }
+    fprintf(stderr, ", records=%ld, commits=%ld, fdatasync=%ld, commit latency: total=%.3f ms",
+            sync_stats.records, sync_stats.commits, sync_stats.syncs, sync_stats.total_ms);
+    if (sync_stats.commits > 0) {
+        fprintf(stderr, ", avg=%.3f ms, max=%.3f ms",
+                sync_stats.total_ms / sync_stats.commits, sync_stats.max_ms);
+    }
+    fprintf(stderr, "\n");
+}
 
-#define TYPE_TEXT     0x00000001
-#define TYPE_BINARY   0x00000002
-#define TYPE_PADDING  0xFFFFFFFF
+/*
+ * --stats 的报告：总耗时与进程 CPU 时间、读写字节数、块头数、定位次数、有效吞吐
+ * （读写字节之和 / 墙钟时间），以及各阶段的墙钟、CPU 时间与调用次数。
+ * 多线程构建中各阶段的时间是所有线程之和，可能超过总耗时。
+ */
+static void print_stats_report(void) {
+    double wall = zzk_clock_ms() - stats_start_ms;
+    double cpu = (double)(clock() - stats_start_cpu) * 1000.0 / CLOCKS_PER_SEC;
+    double mb = ((double)run_stats.bytes_read + (double)run_stats.bytes_written) / (1024.0 * 1024.0);
+    double mb_per_s = wall > 0 ? mb * 1000.0 / wall : 0.0;
+    char rd[24], wr[24];
+    int i;
+
+    if (stats_json) {
+        fprintf(stderr, "{\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"bytes_read\":%s,\"bytes_written\":%s,"
+                "\"chunks\":%ld,\"seeks\":%ld,\"mb_per_s\":%.3f,\"phases\":{",
+                wall, cpu, zzk_u64_str(run_stats.bytes_read, rd), zzk_u64_str(run_stats.bytes_written, wr),
+                run_stats.chunks, run_stats.seeks, mb_per_s);
+        for (i = 0; i < ZZK_PHASE_COUNT; i++) {
+            const struct zzk_phase_stats *ph = &run_stats.phases[i];
+            fprintf(stderr, "%s\"%s\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"calls\":%ld}",
+                    i > 0 ? "," : "", zzk_phase_name(i), ph->wall_ms, ph->cpu_ms, ph->calls);
+        }
+        fprintf(stderr, "}}\n");
+        return;
+    }
+    fprintf(stderr, "Stats: wall=%.3f ms, cpu=%.3f ms, read=%s bytes, written=%s bytes, chunks=%ld, seeks=%ld, "
+            "throughput=%.2f MB/s\n", wall, cpu, zzk_u64_str(run_stats.bytes_read, rd),
+            zzk_u64_str(run_stats.bytes_written, wr), run_stats.chunks, run_stats.seeks, mb_per_s);
+    for (i = 0; i < ZZK_PHASE_COUNT; i++) {
+        const struct zzk_phase_stats *ph = &run_stats.phases[i];
+        if (ph->calls == 0) continue;
+        fprintf(stderr, "  %-6s wall=%.3f ms, cpu=%.3f ms, calls=%ld\n",
+                zzk_phase_name(i), ph->wall_ms, ph->cpu_ms, ph->calls);
+    }
+}
 
-/* unsigned long 在 C89 中保证至少 32 位 */
-typedef unsigned long u32;
+/* ========== 工具函数 ========== */
 
-int write_u32_be(FILE *fp, u32 val);
-int read_u32_be(FILE *fp, u32 *val);
+static zzk_u32 be32(const unsigned char *p) {
+    return ((zzk_u32)p[0] << 24) | ((zzk_u32)p[1] << 16) | ((zzk_u32)p[2] << 8) | (zzk_u32)p[3];
+}
 
-/* ========== 工具函数 ========== */
+/* list / verify 的标题行。ZZK2 归档在大小后注明格式 */
+static void print_file_header(const char *filename, const zzk_reader *r) {
+    char num[24];
+    if (zzk_reader_format(r) == ZZK_FORMAT_ZZK1) {
+        printf("File: %s (Size: %s)\n", filename, zzk_u64_str(zzk_reader_size(r), num));
+    } else {
+        printf("File: %s (Size: %s, ZZK2)\n", filename, zzk_u64_str(zzk_reader_size(r), num));
+    }
+    printf("----------------------------------------\n");
+}
 
-static void die_io(const char *what) {
-    perror(what);
-    exit(1);
+/* 读取一整行（不含换行符）到可增长缓冲区。EOF 且无数据时返回 -1 */
+static int read_line(FILE *fp, char **buf, size_t *cap) {
+    size_t len = 0;
+    int c;
+
+    while ((c = getc(fp)) != EOF) {
+        if (len + 1 >= *cap) {
+            *cap = *cap ? *cap * 2 : 256;
+            *buf = (char *)realloc(*buf, *cap);
+            if (!*buf) {
+                fprintf(stderr, "Error: Memory allocation failed.\n");
+                exit(1);
+            }
+        }
+        if (c == '\n') break;
+        (*buf)[len++] = (char)c;
+    }
+    if (c == EOF && len == 0) return -1;
+    if (len > 0 && (*buf)[len - 1] == '\r') len--;
+    (*buf)[len] = '\0';
+    return 0;
 }
 
-static void require_write_u32(FILE *fp, u32 val, const char *what) {
-    if (write_u32_be(fp, val) != 0) die_io(what);
+/* 原地还原清单字段中的转义: \n \t \\ */
+static void unescape_field(char *s) {
+    char *out = s;
+    while (*s) {
+        if (*s == '\\' && s[1] == 'n') { *out++ = '\n'; s += 2; }
+        else if (*s == '\\' && s[1] == 't') { *out++ = '\t'; s += 2; }
+        else if (*s == '\\' && s[1] == '\\') { *out++ = '\\'; s += 2; }
+        else *out++ = *s++;
+    }
+    *out = '\0';
 }
 
-static void require_fwrite(FILE *fp, const void *buf, size_t len, const char *what) {
-    if (len == 0) return;
-    if (fwrite(buf, 1, len, fp) != len) die_io(what);
+/* 解析 [lo, hi] 范围内的十进制整数。成功返回 0 */
+static int parse_long(const char *str, long lo, long hi, long *out) {
+    char *endptr;
+    long parsed = strtol(str, &endptr, 10);
+    if (*endptr != '\0' || endptr == str || parsed < lo || parsed > hi) return -1;
+    *out = parsed;
+    return 0;
 }
 
-/* 安全字符串拼接，防止缓冲区溢出。成功返回 0，截断返回 -1 */
-static int append_str(char *dst, size_t dst_cap, size_t *used, const char *src) {
-    size_t src_len, avail;
+/* 解析十进制的 zzk_u64，遇到 stop 字符或字符串末尾结束。成功返回 stop 之后的位置，失败返回 NULL */
+static const char *parse_u64(const char *str, char stop, zzk_u64 *out) {
+    zzk_u64 val = 0, limit = (zzk_u64)-1;
+    const char *p = str;
 
-    if (dst_cap == 0 || *used >= dst_cap) {
-        if (dst_cap > 0) dst[dst_cap - 1] = '\0';
-        return -1;
+    for (; *p >= '0' && *p <= '9'; p++) {
+        if (val > (limit - (zzk_u64)(*p - '0')) / 10) return NULL;
+        val = val * 10 + (zzk_u64)(*p - '0');
     }
+    if (p == str || *p != stop) return NULL;
+    *out = val;
+    return stop ? p + 1 : p;
+}
 
-    src_len = strlen(src);
-    avail = (dst_cap - 1) - *used;
-    if (src_len > avail) {
-        memcpy(dst + *used, src, avail);
-        *used += avail;
-        dst[*used] = '\0';
-        return -1;
-    }
+/* ========== 命令实现 ========== */
 
-    memcpy(dst + *used, src, src_len);
-    *used += src_len;
-    dst[*used] = '\0';
+/* create: 创建归档，写入文件头和初始文本块。format 为 ZZK1（默认）或 ZZK2 */
+static int cmd_create(const char *filename, const char *initial_text, int format) {
+    if (zzk_create(filename, format, initial_text, strlen(initial_text), &options) != ZZK_OK) return 1;
+    printf("Archive created: %s\n", filename);
     return 0;
 }
 
-static u32 get_file_size_u32_or_die(FILE *fp, const char *what) {
-    long pos;
-    if (fseek(fp, 0, SEEK_END) != 0) die_io(what);
-    pos = ftell(fp);
-    if (pos < 0) die_io(what);
-    if ((unsigned long)pos > 0xFFFFFFFFUL) {
-        fprintf(stderr, "Error: file too large for U32 size field.\n");
-        exit(1);
+/* 以单条记录追加后提交；失败时放弃句柄（已撤回的记录不会留在归档中） */
+static int finish_single(zzk_writer *w, int rc) {
+    if (rc != ZZK_OK) {
+        zzk_writer_abort(w);
+        return 1;
     }
-    return (u32)(unsigned long)pos;
+    return zzk_writer_close(w) == ZZK_OK ? 0 : 1;
 }
 
-/* 分步前进，避免 fseek 的 long 参数在 32 位平台上溢出 */
-static void seek_forward(FILE *fp, u32 offset) {
-    const long MAX_STEP = 0x70000000;
-    while (offset > 0) {
-        long step = (offset > (u32)MAX_STEP) ? MAX_STEP : (long)offset;
-        if (fseek(fp, step, SEEK_CUR) != 0) die_io("Error seeking file");
-        offset -= (u32)step;
-    }
+/* append: 向归档追加文本块 */
+static int cmd_append(const char *filename, const char *text) {
+    zzk_writer *w;
+
+    if (zzk_writer_open(&w, filename, &options) != ZZK_OK) return 1;
+    if (finish_single(w, zzk_writer_append(w, ZZK_TYPE_TEXT, text, strlen(text))) != 0) return 1;
+    printf("Appended text to: %s\n", filename);
+    return 0;
 }
 
-/* ========== 序列化 ========== */
+/* append-file: 向归档追加二进制文件（自动生成 元数据块 + 二进制块） */
+static int cmd_append_file(const char *archive_name, const char *target_file, const char *description) {
+    zzk_writer *w;
+    struct zzk_dedup_stats dedup;
+    FILE *fp_target;
+    char num[24];
+    int rc;
+
+    /* 先确认目标文件可读，再打开归档：无法读取的文件不会让归档经历一次打开与放弃 */
+    fp_target = fopen(target_file, "rb");
+    if (!fp_target) {
+        perror("Error opening target file");
+        return 1;
+    }
+    fclose(fp_target);
 
-/* 将 u32 转换为大端字节序 */
-static void u32_to_be(u32 val, unsigned char buf[4]) {
-    buf[0] = (unsigned char)((val >> 24) & 0xFF);
-    buf[1] = (unsigned char)((val >> 16) & 0xFF);
-    buf[2] = (unsigned char)((val >> 8)  & 0xFF);
-    buf[3] = (unsigned char)(val & 0xFF);
+    if (zzk_writer_open(&w, archive_name, &options) != ZZK_OK) return 1;
+    rc = zzk_writer_append_file(w, target_file, description);
+    zzk_writer_dedup_stats(w, &dedup);
+    if (finish_single(w, rc) != 0) return 1;
+    printf("Appended file '%s' to: %s\n", target_file, archive_name);
+    if (dedup.refs > 0) {
+        printf("Deduplicated: same content as chunk #%ld (%s bytes not stored).\n", dedup.last_target,
+               zzk_u64_str(dedup.saved, num));
+    }
+    return 0;
 }
 
-/* 以大端序写入 32 位整数 */
-int write_u32_be(FILE *fp, u32 val) {
-    unsigned char buf[4];
-    u32_to_be(val, buf);
-    return (fwrite(buf, 1, 4, fp) != 4) ? -1 : 0;
-}
+/*
+ * append-stream: 追加长度未知的输入（stdin 或 FIFO），无需先落盘。
+ * 生成 元数据块 + 若干 STREAM 分片，整个流在结束时一次性提交
+ * （--sync data / group 下按分片提交，读取方可先看到未结束的流）。
+ */
+static int cmd_append_stream(const char *archive_name, const char *description,
+                             const char *source, zzk_u32 piece_size) {
+    zzk_writer *w;
+    FILE *in = stdin;
+    zzk_u64 total = 0;
+    char num[24];
+    int rc;
+
+    if (strcmp(source, "-") != 0) {
+        in = fopen(source, "rb");
+        if (!in) {
+            perror("Error opening stream source");
+            return 1;
+        }
+    }
 
-/* 以大端序读取 32 位整数 */
-int read_u32_be(FILE *fp, u32 *val) {
-    unsigned char buf[4];
-    if (fread(buf, 1, 4, fp) != 4) return -1;
-    *val = ((u32)buf[0] << 24) |
-           ((u32)buf[1] << 16) |
-           ((u32)buf[2] << 8)  |
-           ((u32)buf[3]);
+    rc = zzk_writer_open(&w, archive_name, &options);
+    if (rc == ZZK_OK) {
+        zzk_writer_prepare_input(w, in);
+        rc = finish_single(w, zzk_writer_append_stream(w, strcmp(source, "-") == 0 ? "<stdin>" : source,
+                                                       description, in, piece_size, &total));
+    }
+    if (in != stdin) fclose(in);
+    if (rc != 0) return 1;
+    printf("Appended stream (%s bytes) to: %s\n", zzk_u64_str(total, num), archive_name);
     return 0;
 }
 
-/* ========== CRC32 校验 ========== */
-
-static u32 crc32_table[256];
-static int crc32_table_ready = 0;
+/*
+ * append-batch: 在一次打开中追加多条记录，结束时只更新一次 TotalSize。
+ * 中途失败或崩溃时 TotalSize 保持原值，整批记录对读取方不可见。
+ * 指定 --sync data / group 时改为按策略逐条或分组提交，崩溃只丢失最后未提交的一组。
+ *
+ * 清单文件：每行一条，字段以 TAB 分隔，支持 \n \t \\ 转义，# 开头为注释
+ *   text<TAB>文本内容
+ *   file<TAB>文件路径<TAB>描述
+ * 清单为 "-" 时从 stdin 读取长度前缀流，每条记录为
+ *   Type(4B) + Length(4B) + Value(Length B)，均为大端序；Type 只能是 TEXT 或 BINARY。
+ */
+static int cmd_append_batch(const char *archive_name, const char *manifest) {
+    zzk_writer *w;
+    struct zzk_dedup_stats dedup;
+    FILE *fp_manifest = NULL;
+    char *line = NULL, *tab1, *tab2;
+    size_t cap = 0;
+    long records = 0, line_no = 0;
+    zzk_u64 start_pos;
+    char num[24];
+    int rc = ZZK_OK;
+
+    if (strcmp(manifest, "-") != 0) {
+        fp_manifest = fopen(manifest, "rb");
+        if (!fp_manifest) {
+            perror("Error opening manifest");
+            return 1;
+        }
+    }
+    if (zzk_writer_open(&w, archive_name, &options) != ZZK_OK) {
+        if (fp_manifest) fclose(fp_manifest);
+        return 1;
+    }
+    start_pos = zzk_writer_size(w);
 
-static void crc32_init(void) {
-    u32 i, j, c;
-    for (i = 0; i < 256; i++) {
-        c = i;
-        for (j = 0; j < 8; j++) {
-            c = (c & 1) ? ((c >> 1) ^ 0xEDB88320UL) : (c >> 1);
+    if (!fp_manifest) {
+        unsigned char hdr[8];
+        size_t got;
+        zzk_u32 type, length;
+
+        zzk_writer_prepare_input(w, stdin);
+        for (;;) {
+            if ((rc = zzk_writer_wait_input(w, stdin)) != ZZK_OK) break;
+            if ((got = fread(hdr, 1, 8, stdin)) != 8) {
+                if (got != 0 || ferror(stdin)) {
+                    fprintf(stderr, "Error: truncated record header on stdin. Batch discarded.\n");
+                    rc = ZZK_ERR_INPUT;
+                }
+                break;
+            }
+            type = be32(hdr);
+            length = be32(hdr + 4);
+            if (type != ZZK_TYPE_TEXT && type != ZZK_TYPE_BINARY) {
+                fprintf(stderr, "Error: record #%ld has unsupported type %lu. Batch discarded.\n",
+                        records + 1, (unsigned long)type);
+                rc = ZZK_ERR_ARG;
+                break;
+            }
+            if ((rc = zzk_writer_append_from(w, type, stdin, length)) != ZZK_OK) break;
+            records++;
+        }
+    } else {
+        while (rc == ZZK_OK && read_line(fp_manifest, &line, &cap) == 0) {
+            line_no++;
+            if (line[0] == '\0' || line[0] == '#') continue;
+
+            tab1 = strchr(line, '\t');
+            if (!tab1) {
+                fprintf(stderr, "Error: manifest line %ld: missing TAB separator. Batch discarded.\n", line_no);
+                rc = ZZK_ERR_ARG;
+                break;
+            }
+            *tab1++ = '\0';
+
+            if (strcmp(line, "text") == 0) {
+                unescape_field(tab1);
+                rc = zzk_writer_append(w, ZZK_TYPE_TEXT, tab1, strlen(tab1));
+            } else if (strcmp(line, "file") == 0 && (tab2 = strchr(tab1, '\t')) != NULL) {
+                *tab2++ = '\0';
+                unescape_field(tab1);
+                unescape_field(tab2);
+                rc = zzk_writer_append_file(w, tab1, tab2);
+            } else {
+                fprintf(stderr, "Error: manifest line %ld: expected 'text<TAB>...' or "
+                                "'file<TAB>path<TAB>description'. Batch discarded.\n", line_no);
+                rc = ZZK_ERR_ARG;
+            }
+            if (rc == ZZK_OK) records++;
+        }
+        if (rc == ZZK_OK && ferror(fp_manifest)) {
+            perror("Error reading manifest");
+            rc = ZZK_ERR_IO;
         }
-        crc32_table[i] = c;
     }
-    crc32_table_ready = 1;
+
+    /* 唯一的出口：释放清单资源，失败时放弃整批 */
+    free(line);
+    if (fp_manifest) fclose(fp_manifest);
+    if (rc != ZZK_OK) {
+        zzk_writer_abort(w);
+        return 1;
+    }
+    start_pos = zzk_writer_size(w) - start_pos;
+    zzk_writer_dedup_stats(w, &dedup);
+    if (zzk_writer_close(w) != ZZK_OK) return 1;
+    printf("Appended %ld records (%s bytes) to: %s\n", records, zzk_u64_str(start_pos, num), archive_name);
+    if (dedup.refs > 0) {
+        printf("Deduplicated %ld files (%s bytes not stored).\n", dedup.refs, zzk_u64_str(dedup.saved, num));
+    }
+    return 0;
 }
 
-/* 增量更新 CRC32。用法: crc=0xFFFFFFFFUL; crc=crc32_update(crc,d,n); crc^=0xFFFFFFFFUL; */
-static u32 crc32_update(u32 crc, const unsigned char *buf, size_t len) {
-    size_t i;
-    if (!crc32_table_ready) crc32_init();
-    for (i = 0; i < len; i++) {
-        crc = crc32_table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+/* extract: 提取指定块（1-based 索引）到输出文件。verify 为 0 对应 --no-verify */
+static int cmd_extract(const char *archive_name, const char *chunk_index_str, const char *output_file,
+                       int verify, const char *range) {
+    zzk_reader *r;
+    struct zzk_chunk chunk;
+    struct zzk_extract_info info;
+    FILE *fp_out;
+    char *endptr;
+    const char *p;
+    long target_index;
+    zzk_u64 range_offset = 0, range_len = 0;
+    char num[24], num2[24];
+    int rc;
+
+    if (range && (!(p = parse_u64(range, ':', &range_offset)) || !parse_u64(p, '\0', &range_len))) {
+        fprintf(stderr, "Error: Invalid range '%s'. Expected OFFSET:LEN.\n", range);
+        return 1;
+    }
+
+    target_index = strtol(chunk_index_str, &endptr, 10);
+    if (*endptr != '\0' || endptr == chunk_index_str || target_index <= 0 || target_index > 2147483647L) {
+        fprintf(stderr, "Error: Invalid chunk index '%s'. Must be a positive integer >= 1.\n", chunk_index_str);
+        return 1;
+    }
+
+    if (zzk_reader_open(&r, archive_name) != ZZK_OK) return 1;
+    if (zzk_reader_find(r, target_index, &chunk) != ZZK_OK) {
+        fprintf(stderr, "Error: Chunk #%ld not found.\n", target_index);
+        zzk_reader_close(r);
+        return 1;
+    }
+
+    if (range) {
+        printf("Extracting %s bytes at offset %s of Chunk #%ld to '%s'...\n", zzk_u64_str(range_len, num),
+               zzk_u64_str(range_offset, num2), target_index, output_file);
+    } else if (chunk.type == ZZK_TYPE_STREAM) {
+        printf("Extracting stream starting at Chunk #%ld to '%s'...\n", target_index, output_file);
+    } else if (chunk.type == ZZK_TYPE_REF) {
+        printf("Extracting Chunk #%ld (reference to existing content) to '%s'...\n", target_index, output_file);
+    } else if (chunk.type == ZZK_TYPE_LZ) {
+        printf("Extracting Chunk #%ld (compressed, %s bytes stored) to '%s'...\n",
+               target_index, zzk_u64_str(chunk.length, num), output_file);
+    } else {
+        printf("Extracting Chunk #%ld (Type %lu, %s bytes) to '%s'...\n",
+               target_index, (unsigned long)chunk.type, zzk_u64_str(chunk.length, num), output_file);
+    }
+
+    fp_out = fopen(output_file, "wb");
+    if (!fp_out) {
+        perror("Error opening output file");
+        zzk_reader_close(r);
+        return 1;
+    }
+
+    if (range) rc = zzk_reader_extract_range(r, &chunk, range_offset, range_len, fp_out, verify, &info);
+    else rc = zzk_reader_extract(r, &chunk, fp_out, verify, &info);
+    zzk_reader_close(r);
+    if (rc != ZZK_OK) {
+        fclose(fp_out);
+        return (rc == ZZK_ERR_CRC || rc == ZZK_ERR_CORRUPT) ? 2 : 1;
+    }
+
+    if (!range && chunk.type == ZZK_TYPE_REF) {
+        printf("Reference resolved: %s bytes.\n", zzk_u64_str(info.bytes, num));
+    } else if (!range && chunk.type == ZZK_TYPE_LZ) {
+        printf("Decompressed %s bytes.\n", zzk_u64_str(info.bytes, num));
+    }
+    if (range && range_len == 0) {
+        printf("Empty range: nothing extracted, CRC32 not checked.\n");
+    } else if (range && verify && info.blocks > 0) {
+        printf("CRC32 verified OK (%ld blocks from the block checksum table).\n", info.blocks);
+    } else if (range && verify && info.crc_checked == 1) {
+        printf("CRC32 verified OK (whole chunk).\n");
+    } else if (chunk.type == ZZK_TYPE_STREAM) {
+        printf("CRC32 %s (%ld pieces, %s bytes).\n", verify ? "verified OK" : "check skipped",
+               info.pieces, zzk_u64_str(info.bytes, num));
+    } else if (!verify) {
+        printf("CRC32 check skipped (--no-verify).\n");
+    } else if (info.crc_checked == 1) {
+        printf("CRC32 verified OK.\n");
+    }
+
+    if (fclose(fp_out) != 0) {
+        perror("Error writing to output file");
+        return 1;
     }
-    return crc;
+    printf("Extraction complete.\n");
+    return 0;
 }
 
-/*
- * 写入完整数据块: Type(4) + Length(4) + Value(Length) + CRC32(4)
- * CRC32 覆盖 Type + Length + Value
- */
-static void write_chunk(FILE *fp, u32 type, const void *value, u32 length) {
-    unsigned char hdr[8];
-    u32 crc = 0xFFFFFFFFUL;
+/* ========== 批量提取 ========== */
 
-    u32_to_be(type, hdr);
-    u32_to_be(length, hdr + 4);
-    crc = crc32_update(crc, hdr, 8);
-    crc = crc32_update(crc, (const unsigned char *)value, (size_t)length);
-    crc ^= 0xFFFFFFFFUL;
+#define EXTRACT_DEFAULT_THREADS 4   /* extract-many 默认的工作者上限：写出通常受磁盘限制，少量并行即可 */
+#define EXTRACT_PATH_MAX        4096
 
-    require_write_u32(fp, type, "Error writing chunk type");
-    require_write_u32(fp, length, "Error writing chunk length");
-    require_fwrite(fp, value, (size_t)length, "Error writing chunk value");
-    require_write_u32(fp, crc, "Error writing chunk CRC32");
+/* open 与 done 按同样的顺序调用，其间至多隔 ZZK_EXTRACT_BATCH 个块，输出路径存放在环形的 paths 中 */
+struct extract_many_state {
+    const char *dir;
+    char *paths;
+    long opened;
+    long done;
+    long failed;
+    zzk_u64 bytes;
+};
+
+static int file_exists(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+    fclose(fp);
+    return 1;
 }
 
-/* ========== 文件头操作 ========== */
+/* 创建 path 中 dir 之后的各级目录（纯 C89 构建没有 mkdir，存储的路径只保留文件名） */
+static void make_parent_dirs(char *path, size_t dir_len) {
+#ifdef ZZK1_POSIX
+    char *p;
+    for (p = path + dir_len + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(path, 0777) != 0 && errno != EEXIST) perror("Error creating directory");
+        *p = '/';
+    }
+#else
+    (void)path;
+    (void)dir_len;
+#endif
+}
 
 /*
- * 读取并验证文件头（Magic + TotalSize + Reserved）。
- * 失败时关闭 fp 并退出程序。
+ * 输出路径: dir/ 加上元数据中的文件名。去掉开头的 / 与 . / .. 路径段，不会写到 dir 之外；
+ * 纯 C89 构建只保留最后一段。没有文件名时为 chunk-N.txt（文本）或 chunk-N.bin。
+ * 目标已存在时不覆盖，改在名字后加 .N（N 为块编号）。
  */
-static void read_header_or_die(FILE *fp, u32 *total_size, u32 *reserved) {
-    u32 magic;
-    if (read_u32_be(fp, &magic) != 0 || magic != MAGIC_NUMBER) {
-        fprintf(stderr, "Invalid magic number.\n");
-        fclose(fp);
-        exit(1);
+static int extract_output_path(const char *dir, const struct zzk_extract_item *item, char *out, size_t cap) {
+    size_t used = strlen(dir), dir_len = used, seg_len;
+    const char *name = item->filename, *seg, *end;
+    char suffix[32];
+
+    if (used + 2 >= cap) return -1;
+    memcpy(out, dir, used);
+    out[used] = '\0';
+    for (seg = name; seg && *seg; seg = *end ? end + 1 : end) {
+        for (end = seg; *end && *end != '/' && *end != '\\'; end++) {
+        }
+        seg_len = (size_t)(end - seg);
+        if (seg_len == 0 || (seg_len == 1 && seg[0] == '.') || (seg_len == 2 && seg[0] == '.' && seg[1] == '.')) continue;
+#ifndef ZZK1_POSIX
+        if (*end) continue;
+#endif
+        if (used + 1 + seg_len + sizeof(suffix) >= cap) return -1;
+        out[used++] = '/';
+        memcpy(out + used, seg, seg_len);
+        used += seg_len;
+        out[used] = '\0';
     }
-    if (read_u32_be(fp, total_size) != 0) {
-        fprintf(stderr, "Error reading total size (truncated header).\n");
-        fclose(fp);
-        exit(1);
+    if (used == dir_len) {
+        sprintf(suffix, "/chunk-%ld.%s", item->chunk.index, item->content_type == ZZK_TYPE_TEXT ? "txt" : "bin");
+        strcpy(out + used, suffix);
+        used += strlen(suffix);
     }
-    if (read_u32_be(fp, reserved) != 0) {
-        fprintf(stderr, "Error reading reserved field (truncated header).\n");
-        fclose(fp);
-        exit(1);
+    make_parent_dirs(out, dir_len);
+    if (file_exists(out)) {
+        sprintf(suffix, ".%ld", item->chunk.index);
+        strcpy(out + used, suffix);
+        if (file_exists(out)) return -1;
     }
+    return 0;
 }
 
-/*
- * 打开现有归档用于追加。验证文件头，定位到写入位置。
- * 处理三种情况：正常 / 尾部有垃圾数据 / 文件被截断。
- */
-static int validate_and_open(const char *filename, FILE **fp_out, u32 *current_size_out) {
-    u32 magic, reserved, header_total_size, actual_size;
-    FILE *fp = fopen(filename, "rb+");
+static FILE *extract_many_open(void *ctx, const struct zzk_extract_item *item) {
+    struct extract_many_state *st = (struct extract_many_state *)ctx;
+    char *path = st->paths + (size_t)(st->opened++ % ZZK_EXTRACT_BATCH) * EXTRACT_PATH_MAX;
+    FILE *fp;
 
-    if (!fp) {
-        perror("Error opening file");
-        exit(1);
-    }
-
-    if (read_u32_be(fp, &magic) != 0 || magic != MAGIC_NUMBER) {
-        fprintf(stderr, "Invalid magic number.\n");
-        fclose(fp);
-        exit(1);
-    }
-    if (read_u32_be(fp, &header_total_size) != 0) {
-        fprintf(stderr, "Error reading size.\n");
-        fclose(fp);
-        exit(1);
-    }
-    if (read_u32_be(fp, &reserved) != 0) {
-        fprintf(stderr, "Error reading reserved.\n");
-        fclose(fp);
-        exit(1);
-    }
-    if (reserved != RESERVED) {
-        fprintf(stderr, "Warning: reserved field is non-zero (%lu).\n", (unsigned long)reserved);
-    }
-    if (header_total_size < HEADER_SIZE) {
-        fprintf(stderr, "Error: invalid total size in header (%lu < %d).\n",
-                (unsigned long)header_total_size, HEADER_SIZE);
-        fclose(fp);
-        exit(1);
-    }
-
-    /* 用实际文件大小做追加基准，避免头部 Total Size 与实际不一致 */
-    actual_size = get_file_size_u32_or_die(fp, "Error seeking/ftell file");
-    if (header_total_size != actual_size) {
-        fprintf(stderr, "Warning: header Total Size (%lu) != actual file size (%lu).\n",
-                (unsigned long)header_total_size, (unsigned long)actual_size);
-
-        if (actual_size > header_total_size) {
-            /* 尾部有垃圾数据，回退到 header 声明的末尾覆盖写入 */
-            fprintf(stderr, "Fixing: overwriting trailing garbage data.\n");
-            if (fseek(fp, 0, SEEK_SET) != 0) {
-                die_io("Error seeking to start of file");
+    if (extract_output_path(st->dir, item, path, EXTRACT_PATH_MAX) != 0) {
+        fprintf(stderr, "Error: No usable output name for Chunk #%ld.\n", item->chunk.index);
+        path[0] = '\0';
+        return NULL;
+    }
+    fp = fopen(path, "wb");
+    if (!fp) perror("Error opening output file");
+    return fp;
+}
+
+static void extract_many_done(void *ctx, const struct zzk_extract_item *item) {
+    struct extract_many_state *st = (struct extract_many_state *)ctx;
+    const char *path = st->paths + (size_t)(st->done++ % ZZK_EXTRACT_BATCH) * EXTRACT_PATH_MAX;
+    char num[24];
+    int rc = item->status;
+
+    if (item->out && fclose(item->out) != 0 && rc == ZZK_OK) {
+        perror("Error writing to output file");
+        rc = ZZK_ERR_IO;
+    }
+    if (rc != ZZK_OK) {
+        st->failed++;
+        printf("Chunk #%ld: FAILED (%s)%s%s\n", item->chunk.index, zzk_strerror(rc), path[0] ? " -> " : "", path);
+        return;
+    }
+    st->bytes += item->info.bytes;
+    printf("Chunk #%ld -> %s (%s bytes%s)\n", item->chunk.index, path, zzk_u64_str(item->info.bytes, num),
+           item->info.crc_checked == 1 ? ", CRC32 OK" : "");
+}
+
+/* 解析 N 或 FIRST-LAST，追加到 indices */
+static int parse_index_list(int argc, char *argv[], long **indices_out, long *count_out) {
+    long *indices = NULL, count = 0, cap = 0, first, last, k;
+    char buf[32], *dash;
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        if (strlen(argv[i]) >= sizeof(buf)) first = last = -1;
+        else {
+            strcpy(buf, argv[i]);
+            dash = strchr(buf, '-');
+            if (dash) *dash = '\0';
+            if (parse_long(buf, 1, 2147483647L, &first) != 0) first = -1;
+            if (!dash) last = first;
+            else if (parse_long(dash + 1, 1, 2147483647L, &last) != 0) last = -1;
+        }
+        if (first < 0 || last < first) {
+            fprintf(stderr, "Error: Invalid chunk index or range '%s'. Expected N or FIRST-LAST.\n", argv[i]);
+            free(indices);
+            return -1;
+        }
+        for (k = first; k <= last; k++) {
+            if (count == cap) {
+                long *grown;
+                cap = cap ? cap * 2 : 64;
+                grown = (long *)realloc(indices, sizeof(long) * (size_t)cap);
+                if (!grown) {
+                    fprintf(stderr, "Error: Memory allocation failed.\n");
+                    free(indices);
+                    return -1;
+                }
+                indices = grown;
             }
-            seek_forward(fp, header_total_size);
-            if (current_size_out) *current_size_out = header_total_size;
-            *fp_out = fp;
-            return 0;
-        } else {
-            fprintf(stderr, "Error: file truncated. Corrupted.\n");
-            fclose(fp);
-            exit(1);
+            indices[count++] = k;
         }
     }
-
-    if (fseek(fp, 0, SEEK_END) != 0) die_io("Error seeking to end");
-    *fp_out = fp;
-    if (current_size_out) *current_size_out = actual_size;
+    *indices_out = indices;
+    *count_out = count;
     return 0;
 }
 
-/* 更新文件头中的 Total Size 字段 */
-static void update_total_size(FILE *fp, u32 added_size, u32 old_size) {
-    u32 new_size;
-    if (old_size > 0xFFFFFFFFUL - added_size) {
-        fprintf(stderr, "Error: file size overflow (exceeds 4GB limit).\n");
-        exit(1);
+/*
+ * extract-many / extract-all: 一次打开、一遍扫描，把选中的块按偏移顺序提取到 dir 下。
+ * 二进制内容以其元数据中的 Filename 命名，其他块为 chunk-N.txt / chunk-N.bin。
+ * indices 为 NULL 时提取全部内容块。
+ */
+static int cmd_extract_many(const char *archive_name, const char *dir, const long *indices, long count,
+                            int verify, int nthreads) {
+    struct extract_many_state st;
+    zzk_reader *r;
+    long extracted;
+    char num[24];
+    int rc;
+
+#ifdef ZZK1_POSIX
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        perror("Error creating output directory");
+        return 1;
+    }
+#endif
+    st.dir = dir;
+    st.opened = 0;
+    st.done = 0;
+    st.failed = 0;
+    st.bytes = 0;
+    st.paths = (char *)malloc((size_t)ZZK_EXTRACT_BATCH * EXTRACT_PATH_MAX);
+    if (!st.paths) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        return 1;
     }
-    new_size = old_size + added_size;
-    if (fflush(fp) != 0) die_io("Error flushing data before header update");
-    if (fseek(fp, 4, SEEK_SET) != 0) die_io("Error seeking to header size field");
-    require_write_u32(fp, new_size, "Error writing updated total size");
-    if (fflush(fp) != 0) die_io("Error flushing header update");
-    if (fseek(fp, 0, SEEK_END) != 0) die_io("Error seeking to end after updating size");
+    if (zzk_reader_open(&r, archive_name) != ZZK_OK) {
+        free(st.paths);
+        return 1;
+    }
+    rc = zzk_reader_extract_many(r, indices, indices ? count : -1, nthreads, verify, extract_many_open,
+                                 extract_many_done, &st, &extracted);
+    zzk_reader_close(r);
+    free(st.paths);
+    if (rc == ZZK_ERR_NOT_FOUND || rc == ZZK_ERR_NOMEM || rc == ZZK_ERR_ARG) return 1;
+
+    printf("Extracted %ld of %ld chunks (%s bytes) to '%s'%s.\n", extracted, st.done, zzk_u64_str(st.bytes, num),
+           dir, verify ? "" : " (CRC32 check skipped)");
+    if (rc == ZZK_ERR_CORRUPT) fprintf(stderr, "WARNING: archive structure is damaged; later chunks were not reached.\n");
+    if (rc == ZZK_ERR_CRC || rc == ZZK_ERR_CORRUPT) return 2;
+    return (rc != ZZK_OK || st.failed > 0) ? 1 : 0;
 }
 
-/* ========== 命令实现 ========== */
+/* index: 扫描全部块头，重建尾部索引块 */
+static int cmd_index(const char *filename, int with_terms) {
+    long chunks, terms;
 
-/* create: 创建归档，写入文件头和初始文本块 */
-static void cmd_create(const char *filename, const char *initial_text) {
-    FILE *fp;
-    u32 text_len, total_size = HEADER_SIZE;
-
-    /* 防止误覆盖已有归档 */
-    fp = fopen(filename, "rb");
-    if (fp) {
-        fclose(fp);
-        fprintf(stderr, "Error: file '%s' already exists. Delete it first or use append.\n", filename);
-        exit(1);
+    if (zzk_rebuild_index(filename, &options, &chunks) != ZZK_OK) return 1;
+    printf("Indexed %ld chunks in: %s\n", chunks, filename);
+    if (with_terms) {
+        if (zzk_rebuild_terms(filename, &options, &terms) != ZZK_OK) return 1;
+        printf("Indexed %ld terms in: %s\n", terms, filename);
     }
+    return 0;
+}
 
-    text_len = (u32)strlen(initial_text);
-    if (text_len > 0xFFFFFFFFUL - HEADER_SIZE - CHUNK_OVERHEAD) {
-        fprintf(stderr, "Error: text too large (overflow risk).\n");
-        exit(1);
+/* 压缩块：文本逐块解压后显示（库在解压时核对内容的 CRC32，内存占用与块大小无关），二进制只显示原长度 */
+static void list_compressed(zzk_reader *r, const struct zzk_chunk *c) {
+    zzk_u32 type, stored_crc;
+    zzk_u64 length;
+    char num[24];
+
+    if (zzk_reader_lz_info(r, c, &type, &length) != ZZK_OK) return;
+    printf("[Compressed %s - %s bytes]\n", zzk_type_name(type), zzk_u64_str(length, num));
+    if (type == ZZK_TYPE_TEXT) {
+        printf("Content:\n");
+        if (zzk_reader_extract(r, c, stdout, 1, NULL) == ZZK_OK) printf("\n[CRC32 OK]\n");
+        else printf("\n");
+    } else if (zzk_reader_stored_crc(r, c, &stored_crc) != ZZK_OK) {
+        fprintf(stderr, "Warning: EOF reading CRC32.\n");
+    } else {
+        printf("[CRC32: %08lX]\n", (unsigned long)stored_crc);
     }
-    total_size += CHUNK_OVERHEAD + text_len;
+}
 
-    fp = fopen(filename, "wb");
-    if (!fp) {
-        perror("Error creating file");
-        exit(1);
-    }
+/* list 的输出格式：默认的可读文本，或每块一行的 TSV / JSON（JSON Lines），供脚本处理 */
+#define LIST_TEXT 0
+#define LIST_TSV  1
+#define LIST_JSON 2
+
+struct list_options {
+    int format;
+    int headers_only;      /* 只读块头与存储的 CRC32，不读取 Value */
+};
+
+/* 结构化输出中的类型名：未知类型写出其数值 */
+static const char *list_type_name(zzk_u32 type, char buf[12]) {
+    const char *name = zzk_type_name(type);
+    if (strcmp(name, "UNKNOWN") != 0) return name;
+    sprintf(buf, "0x%08lX", (unsigned long)type);
+    return buf;
+}
 
-    require_write_u32(fp, MAGIC_NUMBER, "Error writing magic");
-    require_write_u32(fp, total_size, "Error writing total size");
-    require_write_u32(fp, RESERVED, "Error writing reserved");
+/* TSV / JSON 的一行。headers_only 时不读取 Value；否则逐片计算 CRC32 与存储值核对（内存占用恒定） */
+static int list_record(const struct list_options *opt, zzk_reader *r, const struct zzk_chunk *c) {
+    zzk_u32 stored_crc, computed_crc;
+    const char *check = "-";
+    char num[24], num2[24], type[12];
 
-    write_chunk(fp, TYPE_TEXT, initial_text, text_len);
+    if (zzk_reader_stored_crc(r, c, &stored_crc) != ZZK_OK) {
+        fprintf(stderr, "Warning: EOF reading CRC32 of chunk #%ld.\n", c->index);
+        return 0;
+    }
+    if (!opt->headers_only) {
+        if (zzk_reader_value_crc(r, c, NULL, &computed_crc) != ZZK_OK) check = "error";
+        else check = (computed_crc == stored_crc) ? "ok" : "mismatch";
+    }
+    if (opt->format == LIST_TSV) {
+        printf("%ld\t%s\t%s\t%s\t%08lX\t%s\n", c->index, list_type_name(c->type, type), zzk_u64_str(c->offset, num),
+               zzk_u64_str(c->length, num2), (unsigned long)stored_crc, check);
+    } else {
+        printf("{\"chunk\":%ld,\"type\":\"%s\",\"offset\":%s,\"length\":%s,\"crc32\":\"%08lX\"", c->index,
+               list_type_name(c->type, type), zzk_u64_str(c->offset, num), zzk_u64_str(c->length, num2),
+               (unsigned long)stored_crc);
+        if (opt->headers_only) printf("}\n");
+        else printf(",\"check\":\"%s\"}\n", check);
+    }
+    return 0;
+}
 
-    fclose(fp);
-    printf("Archive created: %s\n", filename);
+/* list 的每块输出：文本块按片显示内容并校验 CRC32，其他类型只显示摘要 */
+static int list_chunk(void *ctx, zzk_reader *r, const struct zzk_chunk *c) {
+    const struct list_options *opt = (const struct list_options *)ctx;
+    unsigned char buf[12];
+    const unsigned char *value;
+    zzk_u32 stored_crc, computed_crc;
+    char num[24], num2[24];
+
+    if (opt->format != LIST_TEXT) return list_record(opt, r, c);
+    if (opt->headers_only) {
+        if (zzk_reader_stored_crc(r, c, &stored_crc) != ZZK_OK) {
+            fprintf(stderr, "Warning: EOF reading CRC32 of chunk #%ld.\n", c->index);
+            return 0;
+        }
+        printf("Chunk #%ld: Type=%s, Offset=%s, Length=%s bytes, CRC32=%08lX\n", c->index, zzk_type_name(c->type),
+               zzk_u64_str(c->offset, num), zzk_u64_str(c->length, num2), (unsigned long)stored_crc);
+        return 0;
+    }
+    printf("Chunk #%ld: Type=%s, Length=%s bytes\n", c->index, zzk_type_name(c->type), zzk_u64_str(c->length, num));
+
+    if (c->type == ZZK_TYPE_TEXT) {
+        /* 文本按片写出并同时计算 CRC32，不把整个块读入内存 */
+        printf("Content:\n");
+        if (zzk_reader_value_crc(r, c, stdout, &computed_crc) == ZZK_OK) {
+            printf("\n");
+            if (zzk_reader_stored_crc(r, c, &stored_crc) != ZZK_OK) {
+                fprintf(stderr, "Warning: EOF reading CRC32.\n");
+            } else if (stored_crc == computed_crc) {
+                printf("[CRC32 OK]\n");
+            } else {
+                fflush(stdout);
+                fprintf(stderr, "WARNING: CRC32 MISMATCH (stored: %08lX, computed: %08lX)\n",
+                        (unsigned long)stored_crc, (unsigned long)computed_crc);
+            }
+        } else {
+            printf("\n");
+        }
+    } else if (c->type == ZZK_TYPE_BINARY) {
+        printf("[Binary Data - Skipped]\n");
+        if (zzk_reader_stored_crc(r, c, &stored_crc) != ZZK_OK) {
+            fprintf(stderr, "Warning: EOF reading CRC32.\n");
+        } else {
+            printf("[CRC32: %08lX]\n", (unsigned long)stored_crc);
+        }
+    } else if (c->type == ZZK_TYPE_INDEX && c->length >= 4) {
+        value = (const unsigned char *)zzk_reader_peek(r, c->value_offset, 4, buf);
+        if (!value) {
+            fprintf(stderr, "Warning: EOF reading index chunk.\n");
+        } else {
+            printf("[Index - %lu entries]\n", (unsigned long)be32(value));
+        }
+    } else if (c->type == ZZK_TYPE_STREAM && c->length >= 4) {
+        value = (const unsigned char *)zzk_reader_peek(r, c->value_offset, 4, buf);
+        if (!value) {
+            fprintf(stderr, "Warning: EOF reading stream chunk.\n");
+        } else {
+            printf("[Stream Piece - %s bytes%s]\n", zzk_u64_str(c->length - 4, num),
+                   (be32(value) & ZZK_STREAM_FINAL) ? ", final" : "");
+        }
+    } else if (c->type == ZZK_TYPE_LZ) {
+        list_compressed(r, c);
+    } else if (c->type == ZZK_TYPE_REF && c->length >= 4) {
+        value = (const unsigned char *)zzk_reader_peek(r, c->value_offset, 4, buf);
+        if (!value) {
+            fprintf(stderr, "Warning: EOF reading reference chunk.\n");
+        } else {
+            printf("[Reference - same content as Chunk #%lu]\n", (unsigned long)be32(value));
+        }
+    } else if (c->type == ZZK_TYPE_SUMS && c->length >= 16) {
+        value = (const unsigned char *)zzk_reader_peek(r, c->value_offset, 4, buf);
+        if (!value) {
+            fprintf(stderr, "Warning: EOF reading block checksum table.\n");
+        } else {
+            printf("[Block Checksums - %s blocks of %lu bytes for the previous chunk]\n",
+                   zzk_u64_str((c->length - 16) / 4, num), (unsigned long)be32(value));
+        }
+    } else if (c->type == ZZK_TYPE_TERMS && c->length >= 8) {
+        value = (const unsigned char *)zzk_reader_peek(r, c->value_offset, 8, buf);
+        if (!value) {
+            fprintf(stderr, "Warning: EOF reading term index.\n");
+        } else {
+            printf("[Term Index - %lu terms over %lu chunks]\n", (unsigned long)be32(value + 4),
+                   (unsigned long)be32(value));
+        }
+    } else if (c->type == ZZK_TYPE_CHECKPOINT && c->length >= 24) {
+        value = (const unsigned char *)zzk_reader_peek(r, c->value_offset + 12, 12, buf);
+        if (!value) {
+            fprintf(stderr, "Warning: EOF reading checkpoint.\n");
+        } else {
+            printf("[Checkpoint - %lu chunks before, digest %08lX]\n", (unsigned long)be32(value + 4),
+                   (unsigned long)be32(value + 8));
+        }
+    } else if (c->type == ZZK_TYPE_PADDING) {
+        printf("[Padding - Skipped]\n");
+    } else {
+        printf("[Unknown Type - Skipped]\n");
+    }
+    printf("----------------------------------------\n");
+    return 0;
 }
 
-/* append: 向归档追加文本块 */
-static void cmd_append(const char *filename, const char *text) {
-    FILE *fp;
-    u32 current_size;
-    u32 text_len = (u32)strlen(text);
-    u32 chunk_size;
+/* list: 列出归档中的所有数据块 */
+static int cmd_list(const char *filename, const struct list_options *opt) {
+    zzk_reader *r;
+
+    if (zzk_reader_open(&r, filename) != ZZK_OK) return 1;
+    if (opt->format == LIST_TEXT) print_file_header(filename, r);
+    else if (opt->format == LIST_TSV) printf("chunk\ttype\toffset\tlength\tcrc32\tcheck\n");
+    zzk_reader_foreach(r, list_chunk, (void *)opt);
+    zzk_reader_close(r);
+    return 0;
+}
 
-    if (text_len > 0xFFFFFFFFUL - CHUNK_OVERHEAD) {
-        fprintf(stderr, "Error: text too large (overflow risk).\n");
-        exit(1);
+struct verify_tally {
+    long ok;
+    long bad;
+};
+
+static void verify_report(void *ctx, const struct zzk_verify_item *item) {
+    struct verify_tally *tally = (struct verify_tally *)ctx;
+    char num[24];
+
+    printf("Chunk #%ld: Type=%s, Length=%s bytes: ", item->chunk.index, zzk_type_name(item->chunk.type),
+           zzk_u64_str(item->chunk.length, num));
+    if (item->status == ZZK_ERR_IO) {
+        printf("FAILED (read error)\n");
+        tally->bad++;
+    } else if (item->status != ZZK_OK) {
+        printf("FAILED (stored: %08lX, computed: %08lX)\n",
+               (unsigned long)item->stored_crc, (unsigned long)item->computed_crc);
+        tally->bad++;
+    } else {
+        printf("OK\n");
+        tally->ok++;
     }
-    chunk_size = CHUNK_OVERHEAD + text_len;
+}
 
-    validate_and_open(filename, &fp, &current_size);
+/*
+ * verify: 并行校验每个块的 CRC32。
+ * 退出码与 extract 一致：全部通过返回 0，存在不一致或结构损坏返回 2。
+ */
+static int cmd_verify(const char *filename, int nthreads) {
+    zzk_reader *r;
+    struct verify_tally tally = { 0, 0 };
+    long nchunks;
+    int rc, used;
+
+    if (zzk_reader_open(&r, filename) != ZZK_OK) return 1;
+    print_file_header(filename, r);
+    rc = zzk_reader_verify(r, nthreads, verify_report, &tally, &nchunks, &used);
+    zzk_reader_close(r);
+    if (rc != ZZK_OK && rc != ZZK_ERR_CRC && rc != ZZK_ERR_CORRUPT) return 1;
 
-    if (current_size > 0xFFFFFFFFUL - chunk_size) {
-        fprintf(stderr, "Error: file size overflow (exceeds 4GB limit).\n");
-        fclose(fp);
-        exit(1);
+    printf("----------------------------------------\n");
+    printf("Verified %ld chunks (%d threads): %ld OK, %ld FAILED.\n", nchunks, used, tally.ok, tally.bad);
+    if (rc == ZZK_ERR_CORRUPT) {
+        fprintf(stderr, "WARNING: archive structure is damaged after chunk #%ld.\n", nchunks);
     }
+    return rc == ZZK_OK ? 0 : 2;
+}
 
-    write_chunk(fp, TYPE_TEXT, text, text_len);
+static void grep_report(void *ctx, const struct zzk_grep_match *m) {
+    char num[24];
 
-    update_total_size(fp, chunk_size, current_size);
-    fclose(fp);
-    printf("Appended text to: %s\n", filename);
+    (void)ctx;
+    printf("Chunk #%ld @ %s: ", m->chunk, zzk_u64_str(m->offset, num));
+    fwrite(m->line, 1, m->line_len, stdout);
+    printf(m->status == ZZK_OK ? "\n" : "  [CRC MISMATCH]\n");
 }
 
-/* append-file: 向归档追加二进制文件（自动生成 元数据块 + 二进制块） */
-static void cmd_append_file(const char *archive_name, const char *target_file, const char *description) {
-    FILE *fp_archive, *fp_target;
-    u32 current_size, target_size, meta_len;
-    char metadata[1024];
-    unsigned char buffer[4096];
-    size_t bytes_read;
-    u32 total_added;
+/*
+ * grep: 在文本块中并行查找字面子串，只输出匹配所在的块、偏移与行摘要。
+ * 退出码：有匹配返回 0，没有匹配返回 1，存在 CRC 不一致或结构损坏返回 2。
+ */
+static int cmd_grep(const char *filename, const char *pattern, int flags, int nthreads) {
+    zzk_reader *r;
+    struct zzk_grep_stats stats;
+    char num[24];
+    int rc;
 
-    fp_target = fopen(target_file, "rb");
-    if (!fp_target) {
-        perror("Error opening target file");
-        exit(1);
-    }
+    if (zzk_reader_open(&r, filename) != ZZK_OK) return 1;
+    rc = zzk_reader_grep(r, pattern, strlen(pattern), flags, nthreads, grep_report, NULL, &stats);
+    zzk_reader_close(r);
+    if (rc != ZZK_OK && rc != ZZK_ERR_CRC && rc != ZZK_ERR_CORRUPT) return 1;
 
-    target_size = get_file_size_u32_or_die(fp_target, "Error seeking/ftell target file");
-    if (fseek(fp_target, 0, SEEK_SET) != 0) die_io("Error seeking target file to start");
+    printf("----------------------------------------\n");
+    printf("%ld matches in %ld of %ld text chunks (%s bytes searched, %d threads).\n", stats.matches,
+           stats.matched_chunks, stats.chunks, zzk_u64_str(stats.bytes, num), stats.threads);
+    if (rc != ZZK_OK) return 2;
+    return stats.matches > 0 ? 0 : 1;
+}
 
-    /* 构建元数据文本 */
-    {
-        size_t used = 0;
-        int truncated = 0;
-        char size_buf[32];
+static void find_report(void *ctx, long chunk) {
+    (void)ctx;
+    printf("Chunk #%ld\n", chunk);
+}
 
-        metadata[0] = '\0';
-        sprintf(size_buf, "%lu", (unsigned long)target_size);
+/*
+ * find: 列出包含全部查询词项的文本块。有词项索引时经索引查找，否则逐块扫描。
+ * 退出码与 grep 一致：有匹配返回 0，没有匹配返回 1，结构损坏返回 2。
+ */
+static int cmd_find(const char *filename, const char *const *query, int nquery) {
+    zzk_reader *r;
+    struct zzk_lookup_stats stats;
+    int rc;
 
-        if (append_str(metadata, sizeof(metadata), &used, "Filename: ") != 0) truncated = 1;
-        if (append_str(metadata, sizeof(metadata), &used, target_file) != 0) truncated = 1;
-        if (append_str(metadata, sizeof(metadata), &used, "\nDescription: ") != 0) truncated = 1;
-        if (append_str(metadata, sizeof(metadata), &used, description) != 0) truncated = 1;
-        if (append_str(metadata, sizeof(metadata), &used, "\nSize: ") != 0) truncated = 1;
-        if (append_str(metadata, sizeof(metadata), &used, size_buf) != 0) truncated = 1;
-        if (append_str(metadata, sizeof(metadata), &used, " bytes") != 0) truncated = 1;
+    if (zzk_reader_open(&r, filename) != ZZK_OK) return 1;
+    rc = zzk_reader_lookup(r, query, nquery, find_report, NULL, &stats);
+    zzk_reader_close(r);
+    if (rc != ZZK_OK && rc != ZZK_ERR_CORRUPT) return 1;
 
-        if (truncated) {
-            fprintf(stderr, "Warning: metadata truncated to %lu bytes.\n",
-                    (unsigned long)(sizeof(metadata) - 1));
-        }
+    printf("----------------------------------------\n");
+    if (stats.indexed) {
+        printf("%ld matching chunks (term index, %ld terms).\n", stats.matches, stats.terms);
+    } else {
+        printf("%ld matching chunks (scanned %ld chunks).\n", stats.matches, stats.scanned);
+        fprintf(stderr, "Note: %s; run 'index --terms' to build one.\n",
+                stats.stale ? "term index is out of date" : "no term index");
     }
-    meta_len = (u32)strlen(metadata);
+    if (rc != ZZK_OK) return 2;
+    return stats.matches > 0 ? 0 : 1;
+}
 
-    /* 溢出检查（写入前执行） */
-    if (meta_len > 0xFFFFFFFFUL - CHUNK_OVERHEAD ||
-        target_size > 0xFFFFFFFFUL - CHUNK_OVERHEAD ||
-        (CHUNK_OVERHEAD + meta_len) > 0xFFFFFFFFUL - (CHUNK_OVERHEAD + target_size)) {
-        fprintf(stderr, "Error: file size overflow (exceeds 4GB limit).\n");
-        fclose(fp_target);
-        exit(1);
+/* upgrade: 把 ZZK1 归档转换为 ZZK2（省略 output 时原地替换） */
+static int cmd_upgrade(const char *archive_name, const char *output) {
+    zzk_reader *r;
+    long chunks;
+    zzk_u64 size;
+    char num[24];
+    int rc;
+
+    if (zzk_reader_open(&r, archive_name) != ZZK_OK) return 1;
+    rc = zzk_reader_format(r);
+    zzk_reader_close(r);
+    if (rc == ZZK_FORMAT_ZZK2) {
+        printf("Archive is already ZZK2: %s\n", archive_name);
+        return 0;
     }
-    total_added = (CHUNK_OVERHEAD + meta_len) + (CHUNK_OVERHEAD + target_size);
 
-    validate_and_open(archive_name, &fp_archive, &current_size);
+    rc = zzk_upgrade(archive_name, output, &options, &chunks, &size);
+    if (rc != ZZK_OK) return (rc == ZZK_ERR_CRC || rc == ZZK_ERR_CORRUPT) ? 2 : 1;
+    printf("Upgraded %ld chunks to ZZK2: %s (Size: %s)\n", chunks, output ? output : archive_name,
+           zzk_u64_str(size, num));
+    return 0;
+}
 
-    if (current_size > 0xFFFFFFFFUL - total_added) {
-        fprintf(stderr, "Error: file size overflow (exceeds 4GB limit).\n");
-        fclose(fp_target);
-        fclose(fp_archive);
-        exit(1);
+/*
+ * merge: 把各来源归档的块原样复制到 target 末尾，全部完成后只更新一次 TotalSize。
+ * 任一来源失败时整次合并撤回，target 的 TotalSize 保持不变。退出码：CRC 不一致或来源受损返回 2，其他错误返回 1
+ */
+static int cmd_merge(const char *target, char **sources, int count, int flags, int nthreads) {
+    struct zzk_merge_stats st;
+    zzk_writer *w;
+    zzk_u64 start_pos;
+    char num[24];
+    int i, rc;
+
+    if (zzk_writer_open(&w, target, &options) != ZZK_OK) return 1;
+    start_pos = zzk_writer_size(w);
+    for (i = 0; i < count; i++) {
+        rc = zzk_writer_merge(w, sources[i], flags, nthreads, &st);
+        if (rc != ZZK_OK) {
+            if (st.bad > 0) fprintf(stderr, "%ld chunks in '%s' failed the CRC32 check.\n", st.bad, sources[i]);
+            fprintf(stderr, "Error: merging '%s' failed. Merge discarded.\n", sources[i]);
+            zzk_writer_abort(w);
+            return (rc == ZZK_ERR_CRC || rc == ZZK_ERR_CORRUPT) ? 2 : 1;
+        }
+        printf("Merged %s: %ld chunks (%ld references renumbered, %ld index chunks dropped), %s bytes%s\n",
+               sources[i], st.chunks, st.refs, st.dropped, zzk_u64_str(st.bytes, num),
+               (flags & ZZK_MERGE_VERIFY) ? ", CRC32 OK" : "");
     }
+    start_pos = zzk_writer_size(w) - start_pos;
+    if (zzk_writer_close(w) != ZZK_OK) return 1;
+    printf("Merged %d archives (%s bytes) into: %s\n", count, zzk_u64_str(start_pos, num), target);
+    return 0;
+}
 
-    /* 元数据块 */
-    write_chunk(fp_archive, TYPE_TEXT, metadata, meta_len);
-
-    /* 二进制块（流式写入 + 流式 CRC） */
-    {
-        unsigned char hdr[8];
-        u32 bin_crc = 0xFFFFFFFFUL;
+/*
+ * follow: 把游标之后新提交的块按帧（见 zzk1.h zzk_reader_write_frame）写到标准输出，然后等待归档增长。
+ * 每轮输出 fflush 之后才保存游标，中断后至多重复交付最后一轮。退出码：CRC 不一致或归档受损返回 2，其他错误返回 1
+ */
+static int follow_frame(void *ctx, zzk_reader *r, const struct zzk_chunk *c) {
+    (void)ctx;
+    return zzk_reader_write_frame(r, c, stdout);
+}
 
-        u32_to_be(TYPE_BINARY, hdr);
-        u32_to_be(target_size, hdr + 4);
-        bin_crc = crc32_update(bin_crc, hdr, 8);
+static int cmd_follow(const char *archive_name, const char *cursor_file, int once, int from_end) {
+    struct zzk_cursor cursor;
+    zzk_reader *r;
+    long count;
+    int rc = ZZK_ERR_NOT_FOUND;
 
-        require_write_u32(fp_archive, TYPE_BINARY, "Error writing binary chunk type");
-        require_write_u32(fp_archive, target_size, "Error writing binary chunk length");
-        while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp_target)) > 0) {
-            require_fwrite(fp_archive, buffer, bytes_read, "Error writing binary chunk value");
-            bin_crc = crc32_update(bin_crc, buffer, bytes_read);
+#ifndef ZZK1_POSIX
+    if (!once) {
+        fprintf(stderr, "Error: follow without --once needs a POSIX build.\n");
+        return 1;
+    }
+#endif
+    memset(&cursor, 0, sizeof(cursor));
+    if (cursor_file) {
+        rc = zzk_cursor_load(cursor_file, &cursor);
+        if (rc != ZZK_OK && rc != ZZK_ERR_NOT_FOUND) return 1;
+    }
+    if (zzk_reader_open(&r, archive_name) != ZZK_OK) return 1;
+    /* --from-end 只在没有已保存的游标时生效：跳过现有的块，只输出此后追加的 */
+    if (from_end && rc == ZZK_ERR_NOT_FOUND) rc = zzk_reader_follow(r, &cursor, NULL, NULL, NULL);
+
+    for (;;) {
+        rc = zzk_reader_follow(r, &cursor, follow_frame, NULL, &count);
+        if (fflush(stdout) != 0) {
+            perror("Error writing output");
+            rc = ZZK_ERR_IO;
+        }
+        if (rc != ZZK_OK) break;
+        if (cursor_file && (rc = zzk_cursor_save(cursor_file, &cursor)) != ZZK_OK) break;
+        if (once) break;
+        rc = zzk_reader_wait(r, -1);
+        if (rc == ZZK_ERR_NOT_FOUND) {
+            /* 归档被替换（例如原地 upgrade）：重新打开，原游标须与新文件一致 */
+            zzk_reader_close(r);
+            if (zzk_reader_open(&r, archive_name) != ZZK_OK) return 1;
+            rc = ZZK_OK;
         }
-        if (ferror(fp_target)) die_io("Error reading target file");
-        bin_crc ^= 0xFFFFFFFFUL;
-        require_write_u32(fp_archive, bin_crc, "Error writing binary CRC32");
+        if (rc != ZZK_OK) break;
     }
+    zzk_reader_close(r);
+    if (rc == ZZK_OK) return 0;
+    return (rc == ZZK_ERR_CRC || rc == ZZK_ERR_CORRUPT) ? 2 : 1;
+}
 
-    update_total_size(fp_archive, total_added, current_size);
-    fclose(fp_target);
-    fclose(fp_archive);
-    printf("Appended file '%s' to: %s\n", target_file, archive_name);
+/* ========== 目录遍历 ========== */
+
+/* append-dir 收集的文件路径（按遍历顺序） */
+struct dir_walk {
+    struct zzk_file_item *items;
+    long count;
+    long cap;
+#ifdef ZZK1_POSIX
+    dev_t skip_dev;           /* 归档本身位于目录树中时不收录它 */
+    ino_t skip_ino;
+#endif
+};
+
+#ifdef ZZK1_POSIX
+static int compare_name(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
 }
 
-/* extract: 提取指定块（1-based 索引）到输出文件 */
-static void cmd_extract(const char *archive_name, const char *chunk_index_str, const char *output_file) {
-    FILE *fp_in, *fp_out;
-    u32 total_size, reserved;
-    u32 type, length;
-    u32 bytes_consumed = 0;  /* 已读取的数据区字节数 */
-    u32 data_region;
-    int target_index, current_index = 0;
-    unsigned char buffer[4096];
-    u32 bytes_remaining;
-    size_t to_read;
-    char *endptr;
-    long parsed_value;
+static int walk_add(struct dir_walk *walk, char *path) {
+    if (walk->count == walk->cap) {
+        long cap = walk->cap ? walk->cap * 2 : 256;
+        struct zzk_file_item *items = (struct zzk_file_item *)realloc(walk->items, sizeof(*items) * (size_t)cap);
+        if (!items) return -1;
+        walk->items = items;
+        walk->cap = cap;
+    }
+    memset(&walk->items[walk->count], 0, sizeof(walk->items[0]));
+    walk->items[walk->count++].path = path;
+    return 0;
+}
 
-    parsed_value = strtol(chunk_index_str, &endptr, 10);
-    if (*endptr != '\0' || endptr == chunk_index_str || parsed_value <= 0 || parsed_value > 2147483647L) {
-        fprintf(stderr, "Error: Invalid chunk index '%s'. Must be a positive integer >= 1.\n", chunk_index_str);
-        exit(1);
+/*
+ * 收录 dir 下的全部普通文件，各级目录内按名称排序，结果与文件系统的枚举顺序无关。
+ * 符号链接与设备等特殊文件跳过。失败返回 -1（已输出原因）
+ */
+static int walk_dir(struct dir_walk *walk, const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *ent;
+    struct stat st;
+    char **names = NULL, *path;
+    size_t dir_len = strlen(dir), len;
+    long count = 0, cap = 0, i;
+    int rc = 0;
+
+    if (!d) {
+        fprintf(stderr, "Error opening directory '%s': %s\n", dir, strerror(errno));
+        return -1;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        if (count == cap) {
+            char **grown;
+            cap = cap ? cap * 2 : 64;
+            grown = (char **)realloc(names, sizeof(char *) * (size_t)cap);
+            if (!grown) {
+                rc = -1;
+                break;
+            }
+            names = grown;
+        }
+        len = strlen(ent->d_name);
+        names[count] = (char *)malloc(dir_len + len + 2);
+        if (!names[count]) {
+            rc = -1;
+            break;
+        }
+        memcpy(names[count], dir, dir_len);
+        len = (dir_len > 0 && dir[dir_len - 1] == '/') ? dir_len : dir_len + 1;
+        names[count][len - 1] = '/';
+        strcpy(names[count] + len, ent->d_name);
+        count++;
+    }
+    closedir(d);
+    if (rc != 0) fprintf(stderr, "Error: Memory allocation failed.\n");
+    if (rc == 0) qsort(names, (size_t)count, sizeof(char *), compare_name);
+
+    for (i = 0; i < count; i++) {
+        path = names[i];
+        names[i] = NULL;
+        if (rc != 0) {
+            free(path);
+        } else if (lstat(path, &st) != 0) {
+            fprintf(stderr, "Warning: skipping '%s': %s.\n", path, strerror(errno));
+            free(path);
+        } else if (S_ISDIR(st.st_mode)) {
+            rc = walk_dir(walk, path);
+            free(path);
+        } else if (!S_ISREG(st.st_mode) || (st.st_dev == walk->skip_dev && st.st_ino == walk->skip_ino)) {
+            free(path);
+        } else if (walk_add(walk, path) != 0) {
+            fprintf(stderr, "Error: Memory allocation failed.\n");
+            free(path);
+            rc = -1;
+        }
     }
-    target_index = (int)parsed_value;
+    free(names);
+    return rc;
+}
+#endif
 
-    fp_in = fopen(archive_name, "rb");
-    if (!fp_in) {
-        perror("Error opening archive");
-        exit(1);
+/*
+ * append-dir: 遍历目录树，把其中的普通文件各作为一条记录追加（元数据含修改时间与 Hash）。
+ * 文件在工作者上读取并计算 Hash，由一个写入者按遍历顺序写出，结束时只更新一次 TotalSize。
+ * --incremental 跳过大小、修改时间与 Hash 都与归档中同名文件最近一条记录相同的文件。
+ * 退出码：有文件无法读取时返回 1，但其余文件照常写入
+ */
+static int cmd_append_dir(const char *archive_name, const char *dir, const char *description, int flags,
+                          int nthreads) {
+#ifdef ZZK1_POSIX
+    struct dir_walk walk;
+    struct zzk_files_stats st;
+    struct stat ast;
+    zzk_writer *w;
+    char num[24];
+    long i;
+    int rc;
+
+    memset(&walk, 0, sizeof(walk));
+    if (stat(archive_name, &ast) == 0) {
+        walk.skip_dev = ast.st_dev;
+        walk.skip_ino = ast.st_ino;
+    }
+    rc = walk_dir(&walk, dir) == 0 ? ZZK_OK : ZZK_ERR_IO;
+    if (rc == ZZK_OK) rc = zzk_writer_open(&w, archive_name, &options);
+    if (rc == ZZK_OK) {
+        rc = zzk_writer_append_files(w, walk.items, walk.count, description, flags, nthreads, &st);
+        if (rc != ZZK_OK) zzk_writer_abort(w);
+        else rc = zzk_writer_close(w);
     }
+    for (i = 0; i < walk.count; i++) free((char *)walk.items[i].path);
+    free(walk.items);
+    if (rc != ZZK_OK) return 1;
+
+    printf("Appended %ld files (%s bytes) from '%s' to: %s\n", st.written, zzk_u64_str(st.bytes, num), dir,
+           archive_name);
+    if (flags & ZZK_FILES_INCREMENTAL) printf("Skipped %ld unchanged files.\n", st.skipped);
+    if (st.failed > 0) {
+        fprintf(stderr, "WARNING: %ld files could not be read and were not archived.\n", st.failed);
+        return 1;
+    }
+    return 0;
+#else
+    (void)archive_name;
+    (void)dir;
+    (void)description;
+    (void)flags;
+    (void)nthreads;
+    fprintf(stderr, "Error: append-dir needs a POSIX build (-DZZK1_POSIX) to walk directories.\n");
+    return 1;
+#endif
+}
 
-    read_header_or_die(fp_in, &total_size, &reserved);
+/*
+ * recover: 截掉受损的尾部。退出码：完好或已修复返回 0，--dry-run 发现受损返回 2，其他错误返回 1
+ */
+static int cmd_recover(const char *archive_name, int flags) {
+    struct zzk_recover_stats st;
+    char a[24], b[24], c[24];
+
+    if (zzk_recover(archive_name, &options, flags, &st) != ZZK_OK) return 1;
+    if (st.checkpoint) {
+        printf("Checkpoint: Chunk #%ld at offset %s (searched %s bytes)\n", st.checkpoint_chunk,
+               zzk_u64_str(st.checkpoint_offset, a), zzk_u64_str(st.searched, b));
+    } else if (!(flags & ZZK_RECOVER_FULL)) {
+        printf("No checkpoint found (searched %s bytes); verified from the start.\n", zzk_u64_str(st.searched, a));
+    }
+    printf("Verified %ld chunks (%s bytes)%s.\n", st.verified_chunks, zzk_u64_str(st.verified, a),
+           st.checkpoint ? " after the checkpoint" : "");
+    if (st.mismatched > 0) printf("WARNING: %ld checkpoints do not match the chunks before them.\n", st.mismatched);
 
-    if (total_size < HEADER_SIZE) {
-        fprintf(stderr, "Error: invalid total size in header.\n");
-        fclose(fp_in);
-        exit(1);
+    if (st.incomplete > 0) {
+        printf("Dropped %ld intact chunks of an incomplete record at the end.\n", st.incomplete);
     }
-    data_region = total_size - HEADER_SIZE;
 
-    /* 只在 total_size 声明的范围内遍历 */
-    while (bytes_consumed + 8 <= data_region) {
-        if (read_u32_be(fp_in, &type) != 0) break;
-        if (read_u32_be(fp_in, &length) != 0) {
-            fprintf(stderr, "Warning: Unexpected EOF reading chunk length.\n");
-            break;
+    /* 从检查点开始时只校验了其后的块，不能断言整个归档完好 */
+    if (st.valid_size == st.header_size) {
+        if (st.checkpoint) {
+            printf("No damage after the checkpoint at chunk #%ld: %ld chunks, %s bytes", st.checkpoint_chunk, st.chunks,
+                   zzk_u64_str(st.valid_size, a));
+        } else {
+            printf("Archive is intact: %ld chunks, %s bytes", st.chunks, zzk_u64_str(st.valid_size, a));
         }
-        bytes_consumed += 8;
-
-        /* 需要 length + 4(CRC32) 字节 */
-        if (data_region - bytes_consumed < 4 || length > data_region - bytes_consumed - 4) {
-            fprintf(stderr, "Warning: chunk length exceeds remaining data.\n");
-            break;
+        if (st.file_size != st.header_size) {
+            printf(" (%s bytes of uncommitted data beyond TotalSize ignored)",
+                   zzk_u64_str(st.file_size - st.header_size, b));
         }
+        printf(".\n");
+        return 0;
+    }
+    printf("%s %ld chunks: TotalSize %s (was %s, file size %s).\n", st.repaired ? "Recovered" : "Recoverable",
+           st.chunks, zzk_u64_str(st.valid_size, a), zzk_u64_str(st.header_size, b), zzk_u64_str(st.file_size, c));
+    return st.repaired ? 0 : 2;
+}
 
-        current_index++;
+/* selftest: 用参考实现逐一核对各 CRC32 内核 */
+static int cmd_selftest(void) {
+    return zzk_crc32_selftest(stdout) == ZZK_OK ? 0 : 1;
+}
 
-        if (current_index == target_index) {
-            unsigned char hdr[8];
-            u32 crc = 0xFFFFFFFFUL;
-            u32 stored_crc;
+/* ========== 追加服务 ========== */
 
-            printf("Extracting Chunk #%d (Type %lu, %lu bytes) to '%s'...\n",
-                   target_index, (unsigned long)type, (unsigned long)length, output_file);
+static volatile sig_atomic_t serve_stop = 0;
 
-            /* CRC 计算：包含 Type + Length */
-            u32_to_be(type, hdr);
-            u32_to_be(length, hdr + 4);
-            crc = crc32_update(crc, hdr, 8);
+static void on_stop_signal(int sig) {
+    (void)sig;
+    serve_stop = 1;
+}
 
-            fp_out = fopen(output_file, "wb");
-            if (!fp_out) {
-                perror("Error opening output file");
-                fclose(fp_in);
-                exit(1);
-            }
+/* serve: 独占归档的写入句柄，经 Unix 套接字接收追加请求，SIGINT / SIGTERM 时处理完在途请求后退出 */
+static int cmd_serve(const char *archive_name, const char *socket_path) {
+    struct zzk_serve_stats stats = { 0, 0, 0, 0 };
+    int rc;
+
+    signal(SIGINT, on_stop_signal);
+    signal(SIGTERM, on_stop_signal);
+#ifdef SIGPIPE
+    signal(SIGPIPE, SIG_IGN);  /* 客户端提前断开时不终止服务 */
+#endif
+    printf("Serving %s on %s\n", archive_name, socket_path);
+    fflush(stdout);
+
+    rc = zzk_serve(archive_name, socket_path, &options, &serve_stop, &stats);
+    if (rc != ZZK_OK && stats.connections == 0) return 1;
+    printf("Served %ld records in %ld batches from %ld connections", stats.records, stats.batches,
+           stats.connections);
+    if (stats.failed > 0) printf(", %ld failed", stats.failed);
+    printf(".\n");
+    return rc == ZZK_OK ? 0 : 1;
+}
 
-            bytes_remaining = length;
-            while (bytes_remaining > 0) {
-                to_read = (bytes_remaining > sizeof(buffer)) ? sizeof(buffer) : (size_t)bytes_remaining;
-                if (fread(buffer, 1, to_read, fp_in) != to_read) {
-                    fprintf(stderr, "Error reading chunk data.\n");
-                    fclose(fp_out);
-                    fclose(fp_in);
-                    exit(1);
-                }
-                if (fwrite(buffer, 1, to_read, fp_out) != to_read) {
-                    perror("Error writing to output file");
-                    fclose(fp_out);
-                    fclose(fp_in);
-                    exit(1);
-                }
-                crc = crc32_update(crc, buffer, to_read);
-                bytes_remaining -= (u32)to_read;
-            }
+/* submit: 经 serve 追加一条文本，输出其块编号 */
+static int cmd_submit(const char *socket_path, const char *text) {
+    zzk_client *c;
+    long chunk;
+    int rc;
+
+    if (zzk_client_connect(&c, socket_path) != ZZK_OK) return 1;
+    rc = zzk_client_append(c, ZZK_TYPE_TEXT, text, strlen(text), &chunk);
+    zzk_client_close(c);
+    if (rc != ZZK_OK) return 1;
+    printf("Appended text as chunk #%ld\n", chunk);
+    return 0;
+}
 
-            crc ^= 0xFFFFFFFFUL;
-
-            /* 读取并验证 CRC32 */
-            if (read_u32_be(fp_in, &stored_crc) != 0) {
-                fprintf(stderr, "Warning: could not read CRC32.\n");
-            } else if (stored_crc != crc) {
-                fprintf(stderr, "WARNING: CRC32 MISMATCH (stored: %08lX, computed: %08lX). Data may be corrupted!\n",
-                        (unsigned long)stored_crc, (unsigned long)crc);
-                fclose(fp_out);
-                fclose(fp_in);
-                exit(2);
-            } else {
-                printf("CRC32 verified OK.\n");
-            }
+struct load_client {
+    const char *socket_path;
+    long records;
+    size_t size;
+    long done;
+    long failed;
+    double total_ms;
+    double max_ms;
+};
+
+/* 一个负载客户端：逐条发送记录并等待应答，统计应答延迟 */
+static void *load_client_main(void *arg) {
+    struct load_client *lc = (struct load_client *)arg;
+    zzk_client *c;
+    char *payload = (char *)malloc(lc->size ? lc->size : 1);
+    double start, elapsed;
+    size_t j;
+    long i;
+
+    if (!payload || zzk_client_connect(&c, lc->socket_path) != ZZK_OK) {
+        free(payload);
+        lc->failed = lc->records;
+        return NULL;
+    }
+    for (j = 0; j < lc->size; j++) payload[j] = (char)('a' + j % 26);
+    for (i = 0; i < lc->records; i++) {
+        start = zzk_clock_ms();
+        if (zzk_client_append(c, ZZK_TYPE_TEXT, payload, lc->size, NULL) != ZZK_OK) {
+            lc->failed = lc->records - i;
+            break;
+        }
+        elapsed = zzk_clock_ms() - start;
+        lc->done++;
+        lc->total_ms += elapsed;
+        if (elapsed > lc->max_ms) lc->max_ms = elapsed;
+    }
+    zzk_client_close(c);
+    free(payload);
+    return NULL;
+}
+
+/* serve-load: 多个客户端并发压测 serve，报告吞吐与应答延迟 */
+static int cmd_serve_load(const char *socket_path, int nclients, long records, long size) {
+    struct load_client *clients = (struct load_client *)calloc((size_t)nclients, sizeof(*clients));
+    long done = 0, failed = 0;
+    double start, seconds, total_ms = 0, max_ms = 0;
+    int i;
+#ifdef ZZK1_THREADS
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * (size_t)nclients);
+    int *started = (int *)calloc((size_t)nclients, sizeof(int));
+#endif
+
+    if (!clients) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        return 1;
+    }
+    for (i = 0; i < nclients; i++) {
+        clients[i].socket_path = socket_path;
+        clients[i].records = records;
+        clients[i].size = (size_t)size;
+    }
 
-            fclose(fp_out);
-            fclose(fp_in);
-            printf("Extraction complete.\n");
-            return;
+    start = zzk_clock_ms();
+#ifdef ZZK1_THREADS
+    if (threads && started) {
+        for (i = 0; i < nclients; i++) {
+            started[i] = pthread_create(&threads[i], NULL, load_client_main, &clients[i]) == 0;
         }
+        for (i = 0; i < nclients; i++) {
+            if (started[i]) pthread_join(threads[i], NULL);
+            else load_client_main(&clients[i]);
+        }
+    } else
+#endif
+    {
+        for (i = 0; i < nclients; i++) load_client_main(&clients[i]);
+    }
+    seconds = (zzk_clock_ms() - start) / 1000.0;
+#ifdef ZZK1_THREADS
+    free(threads);
+    free(started);
+#endif
+
+    for (i = 0; i < nclients; i++) {
+        done += clients[i].done;
+        failed += clients[i].failed;
+        total_ms += clients[i].total_ms;
+        if (clients[i].max_ms > max_ms) max_ms = clients[i].max_ms;
+    }
+    free(clients);
+    if (seconds <= 0) seconds = 1e-9;
+
+    printf("Load: %d clients x %ld records x %ld bytes in %.3f s\n", nclients, records, size, seconds);
+    printf("Throughput: %.0f records/s, %.2f MB/s\n", done / seconds, done * (double)size / seconds / 1e6);
+    if (done > 0) printf("Latency: avg=%.3f ms, max=%.3f ms\n", total_ms / done, max_ms);
+    if (failed > 0) printf("Failed: %ld records\n", failed);
+    return failed > 0 ? 1 : 0;
+}
+
+/* ========== 基准测试 ========== */
 
-        /* 跳过 value + CRC32 */
-        seek_forward(fp_in, length);
-        if (fseek(fp_in, 4, SEEK_CUR) != 0) die_io("Error skipping CRC32");
-        bytes_consumed += length + 4;
+/*
+ * generate 与 bench 共用的合成归档参数。内容由固定种子的伪随机数生成，
+ * 同样的参数在任何构建上得到同样的归档，便于比较不同构建。
+ * 文本块是随机单词组成的行；二进制块是不可压缩的随机字节，经 append-file 写入（元数据块 + 二进制块）。
+ */
+struct synth_params {
+    long chunks;         /* 内容块数（文本块或二进制块，二进制块另带一个元数据块） */
+    long min_size;
+    long max_size;
+    int log_sizes;       /* 非零时按位数均匀选取大小（小块多、大块少），否则在 [min, max] 上均匀 */
+    int text_percent;    /* 文本块所占的百分比 */
+    long seed;
+    long repeat;         /* bench: 读取类测试的重复次数 */
+    int format;
+};
+
+#define SYNTH_MAX_SIZE   (64L * 1024 * 1024)
+#define BENCH_CRC_BYTES  (256UL * 1024 * 1024)
+#define BENCH_CRC_BUFFER (4UL * 1024 * 1024)
+#define BENCH_OPS        100
+
+static void synth_defaults(struct synth_params *p) {
+    p->chunks = 1000;
+    p->min_size = 64;
+    p->max_size = 256L * 1024;
+    p->log_sizes = 1;
+    p->text_percent = 50;
+    p->seed = 1;
+    p->repeat = 5;
+    p->format = ZZK_FORMAT_ZZK1;
+}
+
+/*
+ * 解析 argv[0] 处的一个合成参数选项。返回消耗的参数个数；不是这类选项返回 0；取值非法时报错并返回 -1
+ */
+static int parse_synth_option(int argc, char **argv, struct synth_params *p) {
+    const char *name = argv[0];
+    const char *end;
+    zzk_u64 lo, hi;
+
+    if (strcmp(name, "--zzk2") == 0) {
+        p->format = ZZK_FORMAT_ZZK2;
+        return 1;
     }
+    if (strcmp(name, "--log") == 0 || strcmp(name, "--uniform") == 0) {
+        p->log_sizes = strcmp(name, "--log") == 0;
+        return 1;
+    }
+    if (argc < 2) return 0;
+    if (strcmp(name, "--chunks") == 0) {
+        if (parse_long(argv[1], 1, 10000000L, &p->chunks) == 0) return 2;
+    } else if (strcmp(name, "--text") == 0) {
+        long percent;
+        if (parse_long(argv[1], 0, 100, &percent) == 0) {
+            p->text_percent = (int)percent;
+            return 2;
+        }
+    } else if (strcmp(name, "--seed") == 0) {
+        if (parse_long(argv[1], 0, 0x7FFFFFFFL, &p->seed) == 0) return 2;
+    } else if (strcmp(name, "--repeat") == 0) {
+        if (parse_long(argv[1], 1, 1000000L, &p->repeat) == 0) return 2;
+    } else if (strcmp(name, "--size") == 0) {
+        end = parse_u64(argv[1], ':', &lo);
+        if (end && parse_u64(end, '\0', &hi) && lo >= 1 && lo <= hi &&
+            hi <= (zzk_u64)SYNTH_MAX_SIZE) {
+            p->min_size = (long)lo;
+            p->max_size = (long)hi;
+            return 2;
+        }
+    } else {
+        return 0;
+    }
+    fprintf(stderr, "Error: Invalid value '%s' for %s.\n", argv[1], name);
+    return -1;
+}
 
-    fprintf(stderr, "Error: Chunk #%d not found.\n", target_index);
-    fclose(fp_in);
-    exit(1);
+/* xorshift32：只取低 32 位，unsigned long 更宽的平台上结果相同 */
+static zzk_u32 synth_random(zzk_u32 *state) {
+    zzk_u32 x = *state;
+    x ^= (x << 13) & 0xFFFFFFFFUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xFFFFFFFFUL;
+    *state = x;
+    return x;
 }
 
-/* list: 列出归档中的所有数据块 */
-static void cmd_list(const char *filename) {
-    FILE *fp;
-    u32 total_size, reserved;
-    u32 type, length;
-    u32 bytes_consumed = 0;
-    u32 data_region;
-    int chunk_count = 0;
-    unsigned char *buffer;
-    u32 stored_crc;
-    const char *type_name;
-
-    fp = fopen(filename, "rb");
+static size_t synth_size(const struct synth_params *p, zzk_u32 *state) {
+    zzk_u32 span, bits_lo = 0, bits_hi = 0, bits;
+    zzk_u32 lo = (zzk_u32)p->min_size, hi = (zzk_u32)p->max_size;
+
+    if (p->log_sizes) {
+        while ((lo >> bits_lo) > 1) bits_lo++;
+        while ((hi >> bits_hi) > 1) bits_hi++;
+        bits = bits_lo + synth_random(state) % (bits_hi - bits_lo + 1);
+        /* 在 [2^bits, 2^(bits+1)) 与 [min, max] 的交集内均匀选取 */
+        if ((1UL << bits) > lo) lo = (zzk_u32)(1UL << bits);
+        if (bits < 31 && (1UL << (bits + 1)) - 1 < hi) hi = (zzk_u32)((1UL << (bits + 1)) - 1);
+    }
+    span = hi - lo + 1;
+    return (size_t)(lo + (span == 0 ? synth_random(state) : synth_random(state) % span));
+}
+
+/* 填充 len 字节的合成内容：文本为随机单词（约每 12 个单词换行），二进制为随机字节 */
+static void synth_fill(unsigned char *buf, size_t len, int text, zzk_u32 *state) {
+    static const char *words[] = {
+        "archive", "chunk", "record", "header", "length", "value", "checksum", "offset",
+        "stream", "index", "append", "extract", "verify", "storage", "format", "block",
+        "alpha", "beta", "gamma", "delta", "epsilon", "zeta", "theta", "lambda"
+    };
+    size_t i = 0, n, count = 0;
+    const char *w;
+    zzk_u32 r;
+
+    if (!text) {
+        while (i < len) {
+            r = synth_random(state);
+            for (n = 0; n < 4 && i < len; n++, r >>= 8) buf[i++] = (unsigned char)(r & 0xFF);
+        }
+        return;
+    }
+    while (i < len) {
+        w = words[synth_random(state) % (sizeof(words) / sizeof(words[0]))];
+        for (n = 0; w[n] != '\0' && i < len; n++) buf[i++] = (unsigned char)w[n];
+        if (i < len) buf[i++] = (unsigned char)(++count % 12 == 0 ? '\n' : ' ');
+    }
+}
+
+/* 把 len 字节写入 path（合成的二进制块经 append-file 写入） */
+static int write_scratch(const char *path, const unsigned char *buf, size_t len) {
+    FILE *fp = fopen(path, "wb");
+    int rc = 0;
+
     if (!fp) {
-        perror("Error opening file");
-        exit(1);
+        perror("Error creating scratch file");
+        return -1;
     }
+    if (fwrite(buf, 1, len, fp) != len) rc = -1;
+    if (fclose(fp) != 0) rc = -1;
+    if (rc != 0) perror("Error writing scratch file");
+    return rc;
+}
 
-    read_header_or_die(fp, &total_size, &reserved);
+/*
+ * 生成合成归档。scratch 为二进制块内容的临时文件；bytes / chunks 返回写入的内容字节数与归档的块数，
+ * ms 返回追加阶段（不含临时文件写入）的耗时。
+ */
+static int synth_generate(const char *archive, const char *scratch, const struct synth_params *p,
+                          zzk_u64 *bytes, long *chunks, double *ms) {
+    static const char intro[] = "synthetic archive";
+    unsigned char *buf = (unsigned char *)malloc((size_t)p->max_size);
+    zzk_writer *w = NULL;
+    zzk_u32 state = (zzk_u32)(p->seed * 2654435761UL + 1) & 0xFFFFFFFFUL;
+    char description[64];
+    size_t len;
+    double start;
+    long i;
+    int text, rc = ZZK_OK;
+
+    *bytes = 0;
+    *ms = 0;
+    if (state == 0) state = 1;
+    if (!buf) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        return 1;
+    }
+    start = zzk_clock_ms();
+    rc = zzk_create(archive, p->format, intro, sizeof(intro) - 1, &options);
+    if (rc == ZZK_OK) rc = zzk_writer_open(&w, archive, &options);
+    *ms += zzk_clock_ms() - start;
+    for (i = 0; rc == ZZK_OK && i < p->chunks; i++) {
+        len = synth_size(p, &state);
+        text = (long)(synth_random(&state) % 100) < p->text_percent;
+        synth_fill(buf, len, text, &state);
+        if (text) {
+            start = zzk_clock_ms();
+            rc = zzk_writer_append(w, ZZK_TYPE_TEXT, buf, len);
+        } else {
+            if (write_scratch(scratch, buf, len) != 0) {
+                rc = ZZK_ERR_IO;
+                break;
+            }
+            sprintf(description, "synthetic binary %ld", i + 1);
+            start = zzk_clock_ms();
+            rc = zzk_writer_append_file(w, scratch, description);
+        }
+        *ms += zzk_clock_ms() - start;
+        *bytes += (zzk_u64)len;
+    }
+    free(buf);
+    if (!w) return 1;
+    if (rc == ZZK_OK) rc = zzk_writer_chunk_count(w, chunks);
+    start = zzk_clock_ms();
+    if (rc != ZZK_OK) {
+        zzk_writer_abort(w);
+        return 1;
+    }
+    rc = zzk_writer_close(w);
+    *ms += zzk_clock_ms() - start;
+    return rc == ZZK_OK ? 0 : 1;
+}
 
-    if (total_size < HEADER_SIZE) {
-        fprintf(stderr, "Error: invalid total size in header.\n");
-        fclose(fp);
-        exit(1);
+/* generate: 生成合成归档（参数见 struct synth_params） */
+static int cmd_generate(const char *archive, const struct synth_params *p) {
+    char scratch[4096];
+    zzk_u64 bytes;
+    long chunks = 0;
+    double ms;
+    char num[24];
+    int rc;
+
+    if (strlen(archive) + sizeof(".gen.tmp") > sizeof(scratch)) {
+        fprintf(stderr, "Error: archive path too long.\n");
+        return 1;
     }
-    data_region = total_size - HEADER_SIZE;
+    sprintf(scratch, "%s.gen.tmp", archive);
+    rc = synth_generate(archive, scratch, p, &bytes, &chunks, &ms);
+    remove(scratch);
+    if (rc != 0) return 1;
+    printf("Generated %ld chunks (%s content bytes) in: %s\n", chunks, zzk_u64_str(bytes, num), archive);
+    return 0;
+}
 
-    printf("File: %s (Size: %lu)\n", filename, (unsigned long)total_size);
-    printf("----------------------------------------\n");
+/*
+ * 输出一项结果，每行一项、字段固定为 key=value，新增字段只追加在行尾，
+ * 便于脚本按名称比较不同构建的结果。
+ */
+static void bench_result(const char *name, long ops, zzk_u64 bytes, double ms) {
+    char num[24];
+    double seconds = ms / 1000.0;
 
-    /* 只在 total_size 声明的范围内遍历，不读取尾部垃圾 */
-    while (bytes_consumed + 8 <= data_region) {
-        if (read_u32_be(fp, &type) != 0) break;
-        if (read_u32_be(fp, &length) != 0) {
-            fprintf(stderr, "Warning: Unexpected EOF reading chunk length.\n");
-            break;
-        }
-        bytes_consumed += 8;
+    if (seconds <= 0) seconds = 1e-9;
+    printf("name=%s ops=%ld bytes=%s seconds=%.6f mb_per_s=%.2f ops_per_s=%.2f\n", name, ops,
+           zzk_u64_str(bytes, num), seconds, (double)bytes / seconds / 1e6, ops / seconds);
+}
 
-        /* 需要 length + 4(CRC32) 字节 */
-        if (data_region - bytes_consumed < 4 || length > data_region - bytes_consumed - 4) {
-            fprintf(stderr, "Warning: chunk #%d length (%lu) exceeds remaining data. Stopping.\n",
-                    chunk_count + 1, (unsigned long)length);
-            break;
+/* list 的读取路径：文本块逐片计算 CRC32，其他块只读存储的 CRC32 */
+static int bench_list_chunk(void *ctx, zzk_reader *r, const struct zzk_chunk *c) {
+    zzk_u32 crc;
+
+    (void)ctx;
+    if (c->type == ZZK_TYPE_TEXT) zzk_reader_value_crc(r, c, NULL, &crc);
+    zzk_reader_stored_crc(r, c, &crc);
+    return 0;
+}
+
+/* 打开归档、定位并校验提取第 index 块（与 extract 命令的路径相同），重复 repeat 次 */
+static int bench_extract(const char *name, const char *archive, const char *output, long index, long repeat) {
+    zzk_reader *r;
+    struct zzk_chunk c;
+    FILE *out;
+    zzk_u64 bytes = 0;
+    double start = zzk_clock_ms();
+    long i;
+    int rc = ZZK_OK;
+
+    for (i = 0; rc == ZZK_OK && i < repeat; i++) {
+        if ((rc = zzk_reader_open(&r, archive)) != ZZK_OK) break;
+        rc = zzk_reader_find(r, index, &c);
+        out = rc == ZZK_OK ? fopen(output, "wb") : NULL;
+        if (rc == ZZK_OK && !out) rc = ZZK_ERR_IO;
+        if (rc == ZZK_OK) rc = zzk_reader_extract(r, &c, out, 1, NULL);
+        if (out && fclose(out) != 0 && rc == ZZK_OK) rc = ZZK_ERR_IO;
+        zzk_reader_close(r);
+        if (rc == ZZK_OK) bytes += c.length;
+    }
+    if (rc != ZZK_OK) {
+        fprintf(stderr, "Error: %s failed (%s).\n", name, zzk_strerror(rc));
+        return 1;
+    }
+    bench_result(name, repeat, bytes, zzk_clock_ms() - start);
+    return 0;
+}
+
+/*
+ * bench: 在 dir 下生成合成归档并计时各项操作，结果逐行输出到 stdout（格式见 bench_result）。
+ * 写入类测试（create / append / append-file）每次操作都完整地 打开 → 写入 → 关闭，与命令行一致；
+ * 全局选项（--sync 等）照常生效。结束时删除生成的文件。
+ */
+static int cmd_bench(const char *dir, const struct synth_params *p) {
+    static const char *names[] = { "bench.zzk", "bench-ops.zzk", "bench.bin", "bench.out" };
+    char paths[4][4096];
+    const char *archive = paths[0], *ops_archive = paths[1], *scratch = paths[2], *output = paths[3];
+    unsigned char *buf = NULL;
+    zzk_reader *r;
+    zzk_writer *w;
+    zzk_u64 bytes, total;
+    zzk_u32 state = (zzk_u32)(p->seed * 2654435761UL + 7) & 0xFFFFFFFFUL, crc = 0;
+    long chunks = 0, i;
+    double ms, start;
+    size_t len;
+    int k, mapped = 0, rc = 0;
+
+    for (k = 0; k < 4; k++) {
+        if (strlen(dir) + strlen(names[k]) + 2 > sizeof(paths[k])) {
+            fprintf(stderr, "Error: directory path too long.\n");
+            return 1;
         }
+        sprintf(paths[k], "%s/%s", dir, names[k]);
+    }
+    if (state == 0) state = 1;
+    buf = (unsigned char *)malloc(BENCH_CRC_BUFFER > (unsigned long)p->max_size ? BENCH_CRC_BUFFER
+                                                                               : (size_t)p->max_size);
+    if (!buf) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        return 1;
+    }
 
-        chunk_count++;
-        if (type == TYPE_TEXT) type_name = "TEXT";
-        else if (type == TYPE_BINARY) type_name = "BINARY";
-        else if (type == TYPE_PADDING) type_name = "PADDING";
-        else type_name = "UNKNOWN";
+    printf("# zzk1 bench format=1 crc=%s chunks=%ld size=%ld:%ld dist=%s text=%d seed=%ld repeat=%ld archive=%s\n",
+           zzk_crc32_kernel(), p->chunks, p->min_size, p->max_size, p->log_sizes ? "log" : "uniform",
+           p->text_percent, p->seed, p->repeat, p->format == ZZK_FORMAT_ZZK2 ? "zzk2" : "zzk1");
 
-        printf("Chunk #%d: Type=%s, Length=%lu bytes\n",
-               chunk_count, type_name, (unsigned long)length);
+    /* CRC32 内核的原始吞吐 */
+    synth_fill(buf, BENCH_CRC_BUFFER, 0, &state);
+    start = zzk_clock_ms();
+    for (total = 0; total < BENCH_CRC_BYTES; total += BENCH_CRC_BUFFER) {
+        crc = zzk_crc32_update(crc, buf, BENCH_CRC_BUFFER);
+    }
+    bench_result("crc32", (long)(BENCH_CRC_BYTES / BENCH_CRC_BUFFER), total, zzk_clock_ms() - start);
 
-        if (type == TYPE_TEXT) {
-            if (length > 0x10000000) {
-                fprintf(stderr, "Warning: text chunk too large (%lu). Skipping.\n", (unsigned long)length);
-                seek_forward(fp, length);
-                if (read_u32_be(fp, &stored_crc) != 0) {
-                    fprintf(stderr, "Warning: EOF reading CRC32.\n");
-                }
-            } else {
-                buffer = (unsigned char *)malloc(length + 1);
-                if (buffer) {
-                    if (fread(buffer, 1, length, fp) == length) {
-                        unsigned char hdr[8];
-                        u32 computed_crc;
-
-                        buffer[length] = '\0';
-                        printf("Content:\n");
-                        fwrite(buffer, 1, (size_t)length, stdout);
-                        printf("\n");
-
-                        /* 验证 CRC32 */
-                        u32_to_be(type, hdr);
-                        u32_to_be(length, hdr + 4);
-                        computed_crc = 0xFFFFFFFFUL;
-                        computed_crc = crc32_update(computed_crc, hdr, 8);
-                        computed_crc = crc32_update(computed_crc, buffer, (size_t)length);
-                        computed_crc ^= 0xFFFFFFFFUL;
-
-                        if (read_u32_be(fp, &stored_crc) != 0) {
-                            fprintf(stderr, "Warning: EOF reading CRC32.\n");
-                        } else if (stored_crc == computed_crc) {
-                            printf("[CRC32 OK]\n");
-                        } else {
-                            fprintf(stderr, "WARNING: CRC32 MISMATCH (stored: %08lX, computed: %08lX)\n",
-                                    (unsigned long)stored_crc, (unsigned long)computed_crc);
-                        }
-                    } else {
-                        fprintf(stderr, "Warning: Unexpected EOF reading chunk body.\n");
-                    }
-                    free(buffer);
-                } else {
-                    fprintf(stderr, "Error: Memory allocation failed.\n");
-                    seek_forward(fp, length);
-                    if (read_u32_be(fp, &stored_crc) != 0) {
-                        fprintf(stderr, "Warning: EOF reading CRC32.\n");
-                    }
-                }
-            }
-        } else if (type == TYPE_BINARY) {
-            printf("[Binary Data - Skipped]\n");
-            seek_forward(fp, length);
-            if (read_u32_be(fp, &stored_crc) != 0) {
-                fprintf(stderr, "Warning: EOF reading CRC32.\n");
-            } else {
-                printf("[CRC32: %08lX]\n", (unsigned long)stored_crc);
-            }
-        } else if (type == TYPE_PADDING) {
-            printf("[Padding - Skipped]\n");
-            seek_forward(fp, length);
-            if (read_u32_be(fp, &stored_crc) != 0) {
-                fprintf(stderr, "Warning: EOF reading CRC32.\n");
+    rc = synth_generate(archive, scratch, p, &bytes, &chunks, &ms);
+    if (rc == 0) bench_result("generate", p->chunks, bytes, ms);
+
+    /* create：每次新建再删除 */
+    start = zzk_clock_ms();
+    for (i = 0; rc == 0 && i < BENCH_OPS; i++) {
+        if (zzk_create(ops_archive, p->format, "bench", 5, &options) != ZZK_OK || remove(ops_archive) != 0) rc = 1;
+    }
+    if (rc == 0) bench_result("create", BENCH_OPS, (zzk_u64)BENCH_OPS * 5, zzk_clock_ms() - start);
+
+    /* append / append-file：同一分布的文本与二进制记录，每条记录一次打开与关闭 */
+    if (rc == 0 && zzk_create(ops_archive, p->format, "bench", 5, &options) != ZZK_OK) rc = 1;
+    for (k = 0; k < 2 && rc == 0; k++) {
+        ms = 0;
+        bytes = 0;
+        for (i = 0; rc == 0 && i < BENCH_OPS; i++) {
+            len = synth_size(p, &state);
+            synth_fill(buf, len, k == 0, &state);
+            if (k == 1 && write_scratch(scratch, buf, len) != 0) {
+                rc = 1;
+                break;
             }
-        } else {
-            printf("[Unknown Type - Skipped]\n");
-            seek_forward(fp, length);
-            if (read_u32_be(fp, &stored_crc) != 0) {
-                fprintf(stderr, "Warning: EOF reading CRC32.\n");
+            start = zzk_clock_ms();
+            if (zzk_writer_open(&w, ops_archive, &options) != ZZK_OK) {
+                rc = 1;
+                break;
             }
+            rc = finish_single(w, k == 0 ? zzk_writer_append(w, ZZK_TYPE_TEXT, buf, len)
+                                         : zzk_writer_append_file(w, scratch, "bench"));
+            ms += zzk_clock_ms() - start;
+            bytes += (zzk_u64)len;
         }
-        printf("----------------------------------------\n");
+        if (rc == 0) bench_result(k == 0 ? "append" : "append-file", BENCH_OPS, bytes, ms);
+    }
 
-        bytes_consumed += length + 4;
+    /* list：逐块遍历（文本块校验 CRC32），ops 为访问的块数 */
+    total = 0;
+    start = zzk_clock_ms();
+    for (i = 0; rc == 0 && i < p->repeat; i++) {
+        if (zzk_reader_open(&r, archive) != ZZK_OK) {
+            rc = 1;
+            break;
+        }
+        mapped = zzk_reader_mapped(r);
+        total = zzk_reader_size(r);
+        zzk_reader_foreach(r, bench_list_chunk, NULL);
+        zzk_reader_close(r);
     }
+    if (rc == 0) bench_result("list", chunks * p->repeat, total * (zzk_u64)p->repeat, zzk_clock_ms() - start);
 
-    fclose(fp);
+    /* 第 1 块是创建时的文本，内容块从第 2 块开始 */
+    if (rc == 0) rc = bench_extract("extract-first", archive, output, 2, p->repeat);
+    if (rc == 0) rc = bench_extract("extract-middle", archive, output, (chunks + 2) / 2, p->repeat);
+    if (rc == 0) rc = bench_extract("extract-last", archive, output, chunks, p->repeat);
+    if (rc == 0) printf("# mapped=%d crc32=%08lX\n", mapped, (unsigned long)crc);
+
+    free(buf);
+    for (k = 0; k < 4; k++) remove(paths[k]);
+    return rc;
 }
 
 /* ========== 入口 ========== */
 
 int main(int argc, char *argv[]) {
     const char *command;
+    int rc;
+
+    zzk_set_log(log_to_stderr, NULL);
+    zzk_options_init(&options);
+    options.stats = &sync_stats;
+
+    /* 全局选项位于命令之前 */
+    while (argc >= 2 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--sync") == 0 && argc >= 3) {
+            rc = zzk_parse_sync_mode(&options, argv[2]);
+            if (rc == ZZK_ERR_UNSUPPORTED) {
+                fprintf(stderr, "Error: --sync %s requires a POSIX build (-DZZK1_POSIX).\n", argv[2]);
+                return 1;
+            }
+            if (rc != ZZK_OK) {
+                fprintf(stderr, "Error: Invalid sync mode '%s' (none, data, group[:N][,Tms]).\n", argv[2]);
+                return 1;
+            }
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (strcmp(argv[1], "--dedup") == 0) {
+            options.dedup = 1;
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+        } else if (strcmp(argv[1], "--block-crc") == 0) {
+            options.block_crc = (zzk_u32)ZZK_SUMS_DEFAULT_BLOCK;
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+        } else if (strcmp(argv[1], "--checkpoint") == 0) {
+            options.checkpoint = (zzk_u64)ZZK_CHECKPOINT_INTERVAL;
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+        } else if (strcmp(argv[1], "--sync-report") == 0) {
+            atexit(print_sync_report);
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+        } else if (strcmp(argv[1], "--pipeline") == 0 || strncmp(argv[1], "--pipeline=", 11) == 0) {
+            rc = zzk_parse_pipeline(&options, argv[1][10] == '=' ? argv[1] + 11 : "");
+            if (rc == ZZK_ERR_UNSUPPORTED) {
+                fprintf(stderr, "Error: --pipeline requires a multithreaded build (-DZZK1_THREADS).\n");
+                return 1;
+            }
+            if (rc != ZZK_OK) {
+                fprintf(stderr, "Error: Invalid pipeline '%s' (N[:SIZE], %d..%d buffers of 64K..64M).\n",
+                        argv[1] + 11, ZZK_PIPELINE_MIN_BUFFERS, ZZK_PIPELINE_MAX_BUFFERS);
+                return 1;
+            }
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+        } else if (strcmp(argv[1], "--stats") == 0 || strcmp(argv[1], "--stats=json") == 0) {
+            if (zzk_stats_enable(&run_stats) != ZZK_OK) {
+                fprintf(stderr, "Error: --stats requires a build with -DZZK1_STATS.\n");
+                return 1;
+            }
+            stats_json = (argv[1][7] == '=');
+            stats_start_ms = zzk_clock_ms();
+            stats_start_cpu = clock();
+            atexit(print_stats_report);
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[1]);
+            return 1;
+        }
+    }
 
     if (argc < 2) {
         printf("Usage:\n");
-        printf("  %s create <archive> <text>\n", argv[0]);
-        printf("  %s append <archive> <text>\n", argv[0]);
-        printf("  %s append-file <archive> <file> <description>\n", argv[0]);
-        printf("  %s extract <archive> <chunk_index> <output_file>\n", argv[0]);
-        printf("  %s list <archive>\n", argv[0]);
+        printf("  %s [--sync none|data|group[:N][,Tms]] [--sync-report] [--stats[=json]] [--dedup] [--block-crc] "
+               "[--checkpoint] [--pipeline[=N:SIZE]] <command> ...\n", argv[0]);
+        printf("  %s create [--zzk2] <archive> <text>\n", argv[0]);
+        printf("  %s append [--compress] <archive> <text>\n", argv[0]);
+        printf("  %s append-file [--compress] <archive> <file> <description>\n", argv[0]);
+        printf("  %s append-batch <archive> <manifest|->\n", argv[0]);
+        printf("  %s append-dir [--incremental] [--compress] [--threads N] [--description TEXT] <archive> "
+               "<directory>\n", argv[0]);
+        printf("  %s append-stream <archive> <description> [source] [piece_size]\n", argv[0]);
+        printf("  %s extract [--no-verify] [--range OFFSET:LEN] <archive> <chunk_index> <output_file>\n", argv[0]);
+        printf("  %s extract-many [--no-verify] [--threads N] <archive> <output_dir> <index|FIRST-LAST>...\n", argv[0]);
+        printf("  %s extract-all [--no-verify] [--threads N] <archive> <output_dir>\n", argv[0]);
+        printf("  %s merge [--verify] [--threads N] <target> <source>...\n", argv[0]);
+        printf("  %s follow [--once] [--from-end] [--cursor FILE] <archive>\n", argv[0]);
+        printf("  %s list [--headers-only] [--format text|tsv|json] <archive>\n", argv[0]);
+        printf("  %s index [--terms] <archive>\n", argv[0]);
+        printf("  %s verify <archive> [threads]\n", argv[0]);
+        printf("  %s grep [-i] [--crc] <archive> <pattern> [threads]\n", argv[0]);
+        printf("  %s find <archive> <word|filename:NAME|description:TEXT>...\n", argv[0]);
+        printf("  %s upgrade <archive> [output]\n", argv[0]);
+        printf("  %s recover [--full] [--dry-run] <archive>\n", argv[0]);
+        printf("  %s serve <archive> <socket>\n", argv[0]);
+        printf("  %s submit <socket> <text>\n", argv[0]);
+        printf("  %s serve-load <socket> [clients] [records] [size]\n", argv[0]);
+        printf("  %s generate [--chunks N] [--size MIN:MAX] [--log|--uniform] [--text PCT] [--seed N] [--zzk2] "
+               "<archive>\n", argv[0]);
+        printf("  %s bench [--chunks N] [--size MIN:MAX] [--log|--uniform] [--text PCT] [--seed N] [--repeat N] "
+               "[--zzk2] <dir>\n", argv[0]);
+        printf("  %s selftest\n", argv[0]);
         return 1;
     }
 
+    zzk_init();
     command = argv[1];
 
     if (strcmp(command, "create") == 0) {
+        int format = ZZK_FORMAT_ZZK1;
+        if (argc == 5 && strcmp(argv[2], "--zzk2") == 0) {
+            format = ZZK_FORMAT_ZZK2;
+            argv++;
+            argc--;
+        }
         if (argc != 4) {
-            fprintf(stderr, "Usage: %s create <archive> <text>\n", argv[0]);
+            fprintf(stderr, "Usage: %s create [--zzk2] <archive> <text>\n", argv[0]);
             return 1;
         }
-        cmd_create(argv[2], argv[3]);
+        return cmd_create(argv[2], argv[3], format);
     } else if (strcmp(command, "append") == 0) {
+        if (argc == 5 && strcmp(argv[2], "--compress") == 0) {
+            options.compress = 1;
+            argv++;
+            argc--;
+        }
         if (argc != 4) {
-            fprintf(stderr, "Usage: %s append <archive> <text>\n", argv[0]);
+            fprintf(stderr, "Usage: %s append [--compress] <archive> <text>\n", argv[0]);
             return 1;
         }
-        cmd_append(argv[2], argv[3]);
+        return cmd_append(argv[2], argv[3]);
     } else if (strcmp(command, "append-file") == 0) {
+        if (argc == 6 && strcmp(argv[2], "--compress") == 0) {
+            options.compress = 1;
+            argv++;
+            argc--;
+        }
         if (argc != 5) {
-            fprintf(stderr, "Usage: %s append-file <archive> <file> <description>\n", argv[0]);
+            fprintf(stderr, "Usage: %s append-file [--compress] <archive> <file> <description>\n", argv[0]);
             return 1;
         }
-        cmd_append_file(argv[2], argv[3], argv[4]);
+        return cmd_append_file(argv[2], argv[3], argv[4]);
+    } else if (strcmp(command, "append-batch") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Usage: %s append-batch <archive> <manifest|->\n", argv[0]);
+            return 1;
+        }
+        return cmd_append_batch(argv[2], argv[3]);
+    } else if (strcmp(command, "append-stream") == 0) {
+        zzk_u32 piece_size = (zzk_u32)ZZK_STREAM_DEFAULT_PIECE;
+        if (argc < 4 || argc > 6) {
+            fprintf(stderr, "Usage: %s append-stream <archive> <description> [source] [piece_size]\n", argv[0]);
+            return 1;
+        }
+        if (argc == 6) {
+            char *endptr;
+            long parsed = strtol(argv[5], &endptr, 10);
+            if (*endptr != '\0' || endptr == argv[5] || parsed < 1 || (unsigned long)parsed > ZZK_STREAM_MAX_PIECE) {
+                fprintf(stderr, "Error: Invalid piece size '%s' (1..%lu).\n", argv[5], ZZK_STREAM_MAX_PIECE);
+                return 1;
+            }
+            piece_size = (zzk_u32)parsed;
+        }
+        return cmd_append_stream(argv[2], argv[3], argc >= 5 ? argv[4] : "-", piece_size);
     } else if (strcmp(command, "extract") == 0) {
+        const char *range = NULL;
+        int verify = 1;
+        for (;;) {
+            if (argc >= 6 && strcmp(argv[2], "--no-verify") == 0) {
+                verify = 0;
+                argv++;
+                argc--;
+            } else if (argc >= 7 && strcmp(argv[2], "--range") == 0) {
+                range = argv[3];
+                argv += 2;
+                argc -= 2;
+            } else {
+                break;
+            }
+        }
         if (argc != 5) {
-            fprintf(stderr, "Usage: %s extract <archive> <chunk_index> <output_file>\n", argv[0]);
+            fprintf(stderr, "Usage: %s extract [--no-verify] [--range OFFSET:LEN] <archive> <chunk_index> "
+                    "<output_file>\n", argv[0]);
+            return 1;
+        }
+        return cmd_extract(argv[2], argv[3], argv[4], verify, range);
+    } else if (strcmp(command, "extract-many") == 0 || strcmp(command, "extract-all") == 0) {
+        int all = strcmp(command, "extract-all") == 0;
+        int verify = 1, nthreads = zzk_default_threads();
+        long *indices = NULL, count = 0, parsed;
+        if (nthreads > EXTRACT_DEFAULT_THREADS) nthreads = EXTRACT_DEFAULT_THREADS;
+        for (;;) {
+            if (argc >= 3 && strcmp(argv[2], "--no-verify") == 0) {
+                verify = 0;
+                argv++;
+                argc--;
+            } else if (argc >= 4 && strcmp(argv[2], "--threads") == 0) {
+                if (parse_long(argv[3], 1, 256, &parsed) != 0) {
+                    fprintf(stderr, "Error: Invalid thread count '%s'.\n", argv[3]);
+                    return 1;
+                }
+                nthreads = (int)parsed;
+                argv += 2;
+                argc -= 2;
+            } else {
+                break;
+            }
+        }
+        if (all ? argc != 4 : argc < 5) {
+            fprintf(stderr, "Usage: %s %s [--no-verify] [--threads N] <archive> <output_dir>%s\n", argv[0], command,
+                    all ? "" : " <index|FIRST-LAST>...");
+            return 1;
+        }
+        if (!all && parse_index_list(argc - 4, argv + 4, &indices, &count) != 0) return 1;
+        rc = cmd_extract_many(argv[2], argv[3], all ? NULL : indices, count, verify, nthreads);
+        free(indices);
+        return rc;
+    } else if (strcmp(command, "append-dir") == 0) {
+        const char *description = "";
+        int flags = 0, nthreads = zzk_default_threads();
+        long parsed;
+        for (;;) {
+            if (argc >= 3 && strcmp(argv[2], "--incremental") == 0) {
+                flags |= ZZK_FILES_INCREMENTAL;
+                argv++;
+                argc--;
+            } else if (argc >= 3 && strcmp(argv[2], "--compress") == 0) {
+                options.compress = 1;
+                argv++;
+                argc--;
+            } else if (argc >= 4 && strcmp(argv[2], "--description") == 0) {
+                description = argv[3];
+                argv += 2;
+                argc -= 2;
+            } else if (argc >= 4 && strcmp(argv[2], "--threads") == 0) {
+                if (parse_long(argv[3], 1, 256, &parsed) != 0) {
+                    fprintf(stderr, "Error: Invalid thread count '%s'.\n", argv[3]);
+                    return 1;
+                }
+                nthreads = (int)parsed;
+                argv += 2;
+                argc -= 2;
+            } else {
+                break;
+            }
+        }
+        if (argc != 4) {
+            fprintf(stderr, "Usage: %s append-dir [--incremental] [--compress] [--threads N] [--description TEXT] "
+                    "<archive> <directory>\n", argv[0]);
             return 1;
         }
-        cmd_extract(argv[2], argv[3], argv[4]);
+        return cmd_append_dir(argv[2], argv[3], description, flags, nthreads);
+    } else if (strcmp(command, "merge") == 0) {
+        int flags = 0, nthreads = zzk_default_threads();
+        long parsed;
+        for (;;) {
+            if (argc >= 3 && strcmp(argv[2], "--verify") == 0) {
+                flags |= ZZK_MERGE_VERIFY;
+                argv++;
+                argc--;
+            } else if (argc >= 4 && strcmp(argv[2], "--threads") == 0) {
+                if (parse_long(argv[3], 1, 256, &parsed) != 0) {
+                    fprintf(stderr, "Error: Invalid thread count '%s'.\n", argv[3]);
+                    return 1;
+                }
+                nthreads = (int)parsed;
+                argv += 2;
+                argc -= 2;
+            } else {
+                break;
+            }
+        }
+        if (argc < 4) {
+            fprintf(stderr, "Usage: %s merge [--verify] [--threads N] <target> <source>...\n", argv[0]);
+            return 1;
+        }
+        return cmd_merge(argv[2], argv + 3, argc - 3, flags, nthreads);
+    } else if (strcmp(command, "follow") == 0) {
+        const char *cursor_file = NULL;
+        int once = 0, from_end = 0;
+        for (;;) {
+            if (argc >= 3 && strcmp(argv[2], "--once") == 0) {
+                once = 1;
+                argv++;
+                argc--;
+            } else if (argc >= 3 && strcmp(argv[2], "--from-end") == 0) {
+                from_end = 1;
+                argv++;
+                argc--;
+            } else if (argc >= 4 && strcmp(argv[2], "--cursor") == 0) {
+                cursor_file = argv[3];
+                argv += 2;
+                argc -= 2;
+            } else {
+                break;
+            }
+        }
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s follow [--once] [--from-end] [--cursor FILE] <archive>\n", argv[0]);
+            return 1;
+        }
+        return cmd_follow(argv[2], cursor_file, once, from_end);
     } else if (strcmp(command, "list") == 0) {
+        struct list_options opt;
+        opt.format = LIST_TEXT;
+        opt.headers_only = 0;
+        for (;;) {
+            if (argc >= 3 && strcmp(argv[2], "--headers-only") == 0) {
+                opt.headers_only = 1;
+                argv++;
+                argc--;
+            } else if (argc >= 4 && strcmp(argv[2], "--format") == 0) {
+                if (strcmp(argv[3], "text") == 0) {
+                    opt.format = LIST_TEXT;
+                } else if (strcmp(argv[3], "tsv") == 0) {
+                    opt.format = LIST_TSV;
+                } else if (strcmp(argv[3], "json") == 0) {
+                    opt.format = LIST_JSON;
+                } else {
+                    fprintf(stderr, "Error: Unknown list format '%s' (text, tsv or json).\n", argv[3]);
+                    return 1;
+                }
+                argv += 2;
+                argc -= 2;
+            } else {
+                break;
+            }
+        }
         if (argc != 3) {
-            fprintf(stderr, "Usage: %s list <archive>\n", argv[0]);
+            fprintf(stderr, "Usage: %s list [--headers-only] [--format text|tsv|json] <archive>\n", argv[0]);
             return 1;
         }
-        cmd_list(argv[2]);
-    } else {
-        fprintf(stderr, "Unknown command: %s\n", command);
-        return 1;
+        return cmd_list(argv[2], &opt);
+    } else if (strcmp(command, "index") == 0) {
+        int with_terms = 0;
+        if (argc == 4 && strcmp(argv[2], "--terms") == 0) {
+            with_terms = 1;
+            argv++;
+            argc--;
+        }
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s index [--terms] <archive>\n", argv[0]);
+            return 1;
+        }
+        return cmd_index(argv[2], with_terms);
+    } else if (strcmp(command, "verify") == 0) {
+        int nthreads = zzk_default_threads();
+        if (argc != 3 && argc != 4) {
+            fprintf(stderr, "Usage: %s verify <archive> [threads]\n", argv[0]);
+            return 1;
+        }
+        if (argc == 4) {
+            char *endptr;
+            long parsed = strtol(argv[3], &endptr, 10);
+            if (*endptr != '\0' || endptr == argv[3] || parsed < 1 || parsed > 256) {
+                fprintf(stderr, "Error: Invalid thread count '%s'.\n", argv[3]);
+                return 1;
+            }
+            nthreads = (int)parsed;
+        }
+        return cmd_verify(argv[2], nthreads);
+    } else if (strcmp(command, "grep") == 0) {
+        int nthreads = zzk_default_threads();
+        int flags = 0;
+        for (;;) {
+            if (argc >= 5 && strcmp(argv[2], "-i") == 0) {
+                flags |= ZZK_GREP_ICASE;
+            } else if (argc >= 5 && strcmp(argv[2], "--crc") == 0) {
+                flags |= ZZK_GREP_CRC;
+            } else {
+                break;
+            }
+            argv++;
+            argc--;
+        }
+        if ((argc != 4 && argc != 5) || argv[3][0] == '\0') {
+            fprintf(stderr, "Usage: %s grep [-i] [--crc] <archive> <pattern> [threads]\n", argv[0]);
+            return 1;
+        }
+        if (argc == 5) {
+            char *endptr;
+            long parsed = strtol(argv[4], &endptr, 10);
+            if (*endptr != '\0' || endptr == argv[4] || parsed < 1 || parsed > 256) {
+                fprintf(stderr, "Error: Invalid thread count '%s'.\n", argv[4]);
+                return 1;
+            }
+            nthreads = (int)parsed;
+        }
+        return cmd_grep(argv[2], argv[3], flags, nthreads);
+    } else if (strcmp(command, "find") == 0) {
+        if (argc < 4) {
+            fprintf(stderr, "Usage: %s find <archive> <word|filename:NAME|description:TEXT>...\n", argv[0]);
+            return 1;
+        }
+        return cmd_find(argv[2], (const char *const *)(argv + 3), argc - 3);
+    } else if (strcmp(command, "upgrade") == 0) {
+        if (argc != 3 && argc != 4) {
+            fprintf(stderr, "Usage: %s upgrade <archive> [output]\n", argv[0]);
+            return 1;
+        }
+        return cmd_upgrade(argv[2], argc == 4 ? argv[3] : NULL);
+    } else if (strcmp(command, "recover") == 0) {
+        int flags = 0;
+        for (;;) {
+            if (argc >= 4 && strcmp(argv[2], "--full") == 0) {
+                flags |= ZZK_RECOVER_FULL;
+            } else if (argc >= 4 && strcmp(argv[2], "--dry-run") == 0) {
+                flags |= ZZK_RECOVER_DRY_RUN;
+            } else {
+                break;
+            }
+            argv++;
+            argc--;
+        }
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s recover [--full] [--dry-run] <archive>\n", argv[0]);
+            return 1;
+        }
+        return cmd_recover(argv[2], flags);
+    } else if (strcmp(command, "serve") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Usage: %s serve <archive> <socket>\n", argv[0]);
+            return 1;
+        }
+        return cmd_serve(argv[2], argv[3]);
+    } else if (strcmp(command, "submit") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Usage: %s submit <socket> <text>\n", argv[0]);
+            return 1;
+        }
+        return cmd_submit(argv[2], argv[3]);
+    } else if (strcmp(command, "serve-load") == 0) {
+        long clients = 16, records = 1000, size = 100;
+        if (argc < 3 || argc > 6) {
+            fprintf(stderr, "Usage: %s serve-load <socket> [clients] [records] [size]\n", argv[0]);
+            return 1;
+        }
+        if ((argc >= 4 && parse_long(argv[3], 1, 1024, &clients) != 0) ||
+            (argc >= 5 && parse_long(argv[4], 1, 100000000L, &records) != 0) ||
+            (argc >= 6 && parse_long(argv[5], 0, (long)ZZK_SERVE_MAX_RECORD, &size) != 0)) {
+            fprintf(stderr, "Error: Invalid serve-load parameters.\n");
+            return 1;
+        }
+        return cmd_serve_load(argv[2], (int)clients, records, size);
+    } else if (strcmp(command, "generate") == 0 || strcmp(command, "bench") == 0) {
+        struct synth_params params;
+        int used;
+        synth_defaults(&params);
+        while (argc >= 4 && (used = parse_synth_option(argc - 2, argv + 2, &params)) != 0) {
+            if (used < 0) return 1;
+            argv += used;
+            argc -= used;
+        }
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s %s [--chunks N] [--size MIN:MAX] [--log|--uniform] [--text PCT] [--seed N] "
+                    "[--repeat N] [--zzk2] <%s>\n", argv[0], command, strcmp(command, "bench") == 0 ? "dir" : "archive");
+            return 1;
+        }
+        return strcmp(command, "bench") == 0 ? cmd_bench(argv[2], &params) : cmd_generate(argv[2], &params);
+    } else if (strcmp(command, "selftest") == 0) {
+        return cmd_selftest();
     }
 
-    return 0;
+    fprintf(stderr, "Unknown command: %s\n", command);
+    return 1;
 }
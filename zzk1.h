@@ -0,0 +1,622 @@
+/*
+ * libzzk1 — ZZK1 / ZZK2 归档的读写库。C89 标准，无外部依赖。
+ *
+ * 命令行工具 zzk1 是本库的一个薄客户端；其他程序可以直接链接本库，
+ * 在一个进程内长期持有归档句柄，不必为每条记录启动一次进程。
+ *
+ * 约定:
+ *   - 可能失败的函数返回 ZZK_OK (0) 或负的 ZZK_ERR_*，库内从不调用 exit()
+ *   - 错误与警告的详细文本经 zzk_set_log() 安装的回调输出；未安装时静默
+ *   - 句柄不是线程安全的：同一句柄同一时刻只能由一个线程使用
+ *   - 程序启动时调用一次 zzk_init()（选择 CRC32 内核）
+ *
+ * 写入:
+ *   zzk_writer *w;
+ *   if (zzk_writer_open(&w, "a.zzk", NULL) == ZZK_OK) {
+ *       zzk_writer_append(w, ZZK_TYPE_TEXT, "hello", 5);
+ *       zzk_writer_close(w);
+ *   }
+ *
+ * 读取:
+ *   zzk_reader *r;
+ *   if (zzk_reader_open(&r, "a.zzk") == ZZK_OK) {
+ *       zzk_reader_foreach(r, visit, ctx);
+ *       zzk_reader_close(r);
+ *   }
+ *
+ * 构建:
+ *   静态库: gcc -std=c89 -O2 -c libzzk1.c && ar rcs libzzk1.a libzzk1.o
+ *   共享库: gcc -std=c89 -O2 -shared -fPIC -o libzzk1.so libzzk1.c
+ *   平台扩展（ZZK1_POSIX / ZZK1_THREADS / ZZK1_LINUX）在编译库时指定，见 libzzk1.c。
+ */
+#ifndef ZZK1_H
+#define ZZK1_H
+
+#include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+/* unsigned long 在 C89 中保证至少 32 位 */
+typedef unsigned long zzk_u32;
+
+/*
+ * ZZK2 的 TotalSize / Length / Offset 使用 64 位。LP64 平台上 unsigned long 即为 64 位，
+ * 其余平台使用编译器的 64 位扩展类型；都没有时退化为 unsigned long，
+ * 此时超出范围的字段读作最大值，由边界检查拒绝。
+ */
+#if ULONG_MAX > 0xFFFFFFFFUL
+typedef unsigned long zzk_u64;
+#elif defined(_MSC_VER)
+typedef unsigned __int64 zzk_u64;
+#elif defined(__GNUC__)
+__extension__ typedef unsigned long long zzk_u64;
+#else
+typedef unsigned long zzk_u64;
+#endif
+
+/* ========== 状态码 ========== */
+
+#define ZZK_OK                0
+#define ZZK_ERR_IO           -1   /* 读写失败（errno 保留系统原因） */
+#define ZZK_ERR_NOMEM        -2   /* 内存不足 */
+#define ZZK_ERR_ARG          -3   /* 参数无效 */
+#define ZZK_ERR_FORMAT       -4   /* 不是 ZZK1/ZZK2 归档，或文件头无效 */
+#define ZZK_ERR_CORRUPT      -5   /* 块结构损坏（长度越界、流缺少最后一片等） */
+#define ZZK_ERR_CRC          -6   /* CRC32 不一致 */
+#define ZZK_ERR_OVERFLOW     -7   /* 超出格式上限（ZZK1 为 4GB） */
+#define ZZK_ERR_NOT_FOUND    -8   /* 指定的块不存在 */
+#define ZZK_ERR_EXISTS       -9   /* 目标文件已存在 */
+#define ZZK_ERR_UNSUPPORTED  -10  /* 当前构建不支持 */
+#define ZZK_ERR_INPUT        -11  /* 输入提前结束 */
+
+const char *zzk_strerror(int status);
+
+/* ========== 日志 ========== */
+
+#define ZZK_LOG_ERROR   1
+#define ZZK_LOG_WARNING 2
+
+/* fmt 为 printf 风格、以换行结尾的完整一行；回调可直接 vfprintf(stderr, fmt, ap) */
+typedef void (*zzk_log_fn)(void *ctx, int level, const char *fmt, va_list ap);
+
+void zzk_set_log(zzk_log_fn fn, void *ctx);
+
+/* ========== 格式常量 ========== */
+
+#define ZZK_FORMAT_ZZK1 1
+#define ZZK_FORMAT_ZZK2 2
+
+#define ZZK_TYPE_TEXT     0x00000001UL
+#define ZZK_TYPE_BINARY   0x00000002UL
+#define ZZK_TYPE_INDEX    0x00000003UL
+#define ZZK_TYPE_STREAM   0x00000004UL
+#define ZZK_TYPE_REF      0x00000005UL  /* 内容引用: Chunk(4B) + Length(8B) + CRC32(4B) */
+#define ZZK_TYPE_LZ       0x00000006UL  /* 压缩块，编码见 libzzk1.c "LZ 压缩" */
+#define ZZK_TYPE_SUMS     0x00000007UL  /* 前一个二进制块的分块校验表，见 libzzk1.c "分块校验表" */
+#define ZZK_TYPE_TERMS    0x00000008UL  /* 词项索引，见 libzzk1.c "词项索引" */
+#define ZZK_TYPE_CHECKPOINT 0x00000009UL /* 检查点: 之前的块数与滚动摘要，见 libzzk1.c "检查点" */
+#define ZZK_TYPE_PADDING  0xFFFFFFFFUL
+
+#define ZZK_STREAM_FINAL         0x00000001UL
+#define ZZK_STREAM_DEFAULT_PIECE (4UL * 1024 * 1024)
+#define ZZK_STREAM_MAX_PIECE     (256UL * 1024 * 1024)
+
+#define ZZK_SUMS_DEFAULT_BLOCK   (64UL * 1024)
+#define ZZK_CHECKPOINT_INTERVAL  (4UL * 1024 * 1024)
+
+const char *zzk_type_name(zzk_u32 type);
+
+/* ========== 选项 ========== */
+
+/* 持久化模式，含义见 libzzk1.c "持久化策略" 一节 */
+#define ZZK_SYNC_NONE  0
+#define ZZK_SYNC_DATA  1
+#define ZZK_SYNC_GROUP 2
+
+struct zzk_sync_stats {
+    long commits;
+    long records;
+    long syncs;
+    double total_ms;     /* 所有提交（刷新 + 同步 + 写文件头）的累计耗时 */
+    double max_ms;
+};
+
+struct zzk_options {
+    int sync_mode;
+    long group_records;           /* group: 每 N 条记录提交（0 表示不按条数） */
+    long group_ms;                /* group: 距上次提交超过 T 毫秒提交（0 表示不按时间） */
+    struct zzk_sync_stats *stats; /* 非 NULL 时累计提交统计 */
+    int dedup;                    /* 非零时 append_file 对已有内容只写引用块 */
+    int compress;                 /* 非零时 append / append_file 把内容写成压缩块（多线程构建并行压缩） */
+    zzk_u32 block_crc;            /* 非零时 append_file 在二进制块后写分块校验表，值为段大小（1KB..16MB） */
+    zzk_u64 checkpoint;           /* 非零时每写入约这么多字节在记录之间插入检查点块（供 zzk_recover 使用） */
+    int pipeline_buffers;         /* 非零时大于一个缓冲区的内容经读取 / CRC / 写出流水线写入（多线程构建） */
+    zzk_u32 pipeline_size;        /* 流水线每个缓冲区的字节数 */
+};
+
+void zzk_options_init(struct zzk_options *opt);
+
+/* 解析 none | data | group[:N][,Tms]，例如 group:64,10ms */
+int zzk_parse_sync_mode(struct zzk_options *opt, const char *arg);
+
+/* 流水线写入的缓冲区个数与大小，见 libzzk1.c "流水线写入" */
+#define ZZK_PIPELINE_BUFFERS      4
+#define ZZK_PIPELINE_BUFFER_SIZE  (1024UL * 1024)
+#define ZZK_PIPELINE_MIN_BUFFERS  2
+#define ZZK_PIPELINE_MAX_BUFFERS  64
+#define ZZK_PIPELINE_MIN_SIZE     (64UL * 1024)
+#define ZZK_PIPELINE_MAX_SIZE     (64UL * 1024 * 1024)
+
+/*
+ * 解析 N[:SIZE]（SIZE 可带 K / M 后缀，例如 8:4M），空串取默认的 4 个 1MB 缓冲区。
+ * 非多线程构建返回 ZZK_ERR_UNSUPPORTED
+ */
+int zzk_parse_pipeline(struct zzk_options *opt, const char *arg);
+
+/* ========== 基础设施 ========== */
+
+void zzk_init(void);
+const char *zzk_crc32_kernel(void);
+zzk_u32 zzk_crc32_update(zzk_u32 crc, const void *buf, size_t len);
+zzk_u32 zzk_crc32_combine(zzk_u32 crc1, zzk_u32 crc2, zzk_u64 len2);
+
+/* 用参考实现核对全部 CRC32 内核，结果逐行写到 report。全部一致返回 ZZK_OK */
+int zzk_crc32_selftest(FILE *report);
+
+int zzk_default_threads(void);
+
+/* 毫秒时间戳（POSIX 构建为单调时钟），用于计算耗时 */
+double zzk_clock_ms(void);
+
+/* 以十进制格式化 zzk_u64（C89 的 printf 没有 64 位整数格式），返回 buf 内的指针 */
+const char *zzk_u64_str(zzk_u64 val, char buf[24]);
+
+/* ========== 运行统计 ========== */
+
+/* 插桩阶段，时间只记在叶子操作上，阶段之间不重叠 */
+#define ZZK_PHASE_OPEN  0   /* 打开归档并校验文件头 */
+#define ZZK_PHASE_SCAN  1   /* 读取块头 */
+#define ZZK_PHASE_READ  2   /* 读取块内容或输入文件 */
+#define ZZK_PHASE_CRC   3   /* CRC32 计算 */
+#define ZZK_PHASE_WRITE 4   /* 写出（含内核侧拷贝） */
+#define ZZK_PHASE_SYNC  5   /* 刷新与 fdatasync */
+#define ZZK_PHASE_COUNT 6
+
+struct zzk_phase_stats {
+    double wall_ms;
+    double cpu_ms;       /* 执行该阶段的线程消耗的 CPU 时间 */
+    long calls;
+};
+
+struct zzk_stats {
+    struct zzk_phase_stats phases[ZZK_PHASE_COUNT];
+    zzk_u64 bytes_read;
+    zzk_u64 bytes_written;
+    long chunks;         /* 读取过的块头数 */
+    long seeks;
+};
+
+/*
+ * 清零 s 并开始向其累计（NULL 停止累计）。只有以 -DZZK1_STATS 构建的库会插桩，
+ * 否则返回 ZZK_ERR_UNSUPPORTED。统计是进程级的，多线程构建中各工作线程同时计入。
+ */
+int zzk_stats_enable(struct zzk_stats *s);
+const char *zzk_phase_name(int phase);
+
+/* ========== 归档级操作 ========== */
+
+/* 创建归档并写入初始文本块；文件已存在时返回 ZZK_ERR_EXISTS */
+int zzk_create(const char *path, int format, const char *text, size_t len, const struct zzk_options *opt);
+
+/* 扫描全部块头，重建尾部索引块。chunks 返回已索引的块数 */
+int zzk_rebuild_index(const char *path, const struct zzk_options *opt, long *chunks);
+
+/*
+ * 从头收录全部文本块，重建词项索引块（find 据此查找，之后的追加自动维护）。
+ * terms 返回收录的词项数
+ */
+int zzk_rebuild_terms(const char *path, const struct zzk_options *opt, long *terms);
+
+/*
+ * 恢复被截断或尾部受损的归档：把 TotalSize 改写为有效区内最长的完好前缀的末尾。
+ * 从末尾向回找到最后一个完好的检查点，只校验其后的块，耗时取决于受损的尾部而不是归档大小。
+ * 截断点落在记录中间时退到该记录之前。前缀完好时不改写文件；结果写入 stats（可为 NULL）。
+ * 从检查点开始校验时，检查点之前的块不在校验范围内（需要时用 ZZK_RECOVER_FULL 或 zzk_reader_verify）。
+ */
+#define ZZK_RECOVER_FULL    1  /* 忽略检查点从头校验，并核对每个检查点的块数与摘要 */
+#define ZZK_RECOVER_DRY_RUN 2  /* 只报告，不改写文件头 */
+
+struct zzk_recover_stats {
+    zzk_u64 header_size;     /* 原 TotalSize */
+    zzk_u64 file_size;
+    int checkpoint;          /* 非零时从检查点之后开始校验 */
+    long checkpoint_chunk;   /* 检查点的块编号 */
+    zzk_u64 checkpoint_offset;
+    zzk_u64 searched;        /* 向回搜索检查点读取的字节数 */
+    long verified_chunks;    /* 逐块校验的块数与字节数 */
+    zzk_u64 verified;
+    long chunks;             /* 完好前缀内的块数 */
+    long incomplete;         /* 因所在记录未写完而一并截掉的完好块数 */
+    zzk_u64 valid_size;      /* 完好前缀的末尾，即新的 TotalSize */
+    long mismatched;         /* 与之前块序列不符的检查点数（仅 ZZK_RECOVER_FULL） */
+    int repaired;            /* 非零时已改写文件头 */
+};
+
+int zzk_recover(const char *path, const struct zzk_options *opt, int flags, struct zzk_recover_stats *stats);
+
+/*
+ * 把 ZZK1 归档转换为 ZZK2。output 为 NULL 时原地替换。
+ * chunks / size 返回转换的块数与新归档大小（可为 NULL）。
+ */
+int zzk_upgrade(const char *path, const char *output, const struct zzk_options *opt,
+                long *chunks, zzk_u64 *size);
+
+/* ========== 写入句柄 ========== */
+
+typedef struct zzk_writer zzk_writer;
+
+/*
+ * 打开现有归档用于追加。句柄在内存中跟踪 TotalSize，
+ * 只在提交点（按持久化策略或 zzk_writer_commit / close）改写文件头。
+ * 任一追加失败时该记录被整体撤回，句柄仍可继续使用。
+ */
+int zzk_writer_open(zzk_writer **out, const char *path, const struct zzk_options *opt);
+
+/* 追加一个内存中的块（TEXT、BINARY 或自定义类型；不接受 INDEX / STREAM） */
+int zzk_writer_append(zzk_writer *w, zzk_u32 type, const void *data, size_t len);
+
+/* 从 in 读取恰好 length 字节作为一个块追加 */
+int zzk_writer_append_from(zzk_writer *w, zzk_u32 type, FILE *in, zzk_u64 length);
+
+/* 追加文件：元数据块（文本）+ 二进制块 */
+int zzk_writer_append_file(zzk_writer *w, const char *path, const char *description);
+
+/*
+ * 批量追加文件，每个文件一条记录（元数据块 + 二进制块），元数据另含 Modified（修改时间，Unix 秒）
+ * 与 Hash（内容的 CRC32）两行。文件在 nthreads 个工作者上读取并计算 Hash，由调用线程按 items 的顺序写入。
+ * ZZK_FILES_INCREMENTAL 时跳过大小、修改时间与 Hash 都与归档中同名文件最近一条记录相同的文件
+ * （纯 C89 构建不记录修改时间，不会跳过）。单个文件无法读取时记入其 status 并继续；
+ * 写入归档失败时返回错误码，之前的记录不受影响。
+ */
+#define ZZK_FILES_INCREMENTAL 1
+
+struct zzk_file_item {
+    const char *path;      /* 要追加的文件，原样写入元数据的 Filename */
+    int status;            /* 输出：ZZK_OK 或该文件的错误码 */
+    int skipped;           /* 输出：增量模式下未变化、没有写入 */
+    zzk_u64 size;          /* 输出：文件大小 */
+};
+
+struct zzk_files_stats {
+    long written;          /* 写入的文件数 */
+    long skipped;          /* 未变化而跳过的文件数 */
+    long failed;           /* 无法读取的文件数 */
+    zzk_u64 bytes;         /* 写入的文件内容字节数 */
+};
+
+int zzk_writer_append_files(zzk_writer *w, struct zzk_file_item *items, long count, const char *description,
+                            int flags, int nthreads, struct zzk_files_stats *stats);
+
+/*
+ * 追加长度未知的输入：元数据块 + 若干 STREAM 分片（每片至多 piece_size 字节）。
+ * source 写入元数据（如 "<stdin>"），total 返回流的总字节数（可为 NULL）。
+ */
+int zzk_writer_append_stream(zzk_writer *w, const char *source, const char *description,
+                             FILE *in, zzk_u32 piece_size, zzk_u64 *total);
+
+/*
+ * 把另一个同格式归档的全部块原样复制到末尾，作为一条记录。块的字节不变，存储的 CRC32 继续有效；
+ * 尾部索引、词项索引与检查点不复制（提交时为合并后的归档重建），引用块按合并后的编号重新编码。
+ * ZZK_MERGE_VERIFY 时与复制同时在 nthreads 个工作者上校验来源的每个块，不一致时撤回整条记录。
+ * 格式不同返回 ZZK_ERR_FORMAT（先 upgrade），来源即目标本身返回 ZZK_ERR_ARG。
+ */
+#define ZZK_MERGE_VERIFY 1
+
+struct zzk_merge_stats {
+    long chunks;           /* 复制（含重新编码）的块数 */
+    long refs;             /* 重新编码的引用块数 */
+    long dropped;          /* 未复制的索引 / 检查点块数 */
+    zzk_u64 bytes;         /* 写入目标的字节数 */
+    long bad;              /* ZZK_MERGE_VERIFY 时 CRC 不一致或无法读取的来源块数 */
+};
+
+int zzk_writer_merge(zzk_writer *w, const char *path, int flags, int nthreads, struct zzk_merge_stats *stats);
+
+/*
+ * 按时间组提交时，输入须无缓冲才能判断是否有新记录到达：
+ * 在首次读取 in 之前调用 prepare_input，每次等待下一条记录前调用 wait_input。
+ */
+void zzk_writer_prepare_input(zzk_writer *w, FILE *in);
+int zzk_writer_wait_input(zzk_writer *w, FILE *in);
+
+/* 立即提交已写入的记录（按持久化策略落盘），句柄保持打开 */
+int zzk_writer_commit(zzk_writer *w);
+
+/* 最终提交（重写尾部索引）并关闭句柄 */
+int zzk_writer_close(zzk_writer *w);
+
+/*
+ * 放弃未提交的记录并关闭句柄。打开时为改写而摘除的尾部索引与词项索引会恢复：
+ * 没有提交过记录时改回原来的 TotalSize，否则在已提交的末尾重写索引
+ */
+void zzk_writer_abort(zzk_writer *w);
+
+int zzk_writer_format(const zzk_writer *w);
+zzk_u64 zzk_writer_size(const zzk_writer *w);            /* 含未提交记录的有效末尾 */
+zzk_u64 zzk_writer_committed_size(const zzk_writer *w);  /* 文件头当前声明的 TotalSize */
+
+/*
+ * 去重统计（opt.dedup 时）。写入句柄打开时由索引或一遍块头扫描建立 BINARY 块的内容表，
+ * append_file 先计算文件的 CRC32 查表，候选逐字节比较一致后写入元数据块 + REF 块。
+ * 提取 REF 块得到其目标 BINARY 块的内容。
+ */
+struct zzk_dedup_stats {
+    long refs;             /* 写入的引用块数 */
+    zzk_u64 saved;         /* 因此未写入的内容字节数 */
+    long last_target;      /* 最近一个引用块指向的块编号 */
+};
+
+void zzk_writer_dedup_stats(const zzk_writer *w, struct zzk_dedup_stats *out);
+
+/* 有效区内的块数（含未提交记录）；归档没有索引时首次调用会扫描一遍块头 */
+int zzk_writer_chunk_count(zzk_writer *w, long *count);
+
+/* ========== 读取句柄 ========== */
+
+typedef struct zzk_reader zzk_reader;
+
+struct zzk_chunk {
+    long index;            /* 1-based 块编号 */
+    zzk_u32 type;
+    zzk_u64 offset;        /* 块起始（Type 字段）偏移 */
+    zzk_u64 value_offset;  /* Value 起始偏移 */
+    zzk_u64 length;        /* Value 长度 */
+};
+
+int zzk_reader_open(zzk_reader **out, const char *path);
+void zzk_reader_close(zzk_reader *r);
+
+int zzk_reader_format(const zzk_reader *r);
+zzk_u64 zzk_reader_size(const zzk_reader *r);
+int zzk_reader_mapped(const zzk_reader *r);
+
+/*
+ * 按顺序访问每个块。fn 返回非零时停止并把该值原样返回；
+ * 全部访问完返回 ZZK_OK，遇到结构损坏（已访问其之前的块）返回 ZZK_ERR_CORRUPT。
+ */
+typedef int (*zzk_chunk_fn)(void *ctx, zzk_reader *r, const struct zzk_chunk *chunk);
+int zzk_reader_foreach(zzk_reader *r, zzk_chunk_fn fn, void *ctx);
+
+/* 定位第 index 个块：有效的尾部索引直接跳转，否则线性扫描 */
+int zzk_reader_find(zzk_reader *r, long index, struct zzk_chunk *out);
+
+/*
+ * 取得 [offset, offset+len) 的字节：映射模式返回映射内指针（零拷贝），
+ * 否则读入 buf 后返回 buf。越界或读取失败返回 NULL。
+ */
+const void *zzk_reader_peek(zzk_reader *r, zzk_u64 offset, size_t len, void *buf);
+
+/* 块末尾存储的 CRC32 */
+int zzk_reader_stored_crc(zzk_reader *r, const struct zzk_chunk *c, zzk_u32 *crc);
+
+/* Type + Length 的 CRC 中间状态，继续对 Value 调用 zzk_crc32_update 后异或 0xFFFFFFFF 即块 CRC */
+zzk_u32 zzk_reader_header_crc(const zzk_reader *r, const struct zzk_chunk *c);
+
+/*
+ * 按固定大小的片段读取块的 Value（out 非 NULL 时依次写出），crc 返回计算得到的块 CRC32，
+ * 与 zzk_reader_stored_crc 比较即完成校验。内存占用与块大小无关
+ */
+int zzk_reader_value_crc(zzk_reader *r, const struct zzk_chunk *c, FILE *out, zzk_u32 *crc);
+
+struct zzk_extract_info {
+    long pieces;           /* 写出的分片数（非 STREAM 块为 1） */
+    zzk_u64 bytes;         /* 写出的字节数 */
+    int crc_checked;       /* 1 已校验；0 跳过；-1 无法读取存储的 CRC */
+    zzk_u32 stored_crc;    /* ZZK_ERR_CRC 时为不一致块的存储值与计算值 */
+    zzk_u32 computed_crc;
+    long blocks;           /* 按字节范围提取时经分块校验表核对的段数；0 表示整块校验或未校验 */
+};
+
+/* 压缩块的原类型（TEXT / BINARY）与解压后的长度 */
+int zzk_reader_lz_info(zzk_reader *r, const struct zzk_chunk *c, zzk_u32 *type, zzk_u64 *length);
+
+/*
+ * 把块的 Value 写到 out。STREAM 块从该分片起拼接到最后一片，REF 块写出其目标 BINARY 块的内容，
+ * LZ 块写出解压后的内容（verify 时同时核对解压内容的 CRC32）。
+ * verify 为 0 时跳过 CRC 校验。CRC 不一致返回 ZZK_ERR_CRC，流不完整返回 ZZK_ERR_CORRUPT。
+ */
+int zzk_reader_extract(zzk_reader *r, const struct zzk_chunk *c, FILE *out, int verify,
+                       struct zzk_extract_info *info);
+
+/*
+ * 只把内容的 [offset, offset+len) 写到 out（LZ 块为解压后的内容，只解码相交的块；REF 块为目标内容）。
+ * 块后跟有分块校验表时只读取并校验范围所在的段；没有校验表（或校验表损坏）时 verify 回退为整块校验。
+ * 范围越界返回 ZZK_ERR_ARG；STREAM 块不支持按范围提取（ZZK_ERR_UNSUPPORTED）。
+ * len 为 0 时只核对块头与范围，不写出也不校验 CRC32（info->crc_checked 为 0）。
+ */
+int zzk_reader_extract_range(zzk_reader *r, const struct zzk_chunk *c, zzk_u64 offset, zzk_u64 len, FILE *out,
+                             int verify, struct zzk_extract_info *info);
+
+struct zzk_verify_item {
+    struct zzk_chunk chunk;
+    int status;            /* ZZK_OK / ZZK_ERR_CRC / ZZK_ERR_IO */
+    zzk_u32 stored_crc;
+    zzk_u32 computed_crc;
+};
+
+/*
+ * 在至多 nthreads 个工作者上并行校验全部块的 CRC32，再按块顺序对每个块调用 fn。
+ * threads（可为 NULL）返回实际使用的工作者数：不超过任务数，未启用线程的构建为 1。
+ * 全部一致返回 ZZK_OK；存在不一致返回 ZZK_ERR_CRC；结构损坏返回 ZZK_ERR_CORRUPT。
+ */
+typedef void (*zzk_verify_fn)(void *ctx, const struct zzk_verify_item *item);
+int zzk_reader_verify(zzk_reader *r, int nthreads, zzk_verify_fn fn, void *ctx, long *chunks, int *threads);
+
+struct zzk_extract_item {
+    struct zzk_chunk chunk;
+    zzk_u32 content_type;  /* 内容的类型：压缩块为原类型，引用块为 BINARY；压缩块前缀损坏时为 0 */
+    const char *filename;  /* 前一个元数据块中 Filename:（流为 Stream:）的值，原样未经处理；没有时为 NULL */
+    FILE *out;             /* open 回调返回的输出；NULL 表示无法打开，status 为 ZZK_ERR_IO */
+    int status;            /* 同 zzk_reader_extract 的返回值 */
+    struct zzk_extract_info info;
+};
+
+/*
+ * open 在主线程中按偏移顺序调用；done 在该块提取完成后按同样的顺序调用，负责关闭 out。
+ * 块按批处理，一个块的 open 与 done 之间至多有 ZZK_EXTRACT_BATCH 次 open（同时打开的输出不超过此数）。
+ */
+#define ZZK_EXTRACT_BATCH 64
+typedef FILE *(*zzk_extract_open_fn)(void *ctx, const struct zzk_extract_item *item);
+typedef void (*zzk_extract_done_fn)(void *ctx, const struct zzk_extract_item *item);
+
+/*
+ * 一遍提取多个块。indices 为 count 个 1-based 编号（任意顺序，重复的只提取一次）；
+ * count < 0 表示全部内容块（文本、二进制、引用、压缩块与每个流的第一片，不含元数据与内部块）。
+ * 只扫描一遍块头，按偏移顺序分批推进，批内在 nthreads 个工作者上并行提取与校验。
+ * 编号不存在返回 ZZK_ERR_NOT_FOUND（不提取任何块）；否则全部成功返回 ZZK_OK，
+ * 有块失败时返回其状态（存在 CRC 不一致时为 ZZK_ERR_CRC），结构损坏时提取其之前的块后返回 ZZK_ERR_CORRUPT。
+ */
+int zzk_reader_extract_many(zzk_reader *r, const long *indices, long count, int nthreads, int verify,
+                            zzk_extract_open_fn open_fn, zzk_extract_done_fn done_fn, void *ctx, long *extracted);
+
+/* ========== 增量读取 ========== */
+
+/*
+ * 读取游标：上次读到哪里。全零表示从第一个块开始。
+ * 恢复时核对 offset 之前那个块存储的 CRC32 与 last_crc，归档被替换或截短时拒绝继续。
+ */
+struct zzk_cursor {
+    zzk_u64 offset;        /* 下一个块的偏移 */
+    long chunk;            /* 已经过的块数（下一个块的编号减 1） */
+    zzk_u32 last_crc;      /* 最后经过的块存储的 CRC32 */
+};
+
+/* 重新读取文件头中的 TotalSize（映射随之扩大），之后可以读到其他进程此间提交的记录 */
+int zzk_reader_refresh(zzk_reader *r);
+
+/*
+ * 先 refresh，再按顺序为 cursor 之后、TotalSize 之内的每个块调用 fn，每访问一个块把 cursor 推进到它之后。
+ * 内部块（索引、词项索引、检查点、填充）不交给 fn，但同样推进 cursor；fn 为 NULL 时只推进。
+ * 末尾的索引与词项索引会被下一次追加覆盖，cursor 停在它们之前。
+ * fn 返回非零时停止（cursor 停在该块之前）并把该值原样返回；count 返回交给 fn 的块数。
+ * 游标与归档不符返回 ZZK_ERR_ARG，结构损坏返回 ZZK_ERR_CORRUPT。
+ */
+int zzk_reader_follow(zzk_reader *r, struct zzk_cursor *cursor, zzk_chunk_fn fn, void *ctx, long *count);
+
+/*
+ * 等待归档增长：Linux 构建用 inotify 等待文件被写入，其他 POSIX 构建每 ZZK_FOLLOW_POLL_MS 毫秒检查一次文件头。
+ * TotalSize 与上次 refresh 时不同或 timeout_ms（< 0 表示不限）到期时返回 ZZK_OK；
+ * 路径已指向另一个文件（归档被替换或删除）时返回 ZZK_ERR_NOT_FOUND，调用方重新打开后用原游标继续。
+ * 纯 C89 构建返回 ZZK_ERR_UNSUPPORTED。
+ */
+#define ZZK_FOLLOW_POLL_MS 200
+int zzk_reader_wait(zzk_reader *r, int timeout_ms);
+
+/*
+ * 把块写成一帧，供下游按帧读取（整数为大端序）:
+ *   Chunk(8) + Type(4) + Length(8) + Value(Length) + CRC32(4)
+ * Chunk 为块编号，Type 与 Value 即归档中存储的原样内容（压缩块、引用块不展开），
+ * CRC32 覆盖帧内它之前的全部字节。先校验块存储的 CRC32，不一致时不写出并返回 ZZK_ERR_CRC。
+ */
+#define ZZK_FRAME_HEADER 20
+int zzk_reader_write_frame(zzk_reader *r, const struct zzk_chunk *c, FILE *out);
+
+/* 游标文件（一行文本）。文件不存在时 load 返回 ZZK_ERR_NOT_FOUND 并把 cursor 置零；save 先写临时文件再改名 */
+int zzk_cursor_load(const char *path, struct zzk_cursor *cursor);
+int zzk_cursor_save(const char *path, const struct zzk_cursor *cursor);
+
+/* ========== 文本检索 ========== */
+
+#define ZZK_GREP_ICASE 1   /* ASCII 字母不区分大小写 */
+#define ZZK_GREP_CRC   2   /* 同时校验被搜索块的 CRC32 */
+
+struct zzk_grep_match {
+    long chunk;            /* 1-based 块编号 */
+    zzk_u64 offset;        /* 匹配在块文本中的字节偏移（压缩块为解压后的偏移） */
+    const char *line;      /* 匹配所在行的摘要（前后至多 80 字节，不含换行，不以 '\0' 结尾） */
+    size_t line_len;
+    int status;            /* 所在块的校验结果：ZZK_OK / ZZK_ERR_CRC（仅 ZZK_GREP_CRC 时检查） */
+};
+
+struct zzk_grep_stats {
+    long chunks;           /* 搜索的文本块数 */
+    long matched_chunks;
+    long matches;
+    zzk_u64 bytes;         /* 搜索的文本字节数 */
+    long bad;              /* CRC 不一致或无法解码的块数 */
+    int threads;           /* 实际使用的工作者数 */
+};
+
+/*
+ * 在所有 TEXT 块（及原类型为 TEXT 的压缩块）中查找字面子串 pattern（不重叠匹配）。
+ * 文本块按块区间分给 nthreads 个工作者并行查找，fn 在调用线程上按块编号与偏移的顺序调用。
+ * 有块无法解码或 CRC 不一致时返回 ZZK_ERR_CRC（无法解码的压缩块返回前已记录错误），
+ * 结构损坏时搜索损坏点之前的块并返回 ZZK_ERR_CORRUPT；stats 可以为 NULL。
+ */
+typedef void (*zzk_grep_fn)(void *ctx, const struct zzk_grep_match *m);
+int zzk_reader_grep(zzk_reader *r, const void *pattern, size_t len, int flags, int nthreads, zzk_grep_fn fn,
+                    void *ctx, struct zzk_grep_stats *stats);
+
+/* ========== 词项查找 ========== */
+
+struct zzk_lookup_stats {
+    int indexed;           /* 1 表示经词项索引查找 */
+    int stale;             /* 归档中有词项索引但已过时（其后有未收录的块），改为扫描 */
+    long terms;            /* 词项索引中的词项数 */
+    long scanned;          /* 回退扫描时切分的文本块与压缩块数 */
+    long matches;
+};
+
+/*
+ * 查找包含全部查询词项的文本块，fn 按块编号升序调用。
+ * 以 "filename:" / "description:" 开头的参数整体匹配 append-file 元数据中的对应字段
+ * （文件名也可以只给出去掉目录的部分），其余参数按单词切分；ASCII 字母不区分大小写。
+ * 有最新的词项索引时只读取目录与命中的记录；没有、已过时或已损坏时逐块扫描，结果相同。
+ * 查询中没有可查找的词项时返回 ZZK_ERR_ARG；stats 可以为 NULL。
+ */
+typedef void (*zzk_lookup_fn)(void *ctx, long chunk);
+int zzk_reader_lookup(zzk_reader *r, const char *const *query, int nquery, zzk_lookup_fn fn, void *ctx,
+                      struct zzk_lookup_stats *stats);
+
+/* ========== 追加服务 ========== */
+
+/*
+ * 守护进程独占一个写入句柄，经 Unix 流套接字接收多个客户端的追加请求。
+ * 协议（大端序）:
+ *   请求: Type(4B) + Length(4B) + Value(Length B)，Type 为 TEXT 或 BINARY
+ *   应答: Status(4B) + Chunk(4B)，Status 为 0 或 -ZZK_ERR_*，Chunk 为 1-based 块编号
+ * 同一连接的应答按请求顺序返回，客户端可以连续发送多条请求再读取应答。
+ *
+ * 请求进入无锁队列，写入线程每次取走队列中的全部请求作为一批：
+ * 逐条写入块，整批只更新一次文件头（按持久化模式只同步一次），再逐条应答。
+ * 服务运行期间，其他进程的追加会等待写锁直到服务退出。
+ * 需要 ZZK1_THREADS 构建，否则返回 ZZK_ERR_UNSUPPORTED。
+ */
+#define ZZK_SERVE_MAX_RECORD (64UL * 1024 * 1024)
+
+struct zzk_serve_stats {
+    long connections;
+    long records;          /* 成功追加的记录数 */
+    long batches;          /* 文件头更新次数 */
+    long failed;           /* 被拒绝或写入失败的请求数 */
+};
+
+/*
+ * 运行服务直到 *stop 变为非零（通常由信号处理函数设置），或发生致命写入错误。
+ * socket_path 已被占用且无人监听时（上次异常退出残留）会被替换。stats 可为 NULL。
+ */
+int zzk_serve(const char *archive, const char *socket_path, const struct zzk_options *opt,
+              const volatile sig_atomic_t *stop, struct zzk_serve_stats *stats);
+
+/* 客户端（POSIX 构建） */
+typedef struct zzk_client zzk_client;
+
+int zzk_client_connect(zzk_client **out, const char *socket_path);
+
+/* 追加一条记录并等待应答；成功时 chunk 返回块编号（可为 NULL） */
+int zzk_client_append(zzk_client *c, zzk_u32 type, const void *data, size_t len, long *chunk);
+
+void zzk_client_close(zzk_client *c);
+
+#endif /* ZZK1_H */